@@ -36,4 +36,18 @@ static inline void compat_winsock_cleanup(void) {}
 
 #endif /* G_OS_WIN32 */
 
+#include <sys/stat.h>
+
+/* Modification time of a stat result in nanoseconds, where the platform keeps them */
+static inline gint64 compat_stat_mtime_ns(const struct stat *st) {
+#if defined(G_OS_WIN32)
+    return (gint64)st->st_mtime * G_GINT64_CONSTANT(1000000000);
+#elif defined(__APPLE__)
+    return (gint64)st->st_mtimespec.tv_sec * G_GINT64_CONSTANT(1000000000) +
+           st->st_mtimespec.tv_nsec;
+#else
+    return (gint64)st->st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st->st_mtim.tv_nsec;
+#endif
+}
+
 #endif /* COMPAT_H */
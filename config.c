@@ -55,11 +55,7 @@ static void json_get_string_member_safe(JsonObject *obj, const gchar *name,
 /* Parse a single JSON object into SFTPConnection */
 static gboolean parse_connection_object(JsonObject *obj, SFTPConnection *conn)
 {
-    memset(conn, 0, sizeof(SFTPConnection));
-    conn->port = DEFAULT_PORT;
-    conn->state = CONN_DISCONNECTED;
-    conn->use_keyring = FALSE;
-    g_strlcpy(conn->remote_dir, ".", sizeof(conn->remote_dir));
+    sftp_connection_defaults(conn);
 
     json_get_string_member_safe(obj, "name", conn->name, sizeof(conn->name));
     json_get_string_member_safe(obj, "hostname", conn->hostname, sizeof(conn->hostname));
@@ -67,9 +63,43 @@ static gboolean parse_connection_object(JsonObject *obj, SFTPConnection *conn)
     json_get_string_member_safe(obj, "password", conn->password, sizeof(conn->password));
     json_get_string_member_safe(obj, "private_key", conn->private_key, sizeof(conn->private_key));
     json_get_string_member_safe(obj, "remote_dir", conn->remote_dir, sizeof(conn->remote_dir));
+    json_get_string_member_safe(obj, "local_dir", conn->local_dir, sizeof(conn->local_dir));
+    json_get_string_member_safe(obj, "watch_ignore", conn->watch_ignore, sizeof(conn->watch_ignore));
 
     if (json_object_has_member(obj, "port"))
         conn->port = (gint)json_object_get_int_member(obj, "port");
+    if (json_object_has_member(obj, "read_window"))
+        conn->read_window = CLAMP((gint)json_object_get_int_member(obj, "read_window"),
+                                  1, MAX_TRANSFER_WINDOW);
+    if (json_object_has_member(obj, "write_window"))
+        conn->write_window = CLAMP((gint)json_object_get_int_member(obj, "write_window"),
+                                   1, MAX_TRANSFER_WINDOW);
+    if (json_object_has_member(obj, "parallel_streams"))
+        conn->parallel_streams = CLAMP((gint)json_object_get_int_member(obj, "parallel_streams"),
+                                       1, MAX_PARALLEL_STREAMS);
+    if (json_object_has_member(obj, "parallel_threshold_mb"))
+        conn->parallel_threshold_mb = MAX((gint)json_object_get_int_member(obj, "parallel_threshold_mb"), 1);
+    if (json_object_has_member(obj, "dir_cache_ttl"))
+        conn->dir_cache_ttl = CLAMP((gint)json_object_get_int_member(obj, "dir_cache_ttl"),
+                                    0, MAX_DIR_CACHE_TTL);
+    if (json_object_has_member(obj, "prefetch_dirs"))
+        conn->prefetch_dirs = CLAMP((gint)json_object_get_int_member(obj, "prefetch_dirs"),
+                                    0, MAX_PREFETCH_DIRS);
+    if (json_object_has_member(obj, "max_channels"))
+        conn->max_channels = CLAMP((gint)json_object_get_int_member(obj, "max_channels"),
+                                   1, MAX_CHANNELS_LIMIT);
+    if (json_object_has_member(obj, "keepalive_interval"))
+        conn->keepalive_interval = CLAMP((gint)json_object_get_int_member(obj, "keepalive_interval"),
+                                         0, MAX_KEEPALIVE_INTERVAL);
+    if (json_object_has_member(obj, "delta_upload"))
+        conn->delta_upload = json_object_get_boolean_member(obj, "delta_upload");
+    if (json_object_has_member(obj, "atomic_upload"))
+        conn->atomic_upload = json_object_get_boolean_member(obj, "atomic_upload");
+    if (json_object_has_member(obj, "watch_local"))
+        conn->watch_local = json_object_get_boolean_member(obj, "watch_local");
+    if (json_object_has_member(obj, "watch_rate"))
+        conn->watch_rate = CLAMP((gint)json_object_get_int_member(obj, "watch_rate"),
+                                 1, MAX_WATCH_RATE);
 
     return (conn->name[0] && conn->hostname[0]);
 }
@@ -85,6 +115,20 @@ static JsonNode *connection_to_node(const SFTPConnection *conn)
     json_object_set_string_member(obj, "password", conn->password);
     json_object_set_string_member(obj, "private_key", conn->private_key);
     json_object_set_string_member(obj, "remote_dir", conn->remote_dir);
+    json_object_set_string_member(obj, "local_dir", conn->local_dir);
+    json_object_set_int_member(obj, "read_window", conn->read_window);
+    json_object_set_int_member(obj, "write_window", conn->write_window);
+    json_object_set_int_member(obj, "parallel_streams", conn->parallel_streams);
+    json_object_set_int_member(obj, "parallel_threshold_mb", conn->parallel_threshold_mb);
+    json_object_set_int_member(obj, "dir_cache_ttl", conn->dir_cache_ttl);
+    json_object_set_int_member(obj, "prefetch_dirs", conn->prefetch_dirs);
+    json_object_set_int_member(obj, "max_channels", conn->max_channels);
+    json_object_set_int_member(obj, "keepalive_interval", conn->keepalive_interval);
+    json_object_set_boolean_member(obj, "delta_upload", conn->delta_upload);
+    json_object_set_boolean_member(obj, "atomic_upload", conn->atomic_upload);
+    json_object_set_boolean_member(obj, "watch_local", conn->watch_local);
+    json_object_set_string_member(obj, "watch_ignore", conn->watch_ignore);
+    json_object_set_int_member(obj, "watch_rate", conn->watch_rate);
 
     JsonNode *node = json_node_new(JSON_NODE_OBJECT);
     json_node_take_object(node, obj);
@@ -206,6 +250,10 @@ gboolean config_load_settings(SFTPPluginData *plugin_data)
     plugin_data->auto_upload = FALSE;
     plugin_data->show_hidden_files = FALSE;
     plugin_data->default_timeout = CONNECTION_TIMEOUT;
+    plugin_data->upload_debounce_ms = DEFAULT_UPLOAD_DEBOUNCE_MS;
+    plugin_data->remote_poll_interval = DEFAULT_REMOTE_POLL_INTERVAL;
+    plugin_data->diff_tool[0] = '\0';
+    plugin_data->file_cache_mb = DEFAULT_FILE_CACHE_MB;
 
     if (!g_file_test(file, G_FILE_TEST_EXISTS)) {
         g_free(file);
@@ -230,6 +278,20 @@ gboolean config_load_settings(SFTPPluginData *plugin_data)
             plugin_data->show_hidden_files = json_object_get_boolean_member(obj, "show_hidden_files");
         if (json_object_has_member(obj, "default_timeout"))
             plugin_data->default_timeout = (gint)json_object_get_int_member(obj, "default_timeout");
+        if (json_object_has_member(obj, "upload_debounce_ms"))
+            plugin_data->upload_debounce_ms = CLAMP(
+                (gint)json_object_get_int_member(obj, "upload_debounce_ms"),
+                0, MAX_UPLOAD_DEBOUNCE_MS);
+        if (json_object_has_member(obj, "remote_poll_interval"))
+            plugin_data->remote_poll_interval = CLAMP(
+                (gint)json_object_get_int_member(obj, "remote_poll_interval"),
+                0, MAX_REMOTE_POLL_INTERVAL);
+        json_get_string_member_safe(obj, "diff_tool", plugin_data->diff_tool,
+                                    sizeof(plugin_data->diff_tool));
+        if (json_object_has_member(obj, "file_cache_mb"))
+            plugin_data->file_cache_mb = CLAMP(
+                (gint)json_object_get_int_member(obj, "file_cache_mb"),
+                0, MAX_FILE_CACHE_MB);
     }
 
     g_object_unref(parser);
@@ -249,6 +311,10 @@ gboolean config_save_settings(SFTPPluginData *plugin_data)
     json_object_set_boolean_member(obj, "auto_upload", plugin_data->auto_upload);
     json_object_set_boolean_member(obj, "show_hidden_files", plugin_data->show_hidden_files);
     json_object_set_int_member(obj, "default_timeout", plugin_data->default_timeout);
+    json_object_set_int_member(obj, "upload_debounce_ms", plugin_data->upload_debounce_ms);
+    json_object_set_int_member(obj, "remote_poll_interval", plugin_data->remote_poll_interval);
+    json_object_set_string_member(obj, "diff_tool", plugin_data->diff_tool);
+    json_object_set_int_member(obj, "file_cache_mb", plugin_data->file_cache_mb);
 
     JsonNode *root = json_node_new(JSON_NODE_OBJECT);
     json_node_take_object(root, obj);
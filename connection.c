@@ -3,12 +3,442 @@
  * Implement SFTP connection using libssh2
  */
 
-#include "sftp-plugin.h"
+#include "sftp-core.h"
 #include "compat.h"
 
 #include <fcntl.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#define RECONNECT_TEARDOWN_MS 5000   /* Longest wait on a dead connection's goodbye */
+
+/* A queued unit of work for a session's worker pool */
+struct _SFTPJob {
+    SFTPJobFunc func;
+    gpointer data;
+    JobPriority priority;
+    guint64 seq;
+    gboolean cancelled;
+    gboolean *cancel_flag;     /* Points at cancelled or at the owner's flag */
+};
+
+/* Pending async connect, completed on the main loop */
+struct _SFTPConnectRequest {
+    SFTPSession *session;
+    ConnectCallback callback;
+    gpointer user_data;
+    gboolean success;
+    guint idle_id;
+};
+
+static void session_job_func(gpointer data, gpointer user_data);
+
+static gint session_ids;           /* Last id handed out by sftp_session_new */
+
+/* Run higher priority jobs first, FIFO within the same priority */
+static gint job_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const SFTPJob *ja = a;
+    const SFTPJob *jb = b;
+    (void)user_data;
+
+    if (ja->priority != jb->priority)
+        return ja->priority < jb->priority ? -1 : 1;
+    if (ja->seq != jb->seq)
+        return ja->seq < jb->seq ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Fill a connection config with the defaults of every setting
+ */
+void sftp_connection_defaults(SFTPConnection *conn)
+{
+    memset(conn, 0, sizeof(SFTPConnection));
+    conn->port = DEFAULT_PORT;
+    conn->state = CONN_DISCONNECTED;
+    conn->use_keyring = FALSE;
+    conn->read_window = DEFAULT_READ_WINDOW;
+    conn->write_window = DEFAULT_WRITE_WINDOW;
+    conn->parallel_streams = DEFAULT_PARALLEL_STREAMS;
+    conn->parallel_threshold_mb = DEFAULT_PARALLEL_THRESHOLD_MB;
+    conn->dir_cache_ttl = DEFAULT_DIR_CACHE_TTL;
+    conn->prefetch_dirs = DEFAULT_PREFETCH_DIRS;
+    conn->max_channels = DEFAULT_MAX_CHANNELS;
+    conn->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+    conn->delta_upload = TRUE;
+    conn->atomic_upload = FALSE;
+    g_strlcpy(conn->remote_dir, ".", sizeof(conn->remote_dir));
+    conn->local_dir[0] = '\0';
+    conn->watch_local = FALSE;
+    g_strlcpy(conn->watch_ignore, DEFAULT_WATCH_IGNORE, sizeof(conn->watch_ignore));
+    conn->watch_rate = DEFAULT_WATCH_RATE;
+}
+
+/*
+ * Create a disconnected session for a connection config. Its id tells it
+ * apart from a later session allocated at the same address.
+ */
+SFTPSession *sftp_session_new(SFTPConnection *config)
+{
+    SFTPSession *session = g_new0(SFTPSession, 1);
+    session->id = (guint)g_atomic_int_add(&session_ids, 1) + 1;
+    session->config = config;
+    session->sock = 0;
+    session->ssh_session = NULL;
+    session->sftp_session = NULL;
+    session->active = FALSE;
+    g_mutex_init(&session->lock);
+    g_mutex_init(&session->queue_lock);
+    g_mutex_init(&session->channel_lock);
+    g_cond_init(&session->channel_cond);
+    session->idle_channels = g_ptr_array_new();
+    session->dir_cache = dir_cache_new(config->dir_cache_ttl);
+    session->stats = stats_new();
+    return session;
+}
+
+/*
+ * Create an extra session to the same host. The clone gets a private copy
+ * of the config so its connection state does not leak into the UI.
+ */
+SFTPSession *sftp_session_clone(SFTPSession *session)
+{
+    SFTPConnection *config = g_new(SFTPConnection, 1);
+    SFTPSession *clone;
+
+    *config = *session->config;
+    config->state = CONN_DISCONNECTED;
+
+    clone = sftp_session_new(config);
+    clone->owns_config = TRUE;
+
+    /* Listings are cached and transfers counted on the session the UI talks to */
+    dir_cache_free(clone->dir_cache);
+    clone->dir_cache = NULL;
+    stats_free(clone->stats);
+    clone->stats = NULL;
+    return clone;
+}
+
+/*
+ * Disconnect (if needed) and free a session
+ */
+void sftp_session_free(SFTPSession *session)
+{
+    guint i;
+
+    if (!session)
+        return;
+
+    if (session->keepalive_id) {
+        g_source_remove(session->keepalive_id);
+        session->keepalive_id = 0;
+    }
+
+    local_watch_stop(session->local_watch);
+    session->local_watch = NULL;
+
+    /* Let queued jobs drain as cancelled so their callbacks still run */
+    if (session->pool) {
+        g_mutex_lock(&session->queue_lock);
+        session->closing = TRUE;
+        g_mutex_unlock(&session->queue_lock);
+        sftp_session_cancel_jobs(session);
+        g_thread_pool_free(session->pool, FALSE, TRUE);
+        session->pool = NULL;
+    }
+
+    /* Drop a connect completion that has not been dispatched yet */
+    if (session->connect_request) {
+        g_source_remove(session->connect_request->idle_id);
+        g_free(session->connect_request);
+        session->connect_request = NULL;
+    }
+
+    /* Jobs have drained, so every channel is back in the pool */
+    for (i = 0; i < session->idle_channels->len; i++)
+        sftp_session_free(g_ptr_array_index(session->idle_channels, i));
+    g_ptr_array_free(session->idle_channels, TRUE);
+
+    if (session->active)
+        sftp_connection_disconnect(session);
+    dir_cache_free(session->dir_cache);
+    stats_free(session->stats);
+    g_cond_clear(&session->channel_cond);
+    g_mutex_clear(&session->channel_lock);
+    g_mutex_clear(&session->queue_lock);
+    g_mutex_clear(&session->lock);
+    if (session->owns_config)
+        g_free(session->config);
+    g_free(session);
+}
+
+/*
+ * Queue a job on the session's worker pool. cancel_flag, if given, is the
+ * flag the owner uses to cancel the work; it is passed to func when the
+ * job is dequeued so cancelled jobs can finish without touching the network.
+ * Once the session is being freed, a job pushed by another job runs right
+ * away as cancelled, in the caller's thread: the draining pool takes no more.
+ */
+void sftp_session_push_job(SFTPSession *session, JobPriority priority,
+                           SFTPJobFunc func, gpointer data, gboolean *cancel_flag)
+{
+    SFTPJob *job = g_new0(SFTPJob, 1);
+    GError *error = NULL;
+
+    job->func = func;
+    job->data = data;
+    job->priority = priority;
+    job->cancel_flag = cancel_flag ? cancel_flag : &job->cancelled;
+
+    g_mutex_lock(&session->queue_lock);
+    if (session->closing) {
+        g_mutex_unlock(&session->queue_lock);
+        *job->cancel_flag = TRUE;
+        func(session, data, TRUE);
+        g_free(job);
+        return;
+    }
+    if (!session->pool) {
+        /* One worker per channel the pool may lease */
+        session->pool = g_thread_pool_new(session_job_func, session,
+                                          MAX(session->config->max_channels, 1),
+                                          FALSE, NULL);
+        g_thread_pool_set_sort_function(session->pool, job_compare, NULL);
+    }
+    job->seq = session->job_seq++;
+    session->queued_jobs = g_list_prepend(session->queued_jobs, job);
+    g_thread_pool_push(session->pool, job, &error);
+    g_mutex_unlock(&session->queue_lock);
+
+    if (error) {
+        g_printerr("Failed to queue job: %s\n", error->message);
+        g_error_free(error);
+    }
+}
+
+/* Cancel a job and, if it is still queued, run it next. Needs queue_lock. */
+static void session_cancel_job_locked(SFTPSession *session, SFTPJob *job)
+{
+    *job->cancel_flag = TRUE;
+    if (g_list_find(session->queued_jobs, job)) {
+        job->priority = JOB_PRIORITY_HIGH;
+        g_thread_pool_move_to_front(session->pool, job);
+    }
+}
+
+/*
+ * Cancel every queued and running job of a session. Queued jobs are moved
+ * to the front of the queue so their owners are notified right away.
+ */
+void sftp_session_cancel_jobs(SFTPSession *session)
+{
+    GList *l;
+
+    g_mutex_lock(&session->queue_lock);
+    for (l = session->running_jobs; l; l = l->next)
+        session_cancel_job_locked(session, l->data);
+    for (l = session->queued_jobs; l; l = l->next)
+        session_cancel_job_locked(session, l->data);
+    g_mutex_unlock(&session->queue_lock);
+}
+
+/*
+ * Cancel the job carrying data, if it is queued or running
+ */
+void sftp_session_cancel_job(SFTPSession *session, gpointer data)
+{
+    GList *l;
+
+    g_mutex_lock(&session->queue_lock);
+    for (l = session->queued_jobs; l; l = l->next) {
+        SFTPJob *job = l->data;
+        if (job->data == data) {
+            session_cancel_job_locked(session, job);
+            break;
+        }
+    }
+    g_mutex_unlock(&session->queue_lock);
+}
+
+/*
+ * Number of jobs waiting for or currently running on the session
+ */
+guint sftp_session_queue_depth(SFTPSession *session)
+{
+    guint depth;
+
+    g_mutex_lock(&session->queue_lock);
+    depth = g_list_length(session->queued_jobs) + g_list_length(session->running_jobs);
+    g_mutex_unlock(&session->queue_lock);
+    return depth;
+}
+
+/*
+ * Is anything more urgent than priority waiting in the queue?
+ * Long background jobs poll this to step aside for the user.
+ */
+gboolean sftp_session_jobs_waiting(SFTPSession *session, JobPriority priority)
+{
+    gboolean waiting = FALSE;
+    GList *l;
+
+    g_mutex_lock(&session->queue_lock);
+    for (l = session->queued_jobs; l && !waiting; l = l->next) {
+        SFTPJob *job = l->data;
+        waiting = job->priority < priority;
+    }
+    g_mutex_unlock(&session->queue_lock);
+    return waiting;
+}
+
+/*
+ * Reconnect a channel whose connection broke since its last use. Nobody
+ * else holds it: it was just leased.
+ */
+static void session_revive(SFTPSession *channel)
+{
+    g_mutex_lock(&channel->lock);
+    if (sftp_session_lost(channel))
+        sftp_session_reconnect(channel);
+    g_mutex_unlock(&channel->lock);
+}
+
+/*
+ * Lease a channel: the session's own channel if free, else an idle extra
+ * channel, else (with open) a new one while under max_channels
+ */
+static SFTPSession *session_lease(SFTPSession *session, gboolean wait, gboolean open)
+{
+    SFTPSession *owner = session->parent ? session->parent : session;
+    guint limit = (guint)MAX(owner->config->max_channels, 1);
+    SFTPSession *channel = NULL;
+
+    g_mutex_lock(&owner->channel_lock);
+    while (!channel) {
+        if (!owner->primary_leased) {
+            owner->primary_leased = TRUE;
+            channel = owner;
+            break;
+        }
+        if (owner->idle_channels->len > 0) {
+            channel = g_ptr_array_remove_index(owner->idle_channels,
+                                               owner->idle_channels->len - 1);
+            break;
+        }
+        if (open && owner->open_channels + 1 < limit) {
+            owner->open_channels++;
+            g_mutex_unlock(&owner->channel_lock);
+
+            channel = sftp_session_clone(owner);
+            channel->parent = owner;
+            if (sftp_connection_connect(channel)) {
+                g_print("Opened channel %u to %s\n", owner->open_channels + 1,
+                        owner->config->hostname);
+                return channel;
+            }
+            sftp_session_free(channel);
+            channel = NULL;
+
+            g_mutex_lock(&owner->channel_lock);
+            owner->open_channels--;
+        }
+        if (!wait)
+            break;
+        g_cond_wait(&owner->channel_cond, &owner->channel_lock);
+    }
+    g_mutex_unlock(&owner->channel_lock);
+
+    if (!channel)
+        return NULL;
+    if (open) {
+        session_revive(channel);
+    } else {
+        gboolean lost;
+
+        g_mutex_lock(&channel->lock);
+        lost = sftp_session_lost(channel);
+        g_mutex_unlock(&channel->lock);
+        if (lost) {
+            sftp_session_release(channel);
+            return NULL;
+        }
+    }
+    return channel;
+}
+
+/*
+ * Lease a channel for one job: the session's own channel if free, else an
+ * idle extra channel, else a new one while under the connection's
+ * max_channels. Extra channels are separate transports because a libssh2
+ * session must not be used from two threads at once. With wait, blocks
+ * until a channel is released; otherwise returns NULL when none is free.
+ * A channel that lost its connection is reconnected before it is handed out.
+ */
+SFTPSession *sftp_session_lease(SFTPSession *session, gboolean wait)
+{
+    return session_lease(session, wait, TRUE);
+}
+
+/*
+ * Lease a channel that is connected and free right now, or return NULL.
+ * Never dials: no new channel is opened and a broken one is not
+ * reconnected, so speculative and periodic work costs the server nothing
+ * when the pool is busy.
+ */
+SFTPSession *sftp_session_lease_idle(SFTPSession *session)
+{
+    return session_lease(session, FALSE, FALSE);
+}
+
+/*
+ * Return a leased channel to its pool. Channels that lost their
+ * connection are closed instead of being reused.
+ */
+void sftp_session_release(SFTPSession *channel)
+{
+    SFTPSession *owner = channel->parent ? channel->parent : channel;
+    SFTPSession *dead = NULL;
+
+    g_mutex_lock(&owner->channel_lock);
+    if (channel == owner) {
+        owner->primary_leased = FALSE;
+    } else if (channel->active && !sftp_session_lost(channel)) {
+        g_ptr_array_add(owner->idle_channels, channel);
+    } else {
+        owner->open_channels--;
+        dead = channel;
+    }
+    g_cond_broadcast(&owner->channel_cond);
+    g_mutex_unlock(&owner->channel_lock);
+
+    sftp_session_free(dead);
+}
+
+/*
+ * Worker pool entry point
+ */
+static void session_job_func(gpointer data, gpointer user_data)
+{
+    SFTPJob *job = (SFTPJob *)data;
+    SFTPSession *session = (SFTPSession *)user_data;
+
+    g_mutex_lock(&session->queue_lock);
+    session->queued_jobs = g_list_remove(session->queued_jobs, job);
+    session->running_jobs = g_list_prepend(session->running_jobs, job);
+    g_mutex_unlock(&session->queue_lock);
+
+    job->func(session, job->data, *job->cancel_flag);
+
+    g_mutex_lock(&session->queue_lock);
+    session->running_jobs = g_list_remove(session->running_jobs, job);
+    g_mutex_unlock(&session->queue_lock);
+
+    g_free(job);
+}
 
 /*
  * Connect to SFTP server
@@ -28,32 +458,44 @@ gboolean sftp_connection_connect(SFTPSession *session)
 
     config->state = CONN_CONNECTING;
 
-    /* Create socket connection */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        g_printerr("Failed to create socket\n");
+    /* Resolve hostname (getaddrinfo is thread-safe, connects run on workers) */
+    struct addrinfo hints, *addrs, *ai;
+    gchar port_str[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    g_snprintf(port_str, sizeof(port_str), "%d", config->port);
+
+    if (getaddrinfo(config->hostname, port_str, &hints, &addrs) != 0) {
+        g_printerr("Cannot resolve hostname: %s\n", config->hostname);
         config->state = CONN_ERROR;
         return FALSE;
     }
 
     /* Connect to server */
-    struct hostent *host = gethostbyname(config->hostname);
-    if (!host) {
-        g_printerr("Cannot resolve hostname: %s\n", config->hostname);
+    sock = -1;
+    for (ai = addrs; ai && !session->connect_cancelled; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
         compat_close_socket(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (sock < 0) {
+        g_printerr("Failed to connect to server: %s\n", config->hostname);
         config->state = CONN_ERROR;
         return FALSE;
     }
 
-    struct sockaddr_in sin;
-    sin.sin_family = host->h_addrtype;
-    sin.sin_port = htons(config->port);
-    sin.sin_addr = *((struct in_addr *)host->h_addr);
-
-    if (connect(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
-        g_printerr("Failed to connect to server: %s\n", strerror(errno));
+    if (session->connect_cancelled) {
+        g_print("Connection cancelled: %s\n", config->hostname);
         compat_close_socket(sock);
-        config->state = CONN_ERROR;
+        config->state = CONN_DISCONNECTED;
         return FALSE;
     }
 
@@ -72,7 +514,8 @@ gboolean sftp_connection_connect(SFTPSession *session)
     libssh2_session_set_blocking(ssh, 0);
 
     /* Perform SSH handshake */
-    while ((rc = libssh2_session_handshake(ssh, sock)) == LIBSSH2_ERROR_EAGAIN) {
+    while ((rc = libssh2_session_handshake(ssh, sock)) == LIBSSH2_ERROR_EAGAIN &&
+           !session->connect_cancelled) {
         /* Wait for socket to be writable */
         struct timeval tv;
         fd_set fd;
@@ -115,6 +558,15 @@ gboolean sftp_connection_connect(SFTPSession *session)
         return FALSE;
     }
 
+    if (session->connect_cancelled) {
+        g_print("Connection cancelled: %s\n", config->hostname);
+        libssh2_session_disconnect(ssh, "Connection cancelled");
+        libssh2_session_free(ssh);
+        compat_close_socket(sock);
+        config->state = CONN_DISCONNECTED;
+        return FALSE;
+    }
+
     /* Create SFTP session */
     sftp = libssh2_sftp_init(ssh);
     if (!sftp) {
@@ -125,15 +577,147 @@ gboolean sftp_connection_connect(SFTPSession *session)
         return FALSE;
     }
 
+    /* Keeps NAT and firewall state alive; sent by the keepalive job */
+    if (config->keepalive_interval > 0)
+        libssh2_keepalive_config(ssh, 1, (unsigned int)config->keepalive_interval);
+
     session->ssh_session = ssh;
     session->sftp_session = sftp;
     session->active = TRUE;
+    session->dropped = FALSE;
     config->state = CONN_CONNECTED;
 
     g_print("Successfully connected to server: %s\n", config->hostname);
     return TRUE;
 }
 
+/*
+ * Send a keepalive on a channel nobody is using. A channel whose
+ * connection turns out to be gone is reconnected right away, so the next
+ * action does not pay for it.
+ */
+static void session_keepalive_channel(SFTPSession *channel)
+{
+    int next;
+
+    g_mutex_lock(&channel->lock);
+    if (channel->ssh_session && !channel->dropped &&
+        libssh2_keepalive_send(channel->ssh_session, &next) != 0)
+        g_printerr("Keepalive to %s failed\n", channel->config->hostname);
+    if (sftp_session_lost(channel))
+        sftp_session_reconnect(channel);
+    g_mutex_unlock(&channel->lock);
+}
+
+/*
+ * Keepalive job: pings the session's own channel and the idle extra
+ * channels. Busy channels carry traffic already.
+ */
+static void keepalive_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    GPtrArray *idle;
+    gboolean primary = FALSE;
+    guint i;
+
+    (void)data;
+
+    if (!cancelled) {
+        g_mutex_lock(&session->channel_lock);
+        if (!session->primary_leased) {
+            session->primary_leased = TRUE;
+            primary = TRUE;
+        }
+        /* Still counted in open_channels, so leases wait rather than open more */
+        idle = session->idle_channels;
+        session->idle_channels = g_ptr_array_new();
+        g_mutex_unlock(&session->channel_lock);
+
+        if (primary) {
+            session_keepalive_channel(session);
+            sftp_session_release(session);
+        }
+        for (i = 0; i < idle->len; i++) {
+            SFTPSession *channel = g_ptr_array_index(idle, i);
+            session_keepalive_channel(channel);
+            sftp_session_release(channel);
+        }
+        g_ptr_array_free(idle, TRUE);
+    }
+
+    g_atomic_int_set(&session->keepalive_pending, FALSE);
+}
+
+static gboolean keepalive_tick(gpointer data)
+{
+    SFTPSession *session = (SFTPSession *)data;
+
+    if (g_atomic_int_compare_and_exchange(&session->keepalive_pending, FALSE, TRUE))
+        sftp_session_push_job(session, JOB_PRIORITY_BACKGROUND, keepalive_job_func,
+                              NULL, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean connect_complete_idle(gpointer data)
+{
+    SFTPConnectRequest *req = (SFTPConnectRequest *)data;
+    SFTPSession *session = req->session;
+
+    session->connect_request = NULL;
+    if (req->success && !session->connect_cancelled &&
+        session->config->keepalive_interval > 0 && !session->keepalive_id)
+        session->keepalive_id = g_timeout_add_seconds((guint)session->config->keepalive_interval,
+                                                      keepalive_tick, session);
+    if (req->callback)
+        req->callback(session, req->success && !session->connect_cancelled, req->user_data);
+    g_free(req);
+    return G_SOURCE_REMOVE;
+}
+
+static void connect_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    SFTPConnectRequest *req = (SFTPConnectRequest *)data;
+
+    if (!cancelled) {
+        g_mutex_lock(&session->lock);
+        req->success = sftp_connection_connect(session);
+        g_mutex_unlock(&session->lock);
+    }
+
+    g_mutex_lock(&session->queue_lock);
+    req->idle_id = g_idle_add(connect_complete_idle, req);
+    g_mutex_unlock(&session->queue_lock);
+}
+
+/*
+ * Connect on the session's worker pool and report the result through
+ * callback on the main loop. The callback also runs after
+ * sftp_connection_cancel(), with success set to FALSE. Once connected,
+ * idle channels get a keepalive every keepalive_interval seconds.
+ */
+void sftp_connection_connect_async(SFTPSession *session, ConnectCallback callback,
+                                   gpointer user_data)
+{
+    SFTPConnectRequest *req = g_new0(SFTPConnectRequest, 1);
+
+    req->session = session;
+    req->callback = callback;
+    req->user_data = user_data;
+
+    session->connect_cancelled = FALSE;
+    session->connect_request = req;
+    sftp_session_push_job(session, JOB_PRIORITY_HIGH, connect_job_func, req,
+                          &session->connect_cancelled);
+}
+
+/*
+ * Ask a pending async connect to give up. Resolving and the TCP connect
+ * cannot be interrupted; the worker notices at the next stage.
+ */
+void sftp_connection_cancel(SFTPSession *session)
+{
+    session->connect_cancelled = TRUE;
+}
+
 /*
  * Disconnect SFTP connection
  */
@@ -142,6 +726,10 @@ void sftp_connection_disconnect(SFTPSession *session)
     if (!session)
         return;
 
+    /* A dead peer never answers the goodbye; don't wait on it for long */
+    if (session->ssh_session && sftp_session_lost(session))
+        libssh2_session_set_timeout(session->ssh_session, RECONNECT_TEARDOWN_MS);
+
     if (session->sftp_session) {
         libssh2_sftp_shutdown(session->sftp_session);
         session->sftp_session = NULL;
@@ -166,6 +754,89 @@ void sftp_connection_disconnect(SFTPSession *session)
     g_print("Connection disconnected\n");
 }
 
+/*
+ * Did the session's connection break under it? Only a socket error or the
+ * server's word counts; a session never connected or disconnected on
+ * purpose is not lost.
+ */
+gboolean sftp_session_lost(SFTPSession *session)
+{
+    int err;
+
+    if (!session->active)
+        return FALSE;
+    if (session->dropped || !session->ssh_session)
+        return TRUE;
+
+    err = libssh2_session_last_errno(session->ssh_session);
+    if (err == LIBSSH2_ERROR_SFTP_PROTOCOL && session->sftp_session) {
+        unsigned long status = libssh2_sftp_last_error(session->sftp_session);
+        return status == LIBSSH2_FX_NO_CONNECTION || status == LIBSSH2_FX_CONNECTION_LOST;
+    }
+    return err == LIBSSH2_ERROR_SOCKET_SEND || err == LIBSSH2_ERROR_SOCKET_RECV ||
+           err == LIBSSH2_ERROR_SOCKET_DISCONNECT || err == LIBSSH2_ERROR_SOCKET_TIMEOUT;
+}
+
+/*
+ * Replace a lost connection with a new one to the same host, logging in
+ * again. Caller holds session->lock and no handles of the old connection.
+ * The new connection is opened on the side and swapped in, so active and
+ * the config's state, which the main loop reads, never change. If it
+ * fails the session is marked dropped and the next lease or keepalive
+ * tries again.
+ */
+gboolean sftp_session_reconnect(SFTPSession *session)
+{
+    SFTPSession *owner = session->parent ? session->parent : session;
+    SFTPSession *fresh = sftp_session_clone(session);
+    LIBSSH2_SESSION *ssh;
+    LIBSSH2_SFTP *sftp;
+    int sock;
+
+    g_print("Connection to %s lost, reconnecting\n", session->config->hostname);
+
+    if (!sftp_connection_connect(fresh)) {
+        sftp_session_free(fresh);
+        session->dropped = TRUE;
+        return FALSE;
+    }
+
+    g_mutex_lock(&owner->channel_lock);
+    ssh = session->ssh_session;
+    sftp = session->sftp_session;
+    sock = session->sock;
+    session->ssh_session = fresh->ssh_session;
+    session->sftp_session = fresh->sftp_session;
+    session->sock = fresh->sock;
+    session->dropped = FALSE;
+    g_mutex_unlock(&owner->channel_lock);
+
+    /* The old connection is torn down with the clone */
+    fresh->ssh_session = ssh;
+    fresh->sftp_session = sftp;
+    fresh->sock = sock;
+    if (ssh)
+        libssh2_session_set_timeout(ssh, RECONNECT_TEARDOWN_MS);
+    sftp_session_free(fresh);
+    return TRUE;
+}
+
+/*
+ * Stat a remote path, reconnecting once if the connection turns out to be
+ * gone. Caller holds session->lock and no open handles on it.
+ */
+gboolean sftp_remote_stat(SFTPSession *session, const gchar *path,
+                          LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    if (!session->sftp_session || session->dropped)
+        return FALSE;
+    if (libssh2_sftp_stat(session->sftp_session, path, attrs) == 0)
+        return TRUE;
+    if (!sftp_session_lost(session) || !sftp_session_reconnect(session))
+        return FALSE;
+    return libssh2_sftp_stat(session->sftp_session, path, attrs) == 0;
+}
+
 /*
  * List remote directory contents
  */
@@ -176,7 +847,7 @@ gboolean sftp_list_directory(SFTPSession *session, const gchar *path)
     char filename[MAX_PATH_LEN];
     int rc;
 
-    if (!session || !session->active || !session->sftp_session) {
+    if (!session || !session->active || !session->sftp_session || session->dropped) {
         g_printerr("Not connected to server\n");
         return FALSE;
     }
@@ -205,88 +876,438 @@ gboolean sftp_list_directory(SFTPSession *session, const gchar *path)
 }
 
 /*
- * Upload file
+ * Free a directory entry
  */
-gboolean sftp_upload_file(SFTPSession *session, const gchar *local, const gchar *remote,
-                          FileOperation *op)
+void sftp_dir_entry_free(gpointer entry)
 {
-    FILE *local_file;
-    LIBSSH2_SFTP_HANDLE *sftp_handle;
-    char buf[8192];
-    size_t nread;
+    SFTPDirEntry *e = (SFTPDirEntry *)entry;
+    g_free(e->name);
+    g_free(e);
+}
+
+/*
+ * Read a remote directory and hand its entries to callback in batches of
+ * batch_size ("." and ".." are skipped). Stops early when *cancelled is set.
+ * Runs on a worker with the session lock held.
+ */
+gboolean sftp_read_directory(SFTPSession *session, const gchar *path, guint batch_size,
+                             DirBatchCallback callback, gpointer user_data,
+                             const gboolean *cancelled)
+{
+    LIBSSH2_SFTP_HANDLE *handle;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    GPtrArray *batch;
+    char filename[512];
     int rc;
 
-    if (!session || !session->active || !session->sftp_session) {
+    if (!session || !session->active || !session->sftp_session || session->dropped) {
         g_printerr("Not connected to server\n");
         return FALSE;
     }
 
-    local_file = fopen(local, "rb");
-    if (!local_file) {
-        g_printerr("Cannot open local file: %s\n", local);
+    handle = libssh2_sftp_opendir(session->sftp_session, path);
+
+    /* Nothing was delivered yet, so a dropped connection can be replaced */
+    if (!handle && sftp_session_lost(session) && sftp_session_reconnect(session))
+        handle = libssh2_sftp_opendir(session->sftp_session, path);
+    if (!handle) {
+        g_printerr("Cannot open directory: %s\n", path);
         return FALSE;
     }
 
-    /* Get file size for progress */
-    if (op) {
-        fseek(local_file, 0, SEEK_END);
-        op->total_size = (gsize)ftell(local_file);
-        fseek(local_file, 0, SEEK_SET);
-        op->transferred = 0;
+    batch = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+
+    while ((rc = libssh2_sftp_readdir(handle, filename, sizeof(filename), &attrs)) > 0) {
+        SFTPDirEntry *entry;
+
+        if (cancelled && *cancelled)
+            break;
+        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0)
+            continue;
+
+        entry = g_new(SFTPDirEntry, 1);
+        entry->name = g_strdup(filename);
+        entry->attrs = attrs;
+        g_ptr_array_add(batch, entry);
+
+        if (batch->len >= batch_size) {
+            callback(batch, user_data);
+            batch = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+        }
     }
 
-    sftp_handle = libssh2_sftp_open(session->sftp_session, remote,
-                                    LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC,
-                                    LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR);
-    if (!sftp_handle) {
-        g_printerr("Cannot create remote file: %s\n", remote);
-        fclose(local_file);
+    if (batch->len > 0)
+        callback(batch, user_data);
+    else
+        g_ptr_array_unref(batch);
+
+    libssh2_sftp_closedir(handle);
+    return rc >= 0;
+}
+
+/*
+ * Size of the upload buffer for a session. libssh2 splits a write into
+ * WRITE requests of SFTP_CHUNK_SIZE and pipelines them, so the buffer is
+ * what sets the number of requests in flight: one chunk per WRITE window slot.
+ */
+gsize transfer_write_buffer_size(SFTPSession *session)
+{
+    gint window = session->config ? session->config->write_window : 0;
+
+    if (window <= 0)
+        window = DEFAULT_WRITE_WINDOW;
+    window = MIN(window, MAX_TRANSFER_WINDOW);
+    return (gsize)window * SFTP_CHUNK_SIZE;
+}
+
+/*
+ * Run a command on the server over an exec channel and collect up to
+ * max_output bytes of its stdout. Returns FALSE if the server refused the
+ * channel or the command exited non-zero.
+ */
+static gboolean sftp_exec_command(SFTPSession *session, const gchar *command,
+                                  gsize max_output, gchar **output)
+{
+    LIBSSH2_CHANNEL *channel;
+    GString *out = g_string_new(NULL);
+    gchar buf[1024];
+    ssize_t rc;
+    gint exit_status;
+
+    channel = libssh2_channel_open_session(session->ssh_session);
+    if (!channel) {
+        g_printerr("Cannot open exec channel\n");
+        g_string_free(out, TRUE);
+        return FALSE;
+    }
+
+    if (libssh2_channel_exec(channel, command) != 0) {
+        g_printerr("Server refused command: %s\n", command);
+        libssh2_channel_free(channel);
+        g_string_free(out, TRUE);
         return FALSE;
     }
 
-    g_print("Uploading: %s -> %s\n", local, remote);
+    while ((rc = libssh2_channel_read(channel, buf, sizeof(buf))) > 0) {
+        if (out->len < max_output)
+            g_string_append_len(out, buf, MIN((gsize)rc, max_output - out->len));
+    }
 
-    while ((nread = fread(buf, 1, sizeof(buf), local_file)) > 0) {
-        size_t written = 0;
-        while (written < nread) {
-            if (op && op->cancelled) {
+    libssh2_channel_close(channel);
+    libssh2_channel_wait_closed(channel);
+    exit_status = libssh2_channel_get_exit_status(channel);
+    libssh2_channel_free(channel);
+
+    if (rc < 0 || exit_status != 0) {
+        g_string_free(out, TRUE);
+        return FALSE;
+    }
+
+    *output = g_string_free(out, FALSE);
+    return TRUE;
+}
+
+/*
+ * SHA-256 of a local file as lowercase hex, or NULL if it can't be read
+ */
+gchar *sftp_local_sha256(const gchar *path)
+{
+    GChecksum *checksum;
+    FILE *file;
+    guchar buf[65536];
+    size_t n;
+    gchar *digest = NULL;
+
+    file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        g_checksum_update(checksum, buf, n);
+    if (!ferror(file))
+        digest = g_strdup(g_checksum_get_string(checksum));
+
+    g_checksum_free(checksum);
+    fclose(file);
+    return digest;
+}
+
+/*
+ * SHA-256 of a remote file, computed on the server. libssh2 has no API
+ * for the SFTP "check-file" extension, so this runs sha256sum (or
+ * shasum on BSD/macOS) over an exec channel. Returns a newly allocated
+ * lowercase hex digest, or NULL if the server can't provide one.
+ */
+gchar *sftp_remote_sha256(SFTPSession *session, const gchar *path)
+{
+    gchar *quoted;
+    gchar *command;
+    gchar *output = NULL;
+    gchar *digest = NULL;
+    gint i;
+
+    if (!session || !session->active || !session->ssh_session)
+        return NULL;
+
+    quoted = g_shell_quote(path);
+    command = g_strdup_printf("sha256sum -- %s 2>/dev/null || shasum -a 256 -- %s",
+                              quoted, quoted);
+
+    if (sftp_exec_command(session, command, 256, &output)) {
+        /* "<64 hex digits>  <path>" */
+        for (i = 0; i < 64 && g_ascii_isxdigit(output[i]); i++)
+            ;
+        if (i == 64 && (output[64] == ' ' || output[64] == '\t'))
+            digest = g_ascii_strdown(output, 64);
+    }
+
+    if (!digest)
+        g_print("Remote checksum not available for %s\n", path);
+
+    g_free(output);
+    g_free(command);
+    g_free(quoted);
+    return digest;
+}
+
+/*
+ * Size and mtime of the file a transfer reads from, used to tell whether a
+ * resume checkpoint still describes the same source. Local files give
+ * their mtime in nanoseconds: only the tail before the offset is verified,
+ * so a same-size re-save within the same second must not pass as the same
+ * file. Remote mtimes are whole seconds (SFTP v3).
+ */
+static gboolean transfer_source_identity(SFTPSession *session, gboolean is_upload,
+                                         const gchar *local, const gchar *remote,
+                                         gint64 *size, gint64 *mtime)
+{
+    if (is_upload) {
+        struct stat st;
+        if (stat(local, &st) != 0)
+            return FALSE;
+        *size = (gint64)st.st_size;
+        *mtime = compat_stat_mtime_ns(&st);
+        return TRUE;
+    } else {
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+        if (libssh2_sftp_stat(session->sftp_session, remote, &attrs) != 0 ||
+            !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) ||
+            !(attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME))
+            return FALSE;
+        *size = (gint64)attrs.filesize;
+        *mtime = (gint64)attrs.mtime;
+        return TRUE;
+    }
+}
+
+/*
+ * Check that the RESUME_VERIFY_WINDOW bytes before offset match on both
+ * sides before continuing a partial target. Leaves both positions undefined.
+ */
+static gboolean resume_verify_tail(LIBSSH2_SFTP_HANDLE *handle, FILE *local_file, gsize offset)
+{
+    gsize window = MIN(offset, (gsize)RESUME_VERIFY_WINDOW);
+    gchar *remote_buf = g_malloc(window);
+    gchar *local_buf = g_malloc(window);
+    gsize got = 0;
+    ssize_t rc;
+    gboolean same = FALSE;
+
+    libssh2_sftp_seek64(handle, offset - window);
+    while (got < window &&
+           (rc = libssh2_sftp_read(handle, remote_buf + got, window - got)) > 0)
+        got += rc;
+
+    if (got == window &&
+        fseeko(local_file, (off_t)(offset - window), SEEK_SET) == 0 &&
+        fread(local_buf, 1, window, local_file) == window)
+        same = memcmp(remote_buf, local_buf, window) == 0;
+
+    g_free(local_buf);
+    g_free(remote_buf);
+    return same;
+}
+
+/*
+ * Upload file
+ *
+ * libssh2 sends the whole buffer passed to libssh2_sftp_write as a train of
+ * WRITE requests and returns as soon as the first ones are acknowledged;
+ * calling it again with the rest of the same buffer keeps the remaining
+ * requests in flight. Filling a window-sized buffer per round therefore
+ * keeps up to write_window requests outstanding.
+ *
+ * An interrupted upload leaves a resume checkpoint; the next upload of the
+ * same unchanged file continues from there once the remote tail matches.
+ */
+gboolean sftp_upload_file(SFTPSession *session, const gchar *local, const gchar *remote,
+                          FileOperation *op)
+{
+    FILE *local_file;
+    LIBSSH2_SFTP_HANDLE *sftp_handle = NULL;
+    gchar *buf;
+    gsize buf_size;
+    size_t nread;
+    ssize_t rc;
+    gint64 source_size = 0;
+    gint64 source_mtime = 0;
+    gboolean have_identity;
+    gsize offset = 0;
+    gsize written;
+    gboolean ok = TRUE;
+
+    if (!session || !session->active || !session->sftp_session || session->dropped) {
+        g_printerr("Not connected to server\n");
+        return FALSE;
+    }
+
+    local_file = fopen(local, "rb");
+    if (!local_file) {
+        g_printerr("Cannot open local file: %s\n", local);
+        return FALSE;
+    }
+
+    have_identity = transfer_source_identity(session, TRUE, local, remote,
+                                             &source_size, &source_mtime);
+    if (op)
+        op->total_size = (gsize)source_size;
+
+    /* Continue an interrupted upload if the remote prefix checks out */
+    if (have_identity)
+        offset = resume_checkpoint_load(session, TRUE, local, remote,
+                                        source_size, source_mtime);
+    if (offset > 0) {
+        sftp_handle = libssh2_sftp_open(session->sftp_session, remote,
+                                        LIBSSH2_FXF_READ | LIBSSH2_FXF_WRITE, 0);
+        if (!sftp_handle || !resume_verify_tail(sftp_handle, local_file, offset)) {
+            g_print("Partial upload does not match, restarting: %s\n", remote);
+            if (sftp_handle)
                 libssh2_sftp_close(sftp_handle);
-                fclose(local_file);
-                return FALSE;
+            sftp_handle = NULL;
+            offset = 0;
+        }
+    }
+
+    if (offset > 0) {
+        libssh2_sftp_seek64(sftp_handle, offset);
+        fseeko(local_file, (off_t)offset, SEEK_SET);
+        g_print("Resuming upload at %lu bytes\n", (unsigned long)offset);
+    } else {
+        fseek(local_file, 0, SEEK_SET);
+        sftp_handle = libssh2_sftp_open(session->sftp_session, remote,
+                                        LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC,
+                                        LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR);
+        if (!sftp_handle) {
+            g_printerr("Cannot create remote file: %s\n", remote);
+            fclose(local_file);
+            return FALSE;
+        }
+    }
+
+    written = offset;
+    if (op)
+        op->transferred = offset;
+
+    buf_size = transfer_write_buffer_size(session);
+    buf = g_malloc(buf_size);
+
+    g_print("Uploading: %s -> %s (window %lu KB)\n", local, remote,
+            (unsigned long)(buf_size / 1024));
+
+    while (ok) {
+        gint64 disk_start = g_get_monotonic_time();
+        gchar *ptr = buf;
+
+        nread = fread(buf, 1, buf_size, local_file);
+        transfer_op_disk(op, disk_start);
+        if (nread == 0)
+            break;
+        while (nread > 0) {
+            if (op && op->cancelled) {
+                ok = FALSE;
+                break;
             }
-            rc = libssh2_sftp_write(sftp_handle, buf + written, nread - written);
+            rc = libssh2_sftp_write(sftp_handle, ptr, nread);
             if (rc < 0) {
-                g_printerr("Upload failed: %d\n", rc);
-                libssh2_sftp_close(sftp_handle);
-                fclose(local_file);
-                return FALSE;
+                g_printerr("Upload failed: %d\n", (int)rc);
+                ok = FALSE;
+                break;
             }
+            transfer_op_data(op, (gsize)rc);
+            ptr += rc;
+            nread -= rc;
             written += rc;
             if (op)
                 g_atomic_pointer_add(&op->transferred, rc);
         }
     }
 
+    if (ok && ferror(local_file)) {
+        g_printerr("Failed to read local file: %s\n", local);
+        ok = FALSE;
+    }
+
+    g_free(buf);
     libssh2_sftp_close(sftp_handle);
     fclose(local_file);
 
-    g_print("Upload completed\n");
-    return TRUE;
+    if (ok) {
+        resume_checkpoint_clear(session, TRUE, local, remote);
+        g_print("Upload completed\n");
+    } else if (have_identity) {
+        resume_checkpoint_save(session, TRUE, local, remote,
+                               source_size, source_mtime, written);
+    }
+    return ok;
+}
+
+/*
+ * Number of READ requests to keep in flight for a session
+ */
+static gint transfer_read_window(SFTPSession *session)
+{
+    gint window = session->config ? session->config->read_window : 0;
+    if (window <= 0)
+        window = DEFAULT_READ_WINDOW;
+    return MIN(window, MAX_TRANSFER_WINDOW);
+}
+
+/*
+ * Size of the download buffer for a session (chunk size * READ window)
+ */
+gsize transfer_read_buffer_size(SFTPSession *session)
+{
+    return (gsize)transfer_read_window(session) * SFTP_CHUNK_SIZE;
 }
 
 /*
  * Download file
+ *
+ * libssh2 keeps issuing READ requests ahead of the caller for as much data
+ * as the destination buffer can hold, so a buffer of window * chunk bytes
+ * keeps that many requests outstanding. Data is returned in file order and
+ * written straight to the local file.
+ *
+ * Like uploads, interrupted downloads are resumed from their checkpoint.
  */
 gboolean sftp_download_file(SFTPSession *session, const gchar *remote, const gchar *local,
                             FileOperation *op)
 {
-    FILE *local_file;
+    FILE *local_file = NULL;
     LIBSSH2_SFTP_HANDLE *sftp_handle;
-    char buf[8192];
-    int rc;
     LIBSSH2_SFTP_ATTRIBUTES attrs;
+    gchar *buf;
+    gsize buf_size;
+    ssize_t rc;
+    gint64 source_size = 0;
+    gint64 source_mtime = 0;
+    gboolean have_identity = FALSE;
+    gsize offset = 0;
+    gsize written;
+    gboolean ok = TRUE;
 
-    if (!session || !session->active || !session->sftp_session) {
+    if (!session || !session->active || !session->sftp_session || session->dropped) {
         g_printerr("Not connected to server\n");
         return FALSE;
     }
@@ -298,94 +1319,791 @@ gboolean sftp_download_file(SFTPSession *session, const gchar *remote, const gch
     }
 
     /* Get file size for progress */
-    if (libssh2_sftp_stat(session->sftp_session, remote, &attrs) == 0) {
+    if (libssh2_sftp_fstat(sftp_handle, &attrs) == 0 &&
+        (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
         g_print("File size: %lu bytes\n", (unsigned long)attrs.filesize);
         if (op)
             op->total_size = (gsize)attrs.filesize;
+        if (attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+            source_size = (gint64)attrs.filesize;
+            source_mtime = (gint64)attrs.mtime;
+            have_identity = TRUE;
+        }
+    }
+
+    /* Continue an interrupted download if the local prefix checks out */
+    if (have_identity)
+        offset = resume_checkpoint_load(session, FALSE, local, remote,
+                                        source_size, source_mtime);
+    if (offset > 0) {
+        local_file = fopen(local, "r+b");
+        if (!local_file || !resume_verify_tail(sftp_handle, local_file, offset)) {
+            g_print("Partial download does not match, restarting: %s\n", local);
+            if (local_file)
+                fclose(local_file);
+            local_file = NULL;
+            offset = 0;
+        }
+    }
+
+    if (offset > 0) {
+        libssh2_sftp_seek64(sftp_handle, offset);
+        fseeko(local_file, (off_t)offset, SEEK_SET);
+        g_print("Resuming download at %lu bytes\n", (unsigned long)offset);
+    } else {
+        libssh2_sftp_seek64(sftp_handle, 0);
+        local_file = fopen(local, "wb");
+        if (!local_file) {
+            g_printerr("Cannot create local file: %s\n", local);
+            libssh2_sftp_close(sftp_handle);
+            return FALSE;
+        }
     }
+
+    written = offset;
     if (op)
-        op->transferred = 0;
+        op->transferred = offset;
 
-    local_file = fopen(local, "wb");
-    if (!local_file) {
-        g_printerr("Cannot create local file: %s\n", local);
+    buf_size = transfer_read_buffer_size(session);
+    buf = g_malloc(buf_size);
+
+    g_print("Downloading: %s -> %s (window %lu KB)\n", remote, local,
+            (unsigned long)(buf_size / 1024));
+
+    while ((rc = libssh2_sftp_read(sftp_handle, buf, buf_size)) > 0) {
+        gint64 disk_start;
+
+        transfer_op_data(op, (gsize)rc);
+        if (op && op->cancelled) {
+            ok = FALSE;
+            break;
+        }
+        disk_start = g_get_monotonic_time();
+        if (fwrite(buf, 1, rc, local_file) != (size_t)rc) {
+            g_printerr("Failed to write local file\n");
+            ok = FALSE;
+            break;
+        }
+        transfer_op_disk(op, disk_start);
+        written += rc;
+        if (op)
+            g_atomic_pointer_add(&op->transferred, rc);
+    }
+
+    if (ok && rc < 0) {
+        g_printerr("Download failed: %d\n", (int)rc);
+        ok = FALSE;
+    }
+
+    g_free(buf);
+    libssh2_sftp_close(sftp_handle);
+    if (fclose(local_file) != 0)
+        ok = FALSE;
+
+    if (ok) {
+        resume_checkpoint_clear(session, FALSE, local, remote);
+        g_print("Download completed\n");
+    } else if (have_identity) {
+        resume_checkpoint_save(session, FALSE, local, remote,
+                               source_size, source_mtime, written);
+    }
+    return ok;
+}
+
+/*
+ * One byte range of a multi-stream transfer
+ */
+typedef struct {
+    SFTPSession *session;
+    FileOperation *op;
+    gsize offset;
+    gsize length;
+    gsize done;         /* Bytes of the range in place so far */
+    gboolean success;
+} TransferRange;
+
+/*
+ * Download [offset, offset + length) of the remote file into the same
+ * range of the (already created) local file
+ */
+static gboolean download_range(TransferRange *range)
+{
+    FileOperation *op = range->op;
+    LIBSSH2_SFTP_HANDLE *sftp_handle;
+    FILE *local_file;
+    gchar *buf;
+    gsize buf_size;
+    gsize remaining = range->length;
+    gint64 disk_start;
+    ssize_t rc = 0;
+    gboolean ok = TRUE;
+
+    sftp_handle = libssh2_sftp_open(range->session->sftp_session, op->remote_path,
+                                    LIBSSH2_FXF_READ, 0);
+    if (!sftp_handle) {
+        g_printerr("Cannot open remote file: %s\n", op->remote_path);
+        return FALSE;
+    }
+
+    local_file = fopen(op->local_path, "r+b");
+    if (!local_file || fseeko(local_file, (off_t)range->offset, SEEK_SET) != 0) {
+        g_printerr("Cannot open local file: %s\n", op->local_path);
+        if (local_file)
+            fclose(local_file);
         libssh2_sftp_close(sftp_handle);
         return FALSE;
     }
 
-    g_print("Downloading: %s -> %s\n", remote, local);
+    libssh2_sftp_seek64(sftp_handle, range->offset);
+    buf_size = transfer_read_buffer_size(range->session);
+    buf = g_malloc(buf_size);
 
-    while ((rc = libssh2_sftp_read(sftp_handle, buf, sizeof(buf))) > 0) {
-        if (op && op->cancelled) {
-            libssh2_sftp_close(sftp_handle);
-            fclose(local_file);
-            return FALSE;
+    while (remaining > 0) {
+        if (op->cancelled) {
+            ok = FALSE;
+            break;
         }
+        rc = libssh2_sftp_read(sftp_handle, buf, MIN(buf_size, remaining));
+        if (rc <= 0)
+            break;
+        transfer_op_data(op, (gsize)rc);
+        disk_start = g_get_monotonic_time();
         if (fwrite(buf, 1, rc, local_file) != (size_t)rc) {
             g_printerr("Failed to write local file\n");
-            libssh2_sftp_close(sftp_handle);
+            ok = FALSE;
+            break;
+        }
+        transfer_op_disk(op, disk_start);
+        remaining -= rc;
+        range->done += rc;
+        g_atomic_pointer_add(&op->transferred, rc);
+    }
+
+    if (ok && remaining > 0) {
+        g_printerr("Download of range at %lu failed: %d\n",
+                   (unsigned long)range->offset, (int)rc);
+        ok = FALSE;
+    }
+
+    g_free(buf);
+    libssh2_sftp_close(sftp_handle);
+    if (fclose(local_file) != 0)
+        ok = FALSE;
+    return ok;
+}
+
+/*
+ * Upload [offset, offset + length) of the local file into the same range
+ * of the (already created) remote file
+ */
+static gboolean upload_range(TransferRange *range)
+{
+    FileOperation *op = range->op;
+    LIBSSH2_SFTP_HANDLE *sftp_handle;
+    FILE *local_file;
+    gchar *buf;
+    gsize buf_size;
+    gsize remaining = range->length;
+    gboolean ok = TRUE;
+
+    local_file = fopen(op->local_path, "rb");
+    if (!local_file || fseeko(local_file, (off_t)range->offset, SEEK_SET) != 0) {
+        g_printerr("Cannot open local file: %s\n", op->local_path);
+        if (local_file)
             fclose(local_file);
-            return FALSE;
+        return FALSE;
+    }
+
+    sftp_handle = libssh2_sftp_open(range->session->sftp_session, op->remote_path,
+                                    LIBSSH2_FXF_WRITE, 0);
+    if (!sftp_handle) {
+        g_printerr("Cannot open remote file: %s\n", op->remote_path);
+        fclose(local_file);
+        return FALSE;
+    }
+
+    libssh2_sftp_seek64(sftp_handle, range->offset);
+    buf_size = transfer_write_buffer_size(range->session);
+    buf = g_malloc(buf_size);
+
+    while (ok && remaining > 0) {
+        gint64 disk_start = g_get_monotonic_time();
+        size_t nread = fread(buf, 1, MIN(buf_size, remaining), local_file);
+        gchar *ptr = buf;
+
+        transfer_op_disk(op, disk_start);
+
+        if (nread == 0) {
+            g_printerr("Failed to read local file: %s\n", op->local_path);
+            ok = FALSE;
+            break;
         }
-        if (op)
+        remaining -= nread;
+
+        while (nread > 0) {
+            ssize_t rc;
+            if (op->cancelled) {
+                ok = FALSE;
+                break;
+            }
+            rc = libssh2_sftp_write(sftp_handle, ptr, nread);
+            if (rc < 0) {
+                g_printerr("Upload of range at %lu failed: %d\n",
+                           (unsigned long)range->offset, (int)rc);
+                ok = FALSE;
+                break;
+            }
+            transfer_op_data(op, (gsize)rc);
+            ptr += rc;
+            nread -= rc;
+            range->done += rc;
             g_atomic_pointer_add(&op->transferred, rc);
+        }
     }
 
+    g_free(buf);
     libssh2_sftp_close(sftp_handle);
     fclose(local_file);
+    return ok;
+}
+
+static gpointer transfer_range_thread_func(gpointer data)
+{
+    TransferRange *range = (TransferRange *)data;
+
+    if (range->op->is_upload)
+        range->success = upload_range(range);
+    else
+        range->success = download_range(range);
+    return NULL;
+}
 
-    g_print("Download completed\n");
+/*
+ * Create the destination file so every stream can write into its range
+ */
+static gboolean parallel_prepare_target(SFTPSession *session, FileOperation *op)
+{
+    if (op->is_upload) {
+        LIBSSH2_SFTP_HANDLE *handle;
+        handle = libssh2_sftp_open(session->sftp_session, op->remote_path,
+                                   LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC,
+                                   LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR);
+        if (!handle) {
+            g_printerr("Cannot create remote file: %s\n", op->remote_path);
+            return FALSE;
+        }
+        libssh2_sftp_close(handle);
+    } else {
+        FILE *local_file = fopen(op->local_path, "wb");
+        if (!local_file) {
+            g_printerr("Cannot create local file: %s\n", op->local_path);
+            return FALSE;
+        }
+        fclose(local_file);
+    }
     return TRUE;
 }
 
 /*
- * Idle callback - runs on main thread after transfer completes
+ * Split a transfer into byte ranges and move them concurrently over the
+ * given session plus channels leased from its pool. Falls back to fewer
+ * streams when no more channels are free; one channel is always left for
+ * browsing.
+ */
+static gboolean parallel_transfer(SFTPSession *session, FileOperation *op,
+                                  gsize size, gint streams)
+{
+    SFTPSession *owner = session->parent ? session->parent : session;
+    GPtrArray *sessions = g_ptr_array_new();
+    TransferRange *ranges;
+    GThread **threads;
+    gsize range_size;
+    gint64 source_size, source_mtime;
+    gboolean have_identity;
+    gboolean ok = TRUE;
+    guint i;
+
+    streams = MIN(streams, MAX(owner->config->max_channels - 1, 1));
+
+    g_ptr_array_add(sessions, session);
+    for (i = 1; i < (guint)streams; i++) {
+        SFTPSession *channel = sftp_session_lease(session, FALSE);
+        if (!channel)
+            break;
+        g_ptr_array_add(sessions, channel);
+    }
+
+    if (sessions->len < 2 || !parallel_prepare_target(session, op)) {
+        for (i = 1; i < sessions->len; i++)
+            sftp_session_release(g_ptr_array_index(sessions, i));
+        g_ptr_array_free(sessions, TRUE);
+        if (op->cancelled)
+            return FALSE;
+        return op->is_upload
+            ? sftp_upload_file(session, op->local_path, op->remote_path, op)
+            : sftp_download_file(session, op->remote_path, op->local_path, op);
+    }
+
+    /* Taken before any data moves, so a checkpoint never vouches for a later version */
+    have_identity = transfer_source_identity(session, op->is_upload, op->local_path,
+                                             op->remote_path, &source_size, &source_mtime);
+
+    g_print("%s %s in %u streams\n", op->is_upload ? "Uploading" : "Downloading",
+            op->is_upload ? op->local_path : op->remote_path, sessions->len);
+
+    op->total_size = size;
+    op->transferred = 0;
+
+    range_size = size / sessions->len;
+    ranges = g_new0(TransferRange, sessions->len);
+    threads = g_new0(GThread *, sessions->len);
+
+    for (i = 0; i < sessions->len; i++) {
+        ranges[i].session = g_ptr_array_index(sessions, i);
+        ranges[i].op = op;
+        ranges[i].offset = range_size * i;
+        ranges[i].length = (i == sessions->len - 1) ? size - ranges[i].offset : range_size;
+        threads[i] = g_thread_new("sftp-range", transfer_range_thread_func, &ranges[i]);
+    }
+
+    for (i = 0; i < sessions->len; i++) {
+        g_thread_join(threads[i]);
+        if (!ranges[i].success)
+            ok = FALSE;
+    }
+
+    /* Only the unbroken prefix can be resumed, and that by a single stream */
+    if (!ok && have_identity) {
+        gsize prefix = 0;
+
+        for (i = 0; i < sessions->len; i++) {
+            prefix += ranges[i].done;
+            if (ranges[i].done < ranges[i].length)
+                break;
+        }
+        resume_checkpoint_save(session, op->is_upload, op->local_path, op->remote_path,
+                               source_size, source_mtime, prefix);
+    }
+
+    for (i = 1; i < sessions->len; i++)
+        sftp_session_release(g_ptr_array_index(sessions, i));
+    g_ptr_array_free(sessions, TRUE);
+    g_free(threads);
+    g_free(ranges);
+
+    if (ok)
+        g_print("%s completed\n", op->is_upload ? "Upload" : "Download");
+    return ok;
+}
+
+/*
+ * Move op's data directly into its target, splitting it across several
+ * sessions when it is larger than the connection's parallel threshold
+ */
+static gboolean transfer_file_streams(SFTPSession *session, FileOperation *op)
+{
+    SFTPConnection *config = session->config;
+    gint streams = config ? MIN(config->parallel_streams, MAX_PARALLEL_STREAMS) : 1;
+    gsize threshold;
+    gsize size = 0;
+    gboolean have_size = FALSE;
+
+    /* An interrupted transfer resumes on a single stream */
+    if (streams > 1 && !resume_checkpoint_exists(session, op->is_upload,
+                                                 op->local_path, op->remote_path)) {
+        threshold = (gsize)MAX(config->parallel_threshold_mb, 1) * 1024 * 1024;
+
+        if (op->is_upload) {
+            struct stat st;
+            if (stat(op->local_path, &st) == 0) {
+                size = (gsize)st.st_size;
+                have_size = TRUE;
+            }
+        } else {
+            LIBSSH2_SFTP_ATTRIBUTES attrs;
+            if (libssh2_sftp_stat(session->sftp_session, op->remote_path, &attrs) == 0 &&
+                (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)) {
+                size = (gsize)attrs.filesize;
+                have_size = TRUE;
+            }
+        }
+
+        if (have_size && size >= threshold)
+            return parallel_transfer(session, op, size, streams);
+    }
+
+    if (op->is_upload)
+        return sftp_upload_file(session, op->local_path, op->remote_path, op);
+    return sftp_download_file(session, op->remote_path, op->local_path, op);
+}
+
+/*
+ * Hidden sibling an atomic upload writes into, or NULL if its path would
+ * not fit in a FileOperation
+ */
+static gchar *atomic_upload_temp_path(const gchar *remote)
+{
+    gchar *dir = g_path_get_dirname(remote);
+    gchar *base = g_path_get_basename(remote);
+    gchar *name = g_strdup_printf(".%s.sftp-part", base);
+    gchar *temp;
+
+    if (strchr(remote, '/'))
+        temp = g_build_path("/", dir, name, NULL);
+    else
+        temp = g_strdup(name);
+
+    g_free(name);
+    g_free(base);
+    g_free(dir);
+
+    /* Leave room for the ".old" of a swap */
+    if (strlen(temp) + 4 >= MAX_PATH_LEN) {
+        g_free(temp);
+        return NULL;
+    }
+    return temp;
+}
+
+/*
+ * Replace remote with temp. posix-rename@openssh.com and SFTP v5+ renames
+ * overwrite in one step; a v3 server refuses to rename onto an existing
+ * file, so the old file is moved aside first and put back on failure.
+ */
+static gboolean atomic_upload_commit(SFTPSession *session, const gchar *temp,
+                                     const gchar *remote)
+{
+    LIBSSH2_SFTP *sftp = session->sftp_session;
+    gchar *aside;
+    gboolean ok = FALSE;
+
+#if LIBSSH2_VERSION_NUM >= 0x010b01
+    if (libssh2_sftp_posix_rename_ex(sftp, temp, strlen(temp), remote, strlen(remote)) == 0)
+        return TRUE;
+#endif
+    if (libssh2_sftp_rename(sftp, temp, remote) == 0)
+        return TRUE;
+
+    aside = g_strconcat(temp, ".old", NULL);
+    libssh2_sftp_unlink(sftp, aside);
+    if (libssh2_sftp_rename_ex(sftp, remote, strlen(remote), aside, strlen(aside), 0) != 0) {
+        g_printerr("Cannot move %s aside: %lu\n", remote, libssh2_sftp_last_error(sftp));
+    } else if (libssh2_sftp_rename_ex(sftp, temp, strlen(temp), remote, strlen(remote), 0) != 0) {
+        g_printerr("Cannot rename %s to %s: %lu\n", temp, remote, libssh2_sftp_last_error(sftp));
+        libssh2_sftp_rename_ex(sftp, aside, strlen(aside), remote, strlen(remote), 0);
+    } else {
+        libssh2_sftp_unlink(sftp, aside);
+        ok = TRUE;
+    }
+
+    g_free(aside);
+    return ok;
+}
+
+/*
+ * Upload into a hidden sibling of the target and rename it into place once
+ * complete, so readers of the remote file never see a partial copy and a
+ * cancelled upload leaves the old one intact. The target's permission bits
+ * carry over; owner and group become the uploading user's. Symlinks are
+ * written through in place, since renaming would replace the link itself.
+ */
+static gboolean sftp_atomic_upload(SFTPSession *session, FileOperation *op)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    gboolean have_attrs;
+    gchar remote[MAX_PATH_LEN];
+    gchar *temp;
+    gboolean ok;
+
+    have_attrs = libssh2_sftp_lstat(session->sftp_session, op->remote_path, &attrs) == 0;
+    if (have_attrs && (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+        (attrs.permissions & LIBSSH2_SFTP_S_IFMT) == LIBSSH2_SFTP_S_IFLNK)
+        return transfer_file_streams(session, op);
+
+    temp = atomic_upload_temp_path(op->remote_path);
+    if (!temp)
+        return transfer_file_streams(session, op);
+
+    /* Stream into the temp file; resume checkpoints follow it */
+    g_strlcpy(remote, op->remote_path, sizeof(remote));
+    g_strlcpy(op->remote_path, temp, MAX_PATH_LEN);
+    ok = transfer_file_streams(session, op);
+    g_strlcpy(op->remote_path, remote, MAX_PATH_LEN);
+
+    if (ok && have_attrs && (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)) {
+        LIBSSH2_SFTP_ATTRIBUTES perms;
+        memset(&perms, 0, sizeof(perms));
+        perms.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+        perms.permissions = attrs.permissions & 07777;
+        if (libssh2_sftp_setstat(session->sftp_session, temp, &perms) != 0)
+            g_printerr("Cannot copy permissions to %s\n", temp);
+    }
+
+    if (ok && !op->cancelled) {
+        ok = atomic_upload_commit(session, temp, remote);
+        if (ok)
+            g_print("Replaced %s atomically\n", remote);
+    } else {
+        ok = FALSE;
+    }
+
+    /* A partial temp file is only worth keeping if it can be resumed */
+    if (!ok && !resume_checkpoint_exists(session, TRUE, op->local_path, temp))
+        libssh2_sftp_unlink(session->sftp_session, temp);
+
+    g_free(temp);
+    return ok;
+}
+
+/*
+ * Transfer the file described by op. Uploads go through a temporary file
+ * when the connection asks for atomic replacement, and otherwise send only
+ * the changed blocks of files opened for editing.
+ */
+static gboolean transfer_file_dispatch(SFTPSession *session, FileOperation *op)
+{
+    SFTPConnection *config = session ? session->config : NULL;
+
+    if (!session || !session->active || !session->sftp_session || session->dropped) {
+        g_printerr("Not connected to server\n");
+        return FALSE;
+    }
+
+    if (op->is_upload && config && config->atomic_upload)
+        return sftp_atomic_upload(session, op);
+
+    /* Auto-uploads of files we downloaded only send what changed */
+    if (op->is_upload && op->signature && config && config->delta_upload)
+        return sftp_delta_upload(session, op);
+
+    return transfer_file_streams(session, op);
+}
+
+/*
+ * Can op be run again from the start after a broken connection?
+ * Downloads resume into the local file; uploads only when they go
+ * through a temporary file.
+ */
+static gboolean transfer_replayable(SFTPSession *session, FileOperation *op)
+{
+    if (!op->is_upload)
+        return TRUE;
+    return session->config && session->config->atomic_upload;
+}
+
+/*
+ * Transfer the file described by op on a channel the caller has locked,
+ * and record its timing on the pool owner's statistics
+ */
+gboolean sftp_transfer_file(SFTPSession *session, FileOperation *op)
+{
+    SFTPSession *owner = (session && session->parent) ? session->parent : session;
+    gboolean connected = session && session->sftp_session && !session->dropped;
+    gboolean ok;
+
+    /* Callers that lease their own channel start the clock here */
+    if (!op->locked_at)
+        op->locked_at = g_get_monotonic_time();
+
+    /* Keeps a local watch from pushing the half-written file back */
+    if (!op->is_upload)
+        local_watch_write_begin(op->local_path);
+
+    ok = transfer_file_dispatch(session, op);
+
+    /*
+     * Run it again on a new connection if the old one died under it, but
+     * only where a second run cannot leave a half-written target behind
+     */
+    if (!ok && connected && !op->cancelled && transfer_replayable(session, op) &&
+        sftp_session_lost(session) && sftp_session_reconnect(session)) {
+        g_print("Retrying %s\n", op->is_upload ? op->local_path : op->remote_path);
+        op->transferred = 0;
+        ok = transfer_file_dispatch(session, op);
+    }
+
+    if (!op->is_upload)
+        local_watch_write_end(op->local_path);
+
+    op->completed_at = g_get_monotonic_time();
+    if (owner)
+        stats_record(owner->stats, op, ok);
+    return ok;
+}
+
+/*
+ * Count one READ/WRITE call that moved bytes over the network. Range
+ * threads of a parallel transfer call this concurrently.
+ */
+void transfer_op_data(FileOperation *op, gsize bytes)
+{
+    if (!op)
+        return;
+    if (g_atomic_int_compare_and_exchange(&op->first_byte_seen, 0, 1))
+        op->first_byte_at = g_get_monotonic_time();
+    g_atomic_int_inc(&op->requests);
+    g_atomic_pointer_add(&op->bytes_moved, bytes);
+}
+
+/*
+ * Add the time spent in local reads or writes started at since
+ */
+void transfer_op_disk(FileOperation *op, gint64 since)
+{
+    if (op)
+        g_atomic_pointer_add(&op->disk_us, g_get_monotonic_time() - since);
+}
+
+/*
+ * Idle callback - runs on main thread after transfer completes.
+ * Operations without a callback are owned by the queue and freed here.
  */
 static gboolean transfer_complete_idle(gpointer data)
 {
     FileOperation *op = (FileOperation *)data;
-    if (op->callback)
+    if (op->observer)
+        op->observer(op, TRANSFER_EVENT_FINISHED, op->observer_data);
+    if (op->callback) {
         op->callback(op, op->success, op->user_data);
+    } else {
+        delta_signature_unref(op->signature);
+        g_free(op);
+    }
     return G_SOURCE_REMOVE;
 }
 
 /*
- * Worker thread function
+ * Stat a remote file as (size, mtime) for the file cache
+ */
+static gboolean transfer_remote_identity(SFTPSession *channel, const gchar *remote,
+                                         gint64 *size, gint64 *mtime)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    if (!sftp_remote_stat(channel, remote, &attrs) ||
+        !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) ||
+        !(attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME))
+        return FALSE;
+    *size = (gint64)attrs.filesize;
+    *mtime = (gint64)attrs.mtime;
+    return TRUE;
+}
+
+/*
+ * Download a file opened for editing through the persistent cache: one
+ * stat decides whether the cached copy is still what the server holds.
+ * The file is only cached if it did not change while it was downloaded.
  */
-static gpointer transfer_thread_func(gpointer data)
+static gboolean transfer_cached_download(SFTPSession *session, SFTPSession *channel,
+                                         FileOperation *op)
+{
+    gint64 size, mtime, after_size, after_mtime;
+    gboolean known, hit;
+
+    known = transfer_remote_identity(channel, op->remote_path, &size, &mtime);
+    local_watch_write_begin(op->local_path);
+    hit = known && file_cache_lookup(session->file_cache, session->config, op->remote_path,
+                                     size, mtime, op->local_path);
+    local_watch_write_end(op->local_path);
+    if (hit) {
+        op->total_size = (gsize)size;
+        op->transferred = (gsize)size;
+        op->cache_hit = TRUE;
+        op->completed_at = g_get_monotonic_time();
+        stats_record(session->stats, op, TRUE);
+        delta_signature_set(op->signature, op->local_path, size, mtime);
+        return TRUE;
+    }
+
+    if (!sftp_transfer_file(channel, op))
+        return FALSE;
+
+    if (transfer_remote_identity(channel, op->remote_path, &after_size, &after_mtime)) {
+        if (known && after_size == size && after_mtime == mtime)
+            file_cache_store(session->file_cache, session->config, op->remote_path,
+                             size, mtime, op->local_path);
+        delta_signature_set(op->signature, op->local_path, after_size, after_mtime);
+    }
+    return TRUE;
+}
+
+/*
+ * Transfer job, runs on the session's worker pool
+ */
+static void transfer_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
 {
     FileOperation *op = (FileOperation *)data;
 
-    g_mutex_lock(&op->session->lock);
+    if (cancelled) {
+        g_print("Transfer cancelled before start: %s\n",
+                op->is_upload ? op->local_path : op->remote_path);
+        op->success = FALSE;
+    } else {
+        SFTPSession *channel;
 
-    if (op->is_upload)
-        op->success = sftp_upload_file(op->session, op->local_path, op->remote_path, op);
-    else
-        op->success = sftp_download_file(op->session, op->remote_path, op->local_path, op);
+        op->started_at = g_get_monotonic_time();
+        channel = sftp_session_lease(session, TRUE);
+        op->leased_at = g_get_monotonic_time();
+        g_mutex_lock(&channel->lock);
+        op->locked_at = g_get_monotonic_time();
+        if (!op->is_upload && op->signature && session->file_cache) {
+            op->success = transfer_cached_download(session, channel, op);
+        } else {
+            op->success = sftp_transfer_file(channel, op);
+
+            /* Remember what the remote copy of a file opened for editing looks like */
+            if (op->success && !op->is_upload && op->signature)
+                delta_signature_update(op->signature, channel, op->local_path, op->remote_path);
+        }
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
 
-    g_mutex_unlock(&op->session->lock);
+        /* Even a failed upload may have left a partial file behind */
+        if (op->is_upload)
+            dir_cache_invalidate_parent(session->dir_cache, op->remote_path);
+    }
 
     op->completed = TRUE;
     g_idle_add(transfer_complete_idle, op);
-    return NULL;
 }
 
 /*
- * Start an async file transfer. Caller must free the returned FileOperation
- * in the callback (or after completion).
+ * Queue an async file transfer on the session's worker pool. Caller must
+ * free the returned FileOperation in the callback; without a callback it is
+ * freed after completion. signature, if given, is referenced by the op: a
+ * download fills it in, an upload uses it to send only changed blocks.
+ * Call from the main thread: the session's observer is told right away.
  */
 FileOperation *transfer_async(SFTPSession *session, const gchar *local,
-                              const gchar *remote, gboolean is_upload,
+                              const gchar *remote, gboolean is_upload, JobPriority priority,
+                              DeltaSignature *signature,
                               TransferCallback callback, gpointer user_data)
 {
     FileOperation *op = g_new0(FileOperation, 1);
     g_strlcpy(op->local_path, local, MAX_PATH_LEN);
     g_strlcpy(op->remote_path, remote, MAX_PATH_LEN);
     op->is_upload = is_upload;
+    op->priority = priority;
+    op->signature = signature ? delta_signature_ref(signature) : NULL;
     op->session = session;
     op->callback = callback;
     op->user_data = user_data;
+    op->observer = session->transfer_observer;
+    op->observer_data = session->transfer_observer_data;
+    op->queued_at = g_get_monotonic_time();
 
-    op->thread = g_thread_new("sftp-transfer", transfer_thread_func, op);
+    if (op->observer)
+        op->observer(op, TRANSFER_EVENT_QUEUED, op->observer_data);
+    sftp_session_push_job(session, priority, transfer_job_func, op, &op->cancelled);
     return op;
 }
+
+/*
+ * Cancel a queued or running transfer
+ */
+void transfer_cancel(FileOperation *op)
+{
+    op->cancelled = TRUE;
+    if (!op->completed && op->session)
+        sftp_session_cancel_job(op->session, op);
+}
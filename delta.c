@@ -0,0 +1,279 @@
+/*
+ * Delta Upload Module
+ * Re-upload only the blocks of a file that changed since the remote copy
+ */
+
+#include "sftp-core.h"
+
+#include <sys/stat.h>
+
+struct _DeltaSignature {
+    gint refs;
+    GMutex lock;            /* Held for a whole delta upload */
+    gboolean valid;
+    GByteArray *digests;    /* SHA-1 of each DELTA_BLOCK_SIZE block of the remote copy */
+    gint64 remote_size;     /* Remote file the digests describe */
+    gint64 remote_mtime;
+};
+
+#define DELTA_DIGEST_LEN 20
+
+DeltaSignature *delta_signature_new(void)
+{
+    DeltaSignature *sig = g_new0(DeltaSignature, 1);
+    sig->refs = 1;
+    g_mutex_init(&sig->lock);
+    sig->digests = g_byte_array_new();
+    return sig;
+}
+
+DeltaSignature *delta_signature_ref(DeltaSignature *sig)
+{
+    g_atomic_int_inc(&sig->refs);
+    return sig;
+}
+
+void delta_signature_unref(DeltaSignature *sig)
+{
+    if (!sig || !g_atomic_int_dec_and_test(&sig->refs))
+        return;
+    g_byte_array_unref(sig->digests);
+    g_mutex_clear(&sig->lock);
+    g_free(sig);
+}
+
+/*
+ * Append the digest of one block
+ */
+static void block_digest_append(GByteArray *digests, const guchar *block, gsize len)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    guint8 digest[DELTA_DIGEST_LEN];
+    gsize digest_len = sizeof(digest);
+
+    g_checksum_update(checksum, block, len);
+    g_checksum_get_digest(checksum, digest, &digest_len);
+    g_byte_array_append(digests, digest, DELTA_DIGEST_LEN);
+    g_checksum_free(checksum);
+}
+
+/*
+ * Stat the remote file, as (size, mtime)
+ */
+static gboolean remote_identity(SFTPSession *session, const gchar *remote,
+                                gint64 *size, gint64 *mtime)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    if (libssh2_sftp_stat(session->sftp_session, remote, &attrs) != 0 ||
+        !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) ||
+        !(attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME))
+        return FALSE;
+    *size = (gint64)attrs.filesize;
+    *mtime = (gint64)attrs.mtime;
+    return TRUE;
+}
+
+/*
+ * Record that the remote file of this size and mtime holds the contents
+ * of local
+ */
+gboolean delta_signature_set(DeltaSignature *sig, const gchar *local,
+                             gint64 size, gint64 mtime)
+{
+    GByteArray *digests;
+    guchar *block;
+    FILE *file;
+    size_t n;
+    gboolean ok;
+
+    file = fopen(local, "rb");
+    if (!file)
+        return FALSE;
+
+    digests = g_byte_array_new();
+    block = g_malloc(DELTA_BLOCK_SIZE);
+    while ((n = fread(block, 1, DELTA_BLOCK_SIZE, file)) > 0)
+        block_digest_append(digests, block, n);
+    ok = !ferror(file);
+    g_free(block);
+    fclose(file);
+
+    g_mutex_lock(&sig->lock);
+    g_byte_array_unref(sig->digests);
+    sig->digests = digests;
+    sig->remote_size = size;
+    sig->remote_mtime = mtime;
+    sig->valid = ok;
+    g_mutex_unlock(&sig->lock);
+    return ok;
+}
+
+/*
+ * Record that remote now holds the contents of local. Runs on a worker
+ * right after a download or a full upload.
+ */
+gboolean delta_signature_update(DeltaSignature *sig, SFTPSession *session,
+                                const gchar *local, const gchar *remote)
+{
+    gint64 size, mtime;
+
+    if (!remote_identity(session, remote, &size, &mtime))
+        return FALSE;
+    return delta_signature_set(sig, local, size, mtime);
+}
+
+/*
+ * Write one run of changed bytes at offset
+ */
+static gboolean write_run(FileOperation *op, LIBSSH2_SFTP_HANDLE *handle, gsize offset,
+                          const guchar *data, gsize len)
+{
+    libssh2_sftp_seek64(handle, offset);
+    while (len > 0) {
+        ssize_t rc = libssh2_sftp_write(handle, (const char *)data, len);
+        if (rc < 0) {
+            g_printerr("Delta write at %lu failed: %d\n", (unsigned long)offset, (int)rc);
+            return FALSE;
+        }
+        transfer_op_data(op, (gsize)rc);
+        data += rc;
+        len -= rc;
+    }
+    return TRUE;
+}
+
+/*
+ * Upload a file by rewriting only the blocks that differ from the remote
+ * copy described by the op's signature. SFTP offers no server-side copy,
+ * so a block can only be reused at its own offset: edits that shift the
+ * rest of the file rewrite everything after them. Falls back to a full
+ * upload when there is no signature yet or the remote file has changed
+ * since it was taken.
+ */
+gboolean sftp_delta_upload(SFTPSession *session, FileOperation *op)
+{
+    DeltaSignature *sig = op->signature;
+    LIBSSH2_SFTP_HANDLE *handle;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    GByteArray *digests;
+    guchar *block;
+    guchar *run;
+    gsize run_max;
+    gsize run_len = 0;
+    gsize run_offset = 0;
+    gsize offset = 0;
+    gsize changed = 0;
+    guint base_blocks;
+    guint index = 0;
+    gint64 size, mtime;
+    struct stat st;
+    FILE *file;
+    size_t n;
+    gboolean ok = TRUE;
+
+    g_mutex_lock(&sig->lock);
+
+    if (!sig->valid || stat(op->local_path, &st) != 0 ||
+        !remote_identity(session, op->remote_path, &size, &mtime) ||
+        size != sig->remote_size || mtime != sig->remote_mtime) {
+        g_mutex_unlock(&sig->lock);
+        g_print("Remote copy unknown or changed, uploading in full: %s\n", op->remote_path);
+        ok = sftp_upload_file(session, op->local_path, op->remote_path, op);
+        if (ok)
+            delta_signature_update(sig, session, op->local_path, op->remote_path);
+        return ok;
+    }
+
+    file = fopen(op->local_path, "rb");
+    handle = libssh2_sftp_open(session->sftp_session, op->remote_path, LIBSSH2_FXF_WRITE, 0);
+    if (!file || !handle) {
+        g_printerr("Cannot open %s for delta upload\n", file ? op->remote_path : op->local_path);
+        if (file)
+            fclose(file);
+        if (handle)
+            libssh2_sftp_close(handle);
+        g_mutex_unlock(&sig->lock);
+        return FALSE;
+    }
+
+    op->total_size = (gsize)st.st_size;
+    op->transferred = 0;
+
+    base_blocks = sig->digests->len / DELTA_DIGEST_LEN;
+    digests = g_byte_array_new();
+    block = g_malloc(DELTA_BLOCK_SIZE);
+    run_max = MAX(transfer_write_buffer_size(session), (gsize)DELTA_BLOCK_SIZE);
+    run = g_malloc(run_max);
+
+    while (ok && (n = fread(block, 1, DELTA_BLOCK_SIZE, file)) > 0) {
+        gboolean same;
+
+        if (op->cancelled) {
+            ok = FALSE;
+            break;
+        }
+
+        block_digest_append(digests, block, n);
+
+        /* A short final block only matches if the remote ends there too */
+        same = index < base_blocks &&
+               (n == DELTA_BLOCK_SIZE || offset + n == (gsize)sig->remote_size) &&
+               memcmp(digests->data + index * DELTA_DIGEST_LEN,
+                      sig->digests->data + index * DELTA_DIGEST_LEN, DELTA_DIGEST_LEN) == 0;
+
+        /* Coalesce adjacent changed blocks into one pipelined write */
+        if (!same) {
+            if (run_len == 0)
+                run_offset = offset;
+            memcpy(run + run_len, block, n);
+            run_len += n;
+            changed += n;
+        }
+        if (run_len > 0 && (same || run_len + DELTA_BLOCK_SIZE > run_max)) {
+            ok = write_run(op, handle, run_offset, run, run_len);
+            run_len = 0;
+        }
+
+        offset += n;
+        index++;
+        g_atomic_pointer_add(&op->transferred, n);
+    }
+
+    if (ok && run_len > 0)
+        ok = write_run(op, handle, run_offset, run, run_len);
+    if (ok && ferror(file))
+        ok = FALSE;
+
+    /* Drop whatever the remote copy had beyond the new end */
+    if (ok && (gint64)offset < sig->remote_size) {
+        memset(&attrs, 0, sizeof(attrs));
+        attrs.flags = LIBSSH2_SFTP_ATTR_SIZE;
+        attrs.filesize = offset;
+        if (libssh2_sftp_fsetstat(handle, &attrs) != 0) {
+            g_printerr("Cannot truncate remote file: %s\n", op->remote_path);
+            ok = FALSE;
+        }
+    }
+
+    g_free(run);
+    g_free(block);
+    fclose(file);
+    libssh2_sftp_close(handle);
+
+    /* Remember what the remote holds now; on failure it is unknown */
+    if (ok && remote_identity(session, op->remote_path, &size, &mtime)) {
+        g_byte_array_unref(sig->digests);
+        sig->digests = digests;
+        sig->remote_size = size;
+        sig->remote_mtime = mtime;
+        g_print("Delta upload: %lu of %lu bytes sent\n", (unsigned long)changed,
+                (unsigned long)offset);
+    } else {
+        g_byte_array_unref(digests);
+        sig->valid = FALSE;
+    }
+
+    g_mutex_unlock(&sig->lock);
+    return ok;
+}
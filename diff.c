@@ -0,0 +1,336 @@
+/*
+ * Diff Module
+ * Line diff of two files (Myers, linear space) rendered as a unified diff
+ */
+
+#include "sftp-core.h"
+
+#define DIFF_CONTEXT 3
+#define DIFF_BINARY_PROBE 8192      /* Bytes checked for NUL to detect binary files */
+#define DIFF_COST_LIMIT 50000000    /* Diagonal steps before the rest is reported as replaced */
+
+/* One side of the comparison */
+typedef struct {
+    gchar *data;
+    gsize size;
+    GPtrArray *lines;       /* Start of each line in data, '\n' included */
+    guint *ids;             /* Interned line contents */
+    gboolean *changed;
+    gint n;
+} DiffFile;
+
+typedef struct {
+    DiffFile *a;
+    DiffFile *b;
+    gint *vf;               /* Forward furthest x per diagonal, offset applied */
+    gint *vb;               /* Backward furthest x per diagonal, offset applied */
+    gint64 budget;
+} DiffContext;
+
+static gsize diff_line_len(DiffFile *file, gint i)
+{
+    const gchar *start = g_ptr_array_index(file->lines, i);
+    const gchar *end = (i + 1 < file->n) ? (const gchar *)g_ptr_array_index(file->lines, i + 1)
+                                         : file->data + file->size;
+    return (gsize)(end - start);
+}
+
+/*
+ * Read a file and split it into lines. Returns FALSE if it can't be read.
+ */
+static gboolean diff_file_load(DiffFile *file, const gchar *path, GError **error)
+{
+    gchar *p;
+    gchar *end;
+
+    if (!g_file_get_contents(path, &file->data, &file->size, error))
+        return FALSE;
+
+    file->lines = g_ptr_array_new();
+    end = file->data + file->size;
+    for (p = file->data; p < end; ) {
+        gchar *nl = memchr(p, '\n', (gsize)(end - p));
+        g_ptr_array_add(file->lines, p);
+        p = nl ? nl + 1 : end;
+    }
+    file->n = (gint)file->lines->len;
+    file->ids = g_new(guint, file->n + 1);
+    file->changed = g_new0(gboolean, file->n + 1);
+    return TRUE;
+}
+
+static void diff_file_clear(DiffFile *file)
+{
+    if (file->lines)
+        g_ptr_array_free(file->lines, TRUE);
+    g_free(file->ids);
+    g_free(file->changed);
+    g_free(file->data);
+}
+
+static gboolean diff_is_binary(const DiffFile *file)
+{
+    return memchr(file->data, '\0', MIN(file->size, (gsize)DIFF_BINARY_PROBE)) != NULL;
+}
+
+/*
+ * Give equal lines equal ids, so the diff compares integers
+ */
+static void diff_intern(DiffFile *a, DiffFile *b)
+{
+    GHashTable *ids = g_hash_table_new(g_bytes_hash, g_bytes_equal);
+    GPtrArray *keys = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    DiffFile *files[2] = {a, b};
+    gint f, i;
+
+    for (f = 0; f < 2; f++) {
+        for (i = 0; i < files[f]->n; i++) {
+            GBytes *key = g_bytes_new_static(g_ptr_array_index(files[f]->lines, i),
+                                             diff_line_len(files[f], i));
+            gpointer id;
+
+            if (!g_hash_table_lookup_extended(ids, key, NULL, &id)) {
+                id = GUINT_TO_POINTER(g_hash_table_size(ids));
+                g_hash_table_insert(ids, key, id);
+                g_ptr_array_add(keys, key);
+            } else {
+                g_bytes_unref(key);
+            }
+            files[f]->ids[i] = GPOINTER_TO_UINT(id);
+        }
+    }
+
+    g_hash_table_destroy(ids);
+    g_ptr_array_unref(keys);
+}
+
+/*
+ * Find the middle snake of a[a0,a1) against b[b0,b1): the diagonal run
+ * halfway along an optimal edit path. Returns its start and end, or FALSE
+ * once the cost limit is spent.
+ */
+static gboolean diff_middle_snake(DiffContext *ctx, gint a0, gint a1, gint b0, gint b1,
+                                  gint *xs, gint *ys, gint *xe, gint *ye)
+{
+    const guint *a = ctx->a->ids;
+    const guint *b = ctx->b->ids;
+    gint *vf = ctx->vf;
+    gint *vb = ctx->vb;
+    gint n = a1 - a0;
+    gint m = b1 - b0;
+    gint delta = n - m;
+    gboolean odd = (delta & 1) != 0;
+    gint max = (n + m + 1) / 2;
+    gint d, k, x, y, sx, sy;
+
+    vf[1] = 0;
+    vb[1] = 0;
+
+    for (d = 0; d <= max; d++) {
+        ctx->budget -= 2 * (d + 1);
+        if (ctx->budget < 0)
+            return FALSE;
+
+        for (k = -d; k <= d; k += 2) {
+            x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+            y = x - k;
+            sx = x;
+            sy = y;
+            while (x < n && y < m && a[a0 + x] == b[b0 + y]) {
+                x++;
+                y++;
+            }
+            vf[k] = x;
+            if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 && x + vb[delta - k] >= n) {
+                *xs = a0 + sx;
+                *ys = b0 + sy;
+                *xe = a0 + x;
+                *ye = b0 + y;
+                return TRUE;
+            }
+        }
+
+        /* Same search from the ends, x counted back from a1 */
+        for (k = -d; k <= d; k += 2) {
+            x = (k == -d || (k != d && vb[k - 1] < vb[k + 1])) ? vb[k + 1] : vb[k - 1] + 1;
+            y = x - k;
+            sx = x;
+            sy = y;
+            while (x < n && y < m && a[a1 - 1 - x] == b[b1 - 1 - y]) {
+                x++;
+                y++;
+            }
+            vb[k] = x;
+            if (!odd && delta - k >= -d && delta - k <= d && x + vf[delta - k] >= n) {
+                *xs = a1 - x;
+                *ys = b1 - y;
+                *xe = a1 - sx;
+                *ye = b1 - sy;
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Mark the lines of a[a0,a1) and b[b0,b1) that are not part of a longest
+ * common subsequence
+ */
+static void diff_compare(DiffContext *ctx, gint a0, gint a1, gint b0, gint b1)
+{
+    const guint *a = ctx->a->ids;
+    const guint *b = ctx->b->ids;
+    gint xs, ys, xe, ye;
+    gint i;
+
+    while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) {
+        a0++;
+        b0++;
+    }
+    while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) {
+        a1--;
+        b1--;
+    }
+
+    if (a0 == a1 || b0 == b1 || !diff_middle_snake(ctx, a0, a1, b0, b1, &xs, &ys, &xe, &ye)) {
+        for (i = a0; i < a1; i++)
+            ctx->a->changed[i] = TRUE;
+        for (i = b0; i < b1; i++)
+            ctx->b->changed[i] = TRUE;
+        return;
+    }
+
+    diff_compare(ctx, a0, xs, b0, ys);
+    diff_compare(ctx, xe, a1, ye, b1);
+}
+
+static void diff_append_line(GString *out, gchar mark, DiffFile *file, gint i)
+{
+    const gchar *line = g_ptr_array_index(file->lines, i);
+    gsize len = diff_line_len(file, i);
+
+    g_string_append_c(out, mark);
+    g_string_append_len(out, line, (gssize)len);
+    if (len == 0 || line[len - 1] != '\n')
+        g_string_append(out, "\n\\ No newline at end of file\n");
+}
+
+/*
+ * Write the hunks. Unchanged lines pair up in order, so walking both files
+ * together finds each run of changes; runs closer than twice the context
+ * share a hunk.
+ */
+static void diff_write_hunks(GString *out, DiffFile *a, DiffFile *b)
+{
+    gint i = 0, j = 0;
+
+    while (i < a->n || j < b->n) {
+        gint hi, hj, ei, ej, ci, cj, gap;
+
+        if (i < a->n && j < b->n && !a->changed[i] && !b->changed[j]) {
+            i++;
+            j++;
+            continue;
+        }
+
+        /* Hunk starts with up to DIFF_CONTEXT lines before the change */
+        hi = MAX(i - DIFF_CONTEXT, 0);
+        hj = j - (i - hi);
+
+        /* Extend over changes separated by short unchanged runs */
+        ei = i;
+        ej = j;
+        for (;;) {
+            while (ei < a->n && a->changed[ei])
+                ei++;
+            while (ej < b->n && b->changed[ej])
+                ej++;
+            ci = ei;
+            cj = ej;
+            for (gap = 0; ci < a->n && cj < b->n && !a->changed[ci] && !b->changed[cj] &&
+                          gap <= 2 * DIFF_CONTEXT; gap++) {
+                ci++;
+                cj++;
+            }
+            if (gap > 2 * DIFF_CONTEXT || (ci >= a->n && cj >= b->n)) {
+                gap = MIN(gap, DIFF_CONTEXT);
+                ei += gap;
+                ej += gap;
+                break;
+            }
+            ei = ci;
+            ej = cj;
+        }
+
+        g_string_append_printf(out, "@@ -%d,%d +%d,%d @@\n",
+                               ei > hi ? hi + 1 : hi, ei - hi, ej > hj ? hj + 1 : hj, ej - hj);
+        while (hi < ei || hj < ej) {
+            if (hi < ei && hj < ej && !a->changed[hi] && !b->changed[hj]) {
+                diff_append_line(out, ' ', a, hi);
+                hi++;
+                hj++;
+                continue;
+            }
+            while (hi < ei && a->changed[hi])
+                diff_append_line(out, '-', a, hi++);
+            while (hj < ej && b->changed[hj])
+                diff_append_line(out, '+', b, hj++);
+        }
+
+        i = ei;
+        j = ej;
+    }
+}
+
+/*
+ * Unified diff turning old_path into new_path, labelled with the given
+ * names. Returns "" when the files are equal, NULL (with error set) when
+ * one can't be read. Meant for worker threads: nothing here touches GTK.
+ */
+gchar *diff_files_unified(const gchar *old_path, const gchar *new_path,
+                          const gchar *old_label, const gchar *new_label, GError **error)
+{
+    DiffFile a = {0}, b = {0};
+    DiffContext ctx;
+    GString *out;
+    gint offset;
+
+    if (!diff_file_load(&a, old_path, error) || !diff_file_load(&b, new_path, error)) {
+        diff_file_clear(&a);
+        diff_file_clear(&b);
+        return NULL;
+    }
+
+    out = g_string_new(NULL);
+
+    if (a.size == b.size && memcmp(a.data, b.data, a.size) == 0) {
+        /* Identical */
+    } else if (diff_is_binary(&a) || diff_is_binary(&b)) {
+        g_string_printf(out, "Binary files %s and %s differ\n", old_label, new_label);
+    } else {
+        diff_intern(&a, &b);
+
+        offset = (a.n + b.n + 1) / 2 + 2;
+        ctx.a = &a;
+        ctx.b = &b;
+        ctx.vf = g_new(gint, 2 * offset + 1) + offset;
+        ctx.vb = g_new(gint, 2 * offset + 1) + offset;
+        ctx.budget = DIFF_COST_LIMIT;
+
+        diff_compare(&ctx, 0, a.n, 0, b.n);
+        if (ctx.budget < 0)
+            g_print("Diff cost limit reached; some changes are shown as whole blocks\n");
+
+        g_free(ctx.vf - offset);
+        g_free(ctx.vb - offset);
+
+        g_string_append_printf(out, "--- %s\n+++ %s\n", old_label, new_label);
+        diff_write_hunks(out, &a, &b);
+    }
+
+    diff_file_clear(&a);
+    diff_file_clear(&b);
+    return g_string_free(out, FALSE);
+}
@@ -0,0 +1,300 @@
+/*
+ * Directory Cache Module
+ * Per-session cache of remote directory listings, and speculative
+ * prefetching of the directories the user is likely to open next
+ */
+
+#include "sftp-core.h"
+
+/* One cached listing */
+typedef struct {
+    GPtrArray *entries;   /* SFTPDirEntry, read-only once stored */
+    gint64 stored_at;     /* g_get_monotonic_time() */
+} DirCacheItem;
+
+/* One round of prefetching, shared by the worker and the UI */
+struct _DirPrefetch {
+    gint refs;            /* One for the job, one for the caller until cancelled */
+    SFTPSession *session;
+    GPtrArray *paths;     /* Directories to list, in order */
+    GPtrArray *entries;   /* Listing being read */
+    gsize bytes;          /* Entry memory filled so far this round */
+    gboolean cancelled;
+    gboolean stop;        /* Abandon the directory being read */
+};
+
+struct _DirCache {
+    GMutex lock;          /* Workers store and invalidate, the UI looks up */
+    GHashTable *items;    /* normalized path -> DirCacheItem */
+    gint64 ttl_us;
+};
+
+static void dir_cache_item_free(gpointer data)
+{
+    DirCacheItem *item = (DirCacheItem *)data;
+    g_ptr_array_unref(item->entries);
+    g_free(item);
+}
+
+/*
+ * Normalize a remote path for use as a key ("/a/b/" -> "/a/b")
+ */
+static gchar *dir_cache_key(const gchar *path)
+{
+    gchar *key = g_strdup(path);
+    gsize len = strlen(key);
+
+    while (len > 1 && key[len - 1] == '/')
+        key[--len] = '\0';
+    return key;
+}
+
+/*
+ * Drop the oldest listing. Called with the lock held.
+ */
+static void dir_cache_evict_oldest(DirCache *cache)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gpointer oldest_key = NULL;
+    gint64 oldest = G_MAXINT64;
+
+    g_hash_table_iter_init(&iter, cache->items);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        DirCacheItem *item = (DirCacheItem *)value;
+        if (item->stored_at < oldest) {
+            oldest = item->stored_at;
+            oldest_key = key;
+        }
+    }
+
+    if (oldest_key)
+        g_hash_table_remove(cache->items, oldest_key);
+}
+
+/*
+ * Create a cache. Listings older than ttl_seconds are still returned,
+ * but flagged stale; a TTL of 0 disables caching.
+ */
+DirCache *dir_cache_new(gint ttl_seconds)
+{
+    DirCache *cache = g_new0(DirCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, dir_cache_item_free);
+    cache->ttl_us = (gint64)MAX(ttl_seconds, 0) * G_USEC_PER_SEC;
+    return cache;
+}
+
+void dir_cache_free(DirCache *cache)
+{
+    if (!cache)
+        return;
+    g_hash_table_destroy(cache->items);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+/*
+ * Look up a listing. Returns a new reference to its entries, or NULL.
+ * fresh (optional) is set when the listing is younger than the TTL.
+ */
+GPtrArray *dir_cache_lookup(DirCache *cache, const gchar *path, gboolean *fresh)
+{
+    DirCacheItem *item;
+    GPtrArray *entries = NULL;
+    gchar *key;
+
+    if (fresh)
+        *fresh = FALSE;
+    if (!cache || cache->ttl_us == 0)
+        return NULL;
+
+    key = dir_cache_key(path);
+    g_mutex_lock(&cache->lock);
+    item = g_hash_table_lookup(cache->items, key);
+    if (item) {
+        entries = g_ptr_array_ref(item->entries);
+        if (fresh)
+            *fresh = g_get_monotonic_time() - item->stored_at < cache->ttl_us;
+    }
+    g_mutex_unlock(&cache->lock);
+    g_free(key);
+
+    return entries;
+}
+
+/*
+ * Store a complete listing, replacing any previous one. Takes a reference.
+ */
+void dir_cache_store(DirCache *cache, const gchar *path, GPtrArray *entries)
+{
+    DirCacheItem *item;
+
+    if (!cache || cache->ttl_us == 0)
+        return;
+
+    item = g_new(DirCacheItem, 1);
+    item->entries = g_ptr_array_ref(entries);
+    item->stored_at = g_get_monotonic_time();
+
+    g_mutex_lock(&cache->lock);
+    if (g_hash_table_size(cache->items) >= DIR_CACHE_MAX_DIRS)
+        dir_cache_evict_oldest(cache);
+    g_hash_table_insert(cache->items, dir_cache_key(path), item);
+    g_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Forget the listing of a directory
+ */
+void dir_cache_invalidate(DirCache *cache, const gchar *path)
+{
+    gchar *key;
+
+    if (!cache)
+        return;
+
+    key = dir_cache_key(path);
+    g_mutex_lock(&cache->lock);
+    g_hash_table_remove(cache->items, key);
+    g_mutex_unlock(&cache->lock);
+    g_free(key);
+}
+
+/*
+ * Forget the listing of the directory containing path
+ */
+void dir_cache_invalidate_parent(DirCache *cache, const gchar *path)
+{
+    gchar *key;
+    gchar *slash;
+
+    if (!cache)
+        return;
+
+    key = dir_cache_key(path);
+    slash = strrchr(key, '/');
+    if (slash) {
+        if (slash == key)
+            slash[1] = '\0';   /* Parent is the root */
+        else
+            *slash = '\0';
+        dir_cache_invalidate(cache, key);
+    } else {
+        dir_cache_invalidate(cache, ".");  /* Relative to the login directory */
+    }
+    g_free(key);
+}
+
+static void dir_prefetch_unref(DirPrefetch *prefetch)
+{
+    if (!g_atomic_int_dec_and_test(&prefetch->refs))
+        return;
+    g_ptr_array_unref(prefetch->paths);
+    g_free(prefetch);
+}
+
+/* Worker batch callback: keep the entries, stop on budget or contention */
+static void prefetch_batch_cb(GPtrArray *batch, gpointer user_data)
+{
+    DirPrefetch *prefetch = (DirPrefetch *)user_data;
+    guint i;
+
+    for (i = 0; i < batch->len; i++) {
+        SFTPDirEntry *entry = g_ptr_array_index(batch, i);
+        prefetch->bytes += sizeof(SFTPDirEntry) + strlen(entry->name) + 1;
+        g_ptr_array_add(prefetch->entries, entry);
+    }
+    g_ptr_array_set_free_func(batch, NULL);
+    g_ptr_array_unref(batch);
+
+    if (prefetch->cancelled || prefetch->bytes > PREFETCH_MAX_BYTES ||
+        sftp_session_jobs_waiting(prefetch->session, JOB_PRIORITY_BACKGROUND))
+        prefetch->stop = TRUE;
+}
+
+/* Worker: list each path not already fresh in the cache */
+static void prefetch_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    DirPrefetch *prefetch = (DirPrefetch *)data;
+    SFTPSession *channel = NULL;
+    guint fetched = 0;
+    guint i;
+
+    /* Never wait for or open a channel, or queue behind someone holding one */
+    if (!cancelled)
+        channel = sftp_session_lease_idle(session);
+    if (!channel || !g_mutex_trylock(&channel->lock)) {
+        if (channel)
+            sftp_session_release(channel);
+        dir_prefetch_unref(prefetch);
+        return;
+    }
+
+    for (i = 0; i < prefetch->paths->len && !prefetch->stop; i++) {
+        const gchar *path = g_ptr_array_index(prefetch->paths, i);
+        GPtrArray *cached;
+        gboolean fresh;
+        gboolean ok;
+
+        cached = dir_cache_lookup(session->dir_cache, path, &fresh);
+        if (cached)
+            g_ptr_array_unref(cached);
+        if (cached && fresh)
+            continue;
+
+        if (sftp_session_jobs_waiting(session, JOB_PRIORITY_BACKGROUND))
+            break;
+
+        prefetch->entries = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+        ok = sftp_read_directory(channel, path, DIR_LIST_BATCH_SIZE,
+                                 prefetch_batch_cb, prefetch, &prefetch->stop);
+        if (ok && !prefetch->stop) {
+            dir_cache_store(session->dir_cache, path, prefetch->entries);
+            fetched++;
+        }
+        g_ptr_array_unref(prefetch->entries);
+        prefetch->entries = NULL;
+    }
+
+    g_mutex_unlock(&channel->lock);
+    sftp_session_release(channel);
+
+    if (fetched > 0)
+        g_print("Prefetched %u of %u directories\n", fetched, prefetch->paths->len);
+    dir_prefetch_unref(prefetch);
+}
+
+/*
+ * List paths (a GPtrArray of strings, referenced) into the session's cache
+ * at background priority. The round gives up as soon as anything more
+ * urgent is queued on the session, when the session is busy, or when
+ * PREFETCH_MAX_BYTES of entries have been read. Release the returned handle
+ * with dir_cache_prefetch_cancel() before the session is freed.
+ */
+DirPrefetch *dir_cache_prefetch(SFTPSession *session, GPtrArray *paths)
+{
+    DirPrefetch *prefetch = g_new0(DirPrefetch, 1);
+
+    prefetch->refs = 2;
+    prefetch->session = session;
+    prefetch->paths = g_ptr_array_ref(paths);
+
+    sftp_session_push_job(session, JOB_PRIORITY_BACKGROUND, prefetch_job_func,
+                          prefetch, &prefetch->cancelled);
+    return prefetch;
+}
+
+/*
+ * Stop a prefetch round and release the caller's handle
+ */
+void dir_cache_prefetch_cancel(DirPrefetch *prefetch)
+{
+    if (!prefetch)
+        return;
+
+    prefetch->cancelled = TRUE;
+    prefetch->stop = TRUE;
+    sftp_session_cancel_job(prefetch->session, prefetch);
+    dir_prefetch_unref(prefetch);
+}
@@ -0,0 +1,1186 @@
+/*
+ * Directory Sync Module
+ * Sync a local folder with a remote folder. A manifest remembers what both
+ * sides looked like after the last sync, so later syncs only stat the trees
+ * and transfer what changed since.
+ */
+
+#include "sftp-plugin.h"
+#include "compat.h"
+
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#define MANIFEST_DIR "geany-sftp/manifests"
+#define DIRSYNC_RESPONSE_SYNC 1
+#define DIRSYNC_PREVIEW_MAX 2000    /* Actions listed in the preview */
+#define MTIME_UNKNOWN G_MININT64    /* Never equal to a scanned mtime */
+
+typedef enum {
+    DIRSYNC_TWO_WAY,
+    DIRSYNC_UPLOAD_ONLY,
+    DIRSYNC_DOWNLOAD_ONLY
+} DirSyncMode;
+
+typedef enum {
+    SYNC_UPLOAD,
+    SYNC_DOWNLOAD,
+    SYNC_DELETE_REMOTE,     /* Deleted locally since the last sync */
+    SYNC_DELETE_LOCAL,      /* Deleted remotely since the last sync */
+    SYNC_CONFLICT,          /* Changed on both sides; left alone */
+    SYNC_RECORD             /* Contents already match; only the manifest changes */
+} SyncActionType;
+
+/* Size and mtime of one side of a file */
+typedef struct {
+    gint64 size;
+    gint64 mtime;           /* Nanoseconds locally, seconds on the server */
+} SyncStat;
+
+/* Both sides of a file right after it was last synced */
+typedef struct {
+    SyncStat local;
+    SyncStat remote;
+    gchar *sha256;          /* Contents at that point, or NULL */
+} ManifestEntry;
+
+typedef struct {
+    gchar *path;            /* Relative to both roots, '/'-separated */
+    SyncActionType type;
+    gchar *sha256;          /* Contents, when the plan already hashed them */
+} SyncAction;
+
+typedef struct _DirSync DirSync;
+typedef void (*DirSyncCallback)(DirSync *sync, gpointer user_data);
+
+struct _DirSync {
+    SFTPSession *session;       /* Only while a job is queued or running */
+    guint session_id;           /* The session the plan was made on */
+    DirSyncMode mode;
+    gchar *local_root;
+    gchar *remote_root;
+    gchar *manifest_file;
+    GHashTable *manifest;       /* path -> ManifestEntry */
+    GHashTable *local;          /* path -> SyncStat, from the scan */
+    GHashTable *remote;         /* path -> SyncStat, from the scan */
+    GHashTable *remote_dirs;    /* Relative remote directories known to exist */
+    GHashTable *skipped;        /* Symlinks either scan did not follow, as relative paths */
+    GPtrArray *actions;         /* SyncAction, in path order */
+    guint unchanged;
+    gboolean scan_failed;
+    gboolean cancelled;
+    GMutex lock;                /* Protects current and the counters below */
+    FileOperation *current;
+    guint actions_done;
+    guint actions_failed;
+    gsize bytes_total;
+    gsize bytes_done;
+    gint64 started;
+    DirSyncCallback callback;
+    gpointer user_data;
+};
+
+static GList *dirsync_running;     /* DirSync with a job in flight (main loop only) */
+
+static void manifest_entry_free(gpointer data)
+{
+    ManifestEntry *entry = (ManifestEntry *)data;
+    g_free(entry->sha256);
+    g_free(entry);
+}
+
+static void sync_action_free(gpointer data)
+{
+    SyncAction *action = (SyncAction *)data;
+    g_free(action->path);
+    g_free(action->sha256);
+    g_free(action);
+}
+
+/*
+ * Strip trailing slashes ("/a/b/" -> "/a/b")
+ */
+static gchar *dirsync_root(const gchar *path)
+{
+    gchar *root = g_strdup(path);
+    gsize len = strlen(root);
+
+    while (len > 1 && (root[len - 1] == '/' || root[len - 1] == G_DIR_SEPARATOR))
+        root[--len] = '\0';
+    return root;
+}
+
+static gchar *dirsync_local_path(DirSync *sync, const gchar *path)
+{
+    return path[0] ? g_build_filename(sync->local_root, path, NULL) : g_strdup(sync->local_root);
+}
+
+static gchar *dirsync_remote_path(DirSync *sync, const gchar *path)
+{
+    if (!path[0])
+        return g_strdup(sync->remote_root);
+    if (strcmp(sync->remote_root, "/") == 0)
+        return g_strconcat("/", path, NULL);
+    return g_strconcat(sync->remote_root, "/", path, NULL);
+}
+
+/*
+ * Relative path of the directory containing path ("" at the top)
+ */
+static gchar *dirsync_parent(const gchar *path)
+{
+    const gchar *slash = strrchr(path, '/');
+    return slash ? g_strndup(path, slash - path) : g_strdup("");
+}
+
+/*
+ * Manifest file for one pair of folders on one server
+ */
+static gchar *manifest_file_path(SFTPSession *session, const gchar *local, const gchar *remote)
+{
+    gchar *id;
+    gchar *hash;
+    gchar *name;
+    gchar *file;
+
+    id = g_strdup_printf("%s@%s:%d\n%s\n%s", session->config->username,
+                         session->config->hostname, session->config->port, remote, local);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+    name = g_strconcat(hash, ".json", NULL);
+    file = g_build_filename(g_get_user_cache_dir(), MANIFEST_DIR, name, NULL);
+
+    g_free(name);
+    g_free(hash);
+    g_free(id);
+    return file;
+}
+
+static void manifest_load_member(JsonObject *files, const gchar *name, JsonNode *node,
+                                 gpointer user_data)
+{
+    GHashTable *manifest = (GHashTable *)user_data;
+    ManifestEntry *entry;
+    JsonObject *obj;
+
+    (void)files;
+    if (!JSON_NODE_HOLDS_OBJECT(node))
+        return;
+    obj = json_node_get_object(node);
+
+    entry = g_new0(ManifestEntry, 1);
+    entry->local.size = json_object_get_int_member(obj, "size");
+    /* Older manifests kept whole seconds, too coarse to trust without a hash */
+    entry->local.mtime = json_object_has_member(obj, "mtime_ns") ?
+                         json_object_get_int_member(obj, "mtime_ns") : MTIME_UNKNOWN;
+    entry->remote.size = json_object_get_int_member(obj, "remote_size");
+    entry->remote.mtime = json_object_get_int_member(obj, "remote_mtime");
+    if (json_object_has_member(obj, "sha256"))
+        entry->sha256 = g_strdup(json_object_get_string_member(obj, "sha256"));
+    g_hash_table_insert(manifest, g_strdup(name), entry);
+}
+
+/*
+ * Read a manifest; a missing or unreadable one is empty
+ */
+static GHashTable *manifest_load(const gchar *file)
+{
+    GHashTable *manifest = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                 manifest_entry_free);
+    JsonParser *parser;
+
+    if (!g_file_test(file, G_FILE_TEST_EXISTS))
+        return manifest;
+
+    parser = json_parser_new();
+    if (json_parser_load_from_file(parser, file, NULL) &&
+        JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        JsonObject *obj = json_node_get_object(json_parser_get_root(parser));
+        if (json_object_has_member(obj, "files"))
+            json_object_foreach_member(json_object_get_object_member(obj, "files"),
+                                       manifest_load_member, manifest);
+    }
+    g_object_unref(parser);
+
+    return manifest;
+}
+
+/*
+ * Write the manifest next to itself and rename it into place, so an
+ * interrupted save leaves the previous one
+ */
+static gboolean manifest_save(DirSync *sync)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    JsonObject *obj;
+    JsonObject *files;
+    JsonNode *root;
+    JsonGenerator *gen;
+    GError *error = NULL;
+    gchar *dir;
+    gchar *temp;
+    gboolean ok;
+
+    files = json_object_new();
+    g_hash_table_iter_init(&iter, sync->manifest);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        ManifestEntry *entry = (ManifestEntry *)value;
+        JsonObject *item = json_object_new();
+
+        json_object_set_int_member(item, "size", entry->local.size);
+        json_object_set_int_member(item, "mtime_ns", entry->local.mtime);
+        json_object_set_int_member(item, "remote_size", entry->remote.size);
+        json_object_set_int_member(item, "remote_mtime", entry->remote.mtime);
+        if (entry->sha256)
+            json_object_set_string_member(item, "sha256", entry->sha256);
+        json_object_set_object_member(files, (const gchar *)key, item);
+    }
+
+    obj = json_object_new();
+    json_object_set_string_member(obj, "local", sync->local_root);
+    json_object_set_string_member(obj, "remote", sync->remote_root);
+    json_object_set_object_member(obj, "files", files);
+
+    root = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(root, obj);
+    gen = json_generator_new();
+    json_generator_set_root(gen, root);
+
+    dir = g_path_get_dirname(sync->manifest_file);
+    g_mkdir_with_parents(dir, 0700);
+    temp = g_strconcat(sync->manifest_file, ".tmp", NULL);
+
+    ok = json_generator_to_file(gen, temp, &error) && g_rename(temp, sync->manifest_file) == 0;
+    if (!ok) {
+        g_printerr("Failed to save sync manifest: %s\n", error ? error->message : temp);
+        if (error)
+            g_error_free(error);
+        g_unlink(temp);
+    }
+
+    g_free(temp);
+    g_free(dir);
+    g_object_unref(gen);
+    json_node_free(root);
+    return ok;
+}
+
+/*
+ * Is path at or below a symlink one of the scans did not follow? The
+ * transfer code would write through such a link while the scan of that
+ * side never sees what is behind it, so nothing there may be planned.
+ */
+static gboolean dirsync_skipped(DirSync *sync, const gchar *path)
+{
+    gboolean skipped = FALSE;
+    gchar *dir;
+    gchar *slash;
+
+    if (g_hash_table_size(sync->skipped) == 0)
+        return FALSE;
+
+    dir = g_strdup(path);
+    while (!(skipped = g_hash_table_contains(sync->skipped, dir)) &&
+           (slash = strrchr(dir, '/')) != NULL)
+        *slash = '\0';
+    g_free(dir);
+    return skipped;
+}
+
+static SyncStat *sync_stat_new(gint64 size, gint64 mtime)
+{
+    SyncStat *st = g_new(SyncStat, 1);
+    st->size = size;
+    st->mtime = mtime;
+    return st;
+}
+
+/*
+ * Collect the regular files below a local directory. A missing root is
+ * an empty tree only while the manifest is empty; any other unreadable
+ * directory fails the scan, since its files would otherwise look deleted
+ * (a folder on an unmounted drive would empty the remote side).
+ */
+static gboolean dirsync_scan_local(DirSync *sync, const gchar *rel)
+{
+    gchar *dir_path = dirsync_local_path(sync, rel);
+    const gchar *name;
+    gboolean ok = TRUE;
+    GDir *dir;
+
+    dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir) {
+        ok = !rel[0] && !g_file_test(dir_path, G_FILE_TEST_EXISTS) &&
+             g_hash_table_size(sync->manifest) == 0;
+        if (!ok)
+            g_printerr("Cannot read local directory: %s\n", dir_path);
+        g_free(dir_path);
+        return ok;
+    }
+
+    while (ok && !sync->cancelled && (name = g_dir_read_name(dir)) != NULL) {
+        gchar *child_rel = rel[0] ? g_strconcat(rel, "/", name, NULL) : g_strdup(name);
+        gchar *child = g_build_filename(dir_path, name, NULL);
+        struct stat st;
+
+        /* Symlinks to anything but a file are skipped, as in folder
+         * transfers, and so is the same path on the remote side */
+        if (lstat(child, &st) == 0) {
+            if (S_ISLNK(st.st_mode) && (stat(child, &st) != 0 || !S_ISREG(st.st_mode))) {
+                g_print("Skipping symlink: %s\n", child);
+                g_hash_table_add(sync->skipped, child_rel);
+                child_rel = NULL;
+            } else if (S_ISDIR(st.st_mode)) {
+                ok = dirsync_scan_local(sync, child_rel);
+            } else if (S_ISREG(st.st_mode)) {
+                g_hash_table_insert(sync->local, child_rel,
+                                    sync_stat_new((gint64)st.st_size, compat_stat_mtime_ns(&st)));
+                child_rel = NULL;
+            }
+        }
+
+        g_free(child_rel);
+        g_free(child);
+    }
+
+    g_dir_close(dir);
+    g_free(dir_path);
+    return ok;
+}
+
+/* Collect the batches of one remote listing */
+static void dirsync_collect_batch(GPtrArray *batch, gpointer user_data)
+{
+    GPtrArray *entries = (GPtrArray *)user_data;
+    guint i;
+
+    for (i = 0; i < batch->len; i++)
+        g_ptr_array_add(entries, g_ptr_array_index(batch, i));
+    g_ptr_array_set_free_func(batch, NULL);
+    g_ptr_array_unref(batch);
+}
+
+/*
+ * Collect the regular files below a remote directory, one listing per
+ * directory. Leftovers of atomic uploads are ignored. As locally, a
+ * missing root only counts as empty while the manifest is.
+ */
+static gboolean dirsync_scan_remote(DirSync *sync, SFTPSession *channel, const gchar *rel)
+{
+    gchar *dir_path = dirsync_remote_path(sync, rel);
+    GPtrArray *entries = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+    gboolean ok;
+    guint i;
+
+    ok = sftp_read_directory(channel, dir_path, DIR_LIST_BATCH_SIZE, dirsync_collect_batch,
+                             entries, &sync->cancelled);
+    if (!ok && !rel[0]) {
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+        /* Not there yet: the first upload creates it */
+        ok = libssh2_sftp_stat(channel->sftp_session, dir_path, &attrs) != 0 &&
+             libssh2_sftp_last_error(channel->sftp_session) == LIBSSH2_FX_NO_SUCH_FILE &&
+             g_hash_table_size(sync->manifest) == 0;
+        if (!ok)
+            g_printerr("Cannot read remote directory: %s\n", dir_path);
+        g_ptr_array_unref(entries);
+        g_free(dir_path);
+        return ok;
+    }
+    if (ok)
+        g_hash_table_add(sync->remote_dirs, g_strdup(rel));
+
+    for (i = 0; ok && i < entries->len && !sync->cancelled; i++) {
+        SFTPDirEntry *entry = g_ptr_array_index(entries, i);
+        LIBSSH2_SFTP_ATTRIBUTES attrs = entry->attrs;
+        gchar *child_rel;
+        unsigned long type;
+
+        if (g_str_has_suffix(entry->name, ".sftp-part") ||
+            g_str_has_suffix(entry->name, ".sftp-part.old") ||
+            !(attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS))
+            continue;
+
+        child_rel = rel[0] ? g_strconcat(rel, "/", entry->name, NULL) : g_strdup(entry->name);
+        type = attrs.permissions & LIBSSH2_SFTP_S_IFMT;
+
+        /* Skipped locally: the local side of this path is not known */
+        if (dirsync_skipped(sync, child_rel)) {
+            g_free(child_rel);
+            continue;
+        }
+
+        if (type == LIBSSH2_SFTP_S_IFLNK) {
+            gchar *child = dirsync_remote_path(sync, child_rel);
+            if (libssh2_sftp_stat(channel->sftp_session, child, &attrs) == 0 &&
+                LIBSSH2_SFTP_S_ISREG(attrs.permissions)) {
+                type = LIBSSH2_SFTP_S_IFREG;
+            } else {
+                g_print("Skipping symlink: %s\n", child);
+                g_hash_table_add(sync->skipped, child_rel);
+                child_rel = NULL;
+            }
+            g_free(child);
+        }
+
+        if (type == LIBSSH2_SFTP_S_IFDIR) {
+            ok = dirsync_scan_remote(sync, channel, child_rel);
+        } else if (type == LIBSSH2_SFTP_S_IFREG) {
+            g_hash_table_insert(sync->remote, child_rel,
+                                sync_stat_new((gint64)attrs.filesize, (gint64)attrs.mtime));
+            child_rel = NULL;
+        }
+        g_free(child_rel);
+    }
+
+    if (!ok)
+        g_printerr("Cannot read remote directory: %s\n", dir_path);
+    g_ptr_array_unref(entries);
+    g_free(dir_path);
+    return ok;
+}
+
+/*
+ * Has the local file kept the contents recorded in the manifest? A new
+ * mtime with the old size is checked against the recorded hash, so a
+ * checkout or build step that only touches files costs no transfer.
+ * mtimes are compared in nanoseconds: a same-size edit within the second
+ * of the last sync must still count as a change. *sha256 receives the
+ * hash when it had to be computed.
+ */
+static gboolean dirsync_local_unchanged(DirSync *sync, const gchar *path,
+                                        const ManifestEntry *entry, const SyncStat *local,
+                                        gchar **sha256)
+{
+    gchar *file;
+    gchar *digest;
+
+    if (entry->local.size != local->size)
+        return FALSE;
+    if (entry->local.mtime == local->mtime)
+        return TRUE;
+    if (!entry->sha256)
+        return FALSE;
+
+    file = dirsync_local_path(sync, path);
+    digest = sftp_local_sha256(file);
+    g_free(file);
+
+    if (digest && strcmp(digest, entry->sha256) == 0) {
+        *sha256 = digest;
+        return TRUE;
+    }
+    g_free(digest);
+    return FALSE;
+}
+
+/*
+ * Do both sides hold the same contents? Costs a server-side hash, so only
+ * asked when the manifest can't tell.
+ */
+static gboolean dirsync_identical(DirSync *sync, SFTPSession *channel, const gchar *path,
+                                  const SyncStat *local, const SyncStat *remote, gchar **sha256)
+{
+    gchar *remote_file;
+    gchar *remote_digest;
+    gchar *local_file;
+    gchar *local_digest;
+    gboolean same;
+
+    if (local->size != remote->size)
+        return FALSE;
+
+    remote_file = dirsync_remote_path(sync, path);
+    remote_digest = sftp_remote_sha256(channel, remote_file);
+    g_free(remote_file);
+    if (!remote_digest)
+        return FALSE;
+
+    local_file = dirsync_local_path(sync, path);
+    local_digest = sftp_local_sha256(local_file);
+    g_free(local_file);
+
+    same = local_digest && strcmp(local_digest, remote_digest) == 0;
+    if (same) {
+        g_free(*sha256);
+        *sha256 = local_digest;
+    } else {
+        g_free(local_digest);
+    }
+    g_free(remote_digest);
+    return same;
+}
+
+/*
+ * Decide what to do with one path
+ */
+static void dirsync_plan_path(DirSync *sync, SFTPSession *channel, const gchar *path)
+{
+    SyncStat *local = g_hash_table_lookup(sync->local, path);
+    SyncStat *remote = g_hash_table_lookup(sync->remote, path);
+    ManifestEntry *entry = g_hash_table_lookup(sync->manifest, path);
+    gchar *sha256 = NULL;
+    gboolean local_changed;
+    gboolean remote_changed;
+    gint type = -1;
+
+    local_changed = local && (!entry || !dirsync_local_unchanged(sync, path, entry, local, &sha256));
+    remote_changed = remote && (!entry || entry->remote.size != remote->size ||
+                                entry->remote.mtime != remote->mtime);
+
+    if (local && remote) {
+        if (!local_changed && !remote_changed)
+            type = sha256 ? SYNC_RECORD : -1;
+        else if (local_changed && remote_changed)
+            type = dirsync_identical(sync, channel, path, local, remote, &sha256) ? SYNC_RECORD :
+                   sync->mode == DIRSYNC_UPLOAD_ONLY ? SYNC_UPLOAD :
+                   sync->mode == DIRSYNC_DOWNLOAD_ONLY ? SYNC_DOWNLOAD : SYNC_CONFLICT;
+        else if (local_changed)
+            type = sync->mode == DIRSYNC_DOWNLOAD_ONLY ? SYNC_DOWNLOAD : SYNC_UPLOAD;
+        else
+            type = sync->mode == DIRSYNC_UPLOAD_ONLY ? SYNC_UPLOAD : SYNC_DOWNLOAD;
+    } else if (local) {
+        if (sync->mode == DIRSYNC_UPLOAD_ONLY)
+            type = SYNC_UPLOAD;
+        else if (sync->mode == DIRSYNC_TWO_WAY)
+            type = (entry && !local_changed) ? SYNC_DELETE_LOCAL : SYNC_UPLOAD;
+    } else if (remote) {
+        if (sync->mode == DIRSYNC_DOWNLOAD_ONLY)
+            type = SYNC_DOWNLOAD;
+        else if (sync->mode == DIRSYNC_TWO_WAY)
+            type = (entry && !remote_changed) ? SYNC_DELETE_REMOTE : SYNC_DOWNLOAD;
+    }
+
+    if (type < 0) {
+        sync->unchanged++;
+        g_free(sha256);
+        return;
+    }
+
+    SyncAction *action = g_new0(SyncAction, 1);
+    action->path = g_strdup(path);
+    action->type = (SyncActionType)type;
+    action->sha256 = sha256;
+    g_ptr_array_add(sync->actions, action);
+
+    if (type == SYNC_UPLOAD)
+        sync->bytes_total += (gsize)local->size;
+    else if (type == SYNC_DOWNLOAD)
+        sync->bytes_total += (gsize)remote->size;
+}
+
+static gint dirsync_path_compare(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+/*
+ * Scan both trees and work out the actions. Nothing is changed, so this
+ * alone is the dry run.
+ */
+static void dirsync_plan(DirSync *sync, SFTPSession *channel)
+{
+    GHashTableIter iter;
+    gpointer key;
+    GPtrArray *paths;
+    guint i;
+
+    if (!dirsync_scan_local(sync, "") || !dirsync_scan_remote(sync, channel, "")) {
+        sync->scan_failed = TRUE;
+        return;
+    }
+
+    /* Every path on either side, in order, except behind a skipped link */
+    paths = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, sync->local);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (!dirsync_skipped(sync, key))
+            g_ptr_array_add(paths, key);
+    g_hash_table_iter_init(&iter, sync->remote);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        if (!g_hash_table_contains(sync->local, key) && !dirsync_skipped(sync, key))
+            g_ptr_array_add(paths, key);
+    g_ptr_array_sort(paths, dirsync_path_compare);
+
+    for (i = 0; i < paths->len && !sync->cancelled; i++)
+        dirsync_plan_path(sync, channel, g_ptr_array_index(paths, i));
+    g_ptr_array_free(paths, TRUE);
+
+    g_print("Sync plan for %s: %u actions, %u unchanged (%u local, %u remote files)\n",
+            sync->remote_root, sync->actions->len, sync->unchanged,
+            g_hash_table_size(sync->local), g_hash_table_size(sync->remote));
+}
+
+/*
+ * Remember what a path looks like on both sides now
+ */
+static void dirsync_record(DirSync *sync, SFTPSession *channel, const gchar *path,
+                           const gchar *sha256)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    ManifestEntry *entry;
+    gchar *local = dirsync_local_path(sync, path);
+    gchar *remote = dirsync_remote_path(sync, path);
+    struct stat st;
+
+    if (stat(local, &st) == 0 && libssh2_sftp_stat(channel->sftp_session, remote, &attrs) == 0) {
+        entry = g_new0(ManifestEntry, 1);
+        entry->local.size = (gint64)st.st_size;
+        entry->local.mtime = compat_stat_mtime_ns(&st);
+        entry->remote.size = (gint64)attrs.filesize;
+        entry->remote.mtime = (gint64)attrs.mtime;
+        entry->sha256 = sha256 ? g_strdup(sha256) : sftp_local_sha256(local);
+        g_hash_table_insert(sync->manifest, g_strdup(path), entry);
+    } else {
+        /* Unknown state: the next sync compares from scratch */
+        g_hash_table_remove(sync->manifest, path);
+    }
+
+    g_free(remote);
+    g_free(local);
+}
+
+/*
+ * Create a remote directory and any missing parents
+ */
+static gboolean dirsync_remote_mkdir(DirSync *sync, SFTPSession *channel, const gchar *rel)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    gchar *parent;
+    gchar *path;
+    gboolean ok;
+
+    if (g_hash_table_contains(sync->remote_dirs, rel))
+        return TRUE;
+
+    if (rel[0]) {
+        parent = dirsync_parent(rel);
+        ok = dirsync_remote_mkdir(sync, channel, parent);
+        g_free(parent);
+        if (!ok)
+            return FALSE;
+    }
+
+    path = dirsync_remote_path(sync, rel);
+    ok = libssh2_sftp_mkdir(channel->sftp_session, path,
+                            LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP |
+                            LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
+                            LIBSSH2_SFTP_S_IXOTH) == 0 ||
+         (libssh2_sftp_stat(channel->sftp_session, path, &attrs) == 0 &&
+          LIBSSH2_SFTP_S_ISDIR(attrs.permissions));
+    if (ok) {
+        g_hash_table_add(sync->remote_dirs, g_strdup(rel));
+        dir_cache_invalidate_parent(sync->session->dir_cache, path);
+    } else {
+        g_printerr("Cannot create remote directory: %s\n", path);
+    }
+    g_free(path);
+    return ok;
+}
+
+/*
+ * Move one file in the direction of the action
+ */
+static gboolean dirsync_transfer(DirSync *sync, SFTPSession *channel, SyncAction *action)
+{
+    FileOperation *op = g_new0(FileOperation, 1);
+    gchar *local = dirsync_local_path(sync, action->path);
+    gchar *remote = dirsync_remote_path(sync, action->path);
+    gchar *parent = dirsync_parent(action->path);
+    gboolean ok;
+
+    g_strlcpy(op->local_path, local, MAX_PATH_LEN);
+    g_strlcpy(op->remote_path, remote, MAX_PATH_LEN);
+    op->is_upload = action->type == SYNC_UPLOAD;
+    op->priority = JOB_PRIORITY_NORMAL;
+
+    if (op->is_upload) {
+        ok = dirsync_remote_mkdir(sync, channel, parent);
+    } else {
+        gchar *local_dir = g_path_get_dirname(local);
+        ok = g_mkdir_with_parents(local_dir, 0755) == 0;
+        g_free(local_dir);
+    }
+
+    if (ok) {
+        g_mutex_lock(&sync->lock);
+        sync->current = op;
+        g_mutex_unlock(&sync->lock);
+
+        ok = !sync->cancelled && sftp_transfer_file(channel, op);
+
+        g_mutex_lock(&sync->lock);
+        sync->current = NULL;
+        g_mutex_unlock(&sync->lock);
+    }
+
+    if (op->is_upload)
+        dir_cache_invalidate_parent(sync->session->dir_cache, remote);
+    if (ok)
+        dirsync_record(sync, channel, action->path, NULL);
+
+    g_free(parent);
+    g_free(remote);
+    g_free(local);
+    g_free(op);
+    return ok;
+}
+
+/*
+ * Carry out one planned action
+ */
+static gboolean dirsync_apply(DirSync *sync, SFTPSession *channel, SyncAction *action)
+{
+    gchar *path;
+    gboolean ok = TRUE;
+
+    switch (action->type) {
+    case SYNC_UPLOAD:
+    case SYNC_DOWNLOAD:
+        return dirsync_transfer(sync, channel, action);
+    case SYNC_RECORD:
+        dirsync_record(sync, channel, action->path, action->sha256);
+        return TRUE;
+    case SYNC_DELETE_REMOTE:
+        path = dirsync_remote_path(sync, action->path);
+        ok = libssh2_sftp_unlink(channel->sftp_session, path) == 0;
+        dir_cache_invalidate_parent(sync->session->dir_cache, path);
+        break;
+    case SYNC_DELETE_LOCAL:
+        path = dirsync_local_path(sync, action->path);
+        ok = g_unlink(path) == 0;
+        break;
+    case SYNC_CONFLICT:
+    default:
+        return TRUE;
+    }
+
+    if (ok)
+        g_hash_table_remove(sync->manifest, action->path);
+    else
+        g_printerr("Cannot delete %s\n", path);
+    g_free(path);
+    return ok;
+}
+
+/*
+ * Manifest entries of paths gone from both sides, or behind a skipped
+ * link: should the link go away, those paths are compared from scratch
+ * rather than against a history that was written through it
+ */
+static gboolean manifest_entry_gone(gpointer key, gpointer value, gpointer user_data)
+{
+    DirSync *sync = (DirSync *)user_data;
+    (void)value;
+    return (!g_hash_table_contains(sync->local, key) &&
+            !g_hash_table_contains(sync->remote, key)) || dirsync_skipped(sync, key);
+}
+
+/*
+ * Carry out the plan and save the manifest, also after a cancel
+ */
+static void dirsync_run(DirSync *sync, SFTPSession *channel)
+{
+    guint i;
+
+    for (i = 0; i < sync->actions->len && !sync->cancelled; i++) {
+        SyncAction *action = g_ptr_array_index(sync->actions, i);
+        gboolean ok;
+
+        if (action->type == SYNC_CONFLICT)
+            continue;
+
+        ok = dirsync_apply(sync, channel, action);
+
+        g_mutex_lock(&sync->lock);
+        if (ok)
+            sync->actions_done++;
+        else if (!sync->cancelled)
+            sync->actions_failed++;
+        if (action->type == SYNC_UPLOAD)
+            sync->bytes_done += (gsize)((SyncStat *)g_hash_table_lookup(sync->local,
+                                                                        action->path))->size;
+        else if (action->type == SYNC_DOWNLOAD)
+            sync->bytes_done += (gsize)((SyncStat *)g_hash_table_lookup(sync->remote,
+                                                                        action->path))->size;
+        g_mutex_unlock(&sync->lock);
+    }
+
+    g_hash_table_foreach_remove(sync->manifest, manifest_entry_gone, sync);
+    manifest_save(sync);
+}
+
+/* Main loop: hand the result to the owner */
+static gboolean dirsync_complete_idle(gpointer data)
+{
+    DirSync *sync = (DirSync *)data;
+
+    /* The session may be closed from now on */
+    sync->session = NULL;
+    dirsync_running = g_list_remove(dirsync_running, sync);
+    sync->callback(sync, sync->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Worker: plan, or run an existing plan */
+static void dirsync_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    DirSync *sync = (DirSync *)data;
+
+    if (!cancelled) {
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+
+        g_mutex_lock(&channel->lock);
+        if (sync->local)
+            dirsync_run(sync, channel);
+        else {
+            sync->local = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+            sync->remote = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+            dirsync_plan(sync, channel);
+        }
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+    } else if (!sync->local) {
+        sync->scan_failed = TRUE;
+    }
+
+    g_idle_add(dirsync_complete_idle, sync);
+}
+
+/*
+ * Scan local and remote and plan a sync in the background. callback runs
+ * on the main loop once the plan is ready.
+ */
+static DirSync *dirsync_plan_async(SFTPSession *session, const gchar *local,
+                                   const gchar *remote, DirSyncMode mode,
+                                   DirSyncCallback callback, gpointer user_data)
+{
+    DirSync *sync = g_new0(DirSync, 1);
+
+    sync->session = session;
+    sync->session_id = session->id;
+    sync->mode = mode;
+    sync->local_root = dirsync_root(local);
+    sync->remote_root = dirsync_root(remote);
+    sync->manifest_file = manifest_file_path(session, sync->local_root, sync->remote_root);
+    sync->manifest = manifest_load(sync->manifest_file);
+    sync->remote_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    sync->skipped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    sync->actions = g_ptr_array_new_with_free_func(sync_action_free);
+    g_mutex_init(&sync->lock);
+    sync->callback = callback;
+    sync->user_data = user_data;
+
+    dirsync_running = g_list_prepend(dirsync_running, sync);
+    sftp_session_push_job(session, JOB_PRIORITY_NORMAL, dirsync_job_func, sync, &sync->cancelled);
+    return sync;
+}
+
+/*
+ * Carry out a finished plan in the background, on the session it was made
+ * on. callback runs again when done.
+ */
+static void dirsync_run_async(DirSync *sync, SFTPSession *session)
+{
+    sync->session = session;
+    sync->started = g_get_monotonic_time();
+    dirsync_running = g_list_prepend(dirsync_running, sync);
+    sftp_session_push_job(session, JOB_PRIORITY_NORMAL, dirsync_job_func,
+                          sync, &sync->cancelled);
+}
+
+static void dirsync_cancel(DirSync *sync)
+{
+    g_mutex_lock(&sync->lock);
+    sync->cancelled = TRUE;
+    if (sync->current)
+        sync->current->cancelled = TRUE;
+    g_mutex_unlock(&sync->lock);
+}
+
+/*
+ * Stop the syncs running on a session that is about to be freed. Closing
+ * only raises the job's flag, which the file being transferred does not
+ * see; without this, freeing the session waits for that file to finish.
+ */
+void dirsync_session_closing(SFTPSession *session)
+{
+    GList *l;
+
+    for (l = dirsync_running; l; l = l->next) {
+        DirSync *sync = l->data;
+        if (sync->session == session)
+            dirsync_cancel(sync);
+    }
+}
+
+static void dirsync_free(DirSync *sync)
+{
+    if (!sync)
+        return;
+    if (sync->local)
+        g_hash_table_destroy(sync->local);
+    if (sync->remote)
+        g_hash_table_destroy(sync->remote);
+    g_hash_table_destroy(sync->remote_dirs);
+    g_hash_table_destroy(sync->skipped);
+    g_hash_table_destroy(sync->manifest);
+    g_ptr_array_unref(sync->actions);
+    g_mutex_clear(&sync->lock);
+    g_free(sync->manifest_file);
+    g_free(sync->local_root);
+    g_free(sync->remote_root);
+    g_free(sync);
+}
+
+/* Sync dialog state */
+typedef struct {
+    SFTPPluginData *plugin_data;
+    DirSync *sync;
+    GtkWidget *dialog;
+    GtkWidget *label;
+    GtkWidget *progress_bar;
+    GtkWidget *text_view;
+    guint timer_id;
+    gboolean busy;          /* Scan or run in flight */
+    gboolean ran;
+    gboolean closing;       /* Dismissed while busy */
+} DirSyncDialog;
+
+static void dirsync_dialog_free(DirSyncDialog *ctx)
+{
+    if (ctx->timer_id)
+        g_source_remove(ctx->timer_id);
+    gtk_widget_destroy(ctx->dialog);
+    dirsync_free(ctx->sync);
+    g_free(ctx);
+}
+
+/* Timer: progress of the scan (pulse) or the run (bytes) */
+static gboolean dirsync_progress_cb(gpointer data)
+{
+    DirSyncDialog *ctx = (DirSyncDialog *)data;
+    DirSync *sync = ctx->sync;
+    gsize done;
+
+    if (!ctx->busy)
+        return G_SOURCE_CONTINUE;
+
+    if (!sync->started || sync->bytes_total == 0) {
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(ctx->progress_bar));
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_mutex_lock(&sync->lock);
+    done = sync->bytes_done;
+    if (sync->current)
+        done += (gsize)g_atomic_pointer_get(&sync->current->transferred);
+    g_mutex_unlock(&sync->lock);
+
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->progress_bar),
+                                  MIN((gdouble)done / (gdouble)sync->bytes_total, 1.0));
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Fill the preview with the plan
+ */
+static void dirsync_show_plan(DirSyncDialog *ctx)
+{
+    static const gchar *verbs[] = {
+        "upload       ", "download     ", "delete remote", "delete local ", "conflict     "
+    };
+    DirSync *sync = ctx->sync;
+    guint counts[SYNC_RECORD + 1] = {0};
+    GString *text = g_string_new(NULL);
+    gchar *summary;
+    guint listed = 0;
+    guint i;
+
+    for (i = 0; i < sync->actions->len; i++) {
+        SyncAction *action = g_ptr_array_index(sync->actions, i);
+        counts[action->type]++;
+        if (action->type == SYNC_RECORD)
+            continue;
+        if (listed++ < DIRSYNC_PREVIEW_MAX)
+            g_string_append_printf(text, "%s  %s\n", verbs[action->type], action->path);
+    }
+    if (listed > DIRSYNC_PREVIEW_MAX)
+        g_string_append_printf(text, "... and %u more\n", listed - DIRSYNC_PREVIEW_MAX);
+    if (listed == 0)
+        g_string_append(text, "Nothing to transfer.\n");
+
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(ctx->text_view)),
+                             text->str, -1);
+    g_string_free(text, TRUE);
+
+    summary = g_strdup_printf("%u to upload, %u to download, %u to delete, %u conflicts "
+                              "(%.1f MB); %u unchanged, %u already identical",
+                              counts[SYNC_UPLOAD], counts[SYNC_DOWNLOAD],
+                              counts[SYNC_DELETE_REMOTE] + counts[SYNC_DELETE_LOCAL],
+                              counts[SYNC_CONFLICT], sync->bytes_total / 1048576.0,
+                              sync->unchanged, counts[SYNC_RECORD]);
+    gtk_label_set_text(GTK_LABEL(ctx->label), summary);
+    g_free(summary);
+
+    /* Conflicts alone give nothing to do */
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(ctx->dialog), DIRSYNC_RESPONSE_SYNC,
+                                      sync->actions->len > counts[SYNC_CONFLICT]);
+}
+
+/* Main loop: the plan or the run has finished */
+static void on_dirsync_complete(DirSync *sync, gpointer user_data)
+{
+    DirSyncDialog *ctx = (DirSyncDialog *)user_data;
+    SFTPPluginData *plugin_data = ctx->plugin_data;
+    SFTPSession *session;
+    gchar *text;
+
+    ctx->busy = FALSE;
+    if (ctx->closing) {
+        dirsync_dialog_free(ctx);
+        return;
+    }
+
+    if (!ctx->ran) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->progress_bar), 0.0);
+        if (sync->scan_failed)
+            gtk_label_set_text(GTK_LABEL(ctx->label),
+                               "Scan failed: a directory could not be read. Nothing was changed.");
+        else
+            dirsync_show_plan(ctx);
+        return;
+    }
+
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->progress_bar), 1.0);
+    text = g_strdup_printf("%s: %u done, %u failed in %.1f s",
+                           sync->cancelled ? "Cancelled" : "Sync finished",
+                           sync->actions_done, sync->actions_failed,
+                           (g_get_monotonic_time() - sync->started) / (gdouble)G_USEC_PER_SEC);
+    gtk_label_set_text(GTK_LABEL(ctx->label), text);
+    g_free(text);
+
+    session = ui_find_session(plugin_data, sync->session_id);
+    if (session && session->active && plugin_data->current_connection >= 0 &&
+        plugin_data->sessions[plugin_data->current_connection] == session)
+        ui_update_file_list(plugin_data);
+}
+
+static void on_dirsync_response(GtkDialog *dialog, gint response_id, gpointer data)
+{
+    DirSyncDialog *ctx = (DirSyncDialog *)data;
+
+    if (response_id == DIRSYNC_RESPONSE_SYNC) {
+        SFTPSession *session;
+
+        if (ctx->busy || ctx->ran)
+            return;
+        /* The session may have been closed while the preview was open; a
+         * new one to another server can even sit at the same address */
+        session = ui_find_session(ctx->plugin_data, ctx->sync->session_id);
+        if (!session || !session->active) {
+            gtk_label_set_text(GTK_LABEL(ctx->label), "Connection closed; sync again to continue.");
+            gtk_dialog_set_response_sensitive(dialog, DIRSYNC_RESPONSE_SYNC, FALSE);
+            return;
+        }
+        ctx->busy = TRUE;
+        ctx->ran = TRUE;
+        gtk_dialog_set_response_sensitive(dialog, DIRSYNC_RESPONSE_SYNC, FALSE);
+        gtk_label_set_text(GTK_LABEL(ctx->label), "Syncing...");
+        dirsync_run_async(ctx->sync, session);
+        return;
+    }
+
+    /* Close: stop whatever is running, free once it has unwound */
+    if (ctx->busy) {
+        ctx->closing = TRUE;
+        dirsync_cancel(ctx->sync);
+        gtk_widget_hide(ctx->dialog);
+    } else {
+        dirsync_dialog_free(ctx);
+    }
+}
+
+/*
+ * Ask for the local folder and the direction, then preview and run a sync
+ * of remote_dir with it
+ */
+void dirsync_show_dialog(SFTPPluginData *plugin_data, const gchar *remote_dir)
+{
+    SFTPSession *session;
+    DirSyncDialog *ctx;
+    GtkWidget *chooser;
+    GtkWidget *mode_combo;
+    GtkWidget *content;
+    GtkWidget *scrolled;
+    DirSyncMode mode;
+    gchar *local;
+    gchar *title;
+
+    if (plugin_data->current_connection < 0 ||
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active) {
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
+        return;
+    }
+    session = plugin_data->sessions[plugin_data->current_connection];
+
+    /* Local folder and direction */
+    chooser = gtk_file_chooser_dialog_new("Sync With Local Folder", NULL,
+                                          GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                          "_Cancel", GTK_RESPONSE_CANCEL,
+                                          "_Preview", GTK_RESPONSE_ACCEPT, NULL);
+    mode_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(mode_combo), "Two-way");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(mode_combo), "Upload only (local to remote)");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(mode_combo), "Download only (remote to local)");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(mode_combo), 0);
+    gtk_widget_show(mode_combo);
+    gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(chooser), mode_combo);
+
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) != GTK_RESPONSE_ACCEPT) {
+        gtk_widget_destroy(chooser);
+        return;
+    }
+    local = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+    mode = (DirSyncMode)gtk_combo_box_get_active(GTK_COMBO_BOX(mode_combo));
+    gtk_widget_destroy(chooser);
+
+    /* Preview and progress */
+    ctx = g_new0(DirSyncDialog, 1);
+    ctx->plugin_data = plugin_data;
+
+    title = g_strdup_printf("Sync %s with %s", remote_dir, local);
+    ctx->dialog = gtk_dialog_new_with_buttons(title, NULL, 0,
+                                              "_Close", GTK_RESPONSE_CLOSE,
+                                              "_Sync", DIRSYNC_RESPONSE_SYNC, NULL);
+    g_free(title);
+    gtk_window_set_default_size(GTK_WINDOW(ctx->dialog), 600, 400);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(ctx->dialog), DIRSYNC_RESPONSE_SYNC, FALSE);
+
+    content = gtk_dialog_get_content_area(GTK_DIALOG(ctx->dialog));
+
+    ctx->label = gtk_label_new("Scanning...");
+    gtk_label_set_xalign(GTK_LABEL(ctx->label), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), ctx->label, FALSE, FALSE, 5);
+
+    ctx->progress_bar = gtk_progress_bar_new();
+    gtk_box_pack_start(GTK_BOX(content), ctx->progress_bar, FALSE, FALSE, 5);
+
+    ctx->text_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(ctx->text_view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(ctx->text_view), TRUE);
+    scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled), ctx->text_view);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 5);
+
+    g_signal_connect(ctx->dialog, "response", G_CALLBACK(on_dirsync_response), ctx);
+    gtk_widget_show_all(ctx->dialog);
+
+    ctx->busy = TRUE;
+    ctx->sync = dirsync_plan_async(session, local, remote_dir, mode, on_dirsync_complete, ctx);
+    ctx->timer_id = g_timeout_add(100, dirsync_progress_cb, ctx);
+    g_free(local);
+}
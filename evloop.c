@@ -0,0 +1,563 @@
+/*
+ * Event Session Module
+ * Non-blocking transfers multiplexed over one SSH connection, driven by a
+ * GSource on its socket instead of a worker thread blocked per transfer
+ */
+
+#include "sftp-core.h"
+#include "compat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define EVENT_DEFAULT_CHANNELS 8     /* OpenSSH allows 10 sessions per connection (MaxSessions) */
+#define EVENT_STEPS_PER_DISPATCH 16  /* Calls one request may make before the others get a turn */
+
+/*
+ * Every transfer gets an SFTP channel of its own on the shared connection.
+ * libssh2 keeps the state of a pending open, stat or read per LIBSSH2_SFTP,
+ * and a call that returned EAGAIN must be repeated before any other call on
+ * that channel, so two transfers cannot interleave on one channel.
+ */
+typedef enum {
+    EVENT_STAGE_CHANNEL,    /* Waiting for an SFTP channel */
+    EVENT_STAGE_OPEN,
+    EVENT_STAGE_FSTAT,      /* Downloads: size for progress */
+    EVENT_STAGE_DATA,
+    EVENT_STAGE_CLOSE,
+    EVENT_STAGE_DONE
+} EventStage;
+
+/* What one step of a request achieved */
+typedef enum {
+    EVENT_STEP_PROGRESS,    /* Moved on; step again */
+    EVENT_STEP_BLOCKED,     /* Waits for the socket, or for a free channel */
+    EVENT_STEP_DONE
+} EventStep;
+
+typedef struct {
+    FileOperation *op;
+    EventStage stage;
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    FILE *local;
+    gchar *buf;
+    gsize buf_size;
+    gsize buf_len;          /* Upload: bytes read from the local file */
+    gsize buf_pos;          /* Upload: bytes of buf already written */
+    gboolean ok;
+} EventRequest;
+
+typedef struct {
+    GSource source;
+    SFTPEventSession *ev;
+} EventSource;
+
+struct _SFTPEventSession {
+    SFTPSession *owner;         /* Transfers are counted on its stats */
+    SFTPSession *conn;          /* Our own connection, non-blocking */
+    GMainContext *context;
+    GSource *source;
+    GPollFD pollfd;
+    GQueue requests;            /* EventRequest, in submission order */
+    GPtrArray *idle_sftp;       /* SFTP channels no request is using */
+    guint channels;             /* SFTP channels open, idle or busy */
+    guint max_channels;
+    EventRequest *initializing; /* libssh2 runs one channel setup at a time */
+    gboolean kick;              /* Some request can move without waiting for the socket */
+};
+
+static gboolean event_would_block(SFTPEventSession *ev)
+{
+    return libssh2_session_last_errno(ev->conn->ssh_session) == LIBSSH2_ERROR_EAGAIN;
+}
+
+/* Stop the transfer; an open handle is closed first */
+static EventStep event_stop(EventRequest *req, gboolean ok)
+{
+    req->ok = ok;
+    req->stage = req->handle ? EVENT_STAGE_CLOSE : EVENT_STAGE_DONE;
+    return EVENT_STEP_PROGRESS;
+}
+
+static EventStep event_step_channel(SFTPEventSession *ev, EventRequest *req)
+{
+    SFTPSession *conn = ev->conn;
+    FileOperation *op = req->op;
+    LIBSSH2_SFTP *sftp;
+
+    if (!op->started_at)
+        op->started_at = g_get_monotonic_time();
+    if (op->cancelled && ev->initializing != req)
+        return event_stop(req, FALSE);
+
+    if (ev->initializing != req && ev->idle_sftp->len > 0) {
+        req->sftp = g_ptr_array_remove_index_fast(ev->idle_sftp, ev->idle_sftp->len - 1);
+    } else {
+        if (ev->initializing && ev->initializing != req)
+            return EVENT_STEP_BLOCKED;
+        if (!ev->initializing && ev->channels >= ev->max_channels)
+            return EVENT_STEP_BLOCKED;
+
+        sftp = libssh2_sftp_init(conn->ssh_session);
+        if (!sftp && event_would_block(ev)) {
+            ev->initializing = req;
+            return EVENT_STEP_BLOCKED;
+        }
+        ev->initializing = NULL;
+        ev->kick = TRUE;
+        if (!sftp) {
+            /* The server caps channels per connection: make do with what we have */
+            if (ev->channels > 0) {
+                ev->max_channels = ev->channels;
+                g_print("Server refused another SFTP channel; using %u\n", ev->channels);
+                return EVENT_STEP_BLOCKED;
+            }
+            g_printerr("Cannot open SFTP channel: %d\n",
+                       libssh2_session_last_errno(conn->ssh_session));
+            return event_stop(req, FALSE);
+        }
+        ev->channels++;
+        req->sftp = sftp;
+    }
+
+    op->leased_at = g_get_monotonic_time();
+    op->locked_at = op->leased_at;
+    req->stage = EVENT_STAGE_OPEN;
+    return EVENT_STEP_PROGRESS;
+}
+
+static EventStep event_step_open(SFTPEventSession *ev, EventRequest *req)
+{
+    FileOperation *op = req->op;
+
+    if (op->is_upload)
+        req->handle = libssh2_sftp_open_ex(req->sftp, op->remote_path,
+                                           (unsigned int)strlen(op->remote_path),
+                                           LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                                           LIBSSH2_FXF_TRUNC,
+                                           LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR,
+                                           LIBSSH2_SFTP_OPENFILE);
+    else
+        req->handle = libssh2_sftp_open_ex(req->sftp, op->remote_path,
+                                           (unsigned int)strlen(op->remote_path),
+                                           LIBSSH2_FXF_READ, 0, LIBSSH2_SFTP_OPENFILE);
+    if (!req->handle) {
+        if (event_would_block(ev))
+            return EVENT_STEP_BLOCKED;
+        g_printerr("Cannot open remote file %s: %lu\n", op->remote_path,
+                   (unsigned long)libssh2_sftp_last_error(req->sftp));
+        return event_stop(req, FALSE);
+    }
+
+    req->stage = op->is_upload ? EVENT_STAGE_DATA : EVENT_STAGE_FSTAT;
+    return EVENT_STEP_PROGRESS;
+}
+
+static EventStep event_step_fstat(EventRequest *req)
+{
+    FileOperation *op = req->op;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc;
+
+    rc = libssh2_sftp_fstat_ex(req->handle, &attrs, 0);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return EVENT_STEP_BLOCKED;
+    if (rc == 0 && (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE))
+        op->total_size = (gsize)attrs.filesize;
+
+    local_watch_write_begin(op->local_path);
+    req->local = fopen(op->local_path, "wb");
+    if (!req->local) {
+        g_printerr("Cannot create local file: %s\n", op->local_path);
+        local_watch_write_end(op->local_path);
+        return event_stop(req, FALSE);
+    }
+    req->stage = EVENT_STAGE_DATA;
+    return EVENT_STEP_PROGRESS;
+}
+
+static EventStep event_step_download(EventRequest *req)
+{
+    FileOperation *op = req->op;
+    gint64 disk_start;
+    ssize_t rc;
+
+    if (op->cancelled)
+        return event_stop(req, FALSE);
+
+    rc = libssh2_sftp_read(req->handle, req->buf, req->buf_size);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return EVENT_STEP_BLOCKED;
+    if (rc < 0) {
+        g_printerr("Read of %s failed: %d\n", op->remote_path, (int)rc);
+        return event_stop(req, FALSE);
+    }
+    if (rc == 0)
+        return event_stop(req, TRUE);
+
+    transfer_op_data(op, (gsize)rc);
+    disk_start = g_get_monotonic_time();
+    if (fwrite(req->buf, 1, (size_t)rc, req->local) != (size_t)rc) {
+        g_printerr("Failed to write local file\n");
+        return event_stop(req, FALSE);
+    }
+    transfer_op_disk(op, disk_start);
+    g_atomic_pointer_add(&op->transferred, rc);
+    return EVENT_STEP_PROGRESS;
+}
+
+/*
+ * A write that returned EAGAIN must be repeated with the same data, so
+ * cancellation is only looked at between buffers
+ */
+static EventStep event_step_upload(EventRequest *req)
+{
+    FileOperation *op = req->op;
+    ssize_t rc;
+
+    if (req->buf_pos == req->buf_len) {
+        gint64 disk_start = g_get_monotonic_time();
+
+        if (op->cancelled)
+            return event_stop(req, FALSE);
+        req->buf_len = fread(req->buf, 1, req->buf_size, req->local);
+        req->buf_pos = 0;
+        transfer_op_disk(op, disk_start);
+        if (req->buf_len == 0)
+            return event_stop(req, !ferror(req->local));
+    }
+
+    rc = libssh2_sftp_write(req->handle, req->buf + req->buf_pos, req->buf_len - req->buf_pos);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return EVENT_STEP_BLOCKED;
+    if (rc < 0) {
+        g_printerr("Write of %s failed: %d\n", op->remote_path, (int)rc);
+        return event_stop(req, FALSE);
+    }
+
+    transfer_op_data(op, (gsize)rc);
+    req->buf_pos += (gsize)rc;
+    g_atomic_pointer_add(&op->transferred, rc);
+    return EVENT_STEP_PROGRESS;
+}
+
+static EventStep event_step_close(EventRequest *req)
+{
+    int rc = libssh2_sftp_close_handle(req->handle);
+
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return EVENT_STEP_BLOCKED;
+    /* An upload is only complete once the server accepted the close */
+    if (rc != 0 && req->op->is_upload)
+        req->ok = FALSE;
+    req->handle = NULL;
+    req->stage = EVENT_STAGE_DONE;
+    return EVENT_STEP_PROGRESS;
+}
+
+/*
+ * Give the request's channel to whoever waits for one, and drop its
+ * local resources
+ */
+static void event_request_release(SFTPEventSession *ev, EventRequest *req)
+{
+    if (req->sftp) {
+        g_ptr_array_add(ev->idle_sftp, req->sftp);
+        req->sftp = NULL;
+        ev->kick = TRUE;
+    }
+    if (ev->initializing == req)
+        ev->initializing = NULL;
+    if (req->local) {
+        fclose(req->local);
+        req->local = NULL;
+        if (!req->op->is_upload)
+            local_watch_write_end(req->op->local_path);
+    }
+    g_free(req->buf);
+    req->buf = NULL;
+}
+
+static EventStep event_request_step(SFTPEventSession *ev, EventRequest *req)
+{
+    switch (req->stage) {
+        case EVENT_STAGE_CHANNEL: return event_step_channel(ev, req);
+        case EVENT_STAGE_OPEN: return event_step_open(ev, req);
+        case EVENT_STAGE_FSTAT: return event_step_fstat(req);
+        case EVENT_STAGE_DATA:
+            return req->op->is_upload ? event_step_upload(req) : event_step_download(req);
+        case EVENT_STAGE_CLOSE: return event_step_close(req);
+        case EVENT_STAGE_DONE: break;
+    }
+    event_request_release(ev, req);
+    return EVENT_STEP_DONE;
+}
+
+/*
+ * Report a finished request. The callback owns op, like transfer_async's.
+ */
+static void event_request_finish(SFTPEventSession *ev, EventRequest *req)
+{
+    FileOperation *op = req->op;
+
+    if (op->is_upload)
+        dir_cache_invalidate_parent(ev->owner->dir_cache, op->remote_path);
+
+    op->success = req->ok;
+    op->completed = TRUE;
+    op->completed_at = g_get_monotonic_time();
+    stats_record(ev->owner->stats, op, req->ok);
+    g_free(req);
+
+    if (op->callback)
+        op->callback(op, op->success, op->user_data);
+    else
+        g_free(op);
+}
+
+/*
+ * Move every request as far as it goes without blocking. Callbacks run
+ * after the pass, so they may queue new transfers.
+ *
+ * Any call on the connection reads whatever packets have arrived, so a
+ * request passed over as blocked may already have its reply buffered
+ * inside libssh2, where polling the socket won't see it. Only a pass in
+ * which nothing moved goes back to waiting on the socket.
+ */
+static void event_session_run(SFTPEventSession *ev)
+{
+    GQueue finished = G_QUEUE_INIT;
+    EventRequest *req;
+    GList *l, *next;
+
+    ev->kick = FALSE;
+    for (l = ev->requests.head; l; l = next) {
+        EventStep step;
+        gint steps = 0;
+
+        next = l->next;
+        req = (EventRequest *)l->data;
+        while ((step = event_request_step(ev, req)) == EVENT_STEP_PROGRESS) {
+            /* Come back right away, after the rest of the main loop had a turn */
+            ev->kick = TRUE;
+            if (++steps >= EVENT_STEPS_PER_DISPATCH)
+                break;
+        }
+        if (step == EVENT_STEP_DONE) {
+            g_queue_delete_link(&ev->requests, l);
+            g_queue_push_tail(&finished, req);
+        }
+    }
+
+    while ((req = g_queue_pop_head(&finished)) != NULL)
+        event_request_finish(ev, req);
+}
+
+static gboolean event_source_prepare(GSource *source, gint *timeout)
+{
+    SFTPEventSession *ev = ((EventSource *)source)->ev;
+    gint directions;
+
+    *timeout = -1;
+    if (ev->kick)
+        return TRUE;
+
+    /* Nothing in flight: don't wake up for whatever the server sends */
+    if (g_queue_is_empty(&ev->requests)) {
+        ev->pollfd.events = 0;
+        return FALSE;
+    }
+
+#ifdef G_OS_WIN32
+    /* The event handle signals both directions */
+    (void)directions;
+    ev->pollfd.events = G_IO_IN;
+#else
+    directions = libssh2_session_block_directions(ev->conn->ssh_session);
+    ev->pollfd.events = G_IO_ERR | G_IO_HUP;
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+        ev->pollfd.events |= G_IO_OUT;
+    if ((directions & LIBSSH2_SESSION_BLOCK_INBOUND) || !directions)
+        ev->pollfd.events |= G_IO_IN;
+#endif
+    return FALSE;
+}
+
+static gboolean event_source_check(GSource *source)
+{
+    SFTPEventSession *ev = ((EventSource *)source)->ev;
+
+#ifdef G_OS_WIN32
+    if (ev->pollfd.revents) {
+        WSANETWORKEVENTS events;
+        /* Re-arms the event */
+        WSAEnumNetworkEvents(ev->conn->sock, (WSAEVENT)(gintptr)ev->pollfd.fd, &events);
+    }
+#endif
+    return ev->kick || (ev->pollfd.revents & ev->pollfd.events) != 0;
+}
+
+static gboolean event_source_dispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+    (void)callback;
+    (void)data;
+    event_session_run(((EventSource *)source)->ev);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs event_source_funcs = {
+    event_source_prepare,
+    event_source_check,
+    event_source_dispatch,
+    NULL, NULL, NULL
+};
+
+/*
+ * Open a connection of its own to owner's server and drive it from
+ * context (NULL = the default context). The connect itself blocks.
+ * Transfers are counted on owner's statistics, so owner must outlive it.
+ * Every other call must come from the thread that runs context.
+ * max_channels caps the transfers in flight; 0 picks a default.
+ */
+SFTPEventSession *sftp_event_session_new(SFTPSession *owner, GMainContext *context,
+                                         guint max_channels)
+{
+    SFTPEventSession *ev;
+    SFTPSession *conn = sftp_session_clone(owner);
+
+    if (!sftp_connection_connect(conn)) {
+        sftp_session_free(conn);
+        return NULL;
+    }
+
+    ev = g_new0(SFTPEventSession, 1);
+    ev->owner = owner;
+    ev->conn = conn;
+    ev->context = g_main_context_ref(context ? context : g_main_context_default());
+    g_queue_init(&ev->requests);
+    ev->idle_sftp = g_ptr_array_new();
+    /* The connect already opened the first channel */
+    g_ptr_array_add(ev->idle_sftp, conn->sftp_session);
+    ev->channels = 1;
+    ev->max_channels = max_channels > 0 ? max_channels : EVENT_DEFAULT_CHANNELS;
+
+    libssh2_session_set_blocking(conn->ssh_session, 0);
+
+#ifdef G_OS_WIN32
+    {
+        WSAEVENT event = WSACreateEvent();
+        WSAEventSelect(conn->sock, event, FD_READ | FD_WRITE | FD_CLOSE);
+        ev->pollfd.fd = (gintptr)event;
+    }
+#else
+    ev->pollfd.fd = conn->sock;
+#endif
+
+    ev->source = g_source_new(&event_source_funcs, sizeof(EventSource));
+    ((EventSource *)ev->source)->ev = ev;
+    g_source_set_name(ev->source, "SFTP event session");
+    g_source_add_poll(ev->source, &ev->pollfd);
+    g_source_attach(ev->source, ev->context);
+    return ev;
+}
+
+/*
+ * Close the connection. Transfers still in flight are cancelled and their
+ * callbacks run before this returns; don't call it from one of them.
+ */
+void sftp_event_session_free(SFTPEventSession *ev)
+{
+    EventRequest *req;
+    guint i;
+
+    if (!ev)
+        return;
+
+    g_source_destroy(ev->source);
+    g_source_unref(ev->source);
+#ifdef G_OS_WIN32
+    WSAEventSelect(ev->conn->sock, NULL, 0);
+    WSACloseEvent((WSAEVENT)(gintptr)ev->pollfd.fd);
+#endif
+
+    /* What is left is torn down synchronously */
+    libssh2_session_set_blocking(ev->conn->ssh_session, 1);
+    while ((req = g_queue_pop_head(&ev->requests)) != NULL) {
+        req->op->cancelled = TRUE;
+        if (req->handle)
+            libssh2_sftp_close_handle(req->handle);
+        req->handle = NULL;
+        req->ok = FALSE;
+        event_request_release(ev, req);
+        event_request_finish(ev, req);
+    }
+
+    /* The connection's own channel goes with the disconnect */
+    for (i = 0; i < ev->idle_sftp->len; i++) {
+        LIBSSH2_SFTP *sftp = g_ptr_array_index(ev->idle_sftp, i);
+        if (sftp != ev->conn->sftp_session)
+            libssh2_sftp_shutdown(sftp);
+    }
+    g_ptr_array_free(ev->idle_sftp, TRUE);
+
+    sftp_session_free(ev->conn);
+    g_main_context_unref(ev->context);
+    g_free(ev);
+}
+
+/*
+ * Queue a whole-file transfer. Unlike transfer_async there is no resume,
+ * delta or atomic upload: the file is simply copied. callback runs from
+ * the context's dispatch, never from inside this call, and owns op.
+ */
+FileOperation *sftp_event_transfer(SFTPEventSession *ev, const gchar *local,
+                                   const gchar *remote, gboolean is_upload,
+                                   TransferCallback callback, gpointer user_data)
+{
+    FileOperation *op = g_new0(FileOperation, 1);
+    EventRequest *req = g_new0(EventRequest, 1);
+
+    g_strlcpy(op->local_path, local, MAX_PATH_LEN);
+    g_strlcpy(op->remote_path, remote, MAX_PATH_LEN);
+    op->is_upload = is_upload;
+    op->priority = JOB_PRIORITY_NORMAL;
+    op->callback = callback;
+    op->user_data = user_data;
+    op->queued_at = g_get_monotonic_time();
+
+    req->op = op;
+    req->stage = EVENT_STAGE_CHANNEL;
+    req->buf_size = is_upload ? transfer_write_buffer_size(ev->conn)
+                              : transfer_read_buffer_size(ev->conn);
+    req->buf = g_malloc(req->buf_size);
+
+    if (is_upload) {
+        struct stat st;
+
+        req->local = fopen(local, "rb");
+        if (!req->local) {
+            g_printerr("Cannot open local file: %s\n", local);
+            req->stage = EVENT_STAGE_DONE;
+        } else if (fstat(fileno(req->local), &st) == 0) {
+            op->total_size = (gsize)st.st_size;
+        }
+    }
+
+    g_queue_push_tail(&ev->requests, req);
+    ev->kick = TRUE;
+    g_main_context_wakeup(ev->context);
+    return op;
+}
+
+/*
+ * Cancel a transfer of this session. Its callback still runs, with
+ * success FALSE, once the remote handle is closed.
+ */
+void sftp_event_cancel(SFTPEventSession *ev, FileOperation *op)
+{
+    op->cancelled = TRUE;
+    ev->kick = TRUE;
+    g_main_context_wakeup(ev->context);
+}
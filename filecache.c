@@ -0,0 +1,380 @@
+/*
+ * File Cache Module
+ * Persistent cache of downloaded files, so re-opening a file that has not
+ * changed on the server costs one stat instead of a download
+ */
+
+#include "sftp-core.h"
+
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#define FILE_CACHE_DIR "geany-sftp/files"
+#define FILE_CACHE_INDEX "index.json"
+
+/* What one remote file looked like when its contents were cached */
+typedef struct {
+    gchar *sha256;          /* Blob holding the contents */
+    gint64 size;
+    gint64 mtime;
+    gint64 used;            /* Wall-clock seconds of the last hit or store */
+} CacheEntry;
+
+struct _FileCache {
+    GMutex lock;            /* Held by workers for lookups and stores */
+    gchar *dir;
+    GHashTable *entries;    /* "user@host:port/path" -> CacheEntry */
+    GHashTable *blobs;      /* sha256 -> size in bytes */
+    gint64 total;           /* Bytes in blobs */
+    gint64 limit;           /* Bytes, 0 = cache off */
+};
+
+static void cache_entry_free(gpointer data)
+{
+    CacheEntry *entry = (CacheEntry *)data;
+    g_free(entry->sha256);
+    g_free(entry);
+}
+
+static gchar *cache_key(const SFTPConnection *conn, const gchar *remote)
+{
+    return g_strdup_printf("%s@%s:%d%s%s", conn->username, conn->hostname, conn->port,
+                           remote[0] == '/' ? "" : "/", remote);
+}
+
+static gchar *cache_blob_path(FileCache *cache, const gchar *sha256)
+{
+    return g_build_filename(cache->dir, sha256, NULL);
+}
+
+/*
+ * Copy a file. The copy goes to a temp name first so a half-written file
+ * is never seen under the final one.
+ */
+static gboolean cache_copy_file(const gchar *src, const gchar *dest)
+{
+    gchar *temp = g_strconcat(dest, ".part", NULL);
+    FILE *in = fopen(src, "rb");
+    FILE *out = in ? fopen(temp, "wb") : NULL;
+    gchar buf[65536];
+    size_t n;
+    gboolean ok;
+
+    if (!in || !out) {
+        if (in)
+            fclose(in);
+        g_free(temp);
+        return FALSE;
+    }
+
+    ok = TRUE;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok = fwrite(buf, 1, n, out) == n;
+    ok = ok && !ferror(in);
+    fclose(in);
+    ok = fclose(out) == 0 && ok;
+
+    ok = ok && g_rename(temp, dest) == 0;
+    if (!ok)
+        g_unlink(temp);
+    g_free(temp);
+    return ok;
+}
+
+/*
+ * Write the index through a temp file and a rename
+ */
+static void cache_save_index(FileCache *cache)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    JsonObject *obj = json_object_new();
+    JsonObject *entries = json_object_new();
+    JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+    JsonGenerator *gen = json_generator_new();
+    GError *error = NULL;
+    gchar *file = g_build_filename(cache->dir, FILE_CACHE_INDEX, NULL);
+    gchar *temp = g_strconcat(file, ".tmp", NULL);
+
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        CacheEntry *entry = (CacheEntry *)value;
+        JsonObject *item = json_object_new();
+
+        json_object_set_string_member(item, "sha256", entry->sha256);
+        json_object_set_int_member(item, "size", entry->size);
+        json_object_set_int_member(item, "mtime", entry->mtime);
+        json_object_set_int_member(item, "used", entry->used);
+        json_object_set_object_member(entries, (const gchar *)key, item);
+    }
+    json_object_set_int_member(obj, "version", 1);
+    json_object_set_object_member(obj, "entries", entries);
+    json_node_take_object(root, obj);
+    json_generator_set_root(gen, root);
+
+    if (!json_generator_to_file(gen, temp, &error) || g_rename(temp, file) != 0) {
+        g_printerr("Failed to save file cache index: %s\n", error ? error->message : temp);
+        if (error)
+            g_error_free(error);
+        g_unlink(temp);
+    }
+
+    g_free(temp);
+    g_free(file);
+    g_object_unref(gen);
+    json_node_free(root);
+}
+
+/*
+ * Delete a blob once no entry refers to it any more
+ */
+static void cache_release_blob(FileCache *cache, const gchar *sha256)
+{
+    GHashTableIter iter;
+    gpointer value;
+    gchar *blob;
+
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        if (strcmp(((CacheEntry *)value)->sha256, sha256) == 0)
+            return;
+
+    blob = cache_blob_path(cache, sha256);
+    g_unlink(blob);
+    g_free(blob);
+    cache->total -= (gint64)GPOINTER_TO_SIZE(g_hash_table_lookup(cache->blobs, sha256));
+    g_hash_table_remove(cache->blobs, sha256);
+}
+
+static gint cache_compare_used(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    GHashTable *entries = (GHashTable *)user_data;
+    gint64 ua = ((CacheEntry *)g_hash_table_lookup(entries, a))->used;
+    gint64 ub = ((CacheEntry *)g_hash_table_lookup(entries, b))->used;
+    return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/*
+ * Drop least recently used entries until the blobs fit the limit
+ */
+static void cache_evict(FileCache *cache)
+{
+    GList *keys;
+    GList *l;
+    guint dropped = 0;
+
+    if (cache->total <= cache->limit)
+        return;
+
+    keys = g_list_sort_with_data(g_hash_table_get_keys(cache->entries),
+                                 cache_compare_used, cache->entries);
+    for (l = keys; l && cache->total > cache->limit; l = l->next) {
+        CacheEntry *entry = g_hash_table_lookup(cache->entries, l->data);
+        gchar *sha256 = g_strdup(entry->sha256);
+
+        g_hash_table_remove(cache->entries, l->data);
+        cache_release_blob(cache, sha256);
+        g_free(sha256);
+        dropped++;
+    }
+    g_list_free(keys);
+
+    g_print("File cache: evicted %u entries, %ld KB kept\n", dropped, (long)(cache->total / 1024));
+}
+
+static void cache_load_member(JsonObject *entries, const gchar *name, JsonNode *node,
+                              gpointer user_data)
+{
+    FileCache *cache = (FileCache *)user_data;
+    CacheEntry *entry;
+    JsonObject *obj;
+    struct stat st;
+    gchar *blob;
+
+    (void)entries;
+    if (!JSON_NODE_HOLDS_OBJECT(node))
+        return;
+    obj = json_node_get_object(node);
+    if (!json_object_has_member(obj, "sha256"))
+        return;
+
+    entry = g_new0(CacheEntry, 1);
+    entry->sha256 = g_strdup(json_object_get_string_member(obj, "sha256"));
+    entry->size = json_object_get_int_member(obj, "size");
+    entry->mtime = json_object_get_int_member(obj, "mtime");
+    entry->used = json_object_get_int_member(obj, "used");
+
+    /* Entries whose blob was cleaned away are dropped */
+    blob = cache_blob_path(cache, entry->sha256);
+    if (stat(blob, &st) != 0 || (gint64)st.st_size != entry->size) {
+        cache_entry_free(entry);
+        g_free(blob);
+        return;
+    }
+    g_free(blob);
+
+    if (!g_hash_table_contains(cache->blobs, entry->sha256)) {
+        g_hash_table_insert(cache->blobs, g_strdup(entry->sha256),
+                            GSIZE_TO_POINTER((gsize)st.st_size));
+        cache->total += st.st_size;
+    }
+    g_hash_table_insert(cache->entries, g_strdup(name), entry);
+}
+
+/*
+ * Open the cache under the user cache directory, limited to limit_mb
+ * megabytes (0 keeps it off)
+ */
+FileCache *file_cache_new(gint limit_mb)
+{
+    FileCache *cache = g_new0(FileCache, 1);
+    JsonParser *parser;
+    gchar *index;
+
+    g_mutex_init(&cache->lock);
+    cache->dir = g_build_filename(g_get_user_cache_dir(), FILE_CACHE_DIR, NULL);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, cache_entry_free);
+    cache->blobs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    cache->limit = (gint64)limit_mb * 1024 * 1024;
+    g_mkdir_with_parents(cache->dir, 0700);
+
+    index = g_build_filename(cache->dir, FILE_CACHE_INDEX, NULL);
+    parser = json_parser_new();
+    if (g_file_test(index, G_FILE_TEST_EXISTS) &&
+        json_parser_load_from_file(parser, index, NULL) &&
+        JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        JsonObject *obj = json_node_get_object(json_parser_get_root(parser));
+        if (json_object_has_member(obj, "entries"))
+            json_object_foreach_member(json_object_get_object_member(obj, "entries"),
+                                       cache_load_member, cache);
+    }
+    g_object_unref(parser);
+    g_free(index);
+
+    if (cache->total > cache->limit) {
+        cache_evict(cache);
+        cache_save_index(cache);
+    }
+
+    g_print("File cache: %u entries, %ld KB\n", g_hash_table_size(cache->entries),
+            (long)(cache->total / 1024));
+    return cache;
+}
+
+void file_cache_free(FileCache *cache)
+{
+    if (!cache)
+        return;
+    cache_save_index(cache);
+    g_hash_table_destroy(cache->entries);
+    g_hash_table_destroy(cache->blobs);
+    g_mutex_clear(&cache->lock);
+    g_free(cache->dir);
+    g_free(cache);
+}
+
+/*
+ * Change the size limit; 0 turns the cache off and empties it
+ */
+void file_cache_set_limit(FileCache *cache, gint limit_mb)
+{
+    g_mutex_lock(&cache->lock);
+    cache->limit = (gint64)limit_mb * 1024 * 1024;
+    if (cache->total > cache->limit) {
+        cache_evict(cache);
+        cache_save_index(cache);
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Copy the cached contents of remote to dest, if they were cached for a
+ * remote file of exactly this size and mtime. The caller stats the remote
+ * file; that stat is the only network cost of a hit.
+ */
+gboolean file_cache_lookup(FileCache *cache, const SFTPConnection *conn, const gchar *remote,
+                           gint64 size, gint64 mtime, const gchar *dest)
+{
+    gchar *key = cache_key(conn, remote);
+    CacheEntry *entry;
+    gboolean hit = FALSE;
+
+    g_mutex_lock(&cache->lock);
+    entry = cache->limit > 0 ? g_hash_table_lookup(cache->entries, key) : NULL;
+    if (entry && entry->size == size && entry->mtime == mtime) {
+        gchar *blob = cache_blob_path(cache, entry->sha256);
+        hit = cache_copy_file(blob, dest);
+        if (hit)
+            entry->used = g_get_real_time() / G_USEC_PER_SEC;
+        g_free(blob);
+    }
+    g_mutex_unlock(&cache->lock);
+
+    g_print("File cache %s: %s\n", hit ? "hit" : "miss", key);
+    g_free(key);
+    return hit;
+}
+
+/*
+ * Remember that remote, at this size and mtime, holds the contents of the
+ * local file src
+ */
+void file_cache_store(FileCache *cache, const SFTPConnection *conn, const gchar *remote,
+                      gint64 size, gint64 mtime, const gchar *src)
+{
+    gchar *sha256;
+    gchar *old_sha256;
+    gchar *blob;
+    gchar *key;
+    CacheEntry *entry;
+    struct stat st;
+
+    if (cache->limit <= 0 || size > cache->limit || stat(src, &st) != 0 ||
+        (gint64)st.st_size != size)
+        return;
+
+    sha256 = sftp_local_sha256(src);
+    if (!sha256)
+        return;
+    blob = cache_blob_path(cache, sha256);
+
+    g_mutex_lock(&cache->lock);
+
+    key = cache_key(conn, remote);
+    entry = g_hash_table_lookup(cache->entries, key);
+    old_sha256 = entry ? g_strdup(entry->sha256) : NULL;
+    g_free(key);
+
+    if (!g_hash_table_contains(cache->blobs, sha256)) {
+        if (!cache_copy_file(src, blob)) {
+            g_mutex_unlock(&cache->lock);
+            g_printerr("File cache: cannot store %s\n", remote);
+            g_free(old_sha256);
+            g_free(blob);
+            g_free(sha256);
+            return;
+        }
+        g_hash_table_insert(cache->blobs, g_strdup(sha256), GSIZE_TO_POINTER((gsize)size));
+        cache->total += size;
+    }
+
+    entry = g_new0(CacheEntry, 1);
+    entry->sha256 = g_strdup(sha256);
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->used = g_get_real_time() / G_USEC_PER_SEC;
+    g_hash_table_insert(cache->entries, cache_key(conn, remote), entry);
+
+    /* The previous contents of this path may now be unreferenced */
+    if (old_sha256 && strcmp(old_sha256, sha256) != 0)
+        cache_release_blob(cache, old_sha256);
+
+    cache_evict(cache);
+    cache_save_index(cache);
+    g_mutex_unlock(&cache->lock);
+
+    g_free(old_sha256);
+    g_free(blob);
+    g_free(sha256);
+}
@@ -0,0 +1,492 @@
+/*
+ * Folder Transfer Module
+ * Recursive upload and download of directory trees
+ */
+
+#include "sftp-core.h"
+
+#include <sys/stat.h>
+
+#define FOLDER_SUMMARY_FAILURES 10   /* Failed paths listed in the summary */
+
+/*
+ * One file found by the walk. op.cancelled is also the cancel flag of the
+ * file's job, so closing the session stops the copy itself.
+ */
+typedef struct {
+    FolderTransfer *tree;
+    FileOperation op;
+    gsize size;
+} FolderFile;
+
+struct _FolderTransfer {
+    SFTPSession *session;
+    gboolean is_upload;
+    gchar *local_root;
+    gchar *remote_root;
+    GMutex lock;            /* Protects everything below except cancelled */
+    GQueue pending;         /* FolderFile waiting for a job */
+    GPtrArray *running;     /* FileOperation of each queued or running file job */
+    GPtrArray *failures;    /* Paths that could not be transferred */
+    guint jobs;             /* File jobs queued or running */
+    guint max_jobs;
+    gboolean finished;      /* Completion has been reported */
+    guint files_total;
+    guint files_done;
+    guint files_failed;
+    guint dirs_created;     /* Directories walked (and created if missing) */
+    gsize bytes_total;
+    gsize bytes_done;       /* Of finished (or failed) files */
+    gint64 started;
+    gboolean walking;
+    gboolean cancelled;
+    FolderTransferCallback callback;
+    gpointer user_data;
+};
+
+static void folder_file_free(gpointer data)
+{
+    g_free(data);
+}
+
+/*
+ * Build "dir/name" for a remote path, without doubling the root's slash
+ */
+static gchar *folder_remote_child(const gchar *dir, const gchar *name)
+{
+    if (strcmp(dir, "/") == 0)
+        return g_strconcat("/", name, NULL);
+    return g_strconcat(dir, "/", name, NULL);
+}
+
+static void folder_add_failure(FolderTransfer *tree, const gchar *path)
+{
+    g_mutex_lock(&tree->lock);
+    tree->files_failed++;
+    g_ptr_array_add(tree->failures, g_strdup(path));
+    g_mutex_unlock(&tree->lock);
+}
+
+static void folder_dispatch(FolderTransfer *tree);
+
+/*
+ * Hand a file found by the walk to the queue
+ */
+static void folder_add_file(FolderTransfer *tree, gchar *local, gchar *remote, gsize size)
+{
+    FolderFile *file;
+
+    if (strlen(local) >= MAX_PATH_LEN || strlen(remote) >= MAX_PATH_LEN) {
+        folder_add_failure(tree, tree->is_upload ? local : remote);
+        g_free(local);
+        g_free(remote);
+        return;
+    }
+
+    file = g_new0(FolderFile, 1);
+    file->tree = tree;
+    file->size = size;
+    g_strlcpy(file->op.local_path, local, MAX_PATH_LEN);
+    g_strlcpy(file->op.remote_path, remote, MAX_PATH_LEN);
+    file->op.is_upload = tree->is_upload;
+    file->op.priority = JOB_PRIORITY_NORMAL;
+    g_free(local);
+    g_free(remote);
+
+    g_mutex_lock(&tree->lock);
+    g_queue_push_tail(&tree->pending, file);
+    tree->files_total++;
+    tree->bytes_total += size;
+    g_mutex_unlock(&tree->lock);
+
+    folder_dispatch(tree);
+}
+
+/*
+ * Create a remote directory unless it already exists
+ */
+static gboolean folder_remote_mkdir(FolderTransfer *tree, SFTPSession *channel,
+                                    const gchar *path)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    if (libssh2_sftp_mkdir(channel->sftp_session, path,
+                           LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP |
+                           LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
+                           LIBSSH2_SFTP_S_IXOTH) == 0) {
+        dir_cache_invalidate_parent(tree->session->dir_cache, path);
+        return TRUE;
+    }
+
+    return libssh2_sftp_stat(channel->sftp_session, path, &attrs) == 0 &&
+           (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+           LIBSSH2_SFTP_S_ISDIR(attrs.permissions);
+}
+
+/*
+ * Walk a local directory, creating its remote counterpart as we go.
+ * Symlinks to files are uploaded as files; symlinked directories are
+ * skipped so a link loop cannot make the walk endless.
+ */
+static void folder_walk_local(FolderTransfer *tree, SFTPSession *channel,
+                              const gchar *local, const gchar *remote)
+{
+    GError *error = NULL;
+    const gchar *name;
+    GDir *dir;
+
+    if (!folder_remote_mkdir(tree, channel, remote)) {
+        g_printerr("Cannot create remote directory: %s\n", remote);
+        folder_add_failure(tree, local);
+        return;
+    }
+    g_mutex_lock(&tree->lock);
+    tree->dirs_created++;
+    g_mutex_unlock(&tree->lock);
+
+    dir = g_dir_open(local, 0, &error);
+    if (!dir) {
+        g_printerr("Cannot open local directory: %s\n", error->message);
+        g_error_free(error);
+        folder_add_failure(tree, local);
+        return;
+    }
+
+    while (!tree->cancelled && (name = g_dir_read_name(dir)) != NULL) {
+        gchar *child_local = g_build_filename(local, name, NULL);
+        gchar *child_remote = folder_remote_child(remote, name);
+        gboolean is_link;
+        struct stat st;
+
+        if (lstat(child_local, &st) != 0) {
+            folder_add_failure(tree, child_local);
+        } else if ((is_link = S_ISLNK(st.st_mode)) && stat(child_local, &st) != 0) {
+            g_print("Skipping dangling symlink: %s\n", child_local);
+        } else if (is_link && S_ISDIR(st.st_mode)) {
+            g_print("Skipping symlinked directory: %s\n", child_local);
+        } else if (S_ISDIR(st.st_mode)) {
+            folder_walk_local(tree, channel, child_local, child_remote);
+        } else if (S_ISREG(st.st_mode)) {
+            folder_add_file(tree, child_local, child_remote, (gsize)st.st_size);
+            continue;   /* The file owns the paths now */
+        } else {
+            g_print("Skipping special file: %s\n", child_local);
+        }
+
+        g_free(child_local);
+        g_free(child_remote);
+    }
+
+    g_dir_close(dir);
+}
+
+/* Collect the batches of one remote listing */
+static void folder_collect_batch(GPtrArray *batch, gpointer user_data)
+{
+    GPtrArray *entries = (GPtrArray *)user_data;
+    guint i;
+
+    for (i = 0; i < batch->len; i++)
+        g_ptr_array_add(entries, g_ptr_array_index(batch, i));
+    g_ptr_array_set_free_func(batch, NULL);
+    g_ptr_array_unref(batch);
+}
+
+/*
+ * Walk a remote directory, creating its local counterpart as we go.
+ * Symlinks are resolved; those pointing at directories are skipped.
+ */
+static void folder_walk_remote(FolderTransfer *tree, SFTPSession *channel,
+                               const gchar *remote, const gchar *local)
+{
+    GPtrArray *entries;
+    guint i;
+
+    if (g_mkdir_with_parents(local, 0755) != 0) {
+        g_printerr("Cannot create local directory: %s\n", local);
+        folder_add_failure(tree, remote);
+        return;
+    }
+    g_mutex_lock(&tree->lock);
+    tree->dirs_created++;
+    g_mutex_unlock(&tree->lock);
+
+    entries = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+    if (!sftp_read_directory(channel, remote, DIR_LIST_BATCH_SIZE, folder_collect_batch,
+                             entries, &tree->cancelled)) {
+        folder_add_failure(tree, remote);
+        g_ptr_array_unref(entries);
+        return;
+    }
+
+    for (i = 0; i < entries->len && !tree->cancelled; i++) {
+        SFTPDirEntry *entry = g_ptr_array_index(entries, i);
+        LIBSSH2_SFTP_ATTRIBUTES attrs = entry->attrs;
+        gchar *child_remote = folder_remote_child(remote, entry->name);
+        gchar *child_local = g_build_filename(local, entry->name, NULL);
+        unsigned long type = attrs.permissions & LIBSSH2_SFTP_S_IFMT;
+
+        if (!(attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)) {
+            type = 0;
+        } else if (type == LIBSSH2_SFTP_S_IFLNK) {
+            if (libssh2_sftp_stat(channel->sftp_session, child_remote, &attrs) == 0 &&
+                LIBSSH2_SFTP_S_ISREG(attrs.permissions))
+                type = LIBSSH2_SFTP_S_IFREG;
+            else
+                g_print("Skipping symlink: %s\n", child_remote);
+        }
+
+        if (type == LIBSSH2_SFTP_S_IFDIR) {
+            folder_walk_remote(tree, channel, child_remote, child_local);
+        } else if (type == LIBSSH2_SFTP_S_IFREG) {
+            folder_add_file(tree, child_local, child_remote, (gsize)attrs.filesize);
+            continue;
+        }
+
+        g_free(child_local);
+        g_free(child_remote);
+    }
+
+    g_ptr_array_unref(entries);
+}
+
+/* Main loop: report the finished transfer */
+static gboolean folder_complete_idle(gpointer data)
+{
+    FolderTransfer *tree = (FolderTransfer *)data;
+    tree->callback(tree, tree->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void folder_file_job_func(SFTPSession *session, gpointer data, gboolean cancelled);
+
+/*
+ * Queue a job for each waiting file while fewer than max_jobs are out, and
+ * report completion once the walk is over and the last job has returned.
+ * Jobs are pushed outside the lock, since on a closing session they run
+ * right away.
+ */
+static void folder_dispatch(FolderTransfer *tree)
+{
+    GPtrArray *ready = g_ptr_array_new();
+    gboolean finished = FALSE;
+    guint i;
+
+    g_mutex_lock(&tree->lock);
+    while (!tree->cancelled && tree->jobs < tree->max_jobs &&
+           !g_queue_is_empty(&tree->pending)) {
+        FolderFile *file = g_queue_pop_head(&tree->pending);
+        g_ptr_array_add(tree->running, &file->op);
+        g_ptr_array_add(ready, file);
+        tree->jobs++;
+    }
+    if (!tree->walking && tree->jobs == 0 && !tree->finished)
+        finished = tree->finished = TRUE;
+    g_mutex_unlock(&tree->lock);
+
+    for (i = 0; i < ready->len; i++) {
+        FolderFile *file = g_ptr_array_index(ready, i);
+        sftp_session_push_job(tree->session, JOB_PRIORITY_NORMAL, folder_file_job_func,
+                              file, &file->op.cancelled);
+    }
+    g_ptr_array_free(ready, TRUE);
+
+    if (finished)
+        g_idle_add(folder_complete_idle, tree);
+}
+
+/*
+ * File job: copy one file, then give the pool thread back. A cancelled
+ * file can only come from folder_transfer_cancel or a closing session, and
+ * either way the rest of the tree stops too.
+ */
+static void folder_file_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    FolderFile *file = (FolderFile *)data;
+    FolderTransfer *tree = file->tree;
+    FileOperation *op = &file->op;
+    gboolean ok = FALSE;
+
+    if (!cancelled) {
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+
+        g_mutex_lock(&channel->lock);
+        ok = sftp_transfer_file(channel, op);
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+        if (tree->is_upload)
+            dir_cache_invalidate_parent(session->dir_cache, op->remote_path);
+    }
+
+    g_mutex_lock(&tree->lock);
+    g_ptr_array_remove_fast(tree->running, op);
+    tree->jobs--;
+    tree->bytes_done += file->size;
+    if (ok) {
+        tree->files_done++;
+    } else if (op->cancelled) {
+        tree->cancelled = TRUE;
+    } else {
+        tree->files_failed++;
+        g_ptr_array_add(tree->failures,
+                        g_strdup(tree->is_upload ? op->local_path : op->remote_path));
+    }
+    g_mutex_unlock(&tree->lock);
+
+    folder_file_free(file);
+    folder_dispatch(tree);
+}
+
+/* Walk job: find the files; each is queued as its own job as it is found */
+static void folder_walk_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    FolderTransfer *tree = (FolderTransfer *)data;
+
+    if (!cancelled) {
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+
+        g_mutex_lock(&channel->lock);
+        if (tree->is_upload)
+            folder_walk_local(tree, channel, tree->local_root, tree->remote_root);
+        else
+            folder_walk_remote(tree, channel, tree->remote_root, tree->local_root);
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+    }
+
+    g_mutex_lock(&tree->lock);
+    tree->walking = FALSE;
+    g_mutex_unlock(&tree->lock);
+
+    g_print("Found %u files (%lu bytes) in %u directories under %s\n", tree->files_total,
+            (unsigned long)tree->bytes_total, tree->dirs_created,
+            tree->is_upload ? tree->local_root : tree->remote_root);
+
+    folder_dispatch(tree);
+}
+
+/*
+ * Copy the directory local to remote (upload) or remote to local
+ * (download), creating directories as needed. Files are transferred while
+ * the tree is still being walked, up to max_channels - 1 at a time. Each
+ * file is a job of its own, so pool threads return to the queue between
+ * files and listings or other urgent work never wait for the whole tree.
+ * callback runs on the main loop when everything has finished; it owns
+ * the transfer and must free it.
+ */
+FolderTransfer *folder_transfer_start(SFTPSession *session, const gchar *local,
+                                      const gchar *remote, gboolean is_upload,
+                                      FolderTransferCallback callback, gpointer user_data)
+{
+    FolderTransfer *tree = g_new0(FolderTransfer, 1);
+
+    tree->session = session;
+    tree->is_upload = is_upload;
+    tree->local_root = g_strdup(local);
+    tree->remote_root = g_strdup(remote);
+    g_mutex_init(&tree->lock);
+    g_queue_init(&tree->pending);
+    tree->running = g_ptr_array_new();
+    tree->failures = g_ptr_array_new_with_free_func(g_free);
+    tree->started = g_get_monotonic_time();
+    tree->walking = TRUE;
+    tree->max_jobs = (guint)MAX(session->config->max_channels - 1, 1);
+    tree->callback = callback;
+    tree->user_data = user_data;
+
+    sftp_session_push_job(session, JOB_PRIORITY_NORMAL, folder_walk_job_func,
+                          tree, &tree->cancelled);
+
+    g_print("%s folder %s -> %s, %u files at a time\n", is_upload ? "Uploading" : "Downloading",
+            is_upload ? local : remote, is_upload ? remote : local, tree->max_jobs);
+    return tree;
+}
+
+/*
+ * Stop walking and transferring; the callback still runs
+ */
+void folder_transfer_cancel(FolderTransfer *tree)
+{
+    guint i;
+
+    g_mutex_lock(&tree->lock);
+    tree->cancelled = TRUE;
+    for (i = 0; i < tree->running->len; i++)
+        ((FileOperation *)g_ptr_array_index(tree->running, i))->cancelled = TRUE;
+    g_mutex_unlock(&tree->lock);
+}
+
+/*
+ * Snapshot of the transfer's progress, counting files in flight
+ */
+void folder_transfer_progress(FolderTransfer *tree, FolderProgress *progress)
+{
+    guint i;
+
+    g_mutex_lock(&tree->lock);
+    progress->files_total = tree->files_total;
+    progress->files_done = tree->files_done;
+    progress->files_failed = tree->files_failed;
+    progress->bytes_total = tree->bytes_total;
+    progress->bytes_done = tree->bytes_done;
+    for (i = 0; i < tree->running->len; i++) {
+        FileOperation *op = g_ptr_array_index(tree->running, i);
+        progress->bytes_done += (gsize)g_atomic_pointer_get(&op->transferred);
+    }
+    progress->walking = tree->walking;
+    g_mutex_unlock(&tree->lock);
+}
+
+gboolean folder_transfer_is_upload(FolderTransfer *tree)
+{
+    return tree->is_upload;
+}
+
+/*
+ * Did every file make it?
+ */
+gboolean folder_transfer_succeeded(FolderTransfer *tree)
+{
+    return !tree->cancelled && tree->files_failed == 0;
+}
+
+/*
+ * Human-readable account of a finished transfer
+ */
+gchar *folder_transfer_summary(FolderTransfer *tree)
+{
+    GString *text = g_string_new(NULL);
+    gdouble seconds = (g_get_monotonic_time() - tree->started) / (gdouble)G_USEC_PER_SEC;
+    guint i;
+
+    g_string_append_printf(text, "%s %u of %u files (%.1f MB) in %.1f s",
+                           tree->is_upload ? "Uploaded" : "Downloaded",
+                           tree->files_done, tree->files_total,
+                           tree->bytes_done / 1048576.0, seconds);
+    if (tree->cancelled)
+        g_string_append(text, "\nCancelled");
+
+    if (tree->files_failed > 0) {
+        g_string_append_printf(text, "\n\n%u failed:", tree->files_failed);
+        for (i = 0; i < MIN(tree->failures->len, FOLDER_SUMMARY_FAILURES); i++)
+            g_string_append_printf(text, "\n%s", (gchar *)g_ptr_array_index(tree->failures, i));
+        if (tree->failures->len > FOLDER_SUMMARY_FAILURES)
+            g_string_append_printf(text, "\n... and %u more",
+                                   tree->failures->len - FOLDER_SUMMARY_FAILURES);
+    }
+
+    return g_string_free(text, FALSE);
+}
+
+void folder_transfer_free(FolderTransfer *tree)
+{
+    if (!tree)
+        return;
+    g_queue_clear_full(&tree->pending, folder_file_free);
+    g_ptr_array_unref(tree->running);
+    g_ptr_array_unref(tree->failures);
+    g_mutex_clear(&tree->lock);
+    g_free(tree->local_root);
+    g_free(tree->remote_root);
+    g_free(tree);
+}
@@ -0,0 +1,419 @@
+/*
+ * Remote Poller Module
+ * Notice when files opened from the server are changed there by someone
+ * else, using only directory listings and stats
+ */
+
+#include "sftp-plugin.h"
+
+/* One opened file, as sent to and returned from the worker */
+typedef struct {
+    gchar *local;
+    gchar *remote;
+    guint generation;
+    gboolean found;
+    gint64 size;
+    gint64 mtime;
+} PollItem;
+
+/* One round of checks; outlives the poller if it stops meanwhile */
+typedef struct {
+    RemotePoller *poller;       /* NULL once the poller has stopped */
+    guint session_id;           /* Session the items were downloaded through */
+    GPtrArray *items;           /* PollItem */
+    gboolean skipped;           /* No channel was free; try again next tick */
+    gboolean cancelled;
+} PollRound;
+
+struct _RemotePoller {
+    SFTPPluginData *plugin_data;
+    guint timer_id;
+    gint elapsed;               /* Seconds since the last round */
+    PollRound *round;           /* In flight, or NULL */
+    GtkWidget *dialog;          /* Reload question being shown, or NULL */
+    GPtrArray *changed;         /* Local paths the dialog asks about */
+    guint changed_session;      /* Id of the session they were polled on */
+};
+
+static void poll_item_free(gpointer data)
+{
+    PollItem *item = (PollItem *)data;
+    g_free(item->local);
+    g_free(item->remote);
+    g_free(item);
+}
+
+static void poll_round_free(PollRound *round)
+{
+    g_ptr_array_unref(round->items);
+    g_free(round);
+}
+
+/* Batch of one directory listing: note the items it contains */
+static void poll_collect_batch(GPtrArray *batch, gpointer user_data)
+{
+    GHashTable *by_name = (GHashTable *)user_data;
+    guint i;
+
+    for (i = 0; i < batch->len; i++) {
+        SFTPDirEntry *entry = g_ptr_array_index(batch, i);
+        PollItem *item = g_hash_table_lookup(by_name, entry->name);
+
+        if (item && (entry->attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) &&
+            (entry->attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) &&
+            !LIBSSH2_SFTP_S_ISLNK(entry->attrs.permissions)) {
+            item->found = TRUE;
+            item->size = (gint64)entry->attrs.filesize;
+            item->mtime = (gint64)entry->attrs.mtime;
+            g_hash_table_remove(by_name, entry->name);
+        }
+    }
+    g_ptr_array_unref(batch);
+}
+
+static void poll_stat_item(SFTPSession *channel, PollItem *item)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    if (sftp_remote_stat(channel, item->remote, &attrs)) {
+        item->found = TRUE;
+        item->size = (gint64)attrs.filesize;
+        item->mtime = (gint64)attrs.mtime;
+    } else if (libssh2_sftp_last_error(channel->sftp_session) != LIBSSH2_FX_NO_SUCH_FILE) {
+        /* Unknown rather than gone: report it unchanged */
+        item->mtime = -1;
+    }
+}
+
+/*
+ * Check the items of one directory. Several opened files in one directory
+ * cost one listing (a few round trips for any number of them) instead of a
+ * round trip each; a lone file is stat'ed.
+ */
+static void poll_directory(SFTPSession *channel, GPtrArray *items, gboolean *cancelled)
+{
+    GHashTable *by_name;
+    GHashTableIter iter;
+    gpointer value;
+    gchar *dir;
+    guint i;
+
+    if (items->len == 1) {
+        poll_stat_item(channel, g_ptr_array_index(items, 0));
+        return;
+    }
+
+    by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < items->len; i++) {
+        PollItem *item = g_ptr_array_index(items, i);
+        g_hash_table_insert(by_name, g_path_get_basename(item->remote), item);
+    }
+
+    dir = g_path_get_dirname(((PollItem *)g_ptr_array_index(items, 0))->remote);
+    if (!sftp_read_directory(channel, dir, DIR_LIST_BATCH_SIZE, poll_collect_batch,
+                             by_name, cancelled)) {
+        for (i = 0; i < items->len; i++)
+            ((PollItem *)g_ptr_array_index(items, i))->mtime = -1;
+    } else {
+        /* Symlinks and entries without attributes: ask for the target */
+        g_hash_table_iter_init(&iter, by_name);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+            poll_stat_item(channel, (PollItem *)value);
+    }
+
+    g_free(dir);
+    g_hash_table_destroy(by_name);
+}
+
+static gboolean poll_round_idle(gpointer data);
+
+/* Worker: check every item, grouped by directory */
+static void poll_round_job(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    PollRound *round = (PollRound *)data;
+    SFTPSession *channel = NULL;
+
+    /* Never wait for or open a channel: a busy connection just skips a round */
+    if (!cancelled)
+        channel = sftp_session_lease_idle(session);
+
+    if (channel) {
+        GHashTable *by_dir = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify)g_ptr_array_unref);
+        GHashTableIter iter;
+        gpointer value;
+        guint i;
+
+        for (i = 0; i < round->items->len; i++) {
+            PollItem *item = g_ptr_array_index(round->items, i);
+            gchar *dir = g_path_get_dirname(item->remote);
+            GPtrArray *items = g_hash_table_lookup(by_dir, dir);
+
+            if (!items) {
+                items = g_ptr_array_new();
+                g_hash_table_insert(by_dir, dir, items);
+            } else {
+                g_free(dir);
+            }
+            g_ptr_array_add(items, item);
+        }
+
+        g_mutex_lock(&channel->lock);
+        g_hash_table_iter_init(&iter, by_dir);
+        while (!round->cancelled && g_hash_table_iter_next(&iter, NULL, &value))
+            poll_directory(channel, (GPtrArray *)value, &round->cancelled);
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+
+        g_hash_table_destroy(by_dir);
+    } else {
+        round->skipped = TRUE;
+    }
+
+    g_idle_add(poll_round_idle, round);
+}
+
+static void on_reload_complete(FileOperation *op, gboolean success, gpointer user_data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)user_data;
+    GeanyDocument *doc;
+
+    if (success) {
+        poller_forget_remote(plugin_data, op->local_path);
+        doc = document_find_by_filename(op->local_path);
+        if (doc)
+            document_reload_force(doc, NULL);
+        msgwin_status_add("SFTP: reloaded %s", op->remote_path);
+    } else {
+        msgwin_status_add("SFTP: could not reload %s", op->remote_path);
+    }
+    delta_signature_unref(op->signature);
+    g_free(op);
+}
+
+static void on_changed_response(GtkDialog *dialog, gint response_id, gpointer data)
+{
+    RemotePoller *poller = (RemotePoller *)data;
+    SFTPPluginData *plugin_data = poller->plugin_data;
+    SFTPSession *session;
+    guint i;
+
+    /* Reload through the session the files came from, never another
+     * connection that is current by the time the user answers */
+    session = ui_find_session(plugin_data, poller->changed_session);
+    if (session && !session->active)
+        session = NULL;
+    if (response_id == GTK_RESPONSE_YES && !session)
+        msgwin_status_add("SFTP: not reloading, the connection was closed");
+
+    for (i = 0; response_id == GTK_RESPONSE_YES && session && i < poller->changed->len; i++) {
+        const gchar *local = g_ptr_array_index(poller->changed, i);
+        DownloadedFile *file = g_hash_table_lookup(plugin_data->downloaded_files, local);
+        GeanyDocument *doc = document_find_by_filename(local);
+
+        /* Never throw away unsaved edits */
+        if (!file || (doc && doc->changed)) {
+            if (file)
+                msgwin_status_add("SFTP: not reloading %s, it has unsaved changes",
+                                  file->remote_path);
+            continue;
+        }
+        transfer_async(session, local, file->remote_path, FALSE, JOB_PRIORITY_HIGH,
+                       file->signature, on_reload_complete, plugin_data);
+    }
+
+    g_ptr_array_set_size(poller->changed, 0);
+    poller->dialog = NULL;
+    gtk_widget_destroy(GTK_WIDGET(dialog));
+}
+
+/*
+ * Ask once about all files that changed in one round
+ */
+static void poller_show_changed(RemotePoller *poller)
+{
+    GString *text = g_string_new(NULL);
+    guint i;
+
+    for (i = 0; i < poller->changed->len && i < 20; i++) {
+        DownloadedFile *file = g_hash_table_lookup(poller->plugin_data->downloaded_files,
+                                                   g_ptr_array_index(poller->changed, i));
+        g_string_append_printf(text, "%s\n", file->remote_path);
+        msgwin_status_add("SFTP: %s changed on the server", file->remote_path);
+    }
+    if (poller->changed->len > 20)
+        g_string_append_printf(text, "... and %u more\n", poller->changed->len - 20);
+    g_string_append(text, "\nReload from the server? Files with unsaved changes are left as they are.");
+
+    poller->dialog = gtk_message_dialog_new(
+        GTK_WINDOW(poller->plugin_data->geany_data->main_widgets->window),
+        GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+        "%s", poller->changed->len == 1 ? "A file you have open changed on the server"
+                                        : "Files you have open changed on the server");
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(poller->dialog), "%s", text->str);
+    g_signal_connect(poller->dialog, "response", G_CALLBACK(on_changed_response), poller);
+    gtk_widget_show(poller->dialog);
+    g_string_free(text, TRUE);
+}
+
+/* Main loop: compare a round's results with what was last seen */
+static gboolean poll_round_idle(gpointer data)
+{
+    PollRound *round = (PollRound *)data;
+    RemotePoller *poller = round->poller;
+    SFTPPluginData *plugin_data;
+    guint i;
+
+    if (!poller) {
+        poll_round_free(round);
+        return G_SOURCE_REMOVE;
+    }
+    plugin_data = poller->plugin_data;
+    poller->round = NULL;
+
+    for (i = 0; !round->skipped && !round->cancelled && i < round->items->len; i++) {
+        PollItem *item = g_ptr_array_index(round->items, i);
+        DownloadedFile *file = g_hash_table_lookup(plugin_data->downloaded_files, item->local);
+
+        /* Closed, re-downloaded or uploaded by us since the round started */
+        if (!file || file->generation != item->generation || item->mtime < 0 ||
+            g_hash_table_contains(plugin_data->pending_uploads, file->remote_path))
+            continue;
+
+        if (!item->found) {
+            if (file->remote_known)
+                msgwin_status_add("SFTP: %s was removed from the server", file->remote_path);
+            file->remote_known = FALSE;
+            continue;
+        }
+
+        if (file->remote_known &&
+            (file->remote_size != item->size || file->remote_mtime != item->mtime))
+            g_ptr_array_add(poller->changed, g_strdup(item->local));
+
+        file->remote_known = TRUE;
+        file->remote_size = item->size;
+        file->remote_mtime = item->mtime;
+    }
+
+    if (poller->changed->len > 0 && !poller->dialog) {
+        poller->changed_session = round->session_id;
+        poller_show_changed(poller);
+    }
+
+    poll_round_free(round);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Start a round over the opened files that came from the current session.
+ * Skipped while the reload question is open, so nothing is asked twice.
+ */
+static void poller_start_round(RemotePoller *poller)
+{
+    SFTPPluginData *plugin_data = poller->plugin_data;
+    SFTPSession *session;
+    GHashTableIter iter;
+    gpointer key, value;
+    PollRound *round;
+    gsize prefix_len;
+
+    if (poller->round || poller->dialog ||
+        plugin_data->current_connection < 0 ||
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active)
+        return;
+    session = plugin_data->sessions[plugin_data->current_connection];
+    prefix_len = strlen(session->temp_dir);
+
+    round = g_new0(PollRound, 1);
+    round->poller = poller;
+    round->session_id = session->id;
+    round->items = g_ptr_array_new_with_free_func(poll_item_free);
+
+    g_hash_table_iter_init(&iter, plugin_data->downloaded_files);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        DownloadedFile *file = (DownloadedFile *)value;
+        PollItem *item;
+
+        /* Files of other connections live in their own temp directories */
+        if (strncmp((const gchar *)key, session->temp_dir, prefix_len) != 0 ||
+            ((const gchar *)key)[prefix_len] != G_DIR_SEPARATOR)
+            continue;
+
+        item = g_new0(PollItem, 1);
+        item->local = g_strdup((const gchar *)key);
+        item->remote = g_strdup(file->remote_path);
+        item->generation = file->generation;
+        g_ptr_array_add(round->items, item);
+    }
+
+    if (round->items->len == 0) {
+        poll_round_free(round);
+        return;
+    }
+
+    poller->round = round;
+    sftp_session_push_job(session, JOB_PRIORITY_BACKGROUND, poll_round_job, round,
+                          &round->cancelled);
+}
+
+/* Once a second: start a round when the interval has passed */
+static gboolean poller_tick(gpointer data)
+{
+    RemotePoller *poller = (RemotePoller *)data;
+    gint interval = poller->plugin_data->remote_poll_interval;
+
+    if (interval <= 0 || ++poller->elapsed < interval)
+        return G_SOURCE_CONTINUE;
+
+    poller->elapsed = 0;
+    poller_start_round(poller);
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Forget what the remote copy of an opened file looked like, after our
+ * own transfer changed it. The next round takes the new state as is.
+ */
+void poller_forget_remote(SFTPPluginData *plugin_data, const gchar *local)
+{
+    DownloadedFile *file = g_hash_table_lookup(plugin_data->downloaded_files, local);
+
+    if (!file)
+        return;
+    file->remote_known = FALSE;
+    file->generation++;
+}
+
+void poller_init(SFTPPluginData *plugin_data)
+{
+    RemotePoller *poller = g_new0(RemotePoller, 1);
+
+    poller->plugin_data = plugin_data;
+    poller->changed = g_ptr_array_new_with_free_func(g_free);
+    poller->timer_id = g_timeout_add_seconds(1, poller_tick, poller);
+    plugin_data->remote_poller = poller;
+}
+
+/*
+ * Stop polling. A round in flight detaches and is freed when it returns.
+ */
+void poller_shutdown(SFTPPluginData *plugin_data)
+{
+    RemotePoller *poller = plugin_data->remote_poller;
+
+    if (!poller)
+        return;
+
+    g_source_remove(poller->timer_id);
+    if (poller->round) {
+        poller->round->poller = NULL;
+        poller->round->cancelled = TRUE;
+    }
+    if (poller->dialog)
+        gtk_widget_destroy(poller->dialog);
+    g_ptr_array_unref(poller->changed);
+    g_free(poller);
+    plugin_data->remote_poller = NULL;
+}
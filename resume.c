@@ -0,0 +1,147 @@
+/*
+ * Resume Module
+ * Checkpoints of interrupted transfers, so they can continue where they stopped
+ */
+
+#include "sftp-core.h"
+
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#define RESUME_DIR "geany-sftp/partial"
+
+/*
+ * Checkpoint file for one direction between a local and a remote path
+ */
+static gchar *checkpoint_file(SFTPSession *session, gboolean is_upload,
+                              const gchar *local, const gchar *remote)
+{
+    gchar *id;
+    gchar *hash;
+    gchar *name;
+    gchar *file;
+
+    id = g_strdup_printf("%s\n%s@%s:%d\n%s\n%s", is_upload ? "up" : "down",
+                         session->config->username, session->config->hostname,
+                         session->config->port, remote, local);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+    name = g_strconcat(hash, ".json", NULL);
+    file = g_build_filename(g_get_user_cache_dir(), RESUME_DIR, name, NULL);
+
+    g_free(name);
+    g_free(hash);
+    g_free(id);
+    return file;
+}
+
+/*
+ * Offset an interrupted transfer may continue from, or 0. The checkpoint
+ * only counts if the source still has the size and mtime it had when the
+ * transfer stopped.
+ */
+gsize resume_checkpoint_load(SFTPSession *session, gboolean is_upload,
+                             const gchar *local, const gchar *remote,
+                             gint64 source_size, gint64 source_mtime)
+{
+    JsonParser *parser;
+    JsonObject *obj;
+    gchar *file;
+    gsize offset = 0;
+
+    file = checkpoint_file(session, is_upload, local, remote);
+    if (!g_file_test(file, G_FILE_TEST_EXISTS)) {
+        g_free(file);
+        return 0;
+    }
+
+    parser = json_parser_new();
+    if (json_parser_load_from_file(parser, file, NULL) &&
+        JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        obj = json_node_get_object(json_parser_get_root(parser));
+        if (g_strcmp0(json_object_get_string_member(obj, "local"), local) == 0 &&
+            g_strcmp0(json_object_get_string_member(obj, "remote"), remote) == 0 &&
+            json_object_get_int_member(obj, "source_size") == source_size &&
+            json_object_get_int_member(obj, "source_mtime") == source_mtime) {
+            offset = (gsize)json_object_get_int_member(obj, "offset");
+        }
+    }
+    g_object_unref(parser);
+
+    /* Stale or unreadable: the partial target can't be trusted */
+    if (offset == 0 || (gint64)offset >= source_size) {
+        g_unlink(file);
+        offset = 0;
+    }
+    g_free(file);
+    return offset;
+}
+
+/*
+ * Record that the first offset bytes of the target are in place
+ */
+void resume_checkpoint_save(SFTPSession *session, gboolean is_upload,
+                            const gchar *local, const gchar *remote,
+                            gint64 source_size, gint64 source_mtime, gsize offset)
+{
+    JsonObject *obj;
+    JsonNode *root;
+    JsonGenerator *gen;
+    GError *error = NULL;
+    gchar *file;
+    gchar *dir;
+
+    if (offset == 0)
+        return;
+
+    file = checkpoint_file(session, is_upload, local, remote);
+    dir = g_path_get_dirname(file);
+    g_mkdir_with_parents(dir, 0700);
+
+    obj = json_object_new();
+    json_object_set_string_member(obj, "local", local);
+    json_object_set_string_member(obj, "remote", remote);
+    json_object_set_int_member(obj, "offset", (gint64)offset);
+    json_object_set_int_member(obj, "source_size", source_size);
+    json_object_set_int_member(obj, "source_mtime", source_mtime);
+
+    root = json_node_new(JSON_NODE_OBJECT);
+    json_node_take_object(root, obj);
+    gen = json_generator_new();
+    json_generator_set_root(gen, root);
+
+    if (!json_generator_to_file(gen, file, &error)) {
+        g_printerr("Failed to save resume checkpoint: %s\n", error->message);
+        g_error_free(error);
+    } else {
+        g_print("Saved resume point at %lu bytes: %s\n", (unsigned long)offset,
+                is_upload ? local : remote);
+    }
+
+    g_object_unref(gen);
+    json_node_free(root);
+    g_free(dir);
+    g_free(file);
+}
+
+/*
+ * Forget the checkpoint of a finished transfer
+ */
+void resume_checkpoint_clear(SFTPSession *session, gboolean is_upload,
+                             const gchar *local, const gchar *remote)
+{
+    gchar *file = checkpoint_file(session, is_upload, local, remote);
+    g_unlink(file);
+    g_free(file);
+}
+
+/*
+ * Is there a checkpoint for this transfer (without validating it)?
+ */
+gboolean resume_checkpoint_exists(SFTPSession *session, gboolean is_upload,
+                                  const gchar *local, const gchar *remote)
+{
+    gchar *file = checkpoint_file(session, is_upload, local, remote);
+    gboolean exists = g_file_test(file, G_FILE_TEST_EXISTS);
+    g_free(file);
+    return exists;
+}
@@ -0,0 +1,182 @@
+/*
+ * Upload Scheduler Module
+ * Debounce and coalesce auto-uploads, one pending upload per remote path
+ */
+
+#include "sftp-plugin.h"
+
+/* Upload state of one remote path */
+typedef struct {
+    SFTPPluginData *plugin_data;
+    gchar *remote_path;
+    gchar *local_path;        /* Latest saved content wins */
+    guint session_id;         /* Session the file was downloaded through */
+    guint timer_id;           /* Debounce timer, 0 when not waiting */
+    FileOperation *running;   /* Upload in flight, or NULL */
+    gboolean again;           /* Timer fired while a superseded upload unwound */
+} PendingUpload;
+
+static gboolean pending_upload_fire(gpointer data);
+
+static void pending_upload_free(gpointer data)
+{
+    PendingUpload *pending = (PendingUpload *)data;
+
+    if (pending->timer_id)
+        g_source_remove(pending->timer_id);
+    /* The queue frees an op that has no callback */
+    if (pending->running)
+        pending->running->callback = NULL;
+    g_free(pending->remote_path);
+    g_free(pending->local_path);
+    g_free(pending);
+}
+
+/*
+ * (Re)start the debounce timer
+ */
+static void pending_upload_arm(PendingUpload *pending)
+{
+    if (pending->timer_id)
+        g_source_remove(pending->timer_id);
+    pending->timer_id = g_timeout_add(MAX(pending->plugin_data->upload_debounce_ms, 0),
+                                      pending_upload_fire, pending);
+}
+
+static void on_scheduled_upload_complete(FileOperation *op, gboolean success, gpointer user_data)
+{
+    PendingUpload *pending = (PendingUpload *)user_data;
+    SFTPPluginData *plugin_data = pending->plugin_data;
+
+    if (op->cancelled)
+        g_print("Auto-upload superseded: %s\n", pending->remote_path);
+    else if (success)
+        g_print("Auto-upload done: %s\n", pending->remote_path);
+    else
+        g_printerr("Auto-upload failed: %s\n", pending->remote_path);
+
+    /* Our own upload changed the remote file; don't report it as foreign */
+    poller_forget_remote(plugin_data, op->local_path);
+
+    pending->running = NULL;
+    delta_signature_unref(op->signature);
+    g_free(op);
+
+    if (pending->again) {
+        pending->again = FALSE;
+        pending_upload_fire(pending);
+    } else if (!pending->timer_id) {
+        g_hash_table_remove(plugin_data->pending_uploads, pending->remote_path);
+    }
+}
+
+/* Debounce window elapsed: start the upload */
+static gboolean pending_upload_fire(gpointer data)
+{
+    PendingUpload *pending = (PendingUpload *)data;
+    SFTPPluginData *plugin_data = pending->plugin_data;
+    DownloadedFile *file;
+    SFTPSession *session;
+
+    pending->timer_id = 0;
+
+    /* A superseded upload is still unwinding; go once it has */
+    if (pending->running) {
+        pending->again = TRUE;
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Only the session the file came from, even if another one is current now */
+    session = ui_find_session(plugin_data, pending->session_id);
+    if (!session || !session->active) {
+        g_printerr("Auto-upload dropped, not connected: %s\n", pending->remote_path);
+        g_hash_table_remove(plugin_data->pending_uploads, pending->remote_path);
+        return G_SOURCE_REMOVE;
+    }
+
+    file = g_hash_table_lookup(plugin_data->downloaded_files, pending->local_path);
+
+    pending->running = transfer_async(session, pending->local_path, pending->remote_path, TRUE,
+                                      JOB_PRIORITY_BACKGROUND, file ? file->signature : NULL,
+                                      on_scheduled_upload_complete, pending);
+    g_print("Auto-upload queued: %s -> %s (queue depth %u)\n", pending->local_path,
+            pending->remote_path, sftp_session_queue_depth(session));
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Id of the session whose temp directory holds local, or 0
+ */
+static guint scheduler_owner(SFTPPluginData *plugin_data, const gchar *local)
+{
+    gint i;
+
+    for (i = 0; i < plugin_data->num_connections; i++) {
+        SFTPSession *session = plugin_data->sessions[i];
+        gsize prefix_len;
+
+        if (!session || !session->temp_dir[0])
+            continue;
+        prefix_len = strlen(session->temp_dir);
+        if (strncmp(local, session->temp_dir, prefix_len) == 0 &&
+            local[prefix_len] == G_DIR_SEPARATOR)
+            return session->id;
+    }
+    return 0;
+}
+
+/*
+ * Schedule an upload of local to remote, through the session local was
+ * downloaded with. Uploads to the same remote path within
+ * upload_debounce_ms of each other collapse into one, and a save while an
+ * upload to that path is running cancels it in favour of the new content.
+ */
+void scheduler_queue_upload(SFTPPluginData *plugin_data, const gchar *local,
+                            const gchar *remote)
+{
+    PendingUpload *pending = g_hash_table_lookup(plugin_data->pending_uploads, remote);
+    guint owner = scheduler_owner(plugin_data, local);
+
+    /* The owner is fixed at save time: the timer may fire after a switch */
+    if (!owner) {
+        g_printerr("Auto-upload dropped, not connected: %s\n", remote);
+        return;
+    }
+
+    if (!pending) {
+        pending = g_new0(PendingUpload, 1);
+        pending->plugin_data = plugin_data;
+        pending->remote_path = g_strdup(remote);
+        g_hash_table_insert(plugin_data->pending_uploads, pending->remote_path, pending);
+    } else {
+        g_print("Auto-upload coalesced: %s\n", remote);
+    }
+
+    g_free(pending->local_path);
+    pending->local_path = g_strdup(local);
+    pending->session_id = owner;
+
+    if (pending->running)
+        transfer_cancel(pending->running);
+
+    pending_upload_arm(pending);
+}
+
+/*
+ * Set up the table of pending uploads
+ */
+void scheduler_init(SFTPPluginData *plugin_data)
+{
+    plugin_data->pending_uploads = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                         NULL, pending_upload_free);
+}
+
+/*
+ * Drop pending uploads; uploads already running finish on their own
+ */
+void scheduler_shutdown(SFTPPluginData *plugin_data)
+{
+    if (plugin_data->pending_uploads)
+        g_hash_table_destroy(plugin_data->pending_uploads);
+    plugin_data->pending_uploads = NULL;
+}
@@ -0,0 +1,550 @@
+/*
+ * Transfer Benchmark
+ * Headless harness around the core library: uploads and downloads
+ * generated files through the same job queue the plugin uses and reports
+ * throughput, per-file latency and CPU time. Meant for a local sshd on
+ * loopback, optionally behind a netem delay.
+ */
+
+#include "sftp-core.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+/* Command line */
+static gchar *opt_host = NULL;
+static gint opt_port = DEFAULT_PORT;
+static gchar *opt_user = NULL;
+static gchar *opt_key = NULL;
+static gchar *opt_remote_dir = NULL;
+static gchar *opt_sizes = NULL;
+static gint opt_count = 20;
+static gint opt_jobs = 1;
+static gchar *opt_direction = NULL;
+static gchar *opt_netem = NULL;
+static gchar *opt_netem_dev = NULL;
+static gint opt_streams = 0;
+static gint opt_read_window = 0;
+static gint opt_write_window = 0;
+static gint opt_channels = 0;
+static gchar *opt_json = NULL;
+static gboolean opt_event = FALSE;
+static gboolean opt_verbose = FALSE;
+
+static GOptionEntry bench_options[] = {
+    {"host", 'H', 0, G_OPTION_ARG_STRING, &opt_host, "Server (default 127.0.0.1)", "HOST"},
+    {"port", 'p', 0, G_OPTION_ARG_INT, &opt_port, "SSH port (default 22)", "PORT"},
+    {"user", 'u', 0, G_OPTION_ARG_STRING, &opt_user, "User (default: current user)", "USER"},
+    {"key", 'i', 0, G_OPTION_ARG_FILENAME, &opt_key,
+     "Private key (default ~/.ssh/id_ed25519 or id_rsa); "
+     "SFTP_BENCH_PASSWORD is used for password login", "FILE"},
+    {"remote-dir", 'd', 0, G_OPTION_ARG_STRING, &opt_remote_dir,
+     "Remote scratch directory (default /tmp)", "DIR"},
+    {"sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes,
+     "Comma-separated file sizes, K/M/G suffixes (default 64K,1M,16M)", "LIST"},
+    {"count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Files per size (default 20)", "N"},
+    {"jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Transfers kept in flight (default 1)", "N"},
+    {"direction", 0, 0, G_OPTION_ARG_STRING, &opt_direction,
+     "up, down or both (default both); downloads need the upload pass first", "DIR"},
+    {"netem", 0, 0, G_OPTION_ARG_STRING, &opt_netem,
+     "Run under a tc netem qdisc, e.g. \"delay 20ms\" (needs root)", "ARGS"},
+    {"netem-dev", 0, 0, G_OPTION_ARG_STRING, &opt_netem_dev,
+     "Interface for --netem (default lo)", "DEV"},
+    {"streams", 0, 0, G_OPTION_ARG_INT, &opt_streams, "Parallel streams per large file", "N"},
+    {"read-window", 0, 0, G_OPTION_ARG_INT, &opt_read_window, "READ requests in flight", "N"},
+    {"write-window", 0, 0, G_OPTION_ARG_INT, &opt_write_window, "WRITE requests in flight", "N"},
+    {"channels", 0, 0, G_OPTION_ARG_INT, &opt_channels, "SFTP channels per host", "N"},
+    {"json", 0, 0, G_OPTION_ARG_FILENAME, &opt_json,
+     "Write the session's per-transfer timing to FILE as JSON", "FILE"},
+    {"event", 0, 0, G_OPTION_ARG_NONE, &opt_event,
+     "Run transfers on one non-blocking connection driven by the main loop", NULL},
+    {"verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Keep the engine's log output", NULL},
+    {NULL, 0, 0, 0, NULL, NULL, NULL}
+};
+
+/* One direction for one file size */
+typedef struct {
+    SFTPSession *session;
+    SFTPEventSession *event;    /* Set with --event */
+    GMainLoop *loop;
+    gboolean is_upload;
+    gsize size;
+    const gchar *source;        /* Local file every upload sends */
+    const gchar *local_dir;     /* Downloads land here */
+    gint next;
+    gint running;
+    gint done;
+    gint failed;
+    GArray *latencies;          /* Milliseconds per file, gdouble */
+} BenchPhase;
+
+typedef struct {
+    BenchPhase *phase;
+    gint64 start;
+} BenchItem;
+
+static void bench_start_next(BenchPhase *phase);
+
+static void bench_print_quiet(const gchar *string)
+{
+    (void)string;
+}
+
+/*
+ * Parse "64K", "1M", "2G" or a plain byte count
+ */
+static gboolean bench_parse_size(const gchar *text, gsize *size)
+{
+    gchar *end;
+    guint64 value = g_ascii_strtoull(text, &end, 10);
+
+    if (end == text)
+        return FALSE;
+    switch (g_ascii_toupper(*end)) {
+    case 'K': value <<= 10; end++; break;
+    case 'M': value <<= 20; end++; break;
+    case 'G': value <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || value == 0)
+        return FALSE;
+    *size = (gsize)value;
+    return TRUE;
+}
+
+static gchar *bench_remote_path(gsize size, gint index)
+{
+    return g_strdup_printf("%s/sftp-bench-%d-%lu-%d.bin", opt_remote_dir, (int)getpid(),
+                           (unsigned long)size, index);
+}
+
+/*
+ * Write size bytes of incompressible data
+ */
+static gboolean bench_make_source(const gchar *path, gsize size)
+{
+    FILE *file = fopen(path, "wb");
+    guint32 buf[16384];
+    gsize left = size;
+    gsize i;
+
+    if (!file)
+        return FALSE;
+    while (left > 0) {
+        gsize n = MIN(left, sizeof(buf));
+        for (i = 0; i < G_N_ELEMENTS(buf); i++)
+            buf[i] = g_random_int();
+        if (fwrite(buf, 1, n, file) != n) {
+            fclose(file);
+            return FALSE;
+        }
+        left -= n;
+    }
+    return fclose(file) == 0;
+}
+
+/*
+ * Add or remove the netem qdisc. Returns FALSE if tc fails.
+ */
+static gboolean bench_netem(gboolean add)
+{
+    GPtrArray *argv = g_ptr_array_new_with_free_func(g_free);
+    gchar **extra = NULL;
+    gchar *err = NULL;
+    GError *error = NULL;
+    gint status = 0;
+    gboolean ok;
+    gint i;
+
+    g_ptr_array_add(argv, g_strdup("tc"));
+    g_ptr_array_add(argv, g_strdup("qdisc"));
+    g_ptr_array_add(argv, g_strdup(add ? "add" : "del"));
+    g_ptr_array_add(argv, g_strdup("dev"));
+    g_ptr_array_add(argv, g_strdup(opt_netem_dev));
+    g_ptr_array_add(argv, g_strdup("root"));
+    if (add) {
+        g_ptr_array_add(argv, g_strdup("netem"));
+        if (!g_shell_parse_argv(opt_netem, NULL, &extra, &error)) {
+            g_printerr("Bad --netem arguments: %s\n", error->message);
+            g_error_free(error);
+            g_ptr_array_free(argv, TRUE);
+            return FALSE;
+        }
+        for (i = 0; extra[i]; i++)
+            g_ptr_array_add(argv, g_strdup(extra[i]));
+        g_strfreev(extra);
+    }
+    g_ptr_array_add(argv, NULL);
+
+    ok = g_spawn_sync(NULL, (gchar **)argv->pdata, NULL, G_SPAWN_SEARCH_PATH |
+                      G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL, NULL, &err, &status, &error) &&
+         g_spawn_check_exit_status(status, NULL);
+    if (!ok)
+        g_printerr("tc qdisc %s failed: %s\n", add ? "add" : "del",
+                   error ? error->message : (err ? g_strstrip(err) : ""));
+    if (error)
+        g_error_free(error);
+    g_free(err);
+    g_ptr_array_free(argv, TRUE);
+    return ok;
+}
+
+static void bench_transfer_done(FileOperation *op, gboolean success, gpointer user_data)
+{
+    BenchItem *item = (BenchItem *)user_data;
+    BenchPhase *phase = item->phase;
+    gdouble ms = (g_get_monotonic_time() - item->start) / 1000.0;
+
+    if (success) {
+        g_array_append_val(phase->latencies, ms);
+    } else {
+        phase->failed++;
+        g_printerr("Transfer failed: %s\n", op->is_upload ? op->local_path : op->remote_path);
+    }
+
+    /* Downloads are only timed, not kept */
+    if (!op->is_upload)
+        g_unlink(op->local_path);
+
+    phase->running--;
+    phase->done++;
+    g_free(item);
+    g_free(op);
+
+    bench_start_next(phase);
+}
+
+static void bench_start_next(BenchPhase *phase)
+{
+    while (phase->running < opt_jobs && phase->next < opt_count) {
+        BenchItem *item = g_new0(BenchItem, 1);
+        gchar *remote = bench_remote_path(phase->size, phase->next);
+        gchar *local;
+
+        if (phase->is_upload) {
+            local = g_strdup(phase->source);
+        } else {
+            gchar *name = g_path_get_basename(remote);
+            local = g_build_filename(phase->local_dir, name, NULL);
+            g_free(name);
+        }
+
+        item->phase = phase;
+        item->start = g_get_monotonic_time();
+        phase->running++;
+        phase->next++;
+        if (phase->event)
+            sftp_event_transfer(phase->event, local, remote, phase->is_upload,
+                                bench_transfer_done, item);
+        else
+            transfer_async(phase->session, local, remote, phase->is_upload,
+                           JOB_PRIORITY_NORMAL, NULL, bench_transfer_done, item);
+        g_free(local);
+        g_free(remote);
+    }
+
+    if (phase->done == opt_count)
+        g_main_loop_quit(phase->loop);
+}
+
+static gint bench_compare_double(gconstpointer a, gconstpointer b)
+{
+    gdouble da = *(const gdouble *)a;
+    gdouble db = *(const gdouble *)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static gdouble bench_percentile(GArray *sorted, gdouble p)
+{
+    guint rank;
+
+    if (sorted->len == 0)
+        return 0;
+    rank = (guint)(p / 100.0 * sorted->len + 0.999999);
+    rank = CLAMP(rank, 1, sorted->len);
+    return g_array_index(sorted, gdouble, rank - 1);
+}
+
+static gdouble bench_cpu_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Run count transfers of one size in one direction and print a line
+ * of results
+ */
+static gboolean bench_run_phase(SFTPSession *session, SFTPEventSession *event,
+                                gboolean is_upload, gsize size,
+                                const gchar *source, const gchar *local_dir)
+{
+    BenchPhase phase = {0};
+    struct rusage before, after;
+    gdouble wall, user, sys, mb;
+    gint64 start;
+
+    phase.session = session;
+    phase.event = event;
+    phase.loop = g_main_loop_new(NULL, FALSE);
+    phase.is_upload = is_upload;
+    phase.size = size;
+    phase.source = source;
+    phase.local_dir = local_dir;
+    phase.latencies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+
+    getrusage(RUSAGE_SELF, &before);
+    start = g_get_monotonic_time();
+    bench_start_next(&phase);
+    g_main_loop_run(phase.loop);
+    wall = (g_get_monotonic_time() - start) / 1e6;
+    getrusage(RUSAGE_SELF, &after);
+
+    user = bench_cpu_seconds(&after.ru_utime) - bench_cpu_seconds(&before.ru_utime);
+    sys = bench_cpu_seconds(&after.ru_stime) - bench_cpu_seconds(&before.ru_stime);
+    mb = (gdouble)size * phase.latencies->len / (1024.0 * 1024.0);
+    g_array_sort(phase.latencies, bench_compare_double);
+
+    printf("%-8s %9lu x %-4d %9.2f MB/s  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms"
+           "  cpu %6.2f s (user %.2f, sys %.2f, %3.0f%%)  failed %d\n",
+           is_upload ? "upload" : "download", (unsigned long)size, opt_count,
+           wall > 0 ? mb / wall : 0,
+           bench_percentile(phase.latencies, 50), bench_percentile(phase.latencies, 90),
+           bench_percentile(phase.latencies, 99), bench_percentile(phase.latencies, 100),
+           user + sys, user, sys, wall > 0 ? 100.0 * (user + sys) / wall : 0, phase.failed);
+    fflush(stdout);
+
+    g_array_free(phase.latencies, TRUE);
+    g_main_loop_unref(phase.loop);
+    return phase.failed == 0;
+}
+
+/*
+ * Delete the remote files of one size
+ */
+static void bench_remove_remote(SFTPSession *session, gsize size)
+{
+    SFTPSession *channel = sftp_session_lease(session, TRUE);
+    gint i;
+
+    g_mutex_lock(&channel->lock);
+    for (i = 0; i < opt_count; i++) {
+        gchar *remote = bench_remote_path(size, i);
+        libssh2_sftp_unlink(channel->sftp_session, remote);
+        g_free(remote);
+    }
+    g_mutex_unlock(&channel->lock);
+    sftp_session_release(channel);
+}
+
+/*
+ * Dump the session's transfer statistics (queue, lock, first byte, disk
+ * time per transfer) for a closer look than the summary lines
+ */
+static gboolean bench_write_json(SFTPSession *session, const gchar *file)
+{
+    JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+    JsonGenerator *gen = json_generator_new();
+    GError *error = NULL;
+    gboolean ok;
+
+    json_node_take_object(root, stats_to_json(session->stats));
+    json_generator_set_root(gen, root);
+    json_generator_set_pretty(gen, TRUE);
+    ok = json_generator_to_file(gen, file, &error);
+    if (!ok) {
+        g_printerr("Cannot write %s: %s\n", file, error->message);
+        g_error_free(error);
+    }
+
+    g_object_unref(gen);
+    json_node_free(root);
+    return ok;
+}
+
+static void bench_default_key(SFTPConnection *conn)
+{
+    const gchar *names[] = {"id_ed25519", "id_ecdsa", "id_rsa"};
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(names); i++) {
+        gchar *path = g_build_filename(g_get_home_dir(), ".ssh", names[i], NULL);
+        gboolean found = g_file_test(path, G_FILE_TEST_EXISTS);
+        if (found)
+            g_strlcpy(conn->private_key, path, sizeof(conn->private_key));
+        g_free(path);
+        if (found)
+            return;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    SFTPConnection conn;
+    SFTPSession *session = NULL;
+    SFTPEventSession *event = NULL;
+    GArray *sizes;
+    gchar **size_list;
+    gchar *work_dir = NULL;
+    gboolean down;
+    gboolean netem = FALSE;
+    gboolean ok = TRUE;
+    guint i;
+
+    context = g_option_context_new("- SFTP transfer benchmark");
+    g_option_context_set_summary(context,
+        "Uploads and downloads generated files through the plugin's transfer engine.");
+    g_option_context_add_main_entries(context, bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 2;
+    }
+    g_option_context_free(context);
+
+    if (!opt_host)
+        opt_host = g_strdup("127.0.0.1");
+    if (!opt_user)
+        opt_user = g_strdup(g_get_user_name());
+    if (!opt_remote_dir)
+        opt_remote_dir = g_strdup("/tmp");
+    if (!opt_sizes)
+        opt_sizes = g_strdup("64K,1M,16M");
+    if (!opt_direction)
+        opt_direction = g_strdup("both");
+    if (!opt_netem_dev)
+        opt_netem_dev = g_strdup("lo");
+    opt_count = MAX(opt_count, 1);
+    opt_jobs = MAX(opt_jobs, 1);
+
+    down = strcmp(opt_direction, "down") == 0 || strcmp(opt_direction, "both") == 0;
+    if (!down && strcmp(opt_direction, "up") != 0) {
+        g_printerr("--direction must be up, down or both\n");
+        return 2;
+    }
+
+    sizes = g_array_new(FALSE, FALSE, sizeof(gsize));
+    size_list = g_strsplit(opt_sizes, ",", -1);
+    for (i = 0; size_list[i]; i++) {
+        gsize size;
+        if (!bench_parse_size(g_strstrip(size_list[i]), &size)) {
+            g_printerr("Bad size: %s\n", size_list[i]);
+            return 2;
+        }
+        g_array_append_val(sizes, size);
+    }
+    g_strfreev(size_list);
+
+    if (!opt_verbose)
+        g_set_print_handler(bench_print_quiet);
+
+    if (libssh2_init(0) != 0) {
+        g_printerr("libssh2 initialization failed\n");
+        return 1;
+    }
+
+    sftp_connection_defaults(&conn);
+    g_strlcpy(conn.name, "bench", sizeof(conn.name));
+    g_strlcpy(conn.hostname, opt_host, sizeof(conn.hostname));
+    g_strlcpy(conn.username, opt_user, sizeof(conn.username));
+    conn.port = opt_port;
+    if (opt_key)
+        g_strlcpy(conn.private_key, opt_key, sizeof(conn.private_key));
+    else if (!g_getenv("SFTP_BENCH_PASSWORD"))
+        bench_default_key(&conn);
+    if (g_getenv("SFTP_BENCH_PASSWORD"))
+        g_strlcpy(conn.password, g_getenv("SFTP_BENCH_PASSWORD"), sizeof(conn.password));
+    if (opt_streams > 0)
+        conn.parallel_streams = CLAMP(opt_streams, 1, MAX_PARALLEL_STREAMS);
+    if (opt_read_window > 0)
+        conn.read_window = CLAMP(opt_read_window, 1, MAX_TRANSFER_WINDOW);
+    if (opt_write_window > 0)
+        conn.write_window = CLAMP(opt_write_window, 1, MAX_TRANSFER_WINDOW);
+    if (opt_channels > 0)
+        conn.max_channels = CLAMP(opt_channels, 1, MAX_CHANNELS_LIMIT);
+    conn.dir_cache_ttl = 0;
+    conn.prefetch_dirs = 0;
+
+    if (opt_netem) {
+        if (!bench_netem(TRUE)) {
+            ok = FALSE;
+            goto out;
+        }
+        netem = TRUE;
+    }
+
+    session = sftp_session_new(&conn);
+    if (!sftp_connection_connect(session)) {
+        g_printerr("Cannot connect to %s@%s:%d\n", conn.username, conn.hostname, conn.port);
+        ok = FALSE;
+        goto out;
+    }
+
+    if (opt_event) {
+        event = sftp_event_session_new(session, NULL, opt_jobs);
+        if (!event) {
+            g_printerr("Cannot open the event session\n");
+            ok = FALSE;
+            goto out;
+        }
+    }
+
+    work_dir = g_dir_make_tmp("sftp-bench-XXXXXX", &error);
+    if (!work_dir) {
+        g_printerr("Cannot create work directory: %s\n", error->message);
+        g_error_free(error);
+        ok = FALSE;
+        goto out;
+    }
+
+    printf("# %s@%s:%d %s, %d files per size, %d in flight, streams %d, "
+           "read window %d, write window %d, channels %d%s%s%s\n",
+           conn.username, conn.hostname, conn.port, opt_remote_dir, opt_count, opt_jobs,
+           conn.parallel_streams, conn.read_window, conn.write_window, conn.max_channels,
+           opt_event ? ", event loop" : "",
+           opt_netem ? ", netem " : "", opt_netem ? opt_netem : "");
+
+    for (i = 0; i < sizes->len; i++) {
+        gsize size = g_array_index(sizes, gsize, i);
+        gchar *source = g_build_filename(work_dir, "source.bin", NULL);
+
+        if (!bench_make_source(source, size)) {
+            g_printerr("Cannot write %s\n", source);
+            g_free(source);
+            ok = FALSE;
+            break;
+        }
+
+        /* Downloads read back what the upload phase wrote, so it always runs */
+        ok = bench_run_phase(session, event, TRUE, size, source, work_dir) && ok;
+        if (down)
+            ok = bench_run_phase(session, event, FALSE, size, source, work_dir) && ok;
+
+        bench_remove_remote(session, size);
+        g_unlink(source);
+        g_free(source);
+    }
+
+    if (opt_json && !bench_write_json(session, opt_json))
+        ok = FALSE;
+
+out:
+    sftp_event_session_free(event);
+    sftp_session_free(session);
+    if (work_dir) {
+        g_rmdir(work_dir);
+        g_free(work_dir);
+    }
+    if (netem)
+        bench_netem(FALSE);
+    g_array_free(sizes, TRUE);
+    libssh2_exit();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+/*
+ * SFTP Core
+ * Transfer engine shared by the Geany plugin and the benchmark harness.
+ * Needs GLib, GIO, json-glib and libssh2 only; nothing here may include GTK or Geany.
+ */
+
+#ifndef SFTP_CORE_H
+#define SFTP_CORE_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+/* 包含libssh2头文件 */
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+/* 常量定义 */
+#define MAX_HOSTNAME_LEN 256
+#define MAX_USERNAME_LEN 64
+#define MAX_PASSWORD_LEN 256
+#define MAX_PATH_LEN 4096
+#define DEFAULT_PORT 22
+#define CONNECTION_TIMEOUT 30
+#define DEFAULT_KEEPALIVE_INTERVAL 30  /* Seconds between SSH keepalives on idle channels */
+#define MAX_KEEPALIVE_INTERVAL 600
+
+/* 传输管线参数 */
+#define SFTP_CHUNK_SIZE 30000        /* Payload of one SFTP READ/WRITE request (libssh2 limit) */
+#define DEFAULT_READ_WINDOW 64       /* Outstanding READ requests per download */
+#define DEFAULT_WRITE_WINDOW 64      /* Outstanding WRITE requests per upload */
+#define MAX_TRANSFER_WINDOW 256
+#define DEFAULT_PARALLEL_STREAMS 4   /* Sessions used for one large transfer */
+#define MAX_PARALLEL_STREAMS 16
+#define DEFAULT_PARALLEL_THRESHOLD_MB 64
+#define DEFAULT_MAX_CHANNELS 4       /* SFTP channels (transports) leased per host */
+#define MAX_CHANNELS_LIMIT 8
+#define RESUME_VERIFY_WINDOW (64 * 1024)  /* Tail compared before resuming a partial file */
+#define DELTA_BLOCK_SIZE 8192        /* Granularity of delta uploads */
+#define DIR_LIST_BATCH_SIZE 512      /* Directory entries handed to the UI at once */
+
+/* 本地目录监视参数 */
+#define WATCH_BATCH_MS 1000          /* Quiet time that closes a batch of change events */
+#define WATCH_BATCH_MAX_MS 5000      /* A batch is pushed after this long even if events go on */
+#define DEFAULT_WATCH_RATE 10        /* Uploads started per second */
+#define MAX_WATCH_RATE 100
+#define WATCH_MAX_DIRS 4096          /* Directories monitored per watch */
+#define WATCH_IGNORE_LEN 1024
+#define WATCH_MAX_WRITES 1024        /* Finished downloads remembered so the watch skips them */
+#define DEFAULT_WATCH_IGNORE ".git;.svn;.hg;node_modules;__pycache__;*.swp;*~;.#*;*.o;*.pyc"
+
+/* 目录缓存参数 */
+#define DEFAULT_DIR_CACHE_TTL 30     /* Seconds a cached listing is shown without revalidating */
+#define MAX_DIR_CACHE_TTL 3600
+#define DIR_CACHE_MAX_DIRS 256       /* Listings kept per session */
+#define DEFAULT_PREFETCH_DIRS 8      /* Subdirectories listed ahead after each listing */
+#define MAX_PREFETCH_DIRS 32
+#define PREFETCH_MAX_BYTES (1024 * 1024)  /* Entry memory one prefetch round may fill */
+
+/* 连接状态 */
+typedef enum {
+    CONN_DISCONNECTED,
+    CONN_CONNECTING,
+    CONN_CONNECTED,
+    CONN_ERROR
+} ConnectionState;
+
+/* 连接配置结构体 */
+typedef struct {
+    gchar name[128];
+    gchar hostname[MAX_HOSTNAME_LEN];
+    gint port;
+    gchar username[MAX_USERNAME_LEN];
+    gchar password[MAX_PASSWORD_LEN];
+    gchar private_key[MAX_PATH_LEN];
+    gchar remote_dir[MAX_PATH_LEN];
+    gchar local_dir[MAX_PATH_LEN];   /* Local copy of remote_dir, or empty */
+    gboolean watch_local;          /* Push changes under local_dir while connected */
+    gchar watch_ignore[WATCH_IGNORE_LEN];  /* ';'-separated globs the watch skips */
+    gint watch_rate;               /* Watch uploads started per second */
+    gint read_window;              /* READ requests kept in flight while downloading */
+    gint write_window;             /* WRITE requests kept in flight while uploading */
+    gint parallel_streams;         /* Sessions used to split one large transfer */
+    gint parallel_threshold_mb;    /* Files below this size use a single stream */
+    gint dir_cache_ttl;            /* Seconds before a cached listing is revalidated, 0 = off */
+    gint prefetch_dirs;            /* Subdirectories listed ahead into the cache, 0 = off */
+    gint max_channels;             /* SFTP channels open to this host at once */
+    gint keepalive_interval;       /* Seconds between keepalives, 0 = off */
+    gboolean delta_upload;         /* Auto-upload only the blocks that changed */
+    gboolean atomic_upload;        /* Upload to a temp file, then rename over the target */
+    gboolean use_keyring;
+    ConnectionState state;
+} SFTPConnection;
+
+/* 后台任务优先级（数值越小越先执行） */
+typedef enum {
+    JOB_PRIORITY_HIGH,        /* User is waiting on the result (open, browse) */
+    JOB_PRIORITY_NORMAL,      /* Explicit uploads/downloads */
+    JOB_PRIORITY_BACKGROUND   /* Auto-upload and other housekeeping */
+} JobPriority;
+
+typedef struct _SFTPJob SFTPJob;
+typedef struct _SFTPConnectRequest SFTPConnectRequest;
+typedef struct _DirCache DirCache;
+typedef struct _DirPrefetch DirPrefetch;
+typedef struct _DeltaSignature DeltaSignature;
+typedef struct _FolderTransfer FolderTransfer;
+typedef struct _LocalWatch LocalWatch;
+typedef struct _FileCache FileCache;
+typedef struct _TransferStats TransferStats;
+typedef struct _SFTPEventSession SFTPEventSession;
+
+/* 文件操作结构体 */
+typedef struct _FileOperation FileOperation;
+
+/* 异步传输事件 */
+typedef enum {
+    TRANSFER_EVENT_QUEUED,
+    TRANSFER_EVENT_FINISHED     /* Last chance to look at op: the callback may free it */
+} TransferEvent;
+
+/* 传输观察者回调类型，在主线程中调用 */
+typedef void (*TransferObserver)(FileOperation *op, TransferEvent event, gpointer user_data);
+
+/* SFTP会话结构体 */
+typedef struct _SFTPSession {
+    guint id;                       /* Unique for the life of the process, never 0 */
+    SFTPConnection *config;
+    LIBSSH2_SESSION *ssh_session;
+    LIBSSH2_SFTP *sftp_session;
+    int sock;
+    gboolean active;
+    gchar temp_dir[MAX_PATH_LEN];  /* Temp directory for downloaded files */
+    GMutex lock;                    /* Protects libssh2 session from concurrent access */
+    gboolean owns_config;           /* config is a private copy (cloned sessions) */
+    /* Job queue drained by a bounded worker pool */
+    GThreadPool *pool;
+    GMutex queue_lock;              /* Protects queued_jobs, running_jobs, job_seq, closing */
+    GList *queued_jobs;
+    GList *running_jobs;
+    guint64 job_seq;
+    gboolean closing;               /* Being freed: jobs pushed now run at once, cancelled */
+    /* Async connect */
+    gboolean connect_cancelled;
+    SFTPConnectRequest *connect_request;
+    DirCache *dir_cache;            /* Directory listings, keyed by remote path */
+    /* Channel pool: extra connections leased to jobs next to this one */
+    struct _SFTPSession *parent;    /* Pool owner, set on leased channels */
+    GMutex channel_lock;            /* Protects the fields below */
+    GCond channel_cond;
+    gboolean primary_leased;        /* This session's own channel is in use */
+    GPtrArray *idle_channels;
+    guint open_channels;            /* Extra channels connected or connecting */
+    LocalWatch *local_watch;        /* Pushes changes under config->local_dir, or NULL */
+    FileCache *file_cache;          /* Shared cache of files opened for editing, or NULL */
+    TransferStats *stats;           /* Finished transfers, recorded on the pool owner */
+    TransferObserver transfer_observer;  /* Sees every transfer_async op, or NULL */
+    gpointer transfer_observer_data;
+    /* Keepalive and reconnect */
+    guint keepalive_id;             /* Main loop timer, set once connected */
+    gint keepalive_pending;         /* A keepalive job is queued (atomic) */
+    gboolean dropped;               /* Connection lost and not yet re-established */
+} SFTPSession;
+
+/* 远程目录项 */
+typedef struct {
+    gchar *name;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+} SFTPDirEntry;
+
+/* 目录读取批次回调类型，接管 batch（SFTPDirEntry 数组）的所有权 */
+typedef void (*DirBatchCallback)(GPtrArray *batch, gpointer user_data);
+
+/* 异步连接完成回调类型 */
+typedef void (*ConnectCallback)(SFTPSession *session, gboolean success, gpointer user_data);
+
+/* 后台任务函数类型，在工作线程中执行 */
+typedef void (*SFTPJobFunc)(SFTPSession *session, gpointer data, gboolean cancelled);
+
+/* 异步传输完成回调类型 */
+typedef void (*TransferCallback)(FileOperation *op, gboolean success, gpointer user_data);
+
+struct _FileOperation {
+    gchar local_path[MAX_PATH_LEN];
+    gchar remote_path[MAX_PATH_LEN];
+    gboolean is_upload;
+    gsize total_size;
+    gsize transferred;
+    gboolean completed;
+    gboolean cancelled;
+    gboolean success;
+    JobPriority priority;
+    DeltaSignature *signature;  /* Remote copy's block digests (delta upload), or NULL */
+    /* Timing, g_get_monotonic_time() microseconds, 0 = stage not reached */
+    gint64 queued_at;           /* Pushed by transfer_async */
+    gint64 started_at;          /* Picked up by a worker */
+    gint64 leased_at;           /* Got a channel, possibly after opening one */
+    gint64 locked_at;           /* Holds the channel lock; data transfer starts */
+    gint64 first_byte_at;       /* First READ/WRITE returned data */
+    gint64 completed_at;
+    gint first_byte_seen;       /* Set once first_byte_at is claimed (range threads race) */
+    gint requests;              /* READ/WRITE calls into libssh2; each pipelines a window */
+    gsize bytes_moved;          /* Bytes that crossed the network */
+    gsize disk_us;              /* Time in local file reads and writes */
+    gboolean cache_hit;         /* Served by the file cache, no data moved */
+    /* Async callback context */
+    SFTPSession *session;
+    TransferCallback callback;
+    gpointer user_data;
+    TransferObserver observer;  /* Copied from the session: the op may outlive it */
+    gpointer observer_data;
+};
+
+/* 传输统计累计值 */
+typedef struct {
+    guint ops;              /* Finished transfers, failures included */
+    guint failed;
+    guint cancelled;
+    guint cache_hits;
+    guint queued_ops;       /* Went through the job queue, so have queue timing */
+    guint data_ops;         /* Moved at least one byte */
+    guint64 bytes_up;       /* Bytes that crossed the network */
+    guint64 bytes_down;
+    guint64 requests;
+    gint64 queue_us;        /* Waiting in the job queue */
+    gint64 connect_us;      /* Waiting for (or opening) a channel */
+    gint64 lock_us;         /* Waiting for the channel lock */
+    gint64 first_byte_us;   /* Lock to first data */
+    gint64 disk_us;         /* Local file reads and writes */
+    gint64 transfer_us;     /* Lock to completion */
+    gint64 max_total_us;    /* Slowest transfer, queue to completion */
+} TransferTotals;
+
+/* 文件夹传输进度 */
+typedef struct {
+    guint files_total;      /* Found so far; grows while walking */
+    guint files_done;
+    guint files_failed;
+    gsize bytes_total;
+    gsize bytes_done;
+    gboolean walking;
+} FolderProgress;
+
+/* 文件夹传输完成回调类型，接管 transfer 的所有权 */
+typedef void (*FolderTransferCallback)(FolderTransfer *transfer, gpointer user_data);
+
+/* 会话与传输 */
+void sftp_connection_defaults(SFTPConnection *conn);
+SFTPSession *sftp_session_new(SFTPConnection *config);
+SFTPSession *sftp_session_clone(SFTPSession *session);
+void sftp_session_free(SFTPSession *session);
+void sftp_session_push_job(SFTPSession *session, JobPriority priority,
+                           SFTPJobFunc func, gpointer data, gboolean *cancel_flag);
+void sftp_session_cancel_jobs(SFTPSession *session);
+void sftp_session_cancel_job(SFTPSession *session, gpointer data);
+guint sftp_session_queue_depth(SFTPSession *session);
+SFTPSession *sftp_session_lease(SFTPSession *session, gboolean wait);
+SFTPSession *sftp_session_lease_idle(SFTPSession *session);
+void sftp_session_release(SFTPSession *channel);
+gboolean sftp_session_jobs_waiting(SFTPSession *session, JobPriority priority);
+gboolean sftp_connection_connect(SFTPSession *session);
+void sftp_connection_connect_async(SFTPSession *session, ConnectCallback callback,
+                                   gpointer user_data);
+void sftp_connection_cancel(SFTPSession *session);
+void sftp_connection_disconnect(SFTPSession *session);
+gboolean sftp_session_lost(SFTPSession *session);
+gboolean sftp_session_reconnect(SFTPSession *session);
+gboolean sftp_remote_stat(SFTPSession *session, const gchar *path,
+                          LIBSSH2_SFTP_ATTRIBUTES *attrs);
+gboolean sftp_list_directory(SFTPSession *session, const gchar *path);
+gboolean sftp_read_directory(SFTPSession *session, const gchar *path, guint batch_size,
+                             DirBatchCallback callback, gpointer user_data,
+                             const gboolean *cancelled);
+void sftp_dir_entry_free(gpointer entry);
+gboolean sftp_upload_file(SFTPSession *session, const gchar *local, const gchar *remote,
+                          FileOperation *op);
+gboolean sftp_download_file(SFTPSession *session, const gchar *remote, const gchar *local,
+                            FileOperation *op);
+gboolean sftp_transfer_file(SFTPSession *session, FileOperation *op);
+gchar *sftp_remote_sha256(SFTPSession *session, const gchar *path);
+gchar *sftp_local_sha256(const gchar *path);
+gsize transfer_write_buffer_size(SFTPSession *session);
+gsize transfer_read_buffer_size(SFTPSession *session);
+
+/* 目录缓存 */
+DirCache *dir_cache_new(gint ttl_seconds);
+void dir_cache_free(DirCache *cache);
+GPtrArray *dir_cache_lookup(DirCache *cache, const gchar *path, gboolean *fresh);
+void dir_cache_store(DirCache *cache, const gchar *path, GPtrArray *entries);
+void dir_cache_invalidate(DirCache *cache, const gchar *path);
+void dir_cache_invalidate_parent(DirCache *cache, const gchar *path);
+DirPrefetch *dir_cache_prefetch(SFTPSession *session, GPtrArray *paths);
+void dir_cache_prefetch_cancel(DirPrefetch *prefetch);
+
+/* 断点续传 */
+gsize resume_checkpoint_load(SFTPSession *session, gboolean is_upload,
+                             const gchar *local, const gchar *remote,
+                             gint64 source_size, gint64 source_mtime);
+void resume_checkpoint_save(SFTPSession *session, gboolean is_upload,
+                            const gchar *local, const gchar *remote,
+                            gint64 source_size, gint64 source_mtime, gsize offset);
+void resume_checkpoint_clear(SFTPSession *session, gboolean is_upload,
+                             const gchar *local, const gchar *remote);
+gboolean resume_checkpoint_exists(SFTPSession *session, gboolean is_upload,
+                                  const gchar *local, const gchar *remote);
+
+/* 增量上传 */
+DeltaSignature *delta_signature_new(void);
+DeltaSignature *delta_signature_ref(DeltaSignature *sig);
+void delta_signature_unref(DeltaSignature *sig);
+gboolean delta_signature_update(DeltaSignature *sig, SFTPSession *session,
+                                const gchar *local, const gchar *remote);
+gboolean delta_signature_set(DeltaSignature *sig, const gchar *local,
+                             gint64 size, gint64 mtime);
+gboolean sftp_delta_upload(SFTPSession *session, FileOperation *op);
+
+/* 文件夹传输 */
+FolderTransfer *folder_transfer_start(SFTPSession *session, const gchar *local,
+                                      const gchar *remote, gboolean is_upload,
+                                      FolderTransferCallback callback, gpointer user_data);
+void folder_transfer_cancel(FolderTransfer *tree);
+void folder_transfer_progress(FolderTransfer *tree, FolderProgress *progress);
+gboolean folder_transfer_is_upload(FolderTransfer *tree);
+gboolean folder_transfer_succeeded(FolderTransfer *tree);
+gchar *folder_transfer_summary(FolderTransfer *tree);
+void folder_transfer_free(FolderTransfer *tree);
+
+/* 本地目录监视 */
+LocalWatch *local_watch_start(SFTPSession *session);
+void local_watch_stop(LocalWatch *watch);
+void local_watch_write_begin(const gchar *path);
+void local_watch_write_end(const gchar *path);
+
+/* 异步文件传输 */
+FileOperation *transfer_async(SFTPSession *session, const gchar *local,
+                              const gchar *remote, gboolean is_upload, JobPriority priority,
+                              DeltaSignature *signature,
+                              TransferCallback callback, gpointer user_data);
+void transfer_cancel(FileOperation *op);
+void transfer_op_data(FileOperation *op, gsize bytes);
+void transfer_op_disk(FileOperation *op, gint64 since);
+
+/* 事件驱动会话 */
+SFTPEventSession *sftp_event_session_new(SFTPSession *owner, GMainContext *context,
+                                         guint max_channels);
+void sftp_event_session_free(SFTPEventSession *ev);
+FileOperation *sftp_event_transfer(SFTPEventSession *ev, const gchar *local,
+                                   const gchar *remote, gboolean is_upload,
+                                   TransferCallback callback, gpointer user_data);
+void sftp_event_cancel(SFTPEventSession *ev, FileOperation *op);
+
+/* 传输统计 */
+TransferStats *stats_new(void);
+void stats_free(TransferStats *stats);
+void stats_record(TransferStats *stats, const FileOperation *op, gboolean success);
+void stats_get_totals(TransferStats *stats, TransferTotals *totals);
+void stats_reset(TransferStats *stats);
+gdouble stats_avg_ms(gint64 sum_us, guint count);
+gdouble stats_throughput(const TransferTotals *totals);
+JsonObject *stats_to_json(TransferStats *stats);
+
+/* 文本差异 */
+gchar *diff_files_unified(const gchar *old_path, const gchar *new_path,
+                          const gchar *old_label, const gchar *new_label, GError **error);
+
+/* 文件缓存 */
+FileCache *file_cache_new(gint limit_mb);
+void file_cache_free(FileCache *cache);
+void file_cache_set_limit(FileCache *cache, gint limit_mb);
+gboolean file_cache_lookup(FileCache *cache, const SFTPConnection *conn, const gchar *remote,
+                           gint64 size, gint64 mtime, const gchar *dest);
+void file_cache_store(FileCache *cache, const SFTPConnection *conn, const gchar *remote,
+                      gint64 size, gint64 mtime, const gchar *src);
+
+#endif /* SFTP_CORE_H */
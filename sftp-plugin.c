@@ -27,6 +27,7 @@ static void sftp_plugin_cleanup(GeanyPlugin *plugin, gpointer pdata);
 static GtkWidget *sftp_configure(GeanyPlugin *plugin, GtkDialog *dialog, gpointer pdata);
 static void sftp_help(GeanyPlugin *plugin, gpointer pdata);
 static void on_document_save(GObject *obj, GeanyDocument *doc, gpointer user_data);
+static void downloaded_file_free(gpointer data);
 
 /* Forward declaration for sidebar update */
 void ui_update_connection_combo(SFTPPluginData *plugin_data);
@@ -60,12 +61,16 @@ static gboolean sftp_plugin_init(GeanyPlugin *plugin, gpointer pdata)
     plugin_data->current_connection = -1;
     plugin_data->active_operations = NULL;
     plugin_data->completed_operations = NULL;
-    plugin_data->downloaded_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    plugin_data->downloaded_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                          downloaded_file_free);
+    scheduler_init(plugin_data);
+    poller_init(plugin_data);
     strcpy(plugin_data->current_remote_path, ".");
 
     /* Load config */
     config_load_settings(plugin_data);
     config_load_connections(plugin_data);
+    plugin_data->file_cache = file_cache_new(plugin_data->file_cache_mb);
 
     /* Create UI */
     ui_create_sidebar(plugin_data);
@@ -77,6 +82,7 @@ static gboolean sftp_plugin_init(GeanyPlugin *plugin, gpointer pdata)
                                  plugin_data->sidebar, sidebar_label);
         gtk_widget_show_all(plugin_data->sidebar);
     }
+    transfers_init(plugin_data);
 
     /* Connect to document-save signal for auto-upload */
     plugin_signal_connect(plugin, NULL, "document-save", TRUE,
@@ -86,14 +92,24 @@ static gboolean sftp_plugin_init(GeanyPlugin *plugin, gpointer pdata)
     return TRUE;
 }
 
+/*
+ * Free a downloaded_files entry
+ */
+static void downloaded_file_free(gpointer data)
+{
+    DownloadedFile *file = (DownloadedFile *)data;
+    g_free(file->remote_path);
+    delta_signature_unref(file->signature);
+    g_free(file);
+}
+
 /*
  * Document save callback - auto upload if configured
  */
 static void on_document_save(GObject *obj, GeanyDocument *doc, gpointer user_data)
 {
     SFTPPluginData *pdata = (SFTPPluginData *)user_data;
-    const gchar *remote_path;
-    SFTPSession *session;
+    DownloadedFile *file;
 
     (void)obj;
 
@@ -107,15 +123,12 @@ static void on_document_save(GObject *obj, GeanyDocument *doc, gpointer user_dat
         return;
 
     /* Check if this file was downloaded from SFTP */
-    remote_path = g_hash_table_lookup(pdata->downloaded_files, doc->file_name);
-    if (!remote_path)
+    file = g_hash_table_lookup(pdata->downloaded_files, doc->file_name);
+    if (!file)
         return;
 
-    session = pdata->sessions[pdata->current_connection];
-
-    /* Upload the file asynchronously */
-    transfer_async(session, doc->file_name, remote_path, TRUE, NULL, NULL);
-    g_print("Auto-upload started: %s -> %s\n", doc->file_name, remote_path);
+    /* Rapid saves of the same file collapse into one upload */
+    scheduler_queue_upload(pdata, doc->file_name, file->remote_path);
 }
 
 /*
@@ -131,18 +144,24 @@ static void sftp_plugin_cleanup(GeanyPlugin *plugin, gpointer pdata)
         return;
 
     /* Close all connections */
+    scheduler_shutdown(plugin_data);
+    poller_shutdown(plugin_data);
+    statsview_shutdown(plugin_data);
+    ui_cancel_file_list(plugin_data);
     for (i = 0; i < MAX_CONNECTIONS; i++) {
         if (plugin_data->sessions[i]) {
-            sftp_connection_disconnect(plugin_data->sessions[i]);
-            g_mutex_clear(&plugin_data->sessions[i]->lock);
-            g_free(plugin_data->sessions[i]);
+            dirsync_session_closing(plugin_data->sessions[i]);
+            sftp_session_free(plugin_data->sessions[i]);
             plugin_data->sessions[i] = NULL;
         }
     }
 
     /* Cleanup file operations */
-    g_list_free_full(plugin_data->active_operations, g_free);
-    g_list_free_full(plugin_data->completed_operations, g_free);
+    transfers_shutdown(plugin_data);
+
+    /* Workers are gone with the sessions */
+    file_cache_free(plugin_data->file_cache);
+    plugin_data->file_cache = NULL;
 
     /* Cleanup downloaded files hash table */
     if (plugin_data->downloaded_files)
@@ -490,8 +509,10 @@ static void delete_connection(gint conn_index)
 
     /* Close session if connected */
     if (plugin_data->sessions[conn_index]) {
-        sftp_connection_disconnect(plugin_data->sessions[conn_index]);
-        g_free(plugin_data->sessions[conn_index]);
+        if (conn_index == plugin_data->current_connection)
+            ui_cancel_file_list(plugin_data);
+        dirsync_session_closing(plugin_data->sessions[conn_index]);
+        sftp_session_free(plugin_data->sessions[conn_index]);
         plugin_data->sessions[conn_index] = NULL;
     }
 
@@ -665,6 +686,7 @@ static void show_add_connection_dialog(GtkWidget *parent)
     response = gtk_dialog_run(GTK_DIALOG(dialog));
     if (response == GTK_RESPONSE_OK && plugin_data->num_connections < MAX_CONNECTIONS) {
         SFTPConnection *conn = &plugin_data->connections[plugin_data->num_connections];
+        sftp_connection_defaults(conn);
         strncpy(conn->name, gtk_entry_get_text(GTK_ENTRY(name_entry)), sizeof(conn->name) - 1);
         strncpy(conn->hostname, gtk_entry_get_text(GTK_ENTRY(host_entry)), sizeof(conn->hostname) - 1);
         conn->port = atoi(gtk_entry_get_text(GTK_ENTRY(port_entry)));
@@ -698,6 +720,38 @@ static void on_auto_upload_toggled(GtkToggleButton *toggle, gpointer data)
     config_save_settings(plugin_data);
 }
 
+static void on_upload_debounce_changed(GtkSpinButton *spin, gpointer data)
+{
+    (void)data;
+    plugin_data->upload_debounce_ms = gtk_spin_button_get_value_as_int(spin);
+    config_save_settings(plugin_data);
+}
+
+static void on_remote_poll_changed(GtkSpinButton *spin, gpointer data)
+{
+    (void)data;
+    plugin_data->remote_poll_interval = gtk_spin_button_get_value_as_int(spin);
+    config_save_settings(plugin_data);
+}
+
+static void on_file_cache_changed(GtkSpinButton *spin, gpointer data)
+{
+    (void)data;
+    plugin_data->file_cache_mb = gtk_spin_button_get_value_as_int(spin);
+    if (plugin_data->file_cache)
+        file_cache_set_limit(plugin_data->file_cache, plugin_data->file_cache_mb);
+    config_save_settings(plugin_data);
+}
+
+static void on_diff_tool_changed(GtkEditable *editable, gpointer data)
+{
+    (void)data;
+    g_strlcpy(plugin_data->diff_tool, gtk_entry_get_text(GTK_ENTRY(editable)),
+              sizeof(plugin_data->diff_tool));
+    g_strstrip(plugin_data->diff_tool);
+    config_save_settings(plugin_data);
+}
+
 /*
  * Configure dialog function
  */
@@ -797,6 +851,48 @@ static GtkWidget *sftp_configure(GeanyPlugin *plugin, GtkDialog *dialog, gpointe
     g_signal_connect(auto_upload_check, "toggled", G_CALLBACK(on_auto_upload_toggled), NULL);
     gtk_box_pack_start(GTK_BOX(settings_page), auto_upload_check, FALSE, FALSE, 5);
 
+    /* Debounce window for auto upload */
+    GtkWidget *debounce_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(debounce_box), gtk_label_new("Upload delay after save (ms):"),
+                       FALSE, FALSE, 0);
+    GtkWidget *debounce_spin = gtk_spin_button_new_with_range(0, MAX_UPLOAD_DEBOUNCE_MS, 100);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(debounce_spin), plugin_data->upload_debounce_ms);
+    g_signal_connect(debounce_spin, "value-changed", G_CALLBACK(on_upload_debounce_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(debounce_box), debounce_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(settings_page), debounce_box, FALSE, FALSE, 5);
+
+    /* How often opened files are checked for changes on the server */
+    GtkWidget *poll_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(poll_box),
+                       gtk_label_new("Check opened files on server every (s, 0 = off):"),
+                       FALSE, FALSE, 0);
+    GtkWidget *poll_spin = gtk_spin_button_new_with_range(0, MAX_REMOTE_POLL_INTERVAL, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(poll_spin), plugin_data->remote_poll_interval);
+    g_signal_connect(poll_spin, "value-changed", G_CALLBACK(on_remote_poll_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(poll_box), poll_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(settings_page), poll_box, FALSE, FALSE, 5);
+
+    /* Opened files kept on disk, reused while unchanged on the server */
+    GtkWidget *cache_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(cache_box), gtk_label_new("Local file cache (MB, 0 = off):"),
+                       FALSE, FALSE, 0);
+    GtkWidget *cache_spin = gtk_spin_button_new_with_range(0, MAX_FILE_CACHE_MB, 16);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(cache_spin), plugin_data->file_cache_mb);
+    g_signal_connect(cache_spin, "value-changed", G_CALLBACK(on_file_cache_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(cache_box), cache_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(settings_page), cache_box, FALSE, FALSE, 5);
+
+    /* Compare tool; the built-in diff opens in a document */
+    GtkWidget *diff_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(diff_box), gtk_label_new("External diff tool (empty = built-in):"),
+                       FALSE, FALSE, 0);
+    GtkWidget *diff_entry = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(diff_entry), plugin_data->diff_tool);
+    gtk_entry_set_placeholder_text(GTK_ENTRY(diff_entry), "e.g. meld");
+    g_signal_connect(diff_entry, "changed", G_CALLBACK(on_diff_tool_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(diff_box), diff_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(settings_page), diff_box, FALSE, FALSE, 5);
+
     /* Show hidden files option */
     GtkWidget *show_hidden_check = gtk_check_button_new_with_label("Show hidden files");
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(show_hidden_check),
@@ -4,22 +4,22 @@
 #include <geanyplugin.h>
 #include <gtk/gtk.h>
 
-/* 包含libssh2头文件 */
-#include <libssh2.h>
-#include <libssh2_sftp.h>
+#include "sftp-core.h"
 
 /* 插件版本 */
 #define SFTP_PLUGIN_VERSION "1.0.0"
 
 /* 常量定义 */
-#define MAX_HOSTNAME_LEN 256
-#define MAX_USERNAME_LEN 64
-#define MAX_PASSWORD_LEN 256
-#define MAX_PATH_LEN 4096
 #define MAX_CONNECTIONS 10
-#define DEFAULT_PORT 22
-#define CONNECTION_TIMEOUT 30
 #define MAX_SSH_HOSTS 50
+#define DEFAULT_UPLOAD_DEBOUNCE_MS 500  /* Quiet time after a save before auto-upload */
+#define MAX_UPLOAD_DEBOUNCE_MS 10000
+#define DEFAULT_REMOTE_POLL_INTERVAL 5  /* Seconds between checks of opened files on the server */
+#define MAX_REMOTE_POLL_INTERVAL 3600
+#define DEFAULT_FILE_CACHE_MB 256    /* Persistent cache of files opened for editing */
+#define MAX_FILE_CACHE_MB 65536
+
+typedef struct _RemotePoller RemotePoller;
 
 /* SSH Config Host entry */
 typedef struct {
@@ -30,59 +30,15 @@ typedef struct {
     gchar identity_file[MAX_PATH_LEN];
 } SSHConfigHost;
 
-/* 连接状态 */
-typedef enum {
-    CONN_DISCONNECTED,
-    CONN_CONNECTING,
-    CONN_CONNECTED,
-    CONN_ERROR
-} ConnectionState;
-
-/* 连接配置结构体 */
+/* 从服务器下载并在编辑器中打开的文件 */
 typedef struct {
-    gchar name[128];
-    gchar hostname[MAX_HOSTNAME_LEN];
-    gint port;
-    gchar username[MAX_USERNAME_LEN];
-    gchar password[MAX_PASSWORD_LEN];
-    gchar private_key[MAX_PATH_LEN];
-    gchar remote_dir[MAX_PATH_LEN];
-    gboolean use_keyring;
-    ConnectionState state;
-} SFTPConnection;
-
-/* SFTP会话结构体 */
-typedef struct {
-    SFTPConnection *config;
-    LIBSSH2_SESSION *ssh_session;
-    LIBSSH2_SFTP *sftp_session;
-    int sock;
-    gboolean active;
-    gchar temp_dir[MAX_PATH_LEN];  /* Temp directory for downloaded files */
-    GMutex lock;                    /* Protects libssh2 session from concurrent access */
-} SFTPSession;
-
-/* 文件操作结构体 */
-typedef struct _FileOperation FileOperation;
-
-/* 异步传输完成回调类型 */
-typedef void (*TransferCallback)(FileOperation *op, gboolean success, gpointer user_data);
-
-struct _FileOperation {
-    gchar local_path[MAX_PATH_LEN];
-    gchar remote_path[MAX_PATH_LEN];
-    gboolean is_upload;
-    gsize total_size;
-    gsize transferred;
-    gboolean completed;
-    gboolean cancelled;
-    gboolean success;
-    GThread *thread;
-    /* Async callback context */
-    SFTPSession *session;
-    TransferCallback callback;
-    gpointer user_data;
-};
+    gchar *remote_path;
+    DeltaSignature *signature;  /* What the remote copy looks like, for delta uploads */
+    gboolean remote_known;      /* remote_size/remote_mtime are set */
+    gint64 remote_size;         /* Remote file as last seen by the poller */
+    gint64 remote_mtime;
+    guint generation;           /* Bumped when our own transfer rewrites either copy */
+} DownloadedFile;
 
 /* 插件数据结构体 */
 typedef struct {
@@ -101,12 +57,15 @@ typedef struct {
     /* 当前活动连接 */
     gint current_connection;
     gchar current_remote_path[MAX_PATH_LEN];
+    gpointer pending_listing;  /* Directory listing in progress, if any */
+    DirPrefetch *pending_prefetch;  /* Speculative listing of nearby directories */
     
     /* UI组件 */
     GtkWidget *connection_combo;
     GtkWidget *connect_btn;  /* Connect/Disconnect button */
     GtkWidget *upload_btn;   /* Upload button */
     GtkWidget *refresh_btn;  /* Refresh button */
+    GtkWidget *list_spinner; /* Shown while a directory is being listed */
     GtkWidget *file_treeview;
     GtkWidget *path_entry;  /* Editable path entry */
     GtkWidget *statusbar_label;
@@ -116,23 +75,38 @@ typedef struct {
     GList *active_operations;
     GList *completed_operations;
 
-    /* Track downloaded files: local_path -> remote_path */
+    /* Track downloaded files: local_path -> DownloadedFile */
     GHashTable *downloaded_files;
+
+    /* Auto-uploads waiting or running: remote_path -> PendingUpload */
+    GHashTable *pending_uploads;
+
+    /* Checks opened files for changes made on the server */
+    RemotePoller *remote_poller;
+
+    /* Downloaded files kept across restarts */
+    FileCache *file_cache;
     
     /* 配置 */
     gboolean auto_upload;
     gboolean show_hidden_files;
     gint default_timeout;
+    gint upload_debounce_ms;
+    gint remote_poll_interval;  /* Seconds, 0 = off */
+    gchar diff_tool[MAX_PATH_LEN];  /* External compare tool, empty = built-in diff */
+    gint file_cache_mb;         /* 0 = off */
 } SFTPPluginData;
 
-/* 外部函数声明 */
-gboolean sftp_connection_connect(SFTPSession *session);
-void sftp_connection_disconnect(SFTPSession *session);
-gboolean sftp_list_directory(SFTPSession *session, const gchar *path);
-gboolean sftp_upload_file(SFTPSession *session, const gchar *local, const gchar *remote,
-                          FileOperation *op);
-gboolean sftp_download_file(SFTPSession *session, const gchar *remote, const gchar *local,
-                            FileOperation *op);
+/* 自动上传调度 */
+void scheduler_init(SFTPPluginData *plugin_data);
+void scheduler_shutdown(SFTPPluginData *plugin_data);
+void scheduler_queue_upload(SFTPPluginData *plugin_data, const gchar *local,
+                            const gchar *remote);
+
+/* 远程变更检测 */
+void poller_init(SFTPPluginData *plugin_data);
+void poller_shutdown(SFTPPluginData *plugin_data);
+void poller_forget_remote(SFTPPluginData *plugin_data, const gchar *local);
 
 /* 配置管理函数 */
 gboolean config_load_connections(SFTPPluginData *plugin_data);
@@ -146,16 +120,24 @@ gint config_load_ssh_hosts(SSHConfigHost *hosts, gint max_hosts);
 /* UI函数 */
 void ui_create_sidebar(SFTPPluginData *plugin_data);
 void ui_update_file_list(SFTPPluginData *plugin_data);
-void ui_show_progress_dialog(SFTPPluginData *plugin_data, FileOperation *op);
-
-/* 异步文件传输 */
-FileOperation *transfer_async(SFTPSession *session, const gchar *local,
-                              const gchar *remote, gboolean is_upload,
-                              TransferCallback callback, gpointer user_data);
+void ui_cancel_file_list(SFTPPluginData *plugin_data);
+SFTPSession *ui_find_session(SFTPPluginData *plugin_data, guint id);
 
 /* 同步函数 */
 gboolean sync_compare_files(SFTPPluginData *plugin_data, const gchar *local, const gchar *remote);
-gboolean sync_upload_file(SFTPPluginData *plugin_data, const gchar *local, const gchar *remote);
-gboolean sync_download_file(SFTPPluginData *plugin_data, const gchar *remote, const gchar *local);
+
+/* 目录同步 */
+void dirsync_show_dialog(SFTPPluginData *plugin_data, const gchar *remote_dir);
+void dirsync_session_closing(SFTPSession *session);
+
+/* 传输管理面板 */
+void transfers_init(SFTPPluginData *plugin_data);
+void transfers_observe(FileOperation *op, TransferEvent event, gpointer user_data);
+void transfers_present(SFTPPluginData *plugin_data);
+void transfers_shutdown(SFTPPluginData *plugin_data);
+
+/* 传输统计面板 */
+void statsview_show_dialog(SFTPPluginData *plugin_data);
+void statsview_shutdown(SFTPPluginData *plugin_data);
 
 #endif /* SFTP_PLUGIN_H */
\ No newline at end of file
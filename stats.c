@@ -0,0 +1,238 @@
+/*
+ * Transfer Statistics Module
+ * Per-session totals and recent history of finished transfers, built from
+ * the timestamps each FileOperation collects on its way through the queue
+ */
+
+#include "sftp-core.h"
+
+#include <string.h>
+
+#define STATS_RECENT_OPS 64    /* Finished transfers kept with full timing */
+
+/* Timing of one finished transfer, microseconds; -1 = stage not reached */
+typedef struct {
+    gchar *remote_path;
+    gboolean is_upload;
+    gboolean success;
+    gboolean cancelled;
+    gboolean cache_hit;
+    gint64 finished;        /* Wall clock, seconds */
+    gsize size;
+    gsize bytes;            /* Bytes that crossed the network */
+    gint requests;
+    gint64 queue_us;
+    gint64 connect_us;
+    gint64 lock_us;
+    gint64 first_byte_us;
+    gint64 disk_us;
+    gint64 transfer_us;
+    gint64 total_us;
+} TransferRecord;
+
+struct _TransferStats {
+    GMutex lock;            /* Records come from worker threads */
+    TransferTotals totals;
+    GQueue recent;          /* TransferRecord, newest first */
+};
+
+static void transfer_record_free(gpointer data)
+{
+    TransferRecord *record = (TransferRecord *)data;
+    g_free(record->remote_path);
+    g_free(record);
+}
+
+static gint64 stats_span(gint64 from, gint64 to)
+{
+    return (from > 0 && to >= from) ? to - from : -1;
+}
+
+TransferStats *stats_new(void)
+{
+    TransferStats *stats = g_new0(TransferStats, 1);
+    g_mutex_init(&stats->lock);
+    g_queue_init(&stats->recent);
+    return stats;
+}
+
+void stats_free(TransferStats *stats)
+{
+    if (!stats)
+        return;
+    g_queue_clear_full(&stats->recent, transfer_record_free);
+    g_mutex_clear(&stats->lock);
+    g_free(stats);
+}
+
+/*
+ * Add a finished transfer. op's timestamps must be final: every thread
+ * that worked on it has finished.
+ */
+void stats_record(TransferStats *stats, const FileOperation *op, gboolean success)
+{
+    TransferRecord *record;
+    TransferTotals *t;
+
+    if (!stats)
+        return;
+
+    record = g_new0(TransferRecord, 1);
+    record->remote_path = g_strdup(op->remote_path);
+    record->is_upload = op->is_upload;
+    record->success = success;
+    record->cancelled = !success && op->cancelled;
+    record->cache_hit = op->cache_hit;
+    record->finished = g_get_real_time() / G_USEC_PER_SEC;
+    record->size = op->total_size;
+    record->bytes = op->bytes_moved;
+    record->requests = op->requests;
+    record->queue_us = stats_span(op->queued_at, op->started_at);
+    record->connect_us = stats_span(op->started_at, op->leased_at);
+    record->lock_us = stats_span(op->leased_at, op->locked_at);
+    record->first_byte_us = op->first_byte_at ? stats_span(op->locked_at, op->first_byte_at) : -1;
+    record->disk_us = (gint64)op->disk_us;
+    record->transfer_us = stats_span(op->locked_at, op->completed_at);
+    record->total_us = stats_span(op->queued_at ? op->queued_at : op->locked_at,
+                                  op->completed_at);
+
+    g_mutex_lock(&stats->lock);
+    t = &stats->totals;
+    t->ops++;
+    if (record->cancelled)
+        t->cancelled++;
+    else if (!success)
+        t->failed++;
+    if (record->cache_hit)
+        t->cache_hits++;
+    if (op->is_upload)
+        t->bytes_up += record->bytes;
+    else
+        t->bytes_down += record->bytes;
+    t->requests += (guint64)MAX(record->requests, 0);
+    if (record->queue_us >= 0) {
+        t->queued_ops++;
+        t->queue_us += record->queue_us;
+        t->connect_us += MAX(record->connect_us, 0);
+        t->lock_us += MAX(record->lock_us, 0);
+    }
+    if (record->first_byte_us >= 0) {
+        t->data_ops++;
+        t->first_byte_us += record->first_byte_us;
+    }
+    t->disk_us += record->disk_us;
+    t->transfer_us += MAX(record->transfer_us, 0);
+    t->max_total_us = MAX(t->max_total_us, record->total_us);
+
+    g_queue_push_head(&stats->recent, record);
+    while (g_queue_get_length(&stats->recent) > STATS_RECENT_OPS)
+        transfer_record_free(g_queue_pop_tail(&stats->recent));
+    g_mutex_unlock(&stats->lock);
+}
+
+void stats_get_totals(TransferStats *stats, TransferTotals *totals)
+{
+    g_mutex_lock(&stats->lock);
+    *totals = stats->totals;
+    g_mutex_unlock(&stats->lock);
+}
+
+void stats_reset(TransferStats *stats)
+{
+    g_mutex_lock(&stats->lock);
+    memset(&stats->totals, 0, sizeof(stats->totals));
+    g_queue_clear_full(&stats->recent, transfer_record_free);
+    g_mutex_unlock(&stats->lock);
+}
+
+/* Average of sum over count in milliseconds, 0 without samples */
+gdouble stats_avg_ms(gint64 sum_us, guint count)
+{
+    return count ? sum_us / 1000.0 / count : 0;
+}
+
+/* Network throughput while transferring, MB/s */
+gdouble stats_throughput(const TransferTotals *totals)
+{
+    gdouble seconds = totals->transfer_us / 1e6;
+    return seconds > 0 ? (totals->bytes_up + totals->bytes_down) / (1024.0 * 1024.0) / seconds
+                       : 0;
+}
+
+static void stats_set_ms(JsonObject *obj, const gchar *name, gint64 us)
+{
+    if (us >= 0)
+        json_object_set_double_member(obj, name, us / 1000.0);
+    else
+        json_object_set_null_member(obj, name);
+}
+
+/*
+ * Totals, averages and the recent transfers as a JSON object. Times are
+ * milliseconds; null means the transfer never reached that stage.
+ */
+JsonObject *stats_to_json(TransferStats *stats)
+{
+    JsonObject *obj = json_object_new();
+    JsonObject *totals = json_object_new();
+    JsonObject *avg = json_object_new();
+    JsonArray *recent = json_array_new();
+    TransferTotals *t = &stats->totals;
+    GList *l;
+
+    g_mutex_lock(&stats->lock);
+
+    json_object_set_int_member(totals, "ops", t->ops);
+    json_object_set_int_member(totals, "failed", t->failed);
+    json_object_set_int_member(totals, "cancelled", t->cancelled);
+    json_object_set_int_member(totals, "cache_hits", t->cache_hits);
+    json_object_set_int_member(totals, "bytes_up", (gint64)t->bytes_up);
+    json_object_set_int_member(totals, "bytes_down", (gint64)t->bytes_down);
+    json_object_set_int_member(totals, "requests", (gint64)t->requests);
+    json_object_set_double_member(totals, "disk_ms", t->disk_us / 1000.0);
+    json_object_set_double_member(totals, "transfer_ms", t->transfer_us / 1000.0);
+    json_object_set_double_member(totals, "max_total_ms", t->max_total_us / 1000.0);
+
+    json_object_set_double_member(avg, "queue_ms", stats_avg_ms(t->queue_us, t->queued_ops));
+    json_object_set_double_member(avg, "connect_ms", stats_avg_ms(t->connect_us, t->queued_ops));
+    json_object_set_double_member(avg, "lock_ms", stats_avg_ms(t->lock_us, t->queued_ops));
+    json_object_set_double_member(avg, "first_byte_ms",
+                                  stats_avg_ms(t->first_byte_us, t->data_ops));
+    json_object_set_double_member(avg, "disk_ms", stats_avg_ms(t->disk_us, t->ops));
+    json_object_set_double_member(avg, "transfer_ms", stats_avg_ms(t->transfer_us, t->ops));
+    json_object_set_double_member(avg, "mb_per_s", stats_throughput(t));
+
+    for (l = stats->recent.head; l; l = l->next) {
+        TransferRecord *record = (TransferRecord *)l->data;
+        JsonObject *item = json_object_new();
+
+        json_object_set_string_member(item, "remote_path", record->remote_path);
+        json_object_set_string_member(item, "direction", record->is_upload ? "up" : "down");
+        json_object_set_string_member(item, "result",
+                                      record->success ? "ok" :
+                                      record->cancelled ? "cancelled" : "failed");
+        json_object_set_boolean_member(item, "cache_hit", record->cache_hit);
+        json_object_set_int_member(item, "finished", record->finished);
+        json_object_set_int_member(item, "size", (gint64)record->size);
+        json_object_set_int_member(item, "bytes", (gint64)record->bytes);
+        json_object_set_int_member(item, "requests", record->requests);
+        stats_set_ms(item, "queue_ms", record->queue_us);
+        stats_set_ms(item, "connect_ms", record->connect_us);
+        stats_set_ms(item, "lock_ms", record->lock_us);
+        stats_set_ms(item, "first_byte_ms", record->first_byte_us);
+        stats_set_ms(item, "disk_ms", record->disk_us);
+        stats_set_ms(item, "transfer_ms", record->transfer_us);
+        stats_set_ms(item, "total_ms", record->total_us);
+        json_object_set_double_member(item, "mb_per_s",
+            record->transfer_us > 0 ? record->bytes / (1024.0 * 1024.0) /
+                                      (record->transfer_us / 1e6) : 0);
+        json_array_add_object_element(recent, item);
+    }
+
+    g_mutex_unlock(&stats->lock);
+
+    json_object_set_object_member(obj, "totals", totals);
+    json_object_set_object_member(obj, "average", avg);
+    json_object_set_array_member(obj, "recent", recent);
+    return obj;
+}
@@ -0,0 +1,287 @@
+/*
+ * Transfer Statistics View
+ * Live per-connection transfer timing, and a JSON dump of the same data
+ */
+
+#include "sftp-plugin.h"
+
+#include <json-glib/json-glib.h>
+
+#define STATSVIEW_RESPONSE_RESET 1
+#define STATSVIEW_RESPONSE_SAVE 2
+
+enum {
+    STATS_COL_NAME,
+    STATS_COL_OPS,
+    STATS_COL_FAILED,
+    STATS_COL_CACHE_HITS,
+    STATS_COL_UP_MB,
+    STATS_COL_DOWN_MB,
+    STATS_COL_RATE,
+    STATS_COL_QUEUE_MS,
+    STATS_COL_CHANNEL_MS,
+    STATS_COL_LOCK_MS,
+    STATS_COL_FIRST_BYTE_MS,
+    STATS_COL_DISK_MS,
+    STATS_COL_REQUESTS,
+    STATS_NUM_COLS
+};
+
+typedef struct {
+    SFTPPluginData *plugin_data;
+    GtkWidget *dialog;
+    GtkListStore *store;
+    guint timer_id;
+} StatsView;
+
+/* Only one view is open at a time */
+static StatsView *stats_view = NULL;
+
+static void statsview_refresh(StatsView *view)
+{
+    SFTPPluginData *plugin_data = view->plugin_data;
+    gint i;
+
+    gtk_list_store_clear(view->store);
+    for (i = 0; i < plugin_data->num_connections; i++) {
+        SFTPSession *session = plugin_data->sessions[i];
+        TransferTotals t;
+        GtkTreeIter iter;
+
+        if (!session || !session->stats)
+            continue;
+        stats_get_totals(session->stats, &t);
+
+        gtk_list_store_append(view->store, &iter);
+        gtk_list_store_set(view->store, &iter,
+                           STATS_COL_NAME, plugin_data->connections[i].name,
+                           STATS_COL_OPS, t.ops,
+                           STATS_COL_FAILED, t.failed,
+                           STATS_COL_CACHE_HITS, t.cache_hits,
+                           STATS_COL_UP_MB, t.bytes_up / (1024.0 * 1024.0),
+                           STATS_COL_DOWN_MB, t.bytes_down / (1024.0 * 1024.0),
+                           STATS_COL_RATE, stats_throughput(&t),
+                           STATS_COL_QUEUE_MS, stats_avg_ms(t.queue_us, t.queued_ops),
+                           STATS_COL_CHANNEL_MS, stats_avg_ms(t.connect_us, t.queued_ops),
+                           STATS_COL_LOCK_MS, stats_avg_ms(t.lock_us, t.queued_ops),
+                           STATS_COL_FIRST_BYTE_MS, stats_avg_ms(t.first_byte_us, t.data_ops),
+                           STATS_COL_DISK_MS, stats_avg_ms(t.disk_us, t.ops),
+                           STATS_COL_REQUESTS, (guint)MIN(t.requests, G_MAXUINT),
+                           -1);
+    }
+}
+
+static gboolean statsview_timer_cb(gpointer data)
+{
+    statsview_refresh((StatsView *)data);
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Statistics of every connected session as one JSON document
+ */
+static gboolean statsview_save_json(SFTPPluginData *plugin_data, const gchar *file,
+                                    GError **error)
+{
+    JsonObject *obj = json_object_new();
+    JsonArray *connections = json_array_new();
+    JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+    JsonGenerator *gen = json_generator_new();
+    GDateTime *now = g_date_time_new_now_local();
+    gchar *stamp = g_date_time_format(now, "%Y-%m-%dT%H:%M:%S%z");
+    gboolean ok;
+    gint i;
+
+    for (i = 0; i < plugin_data->num_connections; i++) {
+        SFTPSession *session = plugin_data->sessions[i];
+        SFTPConnection *conn = &plugin_data->connections[i];
+        JsonObject *item;
+
+        if (!session || !session->stats)
+            continue;
+        item = stats_to_json(session->stats);
+        json_object_set_string_member(item, "name", conn->name);
+        json_object_set_string_member(item, "hostname", conn->hostname);
+        json_object_set_int_member(item, "port", conn->port);
+        json_object_set_int_member(item, "max_channels", conn->max_channels);
+        json_array_add_object_element(connections, item);
+    }
+
+    json_object_set_string_member(obj, "generated", stamp);
+    json_object_set_array_member(obj, "connections", connections);
+    json_node_take_object(root, obj);
+    json_generator_set_root(gen, root);
+    json_generator_set_pretty(gen, TRUE);
+    ok = json_generator_to_file(gen, file, error);
+
+    g_object_unref(gen);
+    json_node_free(root);
+    g_free(stamp);
+    g_date_time_unref(now);
+    return ok;
+}
+
+static void statsview_ask_save(StatsView *view)
+{
+    GtkWidget *chooser;
+    GError *error = NULL;
+
+    chooser = gtk_file_chooser_dialog_new("Save Transfer Statistics", GTK_WINDOW(view->dialog),
+                                          GTK_FILE_CHOOSER_ACTION_SAVE,
+                                          "_Cancel", GTK_RESPONSE_CANCEL,
+                                          "_Save", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(chooser), "sftp-stats.json");
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(chooser), TRUE);
+
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) == GTK_RESPONSE_ACCEPT) {
+        gchar *file = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+        if (!statsview_save_json(view->plugin_data, file, &error)) {
+            dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Cannot save statistics: %s",
+                                error->message);
+            g_error_free(error);
+        }
+        g_free(file);
+    }
+    gtk_widget_destroy(chooser);
+}
+
+static void on_statsview_response(GtkDialog *dialog, gint response, gpointer data)
+{
+    StatsView *view = (StatsView *)data;
+    SFTPPluginData *plugin_data = view->plugin_data;
+    gint i;
+
+    if (response == STATSVIEW_RESPONSE_RESET) {
+        for (i = 0; i < plugin_data->num_connections; i++)
+            if (plugin_data->sessions[i] && plugin_data->sessions[i]->stats)
+                stats_reset(plugin_data->sessions[i]->stats);
+        statsview_refresh(view);
+        return;
+    }
+    if (response == STATSVIEW_RESPONSE_SAVE) {
+        statsview_ask_save(view);
+        return;
+    }
+    gtk_widget_destroy(GTK_WIDGET(dialog));
+}
+
+static void on_statsview_destroy(GtkWidget *widget, gpointer data)
+{
+    StatsView *view = (StatsView *)data;
+    (void)widget;
+
+    g_source_remove(view->timer_id);
+    g_object_unref(view->store);
+    if (stats_view == view)
+        stats_view = NULL;
+    g_free(view);
+}
+
+/* Doubles are shown with one decimal instead of GValue's full precision */
+static void statsview_double_cell(GtkTreeViewColumn *column, GtkCellRenderer *renderer,
+                                  GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+    gdouble value;
+    gchar text[32];
+    (void)column;
+
+    gtk_tree_model_get(model, iter, GPOINTER_TO_INT(data), &value, -1);
+    g_snprintf(text, sizeof(text), "%.1f", value);
+    g_object_set(renderer, "text", text, NULL);
+}
+
+static void statsview_add_column(GtkTreeView *tree, const gchar *title, gint col,
+                                 gboolean is_double)
+{
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    GtkTreeViewColumn *column;
+
+    if (is_double) {
+        column = gtk_tree_view_column_new();
+        gtk_tree_view_column_set_title(column, title);
+        gtk_tree_view_column_pack_start(column, renderer, TRUE);
+        gtk_tree_view_column_set_cell_data_func(column, renderer, statsview_double_cell,
+                                                GINT_TO_POINTER(col), NULL);
+    } else {
+        column = gtk_tree_view_column_new_with_attributes(title, renderer, "text", col, NULL);
+    }
+    gtk_tree_view_column_set_resizable(column, TRUE);
+    gtk_tree_view_append_column(tree, column);
+}
+
+/*
+ * Show the statistics of all connected sessions, refreshed every second
+ */
+void statsview_show_dialog(SFTPPluginData *plugin_data)
+{
+    StatsView *view;
+    GtkWidget *content;
+    GtkWidget *scrolled;
+    GtkWidget *tree;
+    GtkWidget *label;
+
+    if (stats_view) {
+        gtk_window_present(GTK_WINDOW(stats_view->dialog));
+        return;
+    }
+
+    view = g_new0(StatsView, 1);
+    view->plugin_data = plugin_data;
+    view->store = gtk_list_store_new(STATS_NUM_COLS, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT,
+                                     G_TYPE_UINT, G_TYPE_DOUBLE, G_TYPE_DOUBLE, G_TYPE_DOUBLE,
+                                     G_TYPE_DOUBLE, G_TYPE_DOUBLE, G_TYPE_DOUBLE, G_TYPE_DOUBLE,
+                                     G_TYPE_DOUBLE, G_TYPE_UINT);
+
+    view->dialog = gtk_dialog_new_with_buttons("Transfer Statistics", NULL, 0,
+                                               "_Reset", STATSVIEW_RESPONSE_RESET,
+                                               "Save _JSON...", STATSVIEW_RESPONSE_SAVE,
+                                               "_Close", GTK_RESPONSE_CLOSE, NULL);
+    gtk_window_set_default_size(GTK_WINDOW(view->dialog), 900, 220);
+    content = gtk_dialog_get_content_area(GTK_DIALOG(view->dialog));
+
+    label = gtk_label_new("Averages per transfer, in milliseconds. Queue: waiting for a worker. "
+                          "Channel: waiting for or opening a connection. Lock: waiting for the "
+                          "channel. First byte: from lock to first data. Disk: local reads "
+                          "and writes.");
+    gtk_label_set_line_wrap(GTK_LABEL(label), TRUE);
+    gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), label, FALSE, FALSE, 5);
+
+    tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(view->store));
+    statsview_add_column(GTK_TREE_VIEW(tree), "Connection", STATS_COL_NAME, FALSE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Transfers", STATS_COL_OPS, FALSE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Failed", STATS_COL_FAILED, FALSE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Cached", STATS_COL_CACHE_HITS, FALSE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Up MB", STATS_COL_UP_MB, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Down MB", STATS_COL_DOWN_MB, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "MB/s", STATS_COL_RATE, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Queue", STATS_COL_QUEUE_MS, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Channel", STATS_COL_CHANNEL_MS, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Lock", STATS_COL_LOCK_MS, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "First byte", STATS_COL_FIRST_BYTE_MS, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Disk", STATS_COL_DISK_MS, TRUE);
+    statsview_add_column(GTK_TREE_VIEW(tree), "Requests", STATS_COL_REQUESTS, FALSE);
+
+    scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled), tree);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 5);
+
+    g_signal_connect(view->dialog, "response", G_CALLBACK(on_statsview_response), view);
+    g_signal_connect(view->dialog, "destroy", G_CALLBACK(on_statsview_destroy), view);
+
+    statsview_refresh(view);
+    view->timer_id = g_timeout_add_seconds(1, statsview_timer_cb, view);
+    stats_view = view;
+    gtk_widget_show_all(view->dialog);
+}
+
+/*
+ * Close the view; its timer must not outlive the plugin
+ */
+void statsview_shutdown(SFTPPluginData *plugin_data)
+{
+    if (stats_view && stats_view->plugin_data == plugin_data)
+        gtk_widget_destroy(stats_view->dialog);
+}
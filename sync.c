@@ -7,16 +7,7 @@
 #include "compat.h"
 
 #include <sys/stat.h>
-
-/*
- * Compare modification time of two files
- */
-static gint compare_file_time(time_t t1, time_t t2)
-{
-    if (t1 < t2) return -1;
-    if (t1 > t2) return 1;
-    return 0;
-}
+#include <glib/gstdio.h>
 
 /*
  * Download remote file to temp location for comparison
@@ -65,261 +56,237 @@ static gboolean download_remote_file(SFTPSession *session, const gchar *remote_p
     libssh2_sftp_close(sftp_handle);
     fclose(local_file);
 
-    return TRUE;
-}
-
-/*
- * Use external diff tool to compare files
- */
-static gboolean run_external_diff(const gchar *local, const gchar *remote_temp)
-{
-    const gchar *diff_tools[] = {"meld", "diff", "kdiff3", NULL};
-    gchar *cmd;
-    int i;
-    int result;
-
-    for (i = 0; diff_tools[i] != NULL; i++) {
-        /* Check if tool exists */
-        if (system(g_strdup_printf("which %s > /dev/null 2>&1", diff_tools[i])) == 0) {
-            /* Run diff tool */
-            cmd = g_strdup_printf("%s %s %s", diff_tools[i], local, remote_temp);
-            g_print("Running diff tool: %s\n", cmd);
-            result = system(cmd);
-            g_free(cmd);
-            remove(remote_temp);
-            return (result == 0);
-        }
+    /* A truncated copy would show up as a bogus diff */
+    if (rc < 0) {
+        g_printerr("Read error on remote file: %s\n", remote_path);
+        remove(local_temp_path);
+        return FALSE;
     }
 
-    g_printerr("No external diff tool found\n");
-    return FALSE;
+    return TRUE;
 }
 
 /*
- * Compare local and remote files
+ * Decide from size and checksum alone whether two files are identical.
+ * Different sizes answer "no" without any transfer; equal sizes cost one
+ * round trip to hash the remote file on the server. Returns FALSE when
+ * the files differ or the server can't hash, in which case the caller
+ * downloads the remote file for a real diff.
  */
-gboolean sync_compare_files(SFTPPluginData *plugin_data, const gchar *local,
-                             const gchar *remote)
+static gboolean files_known_identical(SFTPSession *session, const gchar *local,
+                                      const gchar *remote, goffset local_size,
+                                      const LIBSSH2_SFTP_ATTRIBUTES *remote_stat)
 {
-    struct stat local_stat;
-    LIBSSH2_SFTP_ATTRIBUTES remote_stat;
-    SFTPSession *session;
-    gchar remote_temp[MAX_PATH_LEN];
-    gboolean result;
+    gchar *remote_digest;
+    gchar *local_digest;
+    gboolean same;
 
-    if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
-        g_printerr("Not connected to server\n");
+    if (!(remote_stat->flags & LIBSSH2_SFTP_ATTR_SIZE) ||
+        (goffset)remote_stat->filesize != local_size)
         return FALSE;
-    }
 
-    session = plugin_data->sessions[plugin_data->current_connection];
-
-    /* Get local file info */
-    if (stat(local, &local_stat) != 0) {
-        g_printerr("Cannot get local file info: %s\n", local);
+    remote_digest = sftp_remote_sha256(session, remote);
+    if (!remote_digest)
         return FALSE;
-    }
 
-    /* Get remote file info */
-    if (libssh2_sftp_stat(session->sftp_session, remote, &remote_stat) != 0) {
-        g_printerr("Cannot get remote file info: %s\n", remote);
-        return FALSE;
-    }
+    local_digest = sftp_local_sha256(local);
+    same = local_digest && strcmp(local_digest, remote_digest) == 0;
+    g_print("SHA-256 local %s, remote %s\n", local_digest ? local_digest : "?", remote_digest);
 
-    g_print("Local file size: %ld, mtime: %ld\n", (long)local_stat.st_size,
-           (long)local_stat.st_mtime);
-    g_print("Remote file size: %ld, mtime: %ld\n", (long)remote_stat.filesize,
-           (long)remote_stat.mtime);
+    g_free(local_digest);
+    g_free(remote_digest);
+    return same;
+}
 
-    /* Download remote file to temp location */
-    if (!download_remote_file(session, remote, remote_temp)) {
-        return FALSE;
-    }
+/* A compare running on the session's worker pool */
+typedef struct {
+    SFTPPluginData *plugin_data;
+    gchar *local;
+    gchar *remote;
+    gchar *diff_tool;       /* External tool to open, or NULL for the built-in diff */
+    gchar remote_temp[MAX_PATH_LEN];
+    gboolean downloaded;
+    gboolean identical;
+    gchar *diff;            /* Built-in diff, or NULL */
+    gchar *error;
+    gboolean cancelled;
+} CompareJob;
+
+static void compare_job_free(CompareJob *job)
+{
+    if (job->downloaded)
+        g_remove(job->remote_temp);
+    g_free(job->local);
+    g_free(job->remote);
+    g_free(job->diff_tool);
+    g_free(job->diff);
+    g_free(job->error);
+    g_free(job);
+}
 
-    /* Use external diff tool to compare */
-    result = run_external_diff(local, remote_temp);
-
-    if (!result) {
-        /* If external tool fails, show simple comparison result */
-        gint time_cmp = compare_file_time(local_stat.st_mtime, remote_stat.mtime);
-
-        if (time_cmp < 0) {
-            dialogs_show_msgbox(GTK_MESSAGE_INFO,
-                "Local file is older\n"
-                "Remote file is newer\n"
-                "Suggest downloading remote file");
-        } else if (time_cmp > 0) {
-            dialogs_show_msgbox(GTK_MESSAGE_INFO,
-                "Local file is newer\n"
-                "Remote file is older\n"
-                "Suggest uploading local file");
-        } else {
-            dialogs_show_msgbox(GTK_MESSAGE_INFO,
-                "File modification times are the same\n"
-                "Files may be identical");
-        }
-    }
+/* External tool exited: its copy of the remote file can go */
+static void on_diff_tool_exit(GPid pid, gint status, gpointer data)
+{
+    gchar *remote_temp = (gchar *)data;
+    (void)status;
 
-    return TRUE;
+    g_remove(remote_temp);
+    g_free(remote_temp);
+    g_spawn_close_pid(pid);
 }
 
 /*
- * Upload file (sync operation)
+ * Start the external diff tool without waiting for it
  */
-gboolean sync_upload_file(SFTPPluginData *plugin_data, const gchar *local,
-                          const gchar *remote)
+static gboolean spawn_diff_tool(CompareJob *job, GError **error)
 {
-    SFTPSession *session;
+    gchar *argv[] = {job->diff_tool, job->local, job->remote_temp, NULL};
+    GPid pid;
 
-    if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
-        g_printerr("Not connected to server\n");
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                       NULL, NULL, &pid, error))
         return FALSE;
-    }
-
-    session = plugin_data->sessions[plugin_data->current_connection];
 
-    g_print("Sync upload: %s -> %s\n", local, remote);
-
-    if (sftp_upload_file(session, local, remote, NULL)) {
-        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Upload successful");
-        return TRUE;
-    } else {
-        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Upload failed");
-        return FALSE;
-    }
+    g_print("Started diff tool: %s %s %s\n", job->diff_tool, job->local, job->remote_temp);
+    g_child_watch_add(pid, on_diff_tool_exit, g_strdup(job->remote_temp));
+    job->downloaded = FALSE;    /* The exit handler removes it */
+    return TRUE;
 }
 
 /*
- * Download file (sync operation)
+ * Show a built-in diff in a new document
  */
-gboolean sync_download_file(SFTPPluginData *plugin_data, const gchar *remote,
-                            const gchar *local)
+static void show_diff_document(CompareJob *job)
 {
-    SFTPSession *session;
+    gchar *base = g_path_get_basename(job->remote);
+    gchar *name = g_strconcat(base, ".diff", NULL);
+    gchar *text = job->diff;
 
-    if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
-        g_printerr("Not connected to server\n");
-        return FALSE;
-    }
+    if (!g_utf8_validate(text, -1, NULL))
+        text = g_utf8_make_valid(job->diff, -1);
 
-    session = plugin_data->sessions[plugin_data->current_connection];
+    document_new_file(name, filetypes_index(GEANY_FILETYPES_DIFF), text);
 
-    g_print("Sync download: %s -> %s\n", remote, local);
+    if (text != job->diff)
+        g_free(text);
+    g_free(name);
+    g_free(base);
+}
 
-    if (sftp_download_file(session, remote, local, NULL)) {
-        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Download successful");
-        return TRUE;
-    } else {
-        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Download failed");
-        return FALSE;
+/* Main loop: show the outcome of a compare */
+static gboolean compare_complete_idle(gpointer data)
+{
+    CompareJob *job = (CompareJob *)data;
+    GError *error = NULL;
+
+    if (job->cancelled) {
+        g_print("Compare cancelled: %s\n", job->remote);
+    } else if (job->error) {
+        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "%s", job->error);
+    } else if (job->identical || (job->diff && !job->diff[0])) {
+        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Files are identical");
+    } else if (job->diff) {
+        show_diff_document(job);
+    } else if (!spawn_diff_tool(job, &error)) {
+        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Cannot run %s: %s", job->diff_tool,
+                            error->message);
+        g_error_free(error);
     }
+
+    compare_job_free(job);
+    return G_SOURCE_REMOVE;
 }
 
 /*
- * Smart sync: determine sync direction based on file modification time
+ * Compare job, runs on the session's worker pool. The channel is only held
+ * for the network part; the diff itself runs after it is released.
  */
-gboolean sync_auto_sync(SFTPPluginData *plugin_data, const gchar *local,
-                        const gchar *remote)
+static void compare_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
 {
-    struct stat local_stat;
+    CompareJob *job = (CompareJob *)data;
     LIBSSH2_SFTP_ATTRIBUTES remote_stat;
-    SFTPSession *session;
-    gint time_cmp;
-
-    if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
-        g_printerr("Not connected to server\n");
-        return FALSE;
+    struct stat local_stat;
+    SFTPSession *channel;
+    gchar *label;
+    GError *error = NULL;
+
+    if (cancelled) {
+        job->cancelled = TRUE;
+        g_idle_add(compare_complete_idle, job);
+        return;
     }
 
-    session = plugin_data->sessions[plugin_data->current_connection];
-
-    /* Get file info */
-    if (stat(local, &local_stat) != 0) {
-        g_printerr("Cannot get local file info: %s\n", local);
-        return FALSE;
+    if (stat(job->local, &local_stat) != 0) {
+        job->error = g_strdup_printf("Cannot get local file info: %s", job->local);
+        g_idle_add(compare_complete_idle, job);
+        return;
     }
 
-    if (libssh2_sftp_stat(session->sftp_session, remote, &remote_stat) != 0) {
-        g_printerr("Cannot get remote file info: %s\n", remote);
-        return FALSE;
+    /* Don't share a channel with a running transfer */
+    channel = sftp_session_lease(session, TRUE);
+    g_mutex_lock(&channel->lock);
+
+    if (!sftp_remote_stat(channel, job->remote, &remote_stat)) {
+        job->error = g_strdup_printf("Cannot get remote file info: %s", job->remote);
+    } else {
+        g_print("Local file size: %ld, mtime: %ld\n", (long)local_stat.st_size,
+                (long)local_stat.st_mtime);
+        g_print("Remote file size: %ld, mtime: %ld\n", (long)remote_stat.filesize,
+                (long)remote_stat.mtime);
+
+        /* Most compares are of unchanged files: settle those without a download */
+        job->identical = files_known_identical(channel, job->local, job->remote,
+                                               (goffset)local_stat.st_size, &remote_stat);
+        if (!job->identical) {
+            job->downloaded = download_remote_file(channel, job->remote, job->remote_temp);
+            if (!job->downloaded)
+                job->error = g_strdup_printf("Cannot download %s", job->remote);
+        }
     }
 
-    /* Compare modification time */
-    time_cmp = compare_file_time(local_stat.st_mtime, remote_stat.mtime);
+    g_mutex_unlock(&channel->lock);
+    sftp_session_release(channel);
 
-    if (time_cmp < 0) {
-        g_print("Local file is older, downloading from remote\n");
-        return sync_download_file(plugin_data, remote, local);
-    } else if (time_cmp > 0) {
-        g_print("Local file is newer, uploading to remote\n");
-        return sync_upload_file(plugin_data, local, remote);
-    } else {
-        g_print("File times are the same, no sync needed\n");
-        return TRUE;
+    if (job->downloaded && !job->diff_tool) {
+        label = g_strconcat("remote:", job->remote, NULL);
+        job->diff = diff_files_unified(job->remote_temp, job->local, label, job->local, &error);
+        if (!job->diff) {
+            job->error = g_strdup(error->message);
+            g_error_free(error);
+        }
+        g_free(label);
     }
+
+    g_idle_add(compare_complete_idle, job);
 }
 
 /*
- * Show sync dialog
+ * Compare a local file with a remote one in the background. The result is
+ * shown as a diff document, or in the configured external diff tool.
+ * Returns FALSE if the compare could not be started.
  */
-gboolean sync_show_sync_dialog(SFTPPluginData *plugin_data, const gchar *local)
+gboolean sync_compare_files(SFTPPluginData *plugin_data, const gchar *local,
+                             const gchar *remote)
 {
-    GtkWidget *dialog;
-    GtkWidget *content_area;
-    GtkWidget *label;
-    GtkWidget *vbox;
-    gint result;
-    gchar remote_path[MAX_PATH_LEN];
-
-    /* Build remote path */
-    gchar *base = g_path_get_basename(local);
-    if (plugin_data->current_remote_path[strlen(plugin_data->current_remote_path) - 1] == '/') {
-        g_snprintf(remote_path, MAX_PATH_LEN, "%s%s",
-                  plugin_data->current_remote_path, base);
-    } else {
-        g_snprintf(remote_path, MAX_PATH_LEN, "%s/%s",
-                  plugin_data->current_remote_path, base);
-    }
-    g_free(base);
+    SFTPSession *session;
+    CompareJob *job;
 
-    /* Create dialog */
-    dialog = gtk_dialog_new_with_buttons("File Sync", NULL, GTK_DIALOG_MODAL,
-                                        "_Cancel", GTK_RESPONSE_CANCEL,
-                                        "Compare", 1,
-                                        "Upload", 2,
-                                        "Download", 3,
-                                        "Auto", 4,
-                                        "_OK", GTK_RESPONSE_OK, NULL);
-
-    content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-
-    vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_container_add(GTK_CONTAINER(content_area), vbox);
-
-    gchar *label_text = g_strdup_printf("Local file: %s\nRemote path: %s", local, remote_path);
-    label = gtk_label_new(label_text);
-    g_free(label_text);
-    gtk_box_pack_start(GTK_BOX(vbox), label, TRUE, TRUE, 10);
-
-    gtk_widget_show_all(vbox);
-
-    result = gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
-
-    switch (result) {
-        case 1: /* Compare */
-            return sync_compare_files(plugin_data, local, remote_path);
-        case 2: /* Upload */
-            return sync_upload_file(plugin_data, local, remote_path);
-        case 3: /* Download */
-            return sync_download_file(plugin_data, remote_path, local);
-        case 4: /* Auto */
-            return sync_auto_sync(plugin_data, local, remote_path);
-        default:
-            return FALSE;
+    if (plugin_data->current_connection < 0 ||
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active) {
+        g_printerr("Not connected to server\n");
+        return FALSE;
     }
+
+    session = plugin_data->sessions[plugin_data->current_connection];
+
+    job = g_new0(CompareJob, 1);
+    job->plugin_data = plugin_data;
+    job->local = g_strdup(local);
+    job->remote = g_strdup(remote);
+    if (plugin_data->diff_tool[0])
+        job->diff_tool = g_strdup(plugin_data->diff_tool);
+
+    sftp_session_push_job(session, JOB_PRIORITY_HIGH, compare_job_func, job, &job->cancelled);
+    return TRUE;
 }
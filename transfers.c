@@ -0,0 +1,516 @@
+/*
+ * Transfer Manager
+ * Queued, running and finished transfers in one docked list, refreshed by
+ * a single timer that runs only while something is in flight
+ */
+
+#include "sftp-plugin.h"
+
+#define TRANSFERS_TICK_MS 250
+#define TRANSFERS_KEEP_FINISHED 100     /* Finished rows kept before the oldest is dropped */
+#define TRANSFERS_RATE_SMOOTHING 0.3    /* Weight of the newest sample in the speed average */
+
+typedef enum {
+    TRANSFER_QUEUED,
+    TRANSFER_RUNNING,
+    TRANSFER_DONE,
+    TRANSFER_FAILED,
+    TRANSFER_CANCELLED,
+    TRANSFER_PAUSED
+} TransferState;
+
+/*
+ * One row of the list. It outlives its FileOperation: op is only set
+ * between the QUEUED and FINISHED events, after which whoever owns the op
+ * may free it.
+ */
+typedef struct {
+    FileOperation *op;
+    guint session_id;           /* For retries: only that session may repeat the copy */
+    gchar *connection;
+    gchar local_path[MAX_PATH_LEN];
+    gchar remote_path[MAX_PATH_LEN];
+    gboolean is_upload;
+    TransferState state;
+    gboolean pausing;           /* Cancelled by Pause: finishes as PAUSED */
+    gsize total;
+    gsize done;
+    gsize last_done;            /* At the previous tick, for the speed */
+    gint64 last_tick;
+    gdouble rate;               /* Bytes per second, smoothed */
+    GtkTreeIter iter;           /* List store iters persist while the row exists */
+} TransferEntry;
+
+enum {
+    TRANSFERS_COL_NAME,
+    TRANSFERS_COL_DIRECTION,
+    TRANSFERS_COL_CONNECTION,
+    TRANSFERS_COL_STATUS,
+    TRANSFERS_COL_PERCENT,
+    TRANSFERS_COL_SIZE,
+    TRANSFERS_COL_RATE,
+    TRANSFERS_COL_ETA,
+    TRANSFERS_COL_ENTRY,
+    TRANSFERS_NUM_COLS
+};
+
+/* Widgets of the panel; there is one per plugin instance */
+static GtkWidget *transfers_page = NULL;
+static GtkListStore *transfers_store = NULL;
+static GtkWidget *transfers_tree = NULL;
+static guint transfers_tick_id = 0;
+
+static gboolean transfers_tick(gpointer data);
+
+static const gchar *transfers_state_text(TransferState state)
+{
+    switch (state) {
+        case TRANSFER_QUEUED: return "Queued";
+        case TRANSFER_RUNNING: return "Transferring";
+        case TRANSFER_DONE: return "Done";
+        case TRANSFER_FAILED: return "Failed";
+        case TRANSFER_CANCELLED: return "Cancelled";
+        case TRANSFER_PAUSED: return "Paused";
+    }
+    return "";
+}
+
+static gchar *transfers_format_size(gsize bytes)
+{
+    if (bytes >= 1048576)
+        return g_strdup_printf("%.1f MB", bytes / 1048576.0);
+    return g_strdup_printf("%.1f KB", bytes / 1024.0);
+}
+
+static void transfers_entry_free(gpointer data)
+{
+    TransferEntry *entry = (TransferEntry *)data;
+    g_free(entry->connection);
+    g_free(entry);
+}
+
+/*
+ * Write an entry's current state into its row
+ */
+static void transfers_update_row(TransferEntry *entry)
+{
+    gchar *done;
+    gchar *size;
+    gchar *rate = NULL;
+    gchar *eta = NULL;
+    gint percent;
+
+    if (!transfers_store)
+        return;
+
+    done = transfers_format_size(entry->done);
+    if (entry->total > 0) {
+        gchar *total = transfers_format_size(entry->total);
+        size = g_strdup_printf("%s / %s", done, total);
+        g_free(total);
+    } else {
+        size = g_strdup(done);
+    }
+    g_free(done);
+    percent = entry->total > 0 ? (gint)(100.0 * entry->done / entry->total) : 0;
+    if (entry->state == TRANSFER_DONE)
+        percent = 100;
+
+    if (entry->state == TRANSFER_RUNNING && entry->rate > 0) {
+        gint64 left;
+
+        rate = g_strdup_printf("%.1f KB/s", entry->rate / 1024.0);
+        if (entry->total > entry->done) {
+            left = (gint64)((entry->total - entry->done) / entry->rate);
+            eta = g_strdup_printf("%d:%02d", (gint)(left / 60), (gint)(left % 60));
+        }
+    }
+
+    gtk_list_store_set(transfers_store, &entry->iter,
+                       TRANSFERS_COL_STATUS, transfers_state_text(entry->state),
+                       TRANSFERS_COL_PERCENT, CLAMP(percent, 0, 100),
+                       TRANSFERS_COL_SIZE, size,
+                       TRANSFERS_COL_RATE, rate ? rate : "",
+                       TRANSFERS_COL_ETA, eta ? eta : "",
+                       -1);
+    g_free(size);
+    g_free(rate);
+    g_free(eta);
+}
+
+/*
+ * Add a row for the entry at the top of the list
+ */
+static void transfers_add_row(TransferEntry *entry)
+{
+    gchar *name = g_path_get_basename(entry->is_upload ? entry->local_path
+                                                       : entry->remote_path);
+
+    gtk_list_store_insert_with_values(transfers_store, &entry->iter, 0,
+                                      TRANSFERS_COL_NAME, name,
+                                      TRANSFERS_COL_DIRECTION,
+                                      entry->is_upload ? "Upload" : "Download",
+                                      TRANSFERS_COL_CONNECTION, entry->connection,
+                                      TRANSFERS_COL_ENTRY, entry,
+                                      -1);
+    g_free(name);
+    transfers_update_row(entry);
+}
+
+/*
+ * A stopped transfer with the same endpoints, which a new one takes over
+ */
+static TransferEntry *transfers_find_stopped(SFTPPluginData *plugin_data, FileOperation *op)
+{
+    GList *l;
+
+    for (l = plugin_data->completed_operations; l; l = l->next) {
+        TransferEntry *entry = (TransferEntry *)l->data;
+        if (entry->state != TRANSFER_DONE && entry->session_id == op->session->id &&
+            entry->is_upload == op->is_upload &&
+            strcmp(entry->local_path, op->local_path) == 0 &&
+            strcmp(entry->remote_path, op->remote_path) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static TransferEntry *transfers_find_op(SFTPPluginData *plugin_data, FileOperation *op)
+{
+    GList *l;
+
+    for (l = plugin_data->active_operations; l; l = l->next) {
+        TransferEntry *entry = (TransferEntry *)l->data;
+        if (entry->op == op)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Keep the finished list bounded; the oldest rows go first */
+static void transfers_trim_finished(SFTPPluginData *plugin_data)
+{
+    while (g_list_length(plugin_data->completed_operations) > TRANSFERS_KEEP_FINISHED) {
+        GList *last = g_list_last(plugin_data->completed_operations);
+        TransferEntry *entry = (TransferEntry *)last->data;
+
+        plugin_data->completed_operations =
+            g_list_delete_link(plugin_data->completed_operations, last);
+        if (transfers_store)
+            gtk_list_store_remove(transfers_store, &entry->iter);
+        transfers_entry_free(entry);
+    }
+}
+
+static void transfers_on_queued(SFTPPluginData *plugin_data, FileOperation *op)
+{
+    TransferEntry *entry = transfers_find_stopped(plugin_data, op);
+    gint i;
+
+    if (entry) {
+        /* Resumed or retried: reuse the row */
+        plugin_data->completed_operations =
+            g_list_remove(plugin_data->completed_operations, entry);
+    } else {
+        entry = g_new0(TransferEntry, 1);
+        entry->session_id = op->session->id;
+        g_strlcpy(entry->local_path, op->local_path, MAX_PATH_LEN);
+        g_strlcpy(entry->remote_path, op->remote_path, MAX_PATH_LEN);
+        entry->is_upload = op->is_upload;
+        for (i = 0; i < plugin_data->num_connections; i++)
+            if (plugin_data->sessions[i] && plugin_data->sessions[i]->id == op->session->id)
+                entry->connection = g_strdup(plugin_data->connections[i].name);
+        if (!entry->connection)
+            entry->connection = g_strdup("");
+        if (transfers_store)
+            transfers_add_row(entry);
+    }
+
+    entry->op = op;
+    entry->state = TRANSFER_QUEUED;
+    entry->pausing = FALSE;
+    entry->total = 0;
+    entry->done = 0;
+    entry->last_done = 0;
+    entry->last_tick = g_get_monotonic_time();
+    entry->rate = 0;
+    plugin_data->active_operations = g_list_prepend(plugin_data->active_operations, entry);
+    transfers_update_row(entry);
+
+    if (!transfers_tick_id)
+        transfers_tick_id = g_timeout_add(TRANSFERS_TICK_MS, transfers_tick, plugin_data);
+}
+
+static void transfers_on_finished(SFTPPluginData *plugin_data, FileOperation *op)
+{
+    TransferEntry *entry = transfers_find_op(plugin_data, op);
+
+    if (!entry)
+        return;
+
+    entry->op = NULL;
+    entry->total = op->total_size;
+    entry->done = (gsize)g_atomic_pointer_get(&op->transferred);
+    if (op->success)
+        entry->state = TRANSFER_DONE;
+    else if (entry->pausing)
+        entry->state = TRANSFER_PAUSED;
+    else if (op->cancelled)
+        entry->state = TRANSFER_CANCELLED;
+    else
+        entry->state = TRANSFER_FAILED;
+
+    plugin_data->active_operations = g_list_remove(plugin_data->active_operations, entry);
+    plugin_data->completed_operations = g_list_prepend(plugin_data->completed_operations, entry);
+    transfers_update_row(entry);
+    transfers_trim_finished(plugin_data);
+}
+
+/*
+ * Session observer: sees every transfer_async op, on the main thread
+ */
+void transfers_observe(FileOperation *op, TransferEvent event, gpointer user_data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)user_data;
+
+    /* Ops drained after shutdown finish unseen */
+    if (!transfers_store)
+        return;
+    if (event == TRANSFER_EVENT_QUEUED)
+        transfers_on_queued(plugin_data, op);
+    else
+        transfers_on_finished(plugin_data, op);
+}
+
+/*
+ * The shared refresh: progress and speed of every transfer in flight
+ */
+static gboolean transfers_tick(gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    gint64 now = g_get_monotonic_time();
+    GList *l;
+
+    if (!plugin_data->active_operations) {
+        transfers_tick_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    for (l = plugin_data->active_operations; l; l = l->next) {
+        TransferEntry *entry = (TransferEntry *)l->data;
+        FileOperation *op = entry->op;
+        gdouble seconds = (now - entry->last_tick) / 1e6;
+
+        entry->done = (gsize)g_atomic_pointer_get(&op->transferred);
+        entry->total = op->total_size;
+        if (op->started_at)
+            entry->state = TRANSFER_RUNNING;
+        if (seconds > 0 && entry->done >= entry->last_done) {
+            gdouble sample = (entry->done - entry->last_done) / seconds;
+            entry->rate = entry->rate > 0
+                ? TRANSFERS_RATE_SMOOTHING * sample + (1 - TRANSFERS_RATE_SMOOTHING) * entry->rate
+                : sample;
+        }
+        entry->last_done = entry->done;
+        entry->last_tick = now;
+        transfers_update_row(entry);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static TransferEntry *transfers_selected(void)
+{
+    GtkTreeSelection *selection;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    TransferEntry *entry = NULL;
+
+    selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(transfers_tree));
+    if (gtk_tree_selection_get_selected(selection, &model, &iter))
+        gtk_tree_model_get(model, &iter, TRANSFERS_COL_ENTRY, &entry, -1);
+    return entry;
+}
+
+static void on_transfers_pause(GtkButton *button, gpointer data)
+{
+    TransferEntry *entry = transfers_selected();
+    (void)button;
+    (void)data;
+
+    /* An interrupted transfer leaves a resume checkpoint; Resume continues from it */
+    if (entry && entry->op) {
+        entry->pausing = TRUE;
+        transfer_cancel(entry->op);
+    }
+}
+
+static void on_transfers_cancel(GtkButton *button, gpointer data)
+{
+    TransferEntry *entry = transfers_selected();
+    (void)button;
+    (void)data;
+
+    if (entry && entry->op) {
+        entry->pausing = FALSE;
+        transfer_cancel(entry->op);
+    }
+}
+
+/*
+ * Resume a paused transfer, or retry a failed or cancelled one. Only the
+ * copy is repeated: what the original caller meant to do afterwards (open
+ * the file, refresh the list) went with its callback. The session must be
+ * the one the row came from; once that is closed, even a session at the
+ * same address may talk to another host.
+ */
+static void on_transfers_resume(GtkButton *button, gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    TransferEntry *entry = transfers_selected();
+    SFTPSession *session;
+
+    (void)button;
+
+    if (!entry || entry->op || entry->state == TRANSFER_DONE)
+        return;
+
+    session = ui_find_session(plugin_data, entry->session_id);
+    if (!session || !session->active) {
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to %s", entry->connection);
+        return;
+    }
+
+    transfer_async(session, entry->local_path, entry->remote_path, entry->is_upload,
+                   JOB_PRIORITY_NORMAL, NULL, NULL, NULL);
+}
+
+static void on_transfers_clear(GtkButton *button, gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    GList *l = plugin_data->completed_operations;
+    (void)button;
+
+    /* Paused and failed rows stay so they can still be retried */
+    while (l) {
+        GList *next = l->next;
+        TransferEntry *entry = (TransferEntry *)l->data;
+
+        if (entry->state == TRANSFER_DONE || entry->state == TRANSFER_CANCELLED) {
+            plugin_data->completed_operations =
+                g_list_delete_link(plugin_data->completed_operations, l);
+            gtk_list_store_remove(transfers_store, &entry->iter);
+            transfers_entry_free(entry);
+        }
+        l = next;
+    }
+}
+
+static void transfers_add_column(const gchar *title, GtkCellRenderer *renderer,
+                                 const gchar *attribute, gint col, gboolean expand)
+{
+    GtkTreeViewColumn *column;
+
+    column = gtk_tree_view_column_new_with_attributes(title, renderer, attribute, col, NULL);
+    gtk_tree_view_column_set_resizable(column, TRUE);
+    gtk_tree_view_column_set_expand(column, expand);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(transfers_tree), column);
+}
+
+static GtkWidget *transfers_button(const gchar *label, GtkWidget *box, GCallback handler,
+                                   SFTPPluginData *plugin_data)
+{
+    GtkWidget *button = gtk_button_new_with_mnemonic(label);
+    g_signal_connect(button, "clicked", handler, plugin_data);
+    gtk_box_pack_start(GTK_BOX(box), button, FALSE, FALSE, 0);
+    return button;
+}
+
+/*
+ * Add the Transfers page to Geany's message window and start watching
+ * transfers
+ */
+void transfers_init(SFTPPluginData *plugin_data)
+{
+    GeanyData *geany_data = plugin_data->geany_data;
+    GtkWidget *scrolled;
+    GtkWidget *buttons;
+
+    transfers_store = gtk_list_store_new(TRANSFERS_NUM_COLS, G_TYPE_STRING, G_TYPE_STRING,
+                                         G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT,
+                                         G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+                                         G_TYPE_POINTER);
+    transfers_tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(transfers_store));
+    transfers_add_column("File", gtk_cell_renderer_text_new(), "text", TRANSFERS_COL_NAME, TRUE);
+    transfers_add_column("Direction", gtk_cell_renderer_text_new(), "text",
+                         TRANSFERS_COL_DIRECTION, FALSE);
+    transfers_add_column("Connection", gtk_cell_renderer_text_new(), "text",
+                         TRANSFERS_COL_CONNECTION, FALSE);
+    transfers_add_column("Status", gtk_cell_renderer_text_new(), "text",
+                         TRANSFERS_COL_STATUS, FALSE);
+    transfers_add_column("Progress", gtk_cell_renderer_progress_new(), "value",
+                         TRANSFERS_COL_PERCENT, FALSE);
+    transfers_add_column("Size", gtk_cell_renderer_text_new(), "text", TRANSFERS_COL_SIZE, FALSE);
+    transfers_add_column("Speed", gtk_cell_renderer_text_new(), "text", TRANSFERS_COL_RATE, FALSE);
+    transfers_add_column("ETA", gtk_cell_renderer_text_new(), "text", TRANSFERS_COL_ETA, FALSE);
+
+    scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled), transfers_tree);
+
+    buttons = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    transfers_button("_Pause", buttons, G_CALLBACK(on_transfers_pause), plugin_data);
+    transfers_button("_Resume/Retry", buttons, G_CALLBACK(on_transfers_resume), plugin_data);
+    transfers_button("_Cancel", buttons, G_CALLBACK(on_transfers_cancel), plugin_data);
+    transfers_button("C_lear Finished", buttons, G_CALLBACK(on_transfers_clear), plugin_data);
+
+    transfers_page = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(transfers_page), scrolled, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(transfers_page), buttons, FALSE, FALSE, 0);
+    gtk_widget_show_all(transfers_page);
+
+    gtk_notebook_append_page(GTK_NOTEBOOK(geany_data->main_widgets->message_window_notebook),
+                             transfers_page, gtk_label_new("SFTP Transfers"));
+}
+
+/*
+ * Bring the Transfers page to the front
+ */
+void transfers_present(SFTPPluginData *plugin_data)
+{
+    GtkNotebook *notebook =
+        GTK_NOTEBOOK(plugin_data->geany_data->main_widgets->message_window_notebook);
+    gint page;
+
+    if (!transfers_page)
+        return;
+    page = gtk_notebook_page_num(notebook, transfers_page);
+    if (page >= 0)
+        gtk_notebook_set_current_page(notebook, page);
+}
+
+/*
+ * Drop the page and every entry. Call after the sessions are freed;
+ * their drained ops are then ignored by transfers_observe.
+ */
+void transfers_shutdown(SFTPPluginData *plugin_data)
+{
+    if (transfers_tick_id) {
+        g_source_remove(transfers_tick_id);
+        transfers_tick_id = 0;
+    }
+    g_list_free_full(plugin_data->active_operations, transfers_entry_free);
+    g_list_free_full(plugin_data->completed_operations, transfers_entry_free);
+    plugin_data->active_operations = NULL;
+    plugin_data->completed_operations = NULL;
+
+    if (transfers_page) {
+        gtk_widget_destroy(transfers_page);
+        transfers_page = NULL;
+        transfers_tree = NULL;
+    }
+    if (transfers_store) {
+        g_object_unref(transfers_store);
+        transfers_store = NULL;
+    }
+}
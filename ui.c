@@ -11,6 +11,10 @@
 static void download_and_open_file(SFTPPluginData *plugin_data, const gchar *filename);
 static void navigate_to_directory(SFTPPluginData *plugin_data, const gchar *dirname);
 static void navigate_to_path(SFTPPluginData *plugin_data, const gchar *path);
+static GtkListStore *create_file_list_store(void);
+static gchar *remote_child_path(const gchar *dir, const gchar *name);
+static void start_folder_transfer(SFTPPluginData *plugin_data, SFTPSession *session,
+                                  const gchar *local, const gchar *remote, gboolean is_upload);
 
 /* Context for async upload callback */
 typedef struct {
@@ -38,7 +42,8 @@ static void on_upload_complete(FileOperation *op, gboolean success, gpointer use
     if (success) {
         dialogs_show_msgbox(GTK_MESSAGE_INFO, "Upload success: %s", ctx->remote_path);
         ui_update_file_list(ctx->plugin_data);
-    } else {
+    } else if (!op->cancelled) {
+        /* Cancelled or paused from the transfer list: nothing to report */
         dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Upload failed");
     }
     /* Re-enable UI */
@@ -46,7 +51,6 @@ static void on_upload_complete(FileOperation *op, gboolean success, gpointer use
     gtk_widget_set_sensitive(ctx->plugin_data->refresh_btn, TRUE);
     gtk_widget_set_sensitive(ctx->plugin_data->file_treeview, TRUE);
     g_free(ctx);
-    g_thread_unref(op->thread);
     g_free(op);
 }
 
@@ -54,18 +58,26 @@ static void on_download_open_complete(FileOperation *op, gboolean success, gpoin
 {
     DownloadOpenCtx *ctx = (DownloadOpenCtx *)user_data;
     if (success) {
+        DownloadedFile *old = g_hash_table_lookup(ctx->plugin_data->downloaded_files,
+                                                  ctx->local_path);
+        DownloadedFile *file = g_new0(DownloadedFile, 1);
+        file->remote_path = g_strdup(ctx->remote_path);
+        /* A poll of the previous copy must not describe this one */
+        file->generation = old ? old->generation + 1 : 0;
+        file->signature = op->signature;
+        op->signature = NULL;
         g_hash_table_insert(ctx->plugin_data->downloaded_files,
-                            g_strdup(ctx->local_path), g_strdup(ctx->remote_path));
+                            g_strdup(ctx->local_path), file);
         document_open_file(ctx->local_path, FALSE, NULL, NULL);
         g_print("Opened file: %s (remote: %s)\n", ctx->local_path, ctx->remote_path);
-    } else {
+    } else if (!op->cancelled) {
         dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Failed to download: %s", ctx->filename);
     }
+    delta_signature_unref(op->signature);
     gtk_widget_set_sensitive(ctx->plugin_data->upload_btn, TRUE);
     gtk_widget_set_sensitive(ctx->plugin_data->refresh_btn, TRUE);
     gtk_widget_set_sensitive(ctx->plugin_data->file_treeview, TRUE);
     g_free(ctx);
-    g_thread_unref(op->thread);
     g_free(op);
 }
 
@@ -74,13 +86,12 @@ static void on_download_save_complete(FileOperation *op, gboolean success, gpoin
     DownloadSaveCtx *ctx = (DownloadSaveCtx *)user_data;
     if (success)
         dialogs_show_msgbox(GTK_MESSAGE_INFO, "Downloaded: %s", ctx->local_path);
-    else
+    else if (!op->cancelled)
         dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Download failed");
     gtk_widget_set_sensitive(ctx->plugin_data->upload_btn, TRUE);
     gtk_widget_set_sensitive(ctx->plugin_data->refresh_btn, TRUE);
     gtk_widget_set_sensitive(ctx->plugin_data->file_treeview, TRUE);
     g_free(ctx);
-    g_thread_unref(op->thread);
     g_free(op);
 }
 
@@ -114,6 +125,48 @@ void ui_update_connection_combo(SFTPPluginData *plugin_data)
     update_connection_combo(plugin_data);
 }
 
+/*
+ * Session with the given id, or NULL once it has been closed. Dialogs and
+ * timers that outlive a session keep its id rather than the pointer.
+ */
+SFTPSession *ui_find_session(SFTPPluginData *plugin_data, guint id)
+{
+    gint i;
+
+    for (i = 0; id && i < plugin_data->num_connections; i++)
+        if (plugin_data->sessions[i] && plugin_data->sessions[i]->id == id)
+            return plugin_data->sessions[i];
+    return NULL;
+}
+
+/*
+ * Show connection status below the connection selector
+ */
+static void set_connection_status(SFTPPluginData *plugin_data, const gchar *text)
+{
+    if (plugin_data->statusbar_label)
+        gtk_label_set_text(GTK_LABEL(plugin_data->statusbar_label), text);
+}
+
+/*
+ * Update connect button label for the selected connection
+ */
+static void update_connect_button(SFTPPluginData *plugin_data)
+{
+    SFTPSession *session;
+
+    if (plugin_data->current_connection < 0)
+        return;
+
+    session = plugin_data->sessions[plugin_data->current_connection];
+    if (session && session->active)
+        gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Disconnect");
+    else if (session)
+        gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Cancel");
+    else
+        gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Connect");
+}
+
 /*
  * Connection combo changed callback
  */
@@ -125,19 +178,88 @@ static void on_connection_changed(GtkWidget *widget, gpointer data)
     (void)widget;
     active = gtk_combo_box_get_active(GTK_COMBO_BOX(plugin_data->connection_combo));
     if (active >= 0 && active < plugin_data->num_connections) {
+        if (active != plugin_data->current_connection)
+            ui_cancel_file_list(plugin_data);
         plugin_data->current_connection = active;
 
-        /* Update button label based on connection state */
-        if (plugin_data->sessions[active] && plugin_data->sessions[active]->active) {
-            gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Disconnect");
-        } else {
-            gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Connect");
-        }
+        /* Update button label and status based on connection state */
+        update_connect_button(plugin_data);
+        if (!plugin_data->sessions[active])
+            set_connection_status(plugin_data, "Disconnected");
+        else if (!plugin_data->sessions[active]->active)
+            set_connection_status(plugin_data, "Connecting...");
+        else
+            set_connection_status(plugin_data, "Connected");
 
         g_print("Selected: %s\n", plugin_data->connections[active].name);
     }
 }
 
+/*
+ * Async connect finished (or was cancelled)
+ */
+static void on_connect_complete(SFTPSession *session, gboolean success, gpointer user_data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)user_data;
+    SFTPConnection *conn;
+    gint index = -1;
+    gint i;
+
+    for (i = 0; i < plugin_data->num_connections; i++) {
+        if (plugin_data->sessions[i] == session) {
+            index = i;
+            break;
+        }
+    }
+
+    /* Cancelled or deleted while connecting: the session is ours to drop */
+    if (index < 0) {
+        session->config = NULL;
+        sftp_session_free(session);
+        return;
+    }
+
+    conn = &plugin_data->connections[index];
+
+    if (!success) {
+        plugin_data->sessions[index] = NULL;
+        sftp_session_free(session);
+        if (index == plugin_data->current_connection) {
+            update_connect_button(plugin_data);
+            set_connection_status(plugin_data, "Connection failed");
+        }
+        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Connection to %s failed", conn->name);
+        return;
+    }
+
+    /* Create temp directory for this session */
+    g_snprintf(session->temp_dir, sizeof(session->temp_dir),
+             "%s/geany_sftp_%s_%d", g_get_tmp_dir(), conn->name, (int)time(NULL));
+    g_mkdir_with_parents(session->temp_dir, 0755);
+
+    g_print("Connected to %s (temp: %s)\n", conn->name, session->temp_dir);
+
+    /* Files opened for editing go through the persistent cache */
+    session->file_cache = plugin_data->file_cache;
+
+    /* Queued transfers show up in the transfer list */
+    session->transfer_observer = transfers_observe;
+    session->transfer_observer_data = plugin_data;
+
+    /* Push changes made under the mapped local folder */
+    session->local_watch = local_watch_start(session);
+
+    if (index != plugin_data->current_connection)
+        return;
+
+    strcpy(plugin_data->current_remote_path, conn->remote_dir);
+    set_connection_status(plugin_data, "Connected");
+    update_connect_button(plugin_data);
+
+    /* Update file list */
+    ui_update_file_list(plugin_data);
+}
+
 /*
  * Connect button clicked callback
  */
@@ -146,6 +268,7 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data)
     SFTPPluginData *plugin_data = (SFTPPluginData *)data;
     SFTPConnection *conn;
     SFTPSession *session;
+    gchar *status;
 
     (void)widget;
 
@@ -155,14 +278,25 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data)
     }
 
     conn = &plugin_data->connections[plugin_data->current_connection];
+    session = plugin_data->sessions[plugin_data->current_connection];
+
+    /* Cancel a pending connect; the completion callback frees the session */
+    if (session && !session->active) {
+        sftp_connection_cancel(session);
+        plugin_data->sessions[plugin_data->current_connection] = NULL;
+        conn->state = CONN_DISCONNECTED;
+        update_connect_button(plugin_data);
+        set_connection_status(plugin_data, "Connection cancelled");
+        g_print("Cancelled connecting to %s\n", conn->name);
+        return;
+    }
 
     /* Check if already connected */
-    if (plugin_data->sessions[plugin_data->current_connection] &&
-        plugin_data->sessions[plugin_data->current_connection]->active) {
+    if (session) {
         /* Disconnect */
-        sftp_connection_disconnect(plugin_data->sessions[plugin_data->current_connection]);
-        g_mutex_clear(&plugin_data->sessions[plugin_data->current_connection]->lock);
-        g_free(plugin_data->sessions[plugin_data->current_connection]);
+        ui_cancel_file_list(plugin_data);
+        dirsync_session_closing(session);
+        sftp_session_free(session);
         plugin_data->sessions[plugin_data->current_connection] = NULL;
 
         /* Clear file list and path */
@@ -173,42 +307,22 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data)
         strcpy(plugin_data->current_remote_path, "/");
 
         /* Update button label */
-        gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Connect");
+        update_connect_button(plugin_data);
+        set_connection_status(plugin_data, "Disconnected");
 
         g_print("Disconnected from %s\n", conn->name);
         return;
     }
 
-    /* Create new session */
-    session = g_new0(SFTPSession, 1);
-    session->config = conn;
-    session->sock = 0;
-    session->ssh_session = NULL;
-    session->sftp_session = NULL;
-    session->active = FALSE;
-    g_mutex_init(&session->lock);
-
-    /* Connect */
-    if (sftp_connection_connect(session)) {
-        /* Create temp directory for this session */
-        g_snprintf(session->temp_dir, sizeof(session->temp_dir),
-                 "%s/geany_sftp_%s_%d", g_get_tmp_dir(), conn->name, (int)time(NULL));
-        g_mkdir_with_parents(session->temp_dir, 0755);
-
-        plugin_data->sessions[plugin_data->current_connection] = session;
-        strcpy(plugin_data->current_remote_path, conn->remote_dir);
+    /* Create new session and connect in the background */
+    session = sftp_session_new(conn);
+    plugin_data->sessions[plugin_data->current_connection] = session;
+    sftp_connection_connect_async(session, on_connect_complete, plugin_data);
 
-        /* Update file list */
-        ui_update_file_list(plugin_data);
-
-        /* Update button label */
-        gtk_button_set_label(GTK_BUTTON(plugin_data->connect_btn), "Disconnect");
-
-        g_print("Connected to %s (temp: %s)\n", conn->name, session->temp_dir);
-    } else {
-        g_free(session);
-        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Connection failed");
-    }
+    status = g_strdup_printf("Connecting to %s...", conn->hostname);
+    set_connection_status(plugin_data, status);
+    g_free(status);
+    update_connect_button(plugin_data);
 }
 
 /*
@@ -221,11 +335,15 @@ static void on_refresh_clicked(GtkWidget *widget, gpointer data)
     (void)widget;
 
     if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active) {
         dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
         return;
     }
 
+    /* An explicit refresh always goes to the server */
+    dir_cache_invalidate(plugin_data->sessions[plugin_data->current_connection]->dir_cache,
+                         plugin_data->current_remote_path);
     ui_update_file_list(plugin_data);
 }
 
@@ -264,9 +382,9 @@ static void on_upload_clicked(GtkWidget *widget, gpointer data)
     gtk_widget_set_sensitive(plugin_data->upload_btn, FALSE);
     gtk_widget_set_sensitive(plugin_data->refresh_btn, FALSE);
     gtk_widget_set_sensitive(plugin_data->file_treeview, FALSE);
-    FileOperation *op = transfer_async(session, doc->file_name, remote_path, TRUE,
-                                       on_upload_complete, ctx);
-    ui_show_progress_dialog(plugin_data, op);
+    transfer_async(session, doc->file_name, remote_path, TRUE,
+                   JOB_PRIORITY_NORMAL, NULL, on_upload_complete, ctx);
+    transfers_present(plugin_data);
 }
 
 /*
@@ -362,7 +480,8 @@ static void download_and_open_file(SFTPPluginData *plugin_data, const gchar *fil
     gchar local_path[MAX_PATH_LEN];
 
     if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection])
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active)
         return;
 
     session = plugin_data->sessions[plugin_data->current_connection];
@@ -387,9 +506,11 @@ static void download_and_open_file(SFTPPluginData *plugin_data, const gchar *fil
     gtk_widget_set_sensitive(plugin_data->upload_btn, FALSE);
     gtk_widget_set_sensitive(plugin_data->refresh_btn, FALSE);
     gtk_widget_set_sensitive(plugin_data->file_treeview, FALSE);
-    FileOperation *op = transfer_async(session, local_path, remote_path, FALSE,
-                                       on_download_open_complete, ctx);
-    ui_show_progress_dialog(plugin_data, op);
+    DeltaSignature *signature = delta_signature_new();
+    transfer_async(session, local_path, remote_path, FALSE, JOB_PRIORITY_HIGH, signature,
+                   on_download_open_complete, ctx);
+    delta_signature_unref(signature);
+    transfers_present(plugin_data);
 }
 
 /*
@@ -454,14 +575,41 @@ static void on_menu_download(GtkMenuItem *item, gpointer data)
     if (!get_selected_file(plugin_data, &filename, &type))
         return;
 
-    if (strcmp(type, "DIR") == 0) {
+    if (strcmp(filename, "..") == 0) {
         g_free(filename);
         g_free(type);
-        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Directory download not supported yet");
         return;
     }
 
     session = plugin_data->sessions[plugin_data->current_connection];
+    if (!session || !session->active) {
+        g_free(filename);
+        g_free(type);
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
+        return;
+    }
+
+    if (strcmp(type, "DIR") == 0) {
+        /* Choose the folder to download into */
+        dialog = gtk_file_chooser_dialog_new("Download Folder Into", NULL,
+                                              GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                              "_Cancel", GTK_RESPONSE_CANCEL,
+                                              "_Download", GTK_RESPONSE_ACCEPT, NULL);
+        if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+            gchar *parent = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+            gchar *remote = remote_child_path(plugin_data->current_remote_path, filename);
+
+            local_path = g_build_filename(parent, filename, NULL);
+            start_folder_transfer(plugin_data, session, local_path, remote, FALSE);
+            g_free(local_path);
+            g_free(remote);
+            g_free(parent);
+        }
+        gtk_widget_destroy(dialog);
+        g_free(filename);
+        g_free(type);
+        return;
+    }
 
     /* Choose save location */
     dialog = gtk_file_chooser_dialog_new("Save File", NULL,
@@ -486,9 +634,9 @@ static void on_menu_download(GtkMenuItem *item, gpointer data)
         gtk_widget_set_sensitive(plugin_data->upload_btn, FALSE);
         gtk_widget_set_sensitive(plugin_data->refresh_btn, FALSE);
         gtk_widget_set_sensitive(plugin_data->file_treeview, FALSE);
-        FileOperation *fop = transfer_async(session, local_path, remote_path, FALSE,
-                                            on_download_save_complete, ctx);
-        ui_show_progress_dialog(plugin_data, fop);
+        transfer_async(session, local_path, remote_path, FALSE, JOB_PRIORITY_NORMAL, NULL,
+                       on_download_save_complete, ctx);
+        transfers_present(plugin_data);
         g_free(local_path);
     }
 
@@ -497,46 +645,225 @@ static void on_menu_download(GtkMenuItem *item, gpointer data)
     g_free(type);
 }
 
-static void on_menu_delete(GtkMenuItem *item, gpointer data)
+static void on_menu_upload_folder(GtkMenuItem *item, gpointer data)
 {
     SFTPPluginData *plugin_data = (SFTPPluginData *)data;
     SFTPSession *session;
+    GtkWidget *dialog;
+    (void)item;
+
+    session = plugin_data->sessions[plugin_data->current_connection];
+    if (!session || !session->active) {
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
+        return;
+    }
+
+    dialog = gtk_file_chooser_dialog_new("Upload Folder", NULL,
+                                          GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                          "_Cancel", GTK_RESPONSE_CANCEL,
+                                          "_Upload", GTK_RESPONSE_ACCEPT, NULL);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        gchar *local = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        gchar *name = g_path_get_basename(local);
+        gchar *remote = remote_child_path(plugin_data->current_remote_path, name);
+
+        start_folder_transfer(plugin_data, session, local, remote, TRUE);
+        g_free(remote);
+        g_free(name);
+        g_free(local);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+static void on_menu_compare(GtkMenuItem *item, gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    GeanyDocument *doc = document_get_current();
     gchar *filename, *type;
-    gchar remote_path[MAX_PATH_LEN];
-    int rc;
+    gchar *remote;
     (void)item;
 
     if (!get_selected_file(plugin_data, &filename, &type))
         return;
 
-    if (!dialogs_show_question("Delete '%s'?", filename)) {
+    if (strcmp(type, "DIR") == 0) {
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Select a file to compare");
+    } else if (!doc || !doc->file_name || !g_file_test(doc->file_name, G_FILE_TEST_IS_REGULAR)) {
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Save the current document first");
+    } else {
+        remote = remote_child_path(plugin_data->current_remote_path, filename);
+        if (!sync_compare_files(plugin_data, doc->file_name, remote))
+            dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
+        g_free(remote);
+    }
+
+    g_free(filename);
+    g_free(type);
+}
+
+static void on_menu_sync_folder(GtkMenuItem *item, gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    gchar *filename, *type;
+    gchar *remote;
+    (void)item;
+
+    /* The selected folder, or the one being shown */
+    if (get_selected_file(plugin_data, &filename, &type)) {
+        if (strcmp(type, "DIR") == 0 && strcmp(filename, "..") != 0)
+            remote = remote_child_path(plugin_data->current_remote_path, filename);
+        else
+            remote = g_strdup(plugin_data->current_remote_path);
         g_free(filename);
         g_free(type);
-        return;
+    } else {
+        remote = g_strdup(plugin_data->current_remote_path);
     }
 
-    session = plugin_data->sessions[plugin_data->current_connection];
+    dirsync_show_dialog(plugin_data, remote);
+    g_free(remote);
+}
 
-    if (strcmp(plugin_data->current_remote_path, "/") == 0) {
-        g_snprintf(remote_path, sizeof(remote_path), "/%s", filename);
+static void on_menu_stats(GtkMenuItem *item, gpointer data)
+{
+    (void)item;
+    statsview_show_dialog((SFTPPluginData *)data);
+}
+
+/* Remote changes made from the context menu */
+typedef enum {
+    REMOTE_OP_UNLINK,
+    REMOTE_OP_RMDIR,
+    REMOTE_OP_MKDIR
+} RemoteOpKind;
+
+/* A context menu change running on the session's worker pool */
+typedef struct {
+    SFTPPluginData *plugin_data;
+    RemoteOpKind kind;
+    gchar path[MAX_PATH_LEN];
+    gchar parent[MAX_PATH_LEN];
+    gchar *name;            /* As shown to the user */
+    gboolean cancelled;
+    gboolean success;
+} RemoteOpJob;
+
+/* Main loop: report the outcome of a context menu change */
+static gboolean remote_op_complete_idle(gpointer data)
+{
+    RemoteOpJob *job = (RemoteOpJob *)data;
+
+    if (job->cancelled) {
+        g_print("Cancelled: %s\n", job->path);
+    } else if (job->kind == REMOTE_OP_MKDIR) {
+        if (job->success)
+            dialogs_show_msgbox(GTK_MESSAGE_INFO, "Created: %s", job->name);
+        else
+            dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Failed to create directory");
     } else {
-        g_snprintf(remote_path, sizeof(remote_path), "%s/%s",
-                 plugin_data->current_remote_path, filename);
+        if (job->success)
+            dialogs_show_msgbox(GTK_MESSAGE_INFO, "Deleted: %s", job->name);
+        else
+            dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Delete failed (may not be empty)");
     }
 
-    if (strcmp(type, "DIR") == 0) {
-        rc = libssh2_sftp_rmdir(session->sftp_session, remote_path);
+    if (job->success)
+        ui_update_file_list(job->plugin_data);
+
+    g_free(job->name);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Worker: make the change on a leased channel. The listing cache is
+ * updated here, since the session may be gone by the time the main loop
+ * sees the result.
+ */
+static void remote_op_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    RemoteOpJob *job = (RemoteOpJob *)data;
+
+    if (cancelled) {
+        job->cancelled = TRUE;
     } else {
-        rc = libssh2_sftp_unlink(session->sftp_session, remote_path);
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+        int rc;
+
+        g_mutex_lock(&channel->lock);
+        switch (job->kind) {
+            case REMOTE_OP_UNLINK:
+                rc = libssh2_sftp_unlink(channel->sftp_session, job->path);
+                break;
+            case REMOTE_OP_RMDIR:
+                rc = libssh2_sftp_rmdir(channel->sftp_session, job->path);
+                break;
+            default:
+                rc = libssh2_sftp_mkdir(channel->sftp_session, job->path,
+                                        LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP |
+                                        LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
+                                        LIBSSH2_SFTP_S_IXOTH);
+                break;
+        }
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+
+        job->success = rc == 0;
+        if (job->success) {
+            if (job->kind != REMOTE_OP_MKDIR)
+                dir_cache_invalidate(session->dir_cache, job->path);
+            dir_cache_invalidate(session->dir_cache, job->parent);
+        }
     }
 
-    if (rc == 0) {
-        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Deleted: %s", filename);
-        ui_update_file_list(plugin_data);
+    g_idle_add(remote_op_complete_idle, job);
+}
+
+/*
+ * Queue a change to name in the current remote directory. Returns FALSE
+ * if not connected.
+ */
+static gboolean remote_op_start(SFTPPluginData *plugin_data, RemoteOpKind kind,
+                                const gchar *name)
+{
+    SFTPSession *session = plugin_data->current_connection >= 0 ?
+                           plugin_data->sessions[plugin_data->current_connection] : NULL;
+    RemoteOpJob *job;
+
+    if (!session || !session->active)
+        return FALSE;
+
+    job = g_new0(RemoteOpJob, 1);
+    job->plugin_data = plugin_data;
+    job->kind = kind;
+    job->name = g_strdup(name);
+    g_strlcpy(job->parent, plugin_data->current_remote_path, sizeof(job->parent));
+    if (strcmp(plugin_data->current_remote_path, "/") == 0) {
+        g_snprintf(job->path, sizeof(job->path), "/%s", name);
     } else {
-        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Delete failed (may not be empty)");
+        g_snprintf(job->path, sizeof(job->path), "%s/%s",
+                 plugin_data->current_remote_path, name);
     }
 
+    sftp_session_push_job(session, JOB_PRIORITY_HIGH, remote_op_job_func, job, &job->cancelled);
+    return TRUE;
+}
+
+static void on_menu_delete(GtkMenuItem *item, gpointer data)
+{
+    SFTPPluginData *plugin_data = (SFTPPluginData *)data;
+    gchar *filename, *type;
+    (void)item;
+
+    if (!get_selected_file(plugin_data, &filename, &type))
+        return;
+
+    if (dialogs_show_question("Delete '%s'?", filename) &&
+        !remote_op_start(plugin_data,
+                         strcmp(type, "DIR") == 0 ? REMOTE_OP_RMDIR : REMOTE_OP_UNLINK,
+                         filename))
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
+
     g_free(filename);
     g_free(type);
 }
@@ -544,35 +871,13 @@ static void on_menu_delete(GtkMenuItem *item, gpointer data)
 static void on_menu_mkdir(GtkMenuItem *item, gpointer data)
 {
     SFTPPluginData *plugin_data = (SFTPPluginData *)data;
-    SFTPSession *session;
-    gchar remote_path[MAX_PATH_LEN];
     gchar *dirname;
     (void)item;
 
     dirname = dialogs_show_input("Create Directory", NULL, "Folder name:", "New Folder");
-    if (!dirname || strlen(dirname) == 0) {
-        g_free(dirname);
-        return;
-    }
-
-    session = plugin_data->sessions[plugin_data->current_connection];
-
-    if (strcmp(plugin_data->current_remote_path, "/") == 0) {
-        g_snprintf(remote_path, sizeof(remote_path), "/%s", dirname);
-    } else {
-        g_snprintf(remote_path, sizeof(remote_path), "%s/%s",
-                 plugin_data->current_remote_path, dirname);
-    }
-
-    if (libssh2_sftp_mkdir(session->sftp_session, remote_path,
-                           LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP |
-                           LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
-                           LIBSSH2_SFTP_S_IXOTH) == 0) {
-        dialogs_show_msgbox(GTK_MESSAGE_INFO, "Created: %s", dirname);
-        ui_update_file_list(plugin_data);
-    } else {
-        dialogs_show_msgbox(GTK_MESSAGE_ERROR, "Failed to create directory");
-    }
+    if (dirname && strlen(dirname) > 0 &&
+        !remote_op_start(plugin_data, REMOTE_OP_MKDIR, dirname))
+        dialogs_show_msgbox(GTK_MESSAGE_WARNING, "Not connected to server");
 
     g_free(dirname);
 }
@@ -610,13 +915,29 @@ static gboolean on_file_button_press(GtkWidget *widget, GdkEventButton *event, g
     g_signal_connect(item, "activate", G_CALLBACK(on_menu_download), plugin_data);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
 
+    item = gtk_menu_item_new_with_label("Compare with Current Document");
+    g_signal_connect(item, "activate", G_CALLBACK(on_menu_compare), plugin_data);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
     item = gtk_separator_menu_item_new();
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
 
+    item = gtk_menu_item_new_with_label("Upload Folder...");
+    g_signal_connect(item, "activate", G_CALLBACK(on_menu_upload_folder), plugin_data);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
+    item = gtk_menu_item_new_with_label("Sync Folder...");
+    g_signal_connect(item, "activate", G_CALLBACK(on_menu_sync_folder), plugin_data);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
     item = gtk_menu_item_new_with_label("New Folder...");
     g_signal_connect(item, "activate", G_CALLBACK(on_menu_mkdir), plugin_data);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
 
+    item = gtk_menu_item_new_with_label("Transfer Statistics...");
+    g_signal_connect(item, "activate", G_CALLBACK(on_menu_stats), plugin_data);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
     item = gtk_separator_menu_item_new();
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
 
@@ -654,6 +975,8 @@ void ui_create_sidebar(SFTPPluginData *plugin_data)
     gtk_widget_show(connection_frame);
 
     /* Connection row - combo and button on same line */
+    GtkWidget *connection_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_widget_show(connection_box);
     connection_vbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 3);
     gtk_widget_show(connection_vbox);
 
@@ -671,7 +994,15 @@ void ui_create_sidebar(SFTPPluginData *plugin_data)
     g_signal_connect(plugin_data->connect_btn, "clicked", G_CALLBACK(on_connect_clicked), plugin_data);
     gtk_box_pack_start(GTK_BOX(connection_vbox), plugin_data->connect_btn, FALSE, FALSE, 0);
 
-    gtk_container_add(GTK_CONTAINER(connection_frame), connection_vbox);
+    gtk_box_pack_start(GTK_BOX(connection_box), connection_vbox, FALSE, FALSE, 0);
+
+    /* Connection status */
+    plugin_data->statusbar_label = gtk_label_new("Disconnected");
+    gtk_label_set_xalign(GTK_LABEL(plugin_data->statusbar_label), 0.0);
+    gtk_widget_show(plugin_data->statusbar_label);
+    gtk_box_pack_start(GTK_BOX(connection_box), plugin_data->statusbar_label, FALSE, FALSE, 0);
+
+    gtk_container_add(GTK_CONTAINER(connection_frame), connection_box);
     gtk_box_pack_start(GTK_BOX(sidebar_vbox), connection_frame, FALSE, FALSE, 0);
 
     /* File browser frame */
@@ -698,6 +1029,10 @@ void ui_create_sidebar(SFTPPluginData *plugin_data)
     g_signal_connect(plugin_data->upload_btn, "clicked", G_CALLBACK(on_upload_clicked), plugin_data);
     gtk_box_pack_start(GTK_BOX(toolbar), plugin_data->upload_btn, FALSE, FALSE, 0);
 
+    /* Listing spinner, shown only while a directory is being read */
+    plugin_data->list_spinner = gtk_spinner_new();
+    gtk_box_pack_end(GTK_BOX(toolbar), plugin_data->list_spinner, FALSE, FALSE, 0);
+
     gtk_box_pack_start(GTK_BOX(browser_vbox), toolbar, FALSE, FALSE, 0);
 
     /* Editable path entry */
@@ -715,7 +1050,7 @@ void ui_create_sidebar(SFTPPluginData *plugin_data)
     gtk_widget_show(scrolled_window);
 
     /* Create tree view with columns: Name(0), Type(1), Size(2), Icon(3), Modified(4), MTime(5-for sorting) */
-    list_store = gtk_list_store_new(6, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT64);
+    list_store = create_file_list_store();
 
     /* Create sortable model */
     GtkTreeSortable *sortable = GTK_TREE_SORTABLE(list_store);
@@ -781,185 +1116,448 @@ void ui_create_sidebar(SFTPPluginData *plugin_data)
     plugin_data->sidebar = sidebar_vbox;
 }
 
+/* State of an in-flight directory listing */
+typedef struct {
+    SFTPPluginData *plugin_data;
+    SFTPSession *session;
+    gchar path[MAX_PATH_LEN];
+    GtkListStore *store;    /* Filled while detached, attached once complete */
+    GPtrArray *entries;     /* Everything read so far, for the listing cache */
+    gboolean show_hidden;
+    gboolean cancelled;
+    gboolean success;
+} ListingRequest;
+
+/* A batch of entries travelling from the worker to the main loop */
+typedef struct {
+    ListingRequest *req;
+    GPtrArray *entries;
+} ListingBatch;
+
 /*
- * Update file list
+ * Create an empty file list store.
+ * Columns: Name(0), Type(1), Size(2), Icon(3), Modified(4), MTime(5-for sorting)
  */
-void ui_update_file_list(SFTPPluginData *plugin_data)
+static GtkListStore *create_file_list_store(void)
 {
-    GtkListStore *list_store;
-    GtkTreeIter iter;
-    SFTPSession *session;
-    LIBSSH2_SFTP_HANDLE *handle;
-    LIBSSH2_SFTP_ATTRIBUTES attrs;
-    char filename[256];
-    int rc;
+    return gtk_list_store_new(6, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+                              G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT64);
+}
 
-    if (plugin_data->current_connection < 0 ||
-        !plugin_data->sessions[plugin_data->current_connection]) {
-        return;
+/*
+ * Create a store holding only the ".." entry (if not at root)
+ */
+static GtkListStore *create_placeholder_store(const gchar *path)
+{
+    GtkListStore *store = create_file_list_store();
+
+    if (strcmp(path, "/") != 0) {
+        gtk_list_store_insert_with_values(store, NULL, -1,
+                                          0, "..", 1, "DIR", 2, "", 3, "folder",
+                                          4, "", 5, (gint64)0, -1);
     }
+    return store;
+}
 
-    session = plugin_data->sessions[plugin_data->current_connection];
+/*
+ * Append one remote entry to a file list store
+ */
+static void file_list_store_add(GtkListStore *store, const SFTPDirEntry *entry)
+{
+    const LIBSSH2_SFTP_ATTRIBUTES *attrs = &entry->attrs;
+    const gchar *type;
+    const gchar *icon;
+    gchar size_str[32];
+    gchar mtime_str[32];
+    gint64 mtime = 0;
+
+    /* Get modification time */
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        time_t t = (time_t)attrs->mtime;
+        mtime = (gint64)attrs->mtime;
+        strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M", localtime(&t));
+    } else {
+        strcpy(mtime_str, "");
+    }
 
-    list_store = GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(plugin_data->file_treeview)));
-    gtk_list_store_clear(list_store);
+    /* Determine file type and icon */
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS &&
+        (attrs->permissions & LIBSSH2_SFTP_S_IFDIR)) {
+        type = "DIR";
+        icon = "folder";
+        strcpy(size_str, "");
+    } else {
+        type = "FILE";
+        icon = "text-x-generic";
+        g_snprintf(size_str, sizeof(size_str), "%ld", (long)attrs->filesize);
+    }
 
-    /* Add ".." entry for parent directory (if not at root) */
-    if (strcmp(plugin_data->current_remote_path, "/") != 0) {
-        gtk_list_store_append(list_store, &iter);
-        gtk_list_store_set(list_store, &iter, 0, "..", 1, "DIR", 2, "", 3, "folder", 4, "", 5, (gint64)0, -1);
+    gtk_list_store_insert_with_values(store, NULL, -1,
+                                      0, entry->name,
+                                      1, type,
+                                      2, size_str,
+                                      3, icon,
+                                      4, mtime_str,
+                                      5, mtime,
+                                      -1);
+}
+
+/*
+ * Append a listing to a file list store, honouring the hidden-files setting
+ */
+static void file_list_store_add_entries(GtkListStore *store, GPtrArray *entries,
+                                        gboolean show_hidden)
+{
+    guint i;
+
+    for (i = 0; i < entries->len; i++) {
+        SFTPDirEntry *entry = g_ptr_array_index(entries, i);
+        if (entry->name[0] == '.' && !show_hidden)
+            continue; /* Skip hidden files */
+        file_list_store_add(store, entry);
     }
+}
+
+/*
+ * Show a store in the file view, keeping the user's sort order.
+ * The store is sorted once here, after all rows are in.
+ */
+static void attach_file_list_store(SFTPPluginData *plugin_data, GtkListStore *store)
+{
+    GtkTreeModel *old = gtk_tree_view_get_model(GTK_TREE_VIEW(plugin_data->file_treeview));
+    gint sort_column = 0;
+    GtkSortType order = GTK_SORT_ASCENDING;
+
+    gtk_tree_sortable_get_sort_column_id(GTK_TREE_SORTABLE(old), &sort_column, &order);
+    if (sort_column < 0)
+        sort_column = 0;
+    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store), sort_column, order);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(plugin_data->file_treeview), GTK_TREE_MODEL(store));
+}
+
+/*
+ * Stop the listing spinner
+ */
+static void listing_spinner_stop(SFTPPluginData *plugin_data)
+{
+    gtk_spinner_stop(GTK_SPINNER(plugin_data->list_spinner));
+    gtk_widget_hide(plugin_data->list_spinner);
+}
+
+/*
+ * Build "dir/name", without doubling the root's slash
+ */
+static gchar *remote_child_path(const gchar *dir, const gchar *name)
+{
+    if (strcmp(dir, "/") == 0)
+        return g_strconcat("/", name, NULL);
+    return g_strconcat(dir, "/", name, NULL);
+}
 
-    /* Open directory */
-    handle = libssh2_sftp_opendir(session->sftp_session, plugin_data->current_remote_path);
-    if (!handle) {
-        g_printerr("Cannot open directory: %s\n", plugin_data->current_remote_path);
+/*
+ * Prefetch the first visible subdirectories and the parent of path
+ * into the listing cache
+ */
+static void start_prefetch(SFTPPluginData *plugin_data, SFTPSession *session, const gchar *path)
+{
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(plugin_data->file_treeview));
+    GtkTreeIter iter;
+    GPtrArray *paths;
+    const gchar *slash;
+    gboolean valid;
+
+    if (session->config->prefetch_dirs <= 0 || session->config->dir_cache_ttl <= 0)
         return;
+
+    paths = g_ptr_array_new_with_free_func(g_free);
+
+    /* Visible order, so "first" means what the user sees at the top */
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid && paths->len < (guint)session->config->prefetch_dirs) {
+        gchar *name = NULL;
+        gchar *type = NULL;
+
+        gtk_tree_model_get(model, &iter, 0, &name, 1, &type, -1);
+        if (g_strcmp0(type, "DIR") == 0 && strcmp(name, "..") != 0)
+            g_ptr_array_add(paths, remote_child_path(path, name));
+        g_free(name);
+        g_free(type);
+        valid = gtk_tree_model_iter_next(model, &iter);
     }
 
-    /* Read directory contents */
-    while ((rc = libssh2_sftp_readdir(handle, filename, sizeof(filename), &attrs)) > 0) {
-        const gchar *type;
-        const gchar *icon;
-        gchar size_str[32];
-        gchar mtime_str[32];
-        gint64 mtime = 0;
+    slash = strrchr(path, '/');
+    if (slash && strcmp(path, "/") != 0)
+        g_ptr_array_add(paths, slash == path ? g_strdup("/") : g_strndup(path, slash - path));
 
-        /* Skip "." and ".." entries - we add ".." manually above */
-        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
-            continue;
-        }
+    if (paths->len > 0)
+        plugin_data->pending_prefetch = dir_cache_prefetch(session, paths);
+    g_ptr_array_unref(paths);
+}
 
-        if (filename[0] == '.' && !plugin_data->show_hidden_files) {
-            continue; /* Skip hidden files */
-        }
+/* Main loop: add a batch of entries to the detached store */
+static gboolean listing_batch_idle(gpointer data)
+{
+    ListingBatch *batch = (ListingBatch *)data;
+    ListingRequest *req = batch->req;
+    guint i;
 
-        /* Get modification time */
-        if (attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
-            mtime = (gint64)attrs.mtime;
-            struct tm *tm_info = localtime((time_t *)&attrs.mtime);
-            strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M", tm_info);
-        } else {
-            strcpy(mtime_str, "");
-        }
+    if (!req->cancelled) {
+        file_list_store_add_entries(req->store, batch->entries, req->show_hidden);
 
-        /* Determine file type and icon */
-        if (attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS &&
-            (attrs.permissions & LIBSSH2_SFTP_S_IFDIR)) {
-            type = "DIR";
-            icon = "folder";
-            strcpy(size_str, "");
-        } else {
-            type = "FILE";
-            icon = "text-x-generic";
-            g_snprintf(size_str, sizeof(size_str), "%ld", (long)attrs.filesize);
+        /* Hand the entries themselves over to the full listing */
+        for (i = 0; i < batch->entries->len; i++)
+            g_ptr_array_add(req->entries, g_ptr_array_index(batch->entries, i));
+        g_ptr_array_set_free_func(batch->entries, NULL);
+    }
+
+    g_ptr_array_unref(batch->entries);
+    g_free(batch);
+    return G_SOURCE_REMOVE;
+}
+
+/* Main loop: attach the finished store to the view */
+static gboolean listing_complete_idle(gpointer data)
+{
+    ListingRequest *req = (ListingRequest *)data;
+    SFTPPluginData *plugin_data = req->plugin_data;
+
+    if (!req->cancelled && plugin_data->pending_listing == req) {
+        plugin_data->pending_listing = NULL;
+        listing_spinner_stop(plugin_data);
+
+        if (req->success) {
+            dir_cache_store(req->session->dir_cache, req->path, req->entries);
+            attach_file_list_store(plugin_data, req->store);
+            start_prefetch(plugin_data, req->session, req->path);
         }
+    }
+
+    g_ptr_array_unref(req->entries);
+    g_object_unref(req->store);
+    g_free(req);
+    return G_SOURCE_REMOVE;
+}
+
+/* Worker batch callback: forward entries to the main loop */
+static void listing_batch_cb(GPtrArray *entries, gpointer user_data)
+{
+    ListingBatch *batch = g_new(ListingBatch, 1);
+    batch->req = (ListingRequest *)user_data;
+    batch->entries = entries;
+    g_idle_add(listing_batch_idle, batch);
+}
+
+/* Worker: read the directory. Idle sources run in the order they were
+ * added, so the completion always arrives after the last batch. */
+static void listing_job_func(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    ListingRequest *req = (ListingRequest *)data;
 
-        /* Add to list */
-        gtk_list_store_append(list_store, &iter);
-        gtk_list_store_set(list_store, &iter,
-                          0, filename,
-                          1, type,
-                          2, size_str,
-                          3, icon,
-                          4, mtime_str,
-                          5, mtime,
-                          -1);
+    if (!cancelled) {
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+
+        g_mutex_lock(&channel->lock);
+        req->success = sftp_read_directory(channel, req->path, DIR_LIST_BATCH_SIZE,
+                                           listing_batch_cb, req, &req->cancelled);
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
     }
 
-    libssh2_sftp_closedir(handle);
+    g_idle_add(listing_complete_idle, req);
+}
+
+/*
+ * Cancel the directory listing and prefetch in progress, if any.
+ * Must be called before the listing's session is freed.
+ */
+void ui_cancel_file_list(SFTPPluginData *plugin_data)
+{
+    ListingRequest *req = (ListingRequest *)plugin_data->pending_listing;
+
+    dir_cache_prefetch_cancel(plugin_data->pending_prefetch);
+    plugin_data->pending_prefetch = NULL;
+
+    if (!req)
+        return;
+
+    req->cancelled = TRUE;
+    sftp_session_cancel_job(req->session, req);
+    plugin_data->pending_listing = NULL;
+    listing_spinner_stop(plugin_data);
+    g_print("Cancelled listing of %s\n", req->path);
+}
+
+/*
+ * Update file list.
+ * A cached listing is shown at once; if it is older than the connection's
+ * TTL (or there is none) the directory is also read on the session's worker
+ * and streamed into a detached store that replaces the view when complete.
+ * With nothing cached the view shows only "..", so the user can still
+ * navigate away (which cancels the listing).
+ */
+void ui_update_file_list(SFTPPluginData *plugin_data)
+{
+    SFTPSession *session;
+    ListingRequest *req;
+    GPtrArray *cached;
+    gboolean fresh = FALSE;
+
+    if (plugin_data->current_connection < 0 ||
+        !plugin_data->sessions[plugin_data->current_connection] ||
+        !plugin_data->sessions[plugin_data->current_connection]->active) {
+        return;
+    }
+
+    session = plugin_data->sessions[plugin_data->current_connection];
+
+    ui_cancel_file_list(plugin_data);
 
     /* Update path entry */
     gtk_entry_set_text(GTK_ENTRY(plugin_data->path_entry),
                       plugin_data->current_remote_path);
+
+    cached = dir_cache_lookup(session->dir_cache, plugin_data->current_remote_path, &fresh);
+    if (cached) {
+        GtkListStore *store = create_placeholder_store(plugin_data->current_remote_path);
+        file_list_store_add_entries(store, cached, plugin_data->show_hidden_files);
+        attach_file_list_store(plugin_data, store);
+        g_object_unref(store);
+        g_ptr_array_unref(cached);
+        if (fresh) {
+            start_prefetch(plugin_data, session, plugin_data->current_remote_path);
+            return;
+        }
+    } else {
+        /* Swap in a placeholder so stale rows can't be opened against the new path */
+        GtkListStore *placeholder = create_placeholder_store(plugin_data->current_remote_path);
+        attach_file_list_store(plugin_data, placeholder);
+        g_object_unref(placeholder);
+    }
+
+    req = g_new0(ListingRequest, 1);
+    req->plugin_data = plugin_data;
+    req->session = session;
+    req->show_hidden = plugin_data->show_hidden_files;
+    g_strlcpy(req->path, plugin_data->current_remote_path, MAX_PATH_LEN);
+    req->store = create_placeholder_store(req->path);
+    req->entries = g_ptr_array_new_with_free_func(sftp_dir_entry_free);
+
+    plugin_data->pending_listing = req;
+    gtk_widget_show(plugin_data->list_spinner);
+    gtk_spinner_start(GTK_SPINNER(plugin_data->list_spinner));
+
+    sftp_session_push_job(session, JOB_PRIORITY_HIGH, listing_job_func, req, &req->cancelled);
 }
 
 /*
- * Progress dialog context
+ * Folder transfer progress context
  */
 typedef struct {
+    SFTPPluginData *plugin_data;
+    FolderTransfer *transfer;
     GtkWidget *dialog;
     GtkWidget *progress_bar;
     GtkWidget *label;
-    FileOperation *op;
     guint timer_id;
-} ProgressCtx;
+} FolderProgressCtx;
 
-/* Timer callback: update progress bar from worker thread's progress */
-static gboolean progress_timer_cb(gpointer data)
+/* Timer callback: show aggregated progress of all files */
+static gboolean folder_progress_timer_cb(gpointer data)
 {
-    ProgressCtx *ctx = (ProgressCtx *)data;
-    FileOperation *op = ctx->op;
-
-    if (op->completed || op->cancelled) {
-        gtk_widget_destroy(ctx->dialog);
-        g_free(ctx);
-        return G_SOURCE_REMOVE;
-    }
+    FolderProgressCtx *ctx = (FolderProgressCtx *)data;
+    FolderProgress progress;
+    gchar *text;
 
-    gsize transferred = (gsize)g_atomic_pointer_get(&op->transferred);
-    gsize total = op->total_size;
+    folder_transfer_progress(ctx->transfer, &progress);
 
-    if (total > 0) {
-        gdouble fraction = (gdouble)transferred / (gdouble)total;
-        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->progress_bar), fraction);
-
-        gchar *text;
-        if (total >= 1048576)
-            text = g_strdup_printf("%.1f / %.1f MB", transferred / 1048576.0, total / 1048576.0);
-        else
-            text = g_strdup_printf("%.1f / %.1f KB", transferred / 1024.0, total / 1024.0);
-        gtk_label_set_text(GTK_LABEL(ctx->label), text);
-        g_free(text);
+    if (progress.bytes_total > 0 && !progress.walking) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->progress_bar),
+                                      (gdouble)progress.bytes_done / (gdouble)progress.bytes_total);
     } else {
         gtk_progress_bar_pulse(GTK_PROGRESS_BAR(ctx->progress_bar));
     }
 
+    text = g_strdup_printf("%u / %u%s files, %.1f / %.1f MB%s",
+                           progress.files_done, progress.files_total,
+                           progress.walking ? "+" : "",
+                           progress.bytes_done / 1048576.0, progress.bytes_total / 1048576.0,
+                           progress.files_failed ? ", some failed" : "");
+    gtk_label_set_text(GTK_LABEL(ctx->label), text);
+    g_free(text);
+
     return G_SOURCE_CONTINUE;
 }
 
-/* Cancel button handler */
-static void on_progress_cancel(GtkDialog *dialog, gint response_id, gpointer data)
+/* Cancel button (or closing the dialog) stops the transfer */
+static void on_folder_progress_response(GtkDialog *dialog, gint response_id, gpointer data)
+{
+    FolderProgressCtx *ctx = (FolderProgressCtx *)data;
+    (void)response_id;
+
+    gtk_dialog_set_response_sensitive(dialog, GTK_RESPONSE_CANCEL, FALSE);
+    gtk_label_set_text(GTK_LABEL(ctx->label), "Cancelling...");
+    folder_transfer_cancel(ctx->transfer);
+}
+
+/* Main loop: the folder transfer has finished */
+static void on_folder_transfer_complete(FolderTransfer *transfer, gpointer user_data)
 {
-    ProgressCtx *ctx = (ProgressCtx *)data;
-    (void)dialog;
-    if (response_id == GTK_RESPONSE_CANCEL)
-        ctx->op->cancelled = TRUE;
+    FolderProgressCtx *ctx = (FolderProgressCtx *)user_data;
+    SFTPPluginData *plugin_data = ctx->plugin_data;
+    gchar *summary = folder_transfer_summary(transfer);
+
+    g_source_remove(ctx->timer_id);
+    gtk_widget_destroy(ctx->dialog);
+
+    dialogs_show_msgbox(folder_transfer_succeeded(transfer) ? GTK_MESSAGE_INFO : GTK_MESSAGE_WARNING,
+                        "%s", summary);
+
+    if (folder_transfer_is_upload(transfer) && plugin_data->current_connection >= 0 &&
+        plugin_data->sessions[plugin_data->current_connection] &&
+        plugin_data->sessions[plugin_data->current_connection]->active)
+        ui_update_file_list(plugin_data);
+
+    g_free(summary);
+    folder_transfer_free(transfer);
+    g_free(ctx);
 }
 
 /*
- * Show non-modal progress dialog that auto-updates from FileOperation
+ * Start a recursive folder transfer with a progress dialog. The browser
+ * stays usable meanwhile.
  */
-void ui_show_progress_dialog(SFTPPluginData *plugin_data, FileOperation *op)
+static void start_folder_transfer(SFTPPluginData *plugin_data, SFTPSession *session,
+                                  const gchar *local, const gchar *remote, gboolean is_upload)
 {
-    (void)plugin_data;
+    FolderProgressCtx *ctx = g_new0(FolderProgressCtx, 1);
+    GtkWidget *content;
+    gchar *name;
+    gchar *title;
 
-    ProgressCtx *ctx = g_new0(ProgressCtx, 1);
-    ctx->op = op;
-
-    gchar *title = g_strdup_printf("%s: %s",
-        op->is_upload ? "Uploading" : "Downloading",
-        g_path_get_basename(op->is_upload ? op->local_path : op->remote_path));
+    ctx->plugin_data = plugin_data;
 
+    name = g_path_get_basename(is_upload ? local : remote);
+    title = g_strdup_printf("%s folder: %s", is_upload ? "Uploading" : "Downloading", name);
     ctx->dialog = gtk_dialog_new_with_buttons(title, NULL, 0,
                                               "_Cancel", GTK_RESPONSE_CANCEL, NULL);
     g_free(title);
-    gtk_window_set_default_size(GTK_WINDOW(ctx->dialog), 350, 80);
+    g_free(name);
+    gtk_window_set_default_size(GTK_WINDOW(ctx->dialog), 400, 80);
 
-    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(ctx->dialog));
+    content = gtk_dialog_get_content_area(GTK_DIALOG(ctx->dialog));
 
     ctx->progress_bar = gtk_progress_bar_new();
-    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(ctx->progress_bar), TRUE);
     gtk_widget_show(ctx->progress_bar);
     gtk_box_pack_start(GTK_BOX(content), ctx->progress_bar, FALSE, FALSE, 10);
 
-    ctx->label = gtk_label_new("Starting...");
+    ctx->label = gtk_label_new("Scanning...");
     gtk_widget_show(ctx->label);
     gtk_box_pack_start(GTK_BOX(content), ctx->label, FALSE, FALSE, 5);
 
-    g_signal_connect(ctx->dialog, "response", G_CALLBACK(on_progress_cancel), ctx);
+    g_signal_connect(ctx->dialog, "response", G_CALLBACK(on_folder_progress_response), ctx);
     gtk_widget_show(ctx->dialog);
 
-    /* Poll progress every 100ms */
-    ctx->timer_id = g_timeout_add(100, progress_timer_cb, ctx);
+    ctx->transfer = folder_transfer_start(session, local, remote, is_upload,
+                                          on_folder_transfer_complete, ctx);
+    ctx->timer_id = g_timeout_add(100, folder_progress_timer_cb, ctx);
 }
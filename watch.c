@@ -0,0 +1,569 @@
+/*
+ * Local Watch Module
+ * Push files changed under a connection's local_dir to its remote_dir,
+ * whoever changed them (build tools, git, other editors)
+ */
+
+#include "sftp-core.h"
+#include "compat.h"
+
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+struct _LocalWatch {
+    SFTPSession *session;
+    gchar *local_root;
+    gchar *remote_root;
+    GPtrArray *ignore;          /* GPatternSpec, from watch_ignore */
+    GHashTable *monitors;       /* Local directory -> GFileMonitor */
+    GHashTable *batch;          /* Local files changed in the open batch */
+    GQueue queue;               /* Local files waiting for an upload slot */
+    GHashTable *queued;         /* Same files, for de-duplication */
+    GHashTable *running;        /* Local file -> WatchUpload in flight */
+    guint batch_timer;
+    gint64 batch_started;
+    guint tick_timer;           /* Refills the per-second budget */
+    gint budget;                /* Uploads that may still start this second */
+    gint max_running;
+    gboolean dirs_capped;
+};
+
+/* One upload; outlives the watch if the watch stops while it runs */
+typedef struct {
+    LocalWatch *watch;          /* NULL once the watch has stopped */
+    FileOperation op;
+} WatchUpload;
+
+/* A local file downloads are writing, or the last one wrote */
+typedef struct {
+    gint writers;               /* Downloads still writing it */
+    gint64 size;                /* What the last one left behind */
+    gint64 mtime_ns;
+} WatchWrite;
+
+/* Shared by every watch: downloads run on workers of any session */
+static GMutex watch_writes_lock;
+static GHashTable *watch_writes;    /* Local path -> WatchWrite */
+
+static void watch_add_dir(LocalWatch *watch, const gchar *dir);
+static void watch_drain(LocalWatch *watch);
+
+/*
+ * A download starts writing path. Until it ends, changes to path are not
+ * pushed: the file is half-written, and the remote copy is its source.
+ */
+void local_watch_write_begin(const gchar *path)
+{
+    WatchWrite *write;
+
+    g_mutex_lock(&watch_writes_lock);
+    if (!watch_writes)
+        watch_writes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    write = g_hash_table_lookup(watch_writes, path);
+    if (!write) {
+        write = g_new0(WatchWrite, 1);
+        g_hash_table_insert(watch_writes, g_strdup(path), write);
+    }
+    write->writers++;
+    g_mutex_unlock(&watch_writes_lock);
+}
+
+/*
+ * A download of path ended. What it left is remembered, so the events of
+ * its own writes are told apart from a later edit.
+ */
+void local_watch_write_end(const gchar *path)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    WatchWrite *write;
+    struct stat st;
+
+    g_mutex_lock(&watch_writes_lock);
+    write = watch_writes ? g_hash_table_lookup(watch_writes, path) : NULL;
+    if (write && --write->writers == 0) {
+        if (stat(path, &st) == 0) {
+            write->size = (gint64)st.st_size;
+            write->mtime_ns = compat_stat_mtime_ns(&st);
+        } else {
+            g_hash_table_remove(watch_writes, path);
+        }
+    }
+
+    /* Downloads outside any watched folder are never looked up */
+    if (watch_writes && g_hash_table_size(watch_writes) > WATCH_MAX_WRITES) {
+        g_hash_table_iter_init(&iter, watch_writes);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            if (((WatchWrite *)value)->writers == 0)
+                g_hash_table_iter_remove(&iter);
+    }
+    g_mutex_unlock(&watch_writes_lock);
+}
+
+/*
+ * Is path being written by a download, or still exactly what one wrote?
+ */
+static gboolean watch_written_by_download(const gchar *path, const struct stat *st)
+{
+    WatchWrite *write;
+    gboolean ours = FALSE;
+
+    g_mutex_lock(&watch_writes_lock);
+    write = watch_writes ? g_hash_table_lookup(watch_writes, path) : NULL;
+    if (write && write->writers > 0) {
+        ours = TRUE;
+    } else if (write && st) {
+        ours = write->size == (gint64)st->st_size &&
+               write->mtime_ns == compat_stat_mtime_ns(st);
+        if (!ours)
+            g_hash_table_remove(watch_writes, path);    /* Changed since */
+    }
+    g_mutex_unlock(&watch_writes_lock);
+    return ours;
+}
+
+/*
+ * Path of local relative to the watched root ('/'-separated), or NULL if
+ * it is outside
+ */
+static gchar *watch_relative(LocalWatch *watch, const gchar *local)
+{
+    gsize len = strlen(watch->local_root);
+
+    if (strncmp(local, watch->local_root, len) != 0 || local[len] != G_DIR_SEPARATOR)
+        return NULL;
+    return g_strdelimit(g_strdup(local + len + 1), G_DIR_SEPARATOR_S, '/');
+}
+
+/*
+ * Does an ignore pattern match the file's name or its relative path?
+ */
+static gboolean watch_ignored(LocalWatch *watch, const gchar *local)
+{
+    gchar *rel = watch_relative(watch, local);
+    const gchar *name;
+    gboolean ignored = FALSE;
+    guint i;
+
+    if (!rel)
+        return TRUE;
+    name = strrchr(rel, '/') ? strrchr(rel, '/') + 1 : rel;
+
+    for (i = 0; i < watch->ignore->len && !ignored; i++) {
+        GPatternSpec *spec = g_ptr_array_index(watch->ignore, i);
+        ignored = g_pattern_match_string(spec, name) || g_pattern_match_string(spec, rel);
+    }
+
+    /* Leftovers of our own atomic uploads */
+    if (!ignored)
+        ignored = g_str_has_suffix(name, ".sftp-part");
+
+    g_free(rel);
+    return ignored;
+}
+
+/* Batch closed: hand its files to the upload queue, in path order */
+static gboolean watch_batch_flush(gpointer data)
+{
+    LocalWatch *watch = (LocalWatch *)data;
+    GHashTableIter iter;
+    gpointer key;
+    GList *paths = NULL;
+    GList *l;
+    guint added = 0;
+
+    watch->batch_timer = 0;
+    watch->batch_started = 0;
+
+    g_hash_table_iter_init(&iter, watch->batch);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        paths = g_list_prepend(paths, key);
+        g_hash_table_iter_steal(&iter);
+    }
+    paths = g_list_sort(paths, (GCompareFunc)strcmp);
+
+    for (l = paths; l; l = l->next) {
+        gchar *path = (gchar *)l->data;
+        if (g_hash_table_contains(watch->queued, path)) {
+            g_free(path);
+            continue;
+        }
+        g_hash_table_add(watch->queued, path);
+        g_queue_push_tail(&watch->queue, path);
+        added++;
+    }
+    g_list_free(paths);
+
+    if (added > 0)
+        g_print("Watch: %u changed files queued for %s (%u waiting)\n", added,
+                watch->remote_root, g_queue_get_length(&watch->queue));
+    watch_drain(watch);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Note a changed file. A batch closes after WATCH_BATCH_MS without new
+ * events, or WATCH_BATCH_MAX_MS after it opened.
+ */
+static void watch_mark(LocalWatch *watch, const gchar *local)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 deadline;
+    gint delay;
+
+    g_hash_table_add(watch->batch, g_strdup(local));
+
+    if (!watch->batch_started)
+        watch->batch_started = now;
+    if (watch->batch_timer)
+        g_source_remove(watch->batch_timer);
+
+    deadline = watch->batch_started + WATCH_BATCH_MAX_MS * G_TIME_SPAN_MILLISECOND;
+    delay = (gint)MIN(WATCH_BATCH_MS, MAX(deadline - now, 0) / G_TIME_SPAN_MILLISECOND);
+    watch->batch_timer = g_timeout_add(delay, watch_batch_flush, watch);
+}
+
+/*
+ * Mark the files below a directory that just appeared: they may have been
+ * written before its monitor existed. Files touched within the last batch
+ * interval may still be open; the new monitor reports them once closed.
+ */
+static void watch_mark_tree(LocalWatch *watch, const gchar *dir_path)
+{
+    const gchar *name;
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    gint64 settled = (g_get_real_time() - WATCH_BATCH_MS * G_TIME_SPAN_MILLISECOND) *
+                     G_GINT64_CONSTANT(1000);
+
+    if (!dir)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar *child = g_build_filename(dir_path, name, NULL);
+        struct stat st;
+
+        if (!watch_ignored(watch, child) && lstat(child, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                watch_mark_tree(watch, child);
+            else if (S_ISREG(st.st_mode) && compat_stat_mtime_ns(&st) < settled &&
+                     !watch_written_by_download(child, &st))
+                watch_mark(watch, child);
+        }
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+static void on_watch_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                             GFileMonitorEvent event, gpointer user_data)
+{
+    LocalWatch *watch = (LocalWatch *)user_data;
+    gchar *path;
+    struct stat st;
+    (void)monitor;
+    (void)other_file;
+
+    /*
+     * Deletions are not pushed; a sync removes remote files on request.
+     * A file is only pushed once its writer closed it: CREATED comes
+     * before the first byte is written.
+     */
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED)
+        return;
+
+    path = g_file_get_path(file);
+    if (!path || watch_ignored(watch, path) || lstat(path, &st) != 0) {
+        g_free(path);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (event == G_FILE_MONITOR_EVENT_CREATED) {
+            watch_add_dir(watch, path);
+            watch_mark_tree(watch, path);
+        }
+    } else if (S_ISREG(st.st_mode) && event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+               !watch_written_by_download(path, &st)) {
+        watch_mark(watch, path);
+    }
+    g_free(path);
+}
+
+/*
+ * Monitor a directory and the directories below it. GFileMonitor watches
+ * one directory (one inotify watch on Linux), so each needs its own.
+ */
+static void watch_add_dir(LocalWatch *watch, const gchar *dir_path)
+{
+    GFileMonitor *monitor;
+    GError *error = NULL;
+    const gchar *name;
+    GFile *file;
+    GDir *dir;
+
+    if (g_hash_table_contains(watch->monitors, dir_path))
+        return;
+    if (g_hash_table_size(watch->monitors) >= WATCH_MAX_DIRS) {
+        if (!watch->dirs_capped)
+            g_printerr("Watch: more than %d directories under %s, the rest is not watched\n",
+                       WATCH_MAX_DIRS, watch->local_root);
+        watch->dirs_capped = TRUE;
+        return;
+    }
+
+    file = g_file_new_for_path(dir_path);
+    monitor = g_file_monitor_directory(file, G_FILE_MONITOR_NONE, NULL, &error);
+    g_object_unref(file);
+    if (!monitor) {
+        g_printerr("Watch: cannot monitor %s: %s\n", dir_path, error->message);
+        g_error_free(error);
+        return;
+    }
+    g_signal_connect(monitor, "changed", G_CALLBACK(on_watch_changed), watch);
+    g_hash_table_insert(watch->monitors, g_strdup(dir_path), monitor);
+
+    dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir)
+        return;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar *child = g_build_filename(dir_path, name, NULL);
+        struct stat st;
+
+        /* Symlinked directories are not followed */
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode) && !watch_ignored(watch, child))
+            watch_add_dir(watch, child);
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+/*
+ * Create the remote directory of path and any missing parents
+ */
+static gboolean watch_remote_mkdirs(SFTPSession *channel, const gchar *path)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    gchar *dir = g_path_get_dirname(path);
+    gboolean ok = TRUE;
+
+    if (strcmp(dir, ".") != 0 && strcmp(dir, "/") != 0 &&
+        libssh2_sftp_stat(channel->sftp_session, dir, &attrs) != 0) {
+        ok = watch_remote_mkdirs(channel, dir) &&
+             (libssh2_sftp_mkdir(channel->sftp_session, dir,
+                                 LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP |
+                                 LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
+                                 LIBSSH2_SFTP_S_IXOTH) == 0 ||
+              libssh2_sftp_stat(channel->sftp_session, dir, &attrs) == 0);
+        if (!ok)
+            g_printerr("Watch: cannot create remote directory %s\n", dir);
+    }
+    g_free(dir);
+    return ok;
+}
+
+static void watch_upload_done(WatchUpload *upload);
+
+static gboolean watch_upload_idle(gpointer data)
+{
+    watch_upload_done((WatchUpload *)data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Worker: create missing remote directories, then upload */
+static void watch_upload_job(SFTPSession *session, gpointer data, gboolean cancelled)
+{
+    WatchUpload *upload = (WatchUpload *)data;
+    FileOperation *op = &upload->op;
+
+    if (!cancelled) {
+        SFTPSession *channel = sftp_session_lease(session, TRUE);
+
+        g_mutex_lock(&channel->lock);
+        op->success = watch_remote_mkdirs(channel, op->remote_path) &&
+                      sftp_transfer_file(channel, op);
+        g_mutex_unlock(&channel->lock);
+        sftp_session_release(channel);
+
+        dir_cache_invalidate_parent(session->dir_cache, op->remote_path);
+    }
+
+    op->completed = TRUE;
+    g_idle_add(watch_upload_idle, upload);
+}
+
+/*
+ * Start queued uploads while the per-second budget and the channel share
+ * allow. Background priority keeps browsing and explicit transfers ahead.
+ */
+static void watch_drain(LocalWatch *watch)
+{
+    guint skipped = 0;
+
+    while (watch->budget > 0 &&
+           (gint)g_hash_table_size(watch->running) < watch->max_running &&
+           g_queue_get_length(&watch->queue) > skipped) {
+        gchar *local = g_queue_pop_head(&watch->queue);
+        WatchUpload *upload;
+        gchar *rel;
+
+        /* Changed again while uploading: goes after the running upload */
+        if (g_hash_table_contains(watch->running, local)) {
+            g_queue_push_tail(&watch->queue, local);
+            skipped++;
+            continue;
+        }
+
+        g_hash_table_remove(watch->queued, local);
+        rel = watch_relative(watch, local);
+
+        /* A download started on it since it was marked */
+        if (!rel || !g_file_test(local, G_FILE_TEST_IS_REGULAR) ||
+            watch_written_by_download(local, NULL)) {
+            g_free(rel);
+            g_free(local);
+            continue;
+        }
+
+        upload = g_new0(WatchUpload, 1);
+        upload->watch = watch;
+        g_strlcpy(upload->op.local_path, local, MAX_PATH_LEN);
+        if (strcmp(watch->remote_root, "/") == 0)
+            g_snprintf(upload->op.remote_path, MAX_PATH_LEN, "/%s", rel);
+        else
+            g_snprintf(upload->op.remote_path, MAX_PATH_LEN, "%s/%s", watch->remote_root, rel);
+        upload->op.is_upload = TRUE;
+        upload->op.priority = JOB_PRIORITY_BACKGROUND;
+        upload->op.session = watch->session;
+
+        g_hash_table_insert(watch->running, local, upload);
+        watch->budget--;
+        sftp_session_push_job(watch->session, JOB_PRIORITY_BACKGROUND, watch_upload_job,
+                              upload, &upload->op.cancelled);
+        g_free(rel);
+    }
+}
+
+/* Main loop: an upload finished */
+static void watch_upload_done(WatchUpload *upload)
+{
+    LocalWatch *watch = upload->watch;
+
+    if (!watch) {
+        g_free(upload);
+        return;
+    }
+
+    if (upload->op.success)
+        g_print("Watch: uploaded %s\n", upload->op.remote_path);
+    else if (!upload->op.cancelled)
+        g_printerr("Watch: upload failed: %s\n", upload->op.remote_path);
+
+    g_hash_table_remove(watch->running, upload->op.local_path);
+    g_free(upload);
+    watch_drain(watch);
+}
+
+/* Once a second: refill the budget */
+static gboolean watch_tick(gpointer data)
+{
+    LocalWatch *watch = (LocalWatch *)data;
+
+    watch->budget = watch->session->config->watch_rate;
+    if (!g_queue_is_empty(&watch->queue))
+        watch_drain(watch);
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Start pushing changes under the connection's local_dir to its
+ * remote_dir. Returns NULL when the connection has no watch configured.
+ */
+LocalWatch *local_watch_start(SFTPSession *session)
+{
+    SFTPConnection *conn = session->config;
+    LocalWatch *watch;
+    gchar **patterns;
+    gsize len;
+    gint i;
+
+    if (!conn->watch_local || !conn->local_dir[0])
+        return NULL;
+    if (!g_file_test(conn->local_dir, G_FILE_TEST_IS_DIR)) {
+        g_printerr("Watch: local directory not found: %s\n", conn->local_dir);
+        return NULL;
+    }
+
+    watch = g_new0(LocalWatch, 1);
+    watch->session = session;
+    watch->local_root = g_strdup(conn->local_dir);
+    len = strlen(watch->local_root);
+    while (len > 1 && watch->local_root[len - 1] == G_DIR_SEPARATOR)
+        watch->local_root[--len] = '\0';
+    watch->remote_root = g_strdup(conn->remote_dir);
+    len = strlen(watch->remote_root);
+    while (len > 1 && watch->remote_root[len - 1] == '/')
+        watch->remote_root[--len] = '\0';
+
+    watch->ignore = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+    patterns = g_strsplit(conn->watch_ignore, ";", -1);
+    for (i = 0; patterns[i]; i++) {
+        g_strstrip(patterns[i]);
+        if (patterns[i][0])
+            g_ptr_array_add(watch->ignore, g_pattern_spec_new(patterns[i]));
+    }
+    g_strfreev(patterns);
+
+    watch->monitors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    watch->batch = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    watch->queued = g_hash_table_new(g_str_hash, g_str_equal);
+    watch->running = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_queue_init(&watch->queue);
+    watch->budget = conn->watch_rate;
+    /* Leave a channel for browsing and explicit transfers */
+    watch->max_running = MAX(conn->max_channels - 1, 1);
+
+    watch_add_dir(watch, watch->local_root);
+    watch->tick_timer = g_timeout_add_seconds(1, watch_tick, watch);
+
+    g_print("Watch: %s -> %s (%u directories)\n", watch->local_root, watch->remote_root,
+            g_hash_table_size(watch->monitors));
+    return watch;
+}
+
+/*
+ * Stop watching. Uploads already running finish on their own; queued ones
+ * are dropped.
+ */
+void local_watch_stop(LocalWatch *watch)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!watch)
+        return;
+
+    if (watch->batch_timer)
+        g_source_remove(watch->batch_timer);
+    g_source_remove(watch->tick_timer);
+
+    g_hash_table_iter_init(&iter, watch->monitors);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_signal_handlers_disconnect_by_data(value, watch);
+        g_file_monitor_cancel(G_FILE_MONITOR(value));
+    }
+    g_hash_table_destroy(watch->monitors);
+
+    g_hash_table_iter_init(&iter, watch->running);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        ((WatchUpload *)value)->watch = NULL;
+    g_hash_table_destroy(watch->running);
+
+    g_hash_table_destroy(watch->queued);
+    g_queue_clear_full(&watch->queue, g_free);
+    g_hash_table_destroy(watch->batch);
+    g_ptr_array_unref(watch->ignore);
+    g_free(watch->local_root);
+    g_free(watch->remote_root);
+    g_free(watch);
+}